@@ -0,0 +1,177 @@
+/* gencorpus.c
+ * Deterministic synthetic corpus for benchmarking.
+ * Same profile, count, and seed always produce byte-identical output.
+ *
+ * Usage: macb-gencorpus DIR PROFILE [--count=N] [--seed=N]
+ *   DIR/forks/NNNNNN.data, DIR/forks/NNNNNN.res: Inputs for create. Both always exist, possibly empty.
+ *   DIR/archives/NNNNNN.bin: The same content as MacBinary, for tell and extract.
+ *
+ * Profiles:
+ *   tiny   Many small files: data 0..4 kB, resource 0..1 kB.
+ *   empty  Every file has at least one empty fork, and a quarter have both empty.
+ *   giant  A few big files: data 32..64 MB, resource 0..4 MB.
+ *   mixed  Log-uniform sizes from zero to 16 MB, either fork.
+ */
+
+#include "macb_codec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+struct gencorpus_profile {
+  const char *name;
+  int count; // Default.
+  int64_t dfmin,dfmax,rfmin,rfmax;
+  int logscale; // Choose lengths log-uniformly instead of uniformly.
+  int empties; // Force empty forks as described for "empty".
+};
+
+static const struct gencorpus_profile gencorpus_profilev[]={
+  {"tiny",  5000,0,4096,0,1024,0,0},
+  {"empty", 5000,0,4096,0,4096,0,1},
+  {"giant",    4,32<<20,64<<20,0,4<<20,0,0},
+  {"mixed",  500,0,16<<20,0,16<<20,1,0},
+};
+
+/* xorshift64*. Small, fast, and the same everywhere.
+ */
+
+static uint64_t gencorpus_state;
+
+static uint64_t gencorpus_next() {
+  gencorpus_state^=gencorpus_state>>12;
+  gencorpus_state^=gencorpus_state<<25;
+  gencorpus_state^=gencorpus_state>>27;
+  return gencorpus_state*0x2545f4914f6cdd1dull;
+}
+
+static int64_t gencorpus_length(int64_t lo,int64_t hi,int logscale) {
+  if (hi<=lo) return lo;
+  if (!logscale) return lo+(int64_t)(gencorpus_next()%(uint64_t)(hi-lo+1));
+  // Pick a bit length, then a value of that many bits.
+  int bits=0; while (((int64_t)1<<bits)<=hi) bits++;
+  int b=gencorpus_next()%(bits+1);
+  int64_t v=b?(((int64_t)1<<(b-1))+(int64_t)(gencorpus_next()%((uint64_t)1<<(b-1)))):0;
+  if (v<lo) v=lo;
+  if (v>hi) v=hi;
+  return v;
+}
+
+/* Write (len) bytes of junk, plus optionally MacBinary padding.
+ */
+
+static int gencorpus_write_junk(FILE *f,int64_t len,int pad) {
+  uint64_t buf[8192];
+  while (len>0) {
+    int i=0; for (;i<8192;i++) buf[i]=gencorpus_next();
+    int64_t c=(len<sizeof(buf))?len:sizeof(buf);
+    if (fwrite(buf,1,c,f)!=c) return -1;
+    len-=c;
+  }
+  if (pad) {
+    static const uint8_t zeroes[128]={0};
+    if (fwrite(zeroes,1,pad,f)!=pad) return -1;
+  }
+  return 0;
+}
+
+/* Generate one file: both forks separately, then the archive.
+ * The archive uses the same seed state as the forks, so its content matches.
+ */
+
+static int gencorpus_file(const char *dir,int index,const struct gencorpus_profile *profile) {
+  char path[1024];
+  int64_t dflen=gencorpus_length(profile->dfmin,profile->dfmax,profile->logscale);
+  int64_t rflen=gencorpus_length(profile->rfmin,profile->rfmax,profile->logscale);
+  if (profile->empties) {
+    switch (gencorpus_next()&3) {
+      case 0: dflen=rflen=0; break;
+      case 1: case 2: dflen=0; break;
+      case 3: rflen=0; break;
+    }
+  }
+  uint64_t seed=gencorpus_next()|1;
+
+  struct macb_header header={0};
+  header.namec=snprintf(header.name,sizeof(header.name),"%06d",index);
+  header.type=0x42454e43; // BENC
+  header.creator=0x6d616362; // macb
+  header.flags_hi=0x01;
+  header.dflen=dflen;
+  header.rflen=rflen;
+  header.ctime=header.mtime=0xd0000000+index;
+  header.srcversion=header.minversion=0x81;
+  uint8_t hdr[128];
+  macb_header_encode(hdr,sizeof(hdr),&header);
+
+  FILE *f;
+  snprintf(path,sizeof(path),"%s/forks/%06d.data",dir,index);
+  if (!(f=fopen(path,"wb"))) return -1;
+  gencorpus_state=seed;
+  if (gencorpus_write_junk(f,dflen,0)<0) { fclose(f); return -1; }
+  uint64_t afterdf=gencorpus_state;
+  fclose(f);
+  snprintf(path,sizeof(path),"%s/forks/%06d.res",dir,index);
+  if (!(f=fopen(path,"wb"))) return -1;
+  if (gencorpus_write_junk(f,rflen,0)<0) { fclose(f); return -1; }
+  fclose(f);
+
+  snprintf(path,sizeof(path),"%s/archives/%06d.bin",dir,index);
+  if (!(f=fopen(path,"wb"))) return -1;
+  if (fwrite(hdr,1,128,f)!=128) { fclose(f); return -1; }
+  gencorpus_state=seed;
+  if (gencorpus_write_junk(f,dflen,(128-(dflen&127))&127)<0) { fclose(f); return -1; }
+  if (gencorpus_state!=afterdf) { fclose(f); return -1; }
+  if (gencorpus_write_junk(f,rflen,(128-(rflen&127))&127)<0) { fclose(f); return -1; }
+  fclose(f);
+  return 0;
+}
+
+int main(int argc,char **argv) {
+  const char *dir=0,*profilename=0;
+  int count=0;
+  uint64_t seed=1;
+  int argp=1; for (;argp<argc;argp++) {
+    const char *arg=argv[argp];
+    if (!memcmp(arg,"--count=",8)) count=atoi(arg+8);
+    else if (!memcmp(arg,"--seed=",7)) seed=strtoull(arg+7,0,0);
+    else if (!dir) dir=arg;
+    else if (!profilename) profilename=arg;
+    else {
+      fprintf(stderr,"%s: Unexpected argument '%s'\n",argv[0],arg);
+      return 1;
+    }
+  }
+  if (!dir||!profilename) {
+    fprintf(stderr,"Usage: %s DIR tiny|empty|giant|mixed [--count=N] [--seed=N]\n",argv[0]);
+    return 1;
+  }
+  const struct gencorpus_profile *profile=0;
+  int i=0; for (;i<sizeof(gencorpus_profilev)/sizeof(gencorpus_profilev[0]);i++) {
+    if (!strcmp(gencorpus_profilev[i].name,profilename)) profile=gencorpus_profilev+i;
+  }
+  if (!profile) {
+    fprintf(stderr,"%s: Unknown profile '%s'\n",argv[0],profilename);
+    return 1;
+  }
+  if (count<1) count=profile->count;
+
+  char path[1024];
+  mkdir(dir,0777);
+  snprintf(path,sizeof(path),"%s/forks",dir);
+  mkdir(path,0777);
+  snprintf(path,sizeof(path),"%s/archives",dir);
+  mkdir(path,0777);
+
+  gencorpus_state=seed?seed:1;
+  for (i=0;i<count;i++) {
+    uint64_t next=gencorpus_next()|1; // One state per file, so files don't depend on each other's sizes.
+    if (gencorpus_file(dir,i,profile)<0) {
+      fprintf(stderr,"%s: Failed to write file %d.\n",dir,i);
+      return 1;
+    }
+    gencorpus_state=next;
+  }
+  return 0;
+}
@@ -0,0 +1,261 @@
+/* harness.c
+ * End-to-end benchmark: Generate corpora, then time macb's create, tell, and extract over each, in batch mode.
+ *
+ * Usage: macb-bench [--macb=PATH] [--gen=PATH] [--dir=PATH] [--jobs=N] [PROFILE...]
+ *   Default profiles: tiny empty mixed giant
+ *   Corpora go under DIR/corpus (default out/bench), and results are appended to DIR/results.jsonl,
+ *   one JSON object per profile and phase, so runs can be compared with any JSON tool.
+ *
+ * For each phase we report wall time, bytes, files/s, MB/s, peak RSS, and read/write syscall counts.
+ * Syscall counts come from /proc/PID/io, which we read after the child exits but before reaping it.
+ * That counts read-like and write-like calls only (read, pread, readv, splice in, ...), not open or stat.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+struct bench_result {
+  const char *profile,*phase;
+  int filec;
+  int64_t bytes;
+  double seconds;
+  long maxrss_kb;
+  int64_t syscr,syscw;
+  int status;
+};
+
+static double bench_now() {
+  struct timespec ts={0};
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec/1000000000.0;
+}
+
+/* Sorted list of files in a directory with the given suffix, NUL-delimited, and their total size.
+ * If (replace) is not null, it replaces (sfx) in the listed names. Sizes are of the files actually found.
+ */
+
+static int bench_list_cmp(const void *a,const void *b) {
+  return strcmp(*(char**)a,*(char**)b);
+}
+
+static char *bench_list(int *dstc,int *filec,int64_t *bytes,const char *dir,const char *sfx,const char *replace) {
+  DIR *d=opendir(dir);
+  if (!d) return 0;
+  char **namev=0;
+  int namec=0,namea=0;
+  int sfxc=strlen(sfx);
+  struct dirent *de;
+  while ((de=readdir(d))) {
+    int nc=strlen(de->d_name);
+    if ((nc<sfxc)||strcmp(de->d_name+nc-sfxc,sfx)) continue;
+    if (namec>=namea) {
+      namea=namea?(namea<<1):1024;
+      namev=realloc(namev,sizeof(void*)*namea);
+      if (!namev) { closedir(d); return 0; }
+    }
+    namev[namec++]=strdup(de->d_name);
+  }
+  closedir(d);
+  qsort(namev,namec,sizeof(void*),bench_list_cmp);
+
+  size_t a=1;
+  int i=0; for (;i<namec;i++) a+=strlen(dir)+strlen(namev[i])+(replace?strlen(replace):0)+2;
+  char *dst=malloc(a);
+  if (!dst) return 0;
+  *dstc=0;
+  *filec=namec;
+  *bytes=0;
+  for (i=0;i<namec;i++) {
+    char *entry=dst+*dstc;
+    struct stat st;
+    sprintf(entry,"%s/%s",dir,namev[i]);
+    if (!stat(entry,&st)) *bytes+=st.st_size;
+    if (replace) {
+      int entryc=strlen(entry);
+      strcpy(entry+entryc-sfxc,replace);
+    }
+    *dstc+=strlen(entry)+1;
+    free(namev[i]);
+  }
+  free(namev);
+  return dst;
+}
+
+/* Run macb with a NUL-delimited list on stdin, discarding its output.
+ */
+
+static int bench_read_proc_io(int64_t *syscr,int64_t *syscw,pid_t pid) {
+  char path[64];
+  snprintf(path,sizeof(path),"/proc/%d/io",(int)pid);
+  FILE *f=fopen(path,"r");
+  if (!f) return -1;
+  char line[128];
+  while (fgets(line,sizeof(line),f)) {
+    long long v;
+    if (sscanf(line,"syscr: %lld",&v)==1) *syscr=v;
+    else if (sscanf(line,"syscw: %lld",&v)==1) *syscw=v;
+  }
+  fclose(f);
+  return 0;
+}
+
+static int bench_run(struct bench_result *result,const char *macb,const char *command,const char *jobs,const char *list,int listc) {
+  int pipev[2];
+  if (pipe(pipev)<0) return -1;
+  double start=bench_now();
+  pid_t pid=fork();
+  if (pid<0) return -1;
+  if (!pid) {
+    dup2(pipev[0],0);
+    close(pipev[0]);
+    close(pipev[1]);
+    int devnull=open("/dev/null",O_WRONLY);
+    dup2(devnull,1);
+    dup2(devnull,2);
+    if (jobs) execl(macb,macb,command,"--batch",jobs,(char*)0);
+    else execl(macb,macb,command,"--batch",(char*)0);
+    _exit(127);
+  }
+  close(pipev[0]);
+  int listp=0;
+  while (listp<listc) {
+    int err=write(pipev[1],list+listp,listc-listp);
+    if (err<=0) break;
+    listp+=err;
+  }
+  close(pipev[1]);
+
+  siginfo_t si;
+  waitid(P_PID,pid,&si,WEXITED|WNOWAIT);
+  result->seconds=bench_now()-start;
+  result->syscr=result->syscw=-1;
+  bench_read_proc_io(&result->syscr,&result->syscw,pid);
+  int status=0;
+  struct rusage ru={0};
+  wait4(pid,&status,0,&ru);
+  result->maxrss_kb=ru.ru_maxrss;
+  result->status=(WIFEXITED(status)&&!WEXITSTATUS(status))?0:-1;
+  return 0;
+}
+
+/* Report.
+ */
+
+static void bench_report(FILE *jsonl,const struct bench_result *r) {
+  double fps=(r->seconds>0.0)?(r->filec/r->seconds):0.0;
+  double mbps=(r->seconds>0.0)?(r->bytes/r->seconds/1000000.0):0.0;
+  printf(
+    "%-6s %-8s %7d files %10.1f MB %8.3f s %10.0f files/s %9.1f MB/s %8ld kB RSS %9lld rd %9lld wr%s\n",
+    r->profile,r->phase,r->filec,r->bytes/1000000.0,r->seconds,fps,mbps,r->maxrss_kb,
+    (long long)r->syscr,(long long)r->syscw,r->status?" FAILED":""
+  );
+  if (jsonl) fprintf(jsonl,
+    "{\"time\":%lld,\"profile\":\"%s\",\"phase\":\"%s\",\"files\":%d,\"bytes\":%lld,\"seconds\":%.6f,"
+    "\"files_per_sec\":%.1f,\"mb_per_sec\":%.3f,\"max_rss_kb\":%ld,\"syscalls_read\":%lld,\"syscalls_write\":%lld,\"ok\":%s}\n",
+    (long long)time(0),r->profile,r->phase,r->filec,(long long)r->bytes,r->seconds,
+    fps,mbps,r->maxrss_kb,(long long)r->syscr,(long long)r->syscw,r->status?"false":"true"
+  );
+}
+
+/* One profile: Generate, then each phase.
+ */
+
+static int bench_profile(FILE *jsonl,const char *profile,const char *macb,const char *gen,const char *dir,const char *jobs) {
+  char corpus[1024],path[sizeof(corpus)+16],cmd[4096]; // (path) is (corpus) plus a short subdirectory.
+  int corpusc=snprintf(corpus,sizeof(corpus),"%s/corpus/%s",dir,profile);
+  if ((corpusc<0)||(corpusc>=sizeof(corpus))) {
+    fprintf(stderr,"%s: Directory name too long.\n",dir);
+    return -1;
+  }
+  snprintf(cmd,sizeof(cmd),"rm -rf '%s' && mkdir -p '%s/corpus' && '%s' '%s' '%s'",corpus,dir,gen,corpus,profile);
+  if (system(cmd)) {
+    fprintf(stderr,"%s: Failed to generate corpus.\n",corpus);
+    return -1;
+  }
+
+  int status=0;
+  struct {
+    const char *phase,*command,*subdir,*sfx,*replace;
+  } phasev[]={
+    {"create","-c","forks",".data",".bin"},
+    {"tell","-t","archives",".bin",0},
+    {"extract","-x","archives",".bin",0},
+  };
+  int i=0; for (;i<sizeof(phasev)/sizeof(phasev[0]);i++) {
+    struct bench_result result={.profile=profile,.phase=phasev[i].phase};
+    snprintf(path,sizeof(path),"%s/%s",corpus,phasev[i].subdir);
+    int listc=0;
+    char *list=bench_list(&listc,&result.filec,&result.bytes,path,phasev[i].sfx,phasev[i].replace);
+    if (!list) return -1;
+    // Create reads both forks, but we only listed the data forks.
+    if (phasev[i].command[1]=='c') {
+      int resc=0,resfilec=0;
+      int64_t resbytes=0;
+      char *reslist=bench_list(&resc,&resfilec,&resbytes,path,".res",0);
+      if (reslist) {
+        free(reslist);
+        result.bytes+=resbytes;
+      }
+    }
+    if (phasev[i].command[1]=='t') result.bytes=(int64_t)result.filec*128;
+    if (bench_run(&result,macb,phasev[i].command,jobs,list,listc)<0) result.status=-1;
+    free(list);
+    bench_report(jsonl,&result);
+    if (result.status) status=-1;
+  }
+  return status;
+}
+
+int main(int argc,char **argv) {
+  const char *macb="out/macb";
+  const char *gen="out/macb-gencorpus";
+  const char *dir="out/bench";
+  const char *jobs=0;
+  const char *profilev[16];
+  int profilec=0;
+  int argp=1; for (;argp<argc;argp++) {
+    const char *arg=argv[argp];
+    if (!memcmp(arg,"--macb=",7)) macb=arg+7;
+    else if (!memcmp(arg,"--gen=",6)) gen=arg+6;
+    else if (!memcmp(arg,"--dir=",6)) dir=arg+6;
+    else if (!memcmp(arg,"--jobs=",7)) jobs=arg;
+    else if ((arg[0]!='-')&&(profilec<16)) profilev[profilec++]=arg;
+    else {
+      fprintf(stderr,"%s: Unexpected argument '%s'\n",argv[0],arg);
+      return 1;
+    }
+  }
+  if (!profilec) {
+    profilev[profilec++]="tiny";
+    profilev[profilec++]="empty";
+    profilev[profilec++]="mixed";
+    profilev[profilec++]="giant";
+  }
+
+  char path[1024];
+  snprintf(path,sizeof(path),"mkdir -p '%s'",dir);
+  if (system(path)) return 1;
+  snprintf(path,sizeof(path),"%s/results.jsonl",dir);
+  FILE *jsonl=fopen(path,"a");
+  if (!jsonl) fprintf(stderr,"%s: Failed to open for append. Reporting to stdout only.\n",path);
+
+  int status=0;
+  int i=0; for (;i<profilec;i++) {
+    if (bench_profile(jsonl,profilev[i],macb,gen,dir,jobs)<0) status=1;
+  }
+  if (jsonl) {
+    fclose(jsonl);
+    printf("Results appended to %s\n",path);
+  }
+  return status;
+}
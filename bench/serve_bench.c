@@ -0,0 +1,194 @@
+/* serve_bench.c
+ * Per-request latency of '-t' on one small archive: A fresh macb process per request, versus requests to 'macb --serve'.
+ *
+ * Usage: macb-serve-bench [--macb=PATH] [--dir=PATH] [--count=N]
+ *   Makes a small archive and a socket under DIR/serve (default out/bench/serve), starts the daemon, and runs
+ *   N requests each way (default 1000), reporting mean and worst latency. The daemon is killed at the end.
+ *
+ * This is also the reference client: See bench_serve_request for the whole protocol.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+static double bench_now() {
+  struct timespec ts={0};
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec/1000000000.0;
+}
+
+/* Client.
+ */
+
+static int bench_serve_connect(const char *path) {
+  struct sockaddr_un addr={.sun_family=AF_UNIX};
+  if (strlen(path)>=sizeof(addr.sun_path)) return -1;
+  strcpy(addr.sun_path,path);
+  int fd=socket(AF_UNIX,SOCK_STREAM,0);
+  if (fd<0) return -1;
+  if (connect(fd,(struct sockaddr*)&addr,sizeof(addr))<0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int bench_io(int fd,void *v,int c,int wr) {
+  char *V=v;
+  while (c>0) {
+    int err=wr?write(fd,V,c):read(fd,V,c);
+    if (err<=0) return -1;
+    V+=err;
+    c-=err;
+  }
+  return 0;
+}
+
+static uint32_t bench_rd32(const uint8_t *src) {
+  return ((uint32_t)src[0]<<24)|(src[1]<<16)|(src[2]<<8)|src[3];
+}
+
+// Send arguments, wait for the response, return its status (0 ok, 1 failed) or <0 if the connection broke.
+static int bench_serve_request(int fd,const char **argv,int argc) {
+  char req[4096];
+  int reqc=4,i;
+  for (i=0;i<argc;i++) {
+    int c=strlen(argv[i])+1;
+    if (reqc+c>sizeof(req)) return -1;
+    memcpy(req+reqc,argv[i],c);
+    reqc+=c;
+  }
+  uint32_t len=reqc-4;
+  req[0]=len>>24; req[1]=len>>16; req[2]=len>>8; req[3]=len;
+  if (bench_io(fd,req,reqc,1)<0) return -1;
+
+  uint8_t pre[8];
+  if (bench_io(fd,pre,8,0)<0) return -1;
+  uint32_t rspc=bench_rd32(pre);
+  if (rspc<12) return -1;
+  char *rsp=malloc(rspc-4);
+  if (!rsp) return -1;
+  int err=bench_io(fd,rsp,rspc-4,0);
+  free(rsp); // OUTC, report, ERRC, errors. We only time it.
+  if (err<0) return -1;
+  return bench_rd32(pre+4);
+}
+
+/* Fresh process per request.
+ */
+
+static int bench_spawn(const char *macb,const char *archive) {
+  pid_t pid=fork();
+  if (pid<0) return -1;
+  if (!pid) {
+    int devnull=open("/dev/null",O_WRONLY);
+    dup2(devnull,1);
+    dup2(devnull,2);
+    execl(macb,macb,"-t",archive,"--format=json",(char*)0);
+    _exit(127);
+  }
+  int status=0;
+  waitpid(pid,&status,0);
+  return (WIFEXITED(status)&&!WEXITSTATUS(status))?0:1;
+}
+
+static void bench_report(const char *what,int count,int failc,double total,double worst) {
+  printf(
+    "%-8s %7d requests %10.1f us mean %10.1f us worst %10.0f requests/s%s\n",
+    what,count,total*1000000.0/count,worst*1000000.0,count/total,failc?" FAILED":""
+  );
+}
+
+int main(int argc,char **argv) {
+  const char *macb="out/macb";
+  const char *dir="out/bench/serve";
+  int count=1000;
+  int argp=1; for (;argp<argc;argp++) {
+    const char *arg=argv[argp];
+    if (!memcmp(arg,"--macb=",7)) macb=arg+7;
+    else if (!memcmp(arg,"--dir=",6)) dir=arg+6;
+    else if (!memcmp(arg,"--count=",8)) count=atoi(arg+8);
+    else {
+      fprintf(stderr,"%s: Unexpected argument '%s'\n",argv[0],arg);
+      return 1;
+    }
+  }
+  if (count<1) count=1;
+
+  char archive[1024],sock[1024],cmd[4096];
+  snprintf(archive,sizeof(archive),"%s/tiny.bin",dir);
+  snprintf(sock,sizeof(sock),"%s/macb.sock",dir);
+  snprintf(cmd,sizeof(cmd),
+    "mkdir -p '%s' && printf 'Hello, MacBinary.' > '%s/tiny.data' && '%s' -c '%s' -d '%s/tiny.data' -T TEXT -C ttxt",
+    dir,dir,macb,archive,dir
+  );
+  if (system(cmd)) {
+    fprintf(stderr,"%s: Failed to create archive.\n",archive);
+    return 1;
+  }
+
+  pid_t daemon=fork();
+  if (daemon<0) return 1;
+  if (!daemon) {
+    char servearg[1100];
+    snprintf(servearg,sizeof(servearg),"--serve=%s",sock);
+    execl(macb,macb,servearg,"-j","1",(char*)0);
+    _exit(127);
+  }
+  int fd=-1,i;
+  for (i=0;(i<500)&&(fd<0);i++) {
+    if ((fd=bench_serve_connect(sock))<0) usleep(10000);
+  }
+  if (fd<0) {
+    fprintf(stderr,"%s: Daemon didn't come up.\n",sock);
+    kill(daemon,SIGTERM);
+    waitpid(daemon,0,0);
+    return 1;
+  }
+
+  int status=0,failc=0;
+  double total=0.0,worst=0.0;
+  for (i=0;i<count;i++) {
+    double start=bench_now();
+    if (bench_spawn(macb,archive)) failc++;
+    double elapsed=bench_now()-start;
+    total+=elapsed;
+    if (elapsed>worst) worst=elapsed;
+  }
+  bench_report("spawn",count,failc,total,worst);
+  if (failc) status=1;
+
+  const char *reqv[]={"-t",archive,"--format=json"};
+  failc=0;
+  total=worst=0.0;
+  for (i=0;i<count;i++) {
+    double start=bench_now();
+    int err=bench_serve_request(fd,reqv,3);
+    double elapsed=bench_now()-start;
+    if (err<0) {
+      fprintf(stderr,"%s: Connection lost.\n",sock);
+      failc+=count-i;
+      break;
+    }
+    if (err) failc++;
+    total+=elapsed;
+    if (elapsed>worst) worst=elapsed;
+  }
+  bench_report("serve",count,failc,total,worst);
+  if (failc) status=1;
+
+  close(fd);
+  kill(daemon,SIGTERM);
+  waitpid(daemon,0,0);
+  unlink(sock);
+  return status;
+}
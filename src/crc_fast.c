@@ -0,0 +1,240 @@
+/* crc_fast.c
+ * Faster kernels for the same CRC-16 (XMODEM, poly 0x1021) that crc.c computes a byte at a time.
+ * crc.c stays as the reference; everything here must agree with it bit for bit.
+ */
+
+#include "macb_codec.h"
+
+#if defined(__x86_64__)
+  #include <immintrin.h>
+  #define MACB_CRC_HAVE_CLMUL 1
+#else
+  #define MACB_CRC_HAVE_CLMUL 0
+#endif
+
+#define MACB_CRC_POLY 0x1021
+
+/* Tables.
+ * crc_slice[k][b] is the CRC of byte (b) followed by (k) zero bytes, starting from zero.
+ * crc_slice[0] is the same as crc.c's "magic".
+ */
+
+static uint16_t crc_slice[16][256];
+
+// x**d mod P, for the carry-less folding constants.
+static uint16_t crc_xpow(int d) {
+  uint32_t r=1;
+  while (d-->0) {
+    r<<=1;
+    if (r&0x10000) r^=0x10000|MACB_CRC_POLY;
+  }
+  return r;
+}
+
+/* Byte at a time from our own table. Finishes up for the other kernels.
+ */
+
+static uint16_t crc_kernel_byte(const uint8_t *src,int srcc,uint16_t crc) {
+  for (;srcc-->0;src++) {
+    crc=(crc<<8)^crc_slice[0][(crc>>8)^*src];
+  }
+  return crc;
+}
+
+/* Slice-by-8 and slice-by-16.
+ * The running CRC folds into the first two bytes of each group, then every byte of the group is one table lookup.
+ */
+
+static uint16_t crc_kernel_slice8(const uint8_t *src,int srcc,uint16_t crc) {
+  for (;srcc>=8;src+=8,srcc-=8) {
+    crc=
+      crc_slice[7][src[0]^(crc>>8)]^
+      crc_slice[6][src[1]^(crc&0xff)]^
+      crc_slice[5][src[2]]^
+      crc_slice[4][src[3]]^
+      crc_slice[3][src[4]]^
+      crc_slice[2][src[5]]^
+      crc_slice[1][src[6]]^
+      crc_slice[0][src[7]];
+  }
+  return crc_kernel_byte(src,srcc,crc);
+}
+
+static uint16_t crc_kernel_slice16(const uint8_t *src,int srcc,uint16_t crc) {
+  for (;srcc>=16;src+=16,srcc-=16) {
+    crc=
+      crc_slice[15][src[0]^(crc>>8)]^
+      crc_slice[14][src[1]^(crc&0xff)]^
+      crc_slice[13][src[2]]^
+      crc_slice[12][src[3]]^
+      crc_slice[11][src[4]]^
+      crc_slice[10][src[5]]^
+      crc_slice[9][src[6]]^
+      crc_slice[8][src[7]]^
+      crc_slice[7][src[8]]^
+      crc_slice[6][src[9]]^
+      crc_slice[5][src[10]]^
+      crc_slice[4][src[11]]^
+      crc_slice[3][src[12]]^
+      crc_slice[2][src[13]]^
+      crc_slice[1][src[14]]^
+      crc_slice[0][src[15]];
+  }
+  return crc_kernel_slice8(src,srcc,crc);
+}
+
+/* Carry-less multiply folding.
+ * Four 128-bit accumulators, each holding a 16-byte block as a big-endian polynomial.
+ * Folding a block forward by N bits is (hi*(x**(N+64) mod P)) ^ (lo*(x**N mod P)); the products are under 80 bits.
+ * At the end, whatever is left in the accumulator is congruent to the message so far,
+ * so we hand its 16 bytes plus the tail to the table kernel, starting from zero.
+ */
+
+#if MACB_CRC_HAVE_CLMUL
+
+static int64_t crc_fold512[2],crc_fold384[2],crc_fold256[2],crc_fold128[2]; // [lo,hi]
+
+#define CRC_CLMUL_TARGET __attribute__((target("pclmul,ssse3")))
+
+CRC_CLMUL_TARGET
+static inline __m128i crc_clmul_fold(__m128i x,const int64_t *k) {
+  __m128i kk=_mm_set_epi64x(k[1],k[0]);
+  return _mm_xor_si128(
+    _mm_clmulepi64_si128(x,kk,0x11),
+    _mm_clmulepi64_si128(x,kk,0x00)
+  );
+}
+
+CRC_CLMUL_TARGET
+static uint16_t crc_kernel_clmul(const uint8_t *src,int srcc,uint16_t crc) {
+  if (srcc<128) return crc_kernel_slice16(src,srcc,crc);
+  const __m128i bswap=_mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+  #define LOAD(p) _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p)),bswap)
+
+  __m128i x0=LOAD(src);
+  __m128i x1=LOAD(src+16);
+  __m128i x2=LOAD(src+32);
+  __m128i x3=LOAD(src+48);
+  x0=_mm_xor_si128(x0,_mm_set_epi64x((int64_t)((uint64_t)crc<<48),0));
+  src+=64;
+  srcc-=64;
+
+  for (;srcc>=64;src+=64,srcc-=64) {
+    x0=_mm_xor_si128(crc_clmul_fold(x0,crc_fold512),LOAD(src));
+    x1=_mm_xor_si128(crc_clmul_fold(x1,crc_fold512),LOAD(src+16));
+    x2=_mm_xor_si128(crc_clmul_fold(x2,crc_fold512),LOAD(src+32));
+    x3=_mm_xor_si128(crc_clmul_fold(x3,crc_fold512),LOAD(src+48));
+  }
+
+  __m128i x=_mm_xor_si128(
+    _mm_xor_si128(crc_clmul_fold(x0,crc_fold384),crc_clmul_fold(x1,crc_fold256)),
+    _mm_xor_si128(crc_clmul_fold(x2,crc_fold128),x3)
+  );
+  for (;srcc>=16;src+=16,srcc-=16) {
+    x=_mm_xor_si128(crc_clmul_fold(x,crc_fold128),LOAD(src));
+  }
+  #undef LOAD
+
+  uint8_t rem[16];
+  _mm_storeu_si128((__m128i*)rem,_mm_shuffle_epi8(x,bswap));
+  crc=crc_kernel_slice16(rem,16,0);
+  return crc_kernel_byte(src,srcc,crc);
+}
+
+#endif
+
+/* Kernel registry and dispatch.
+ */
+
+typedef uint16_t (*crc_kernel_fn)(const uint8_t *src,int srcc,uint16_t crc);
+
+static crc_kernel_fn crc_kernel=crc_kernel_slice16;
+
+static crc_kernel_fn crc_kernel_by_id(int kernel) {
+  switch (kernel) {
+    case MACB_CRC_KERNEL_BYTE: return crc_kernel_byte;
+    case MACB_CRC_KERNEL_SLICE8: return crc_kernel_slice8;
+    case MACB_CRC_KERNEL_SLICE16: return crc_kernel_slice16;
+    #if MACB_CRC_HAVE_CLMUL
+      case MACB_CRC_KERNEL_CLMUL: {
+          if (!__builtin_cpu_supports("pclmul")||!__builtin_cpu_supports("ssse3")) return 0;
+          return crc_kernel_clmul;
+        }
+    #endif
+  }
+  return 0;
+}
+
+const char *macb_crc_kernel_name(int kernel) {
+  switch (kernel) {
+    case MACB_CRC_KERNEL_AUTO: return "auto";
+    case MACB_CRC_KERNEL_BYTE: return "byte";
+    case MACB_CRC_KERNEL_SLICE8: return "slice8";
+    case MACB_CRC_KERNEL_SLICE16: return "slice16";
+    case MACB_CRC_KERNEL_CLMUL: return "clmul";
+  }
+  return "?";
+}
+
+int macb_crc_set_kernel(int kernel) {
+  if (kernel==MACB_CRC_KERNEL_AUTO) {
+    if (macb_crc_set_kernel(MACB_CRC_KERNEL_CLMUL)>=0) return 0;
+    return macb_crc_set_kernel(MACB_CRC_KERNEL_SLICE16);
+  }
+  crc_kernel_fn fn=crc_kernel_by_id(kernel);
+  if (!fn) return -1;
+  crc_kernel=fn;
+  return 0;
+}
+
+/* Build tables and pick a kernel before main(), so threads never race on it.
+ */
+
+static void __attribute__((constructor)) crc_fast_init() {
+  int b=0; for (;b<256;b++) {
+    uint16_t crc=b<<8;
+    int i=8; while (i-->0) {
+      if (crc&0x8000) crc=(crc<<1)^MACB_CRC_POLY;
+      else crc<<=1;
+    }
+    crc_slice[0][b]=crc;
+  }
+  int k=1; for (;k<16;k++) {
+    for (b=0;b<256;b++) {
+      uint16_t prev=crc_slice[k-1][b];
+      crc_slice[k][b]=(prev<<8)^crc_slice[0][prev>>8];
+    }
+  }
+  #if MACB_CRC_HAVE_CLMUL
+    crc_fold512[0]=crc_xpow(512); crc_fold512[1]=crc_xpow(576);
+    crc_fold384[0]=crc_xpow(384); crc_fold384[1]=crc_xpow(448);
+    crc_fold256[0]=crc_xpow(256); crc_fold256[1]=crc_xpow(320);
+    crc_fold128[0]=crc_xpow(128); crc_fold128[1]=crc_xpow(192);
+  #endif
+  macb_crc_set_kernel(MACB_CRC_KERNEL_AUTO);
+}
+
+/* Public entry points.
+ */
+
+uint16_t macb_crc_macb(const void *src,int srcc,uint16_t crc) {
+  if (srcc<=0) return crc;
+  return crc_kernel(src,srcc,crc);
+}
+
+uint16_t macb_crc_binh(const void *src,int srcc,uint16_t crc) {
+  /* BinHex's loop feeds bytes in below the register instead of XORing them on top,
+   * so the last two bytes are never reduced and the starting value sits 16 bits further left.
+   * binh(M+B,c) == macb(M,c*x**16) ^ B, where B is the final two bytes.
+   */
+  if (srcc<2) {
+    const uint8_t *SRC=src;
+    for (;srcc-->0;SRC++) crc=((crc<<8)|*SRC)^crc_slice[0][crc>>8];
+    return crc;
+  }
+  const uint8_t *tail=(const uint8_t*)src+srcc-2;
+  uint8_t pre[2]={crc>>8,crc};
+  crc=crc_kernel_byte(pre,2,0);
+  crc=macb_crc_macb(src,srcc-2,crc);
+  return crc^((tail[0]<<8)|tail[1]);
+}
@@ -6,9 +6,17 @@
 #include <string.h>
 #include <limits.h>
 #include <stdint.h>
+#include <sys/uio.h>
+#include "macb_codec.h"
 
 #define UNIX_EPOCH_IN_MAC_TIME 2082844800
 
+// "-" as a path means stdin or stdout, whichever makes sense.
+#define MACB_PATH_IS_STDIO(path) ((path)&&((path)[0]=='-')&&!(path)[1])
+
+// Fork lengths are unsigned 32 bits in the header. Archives can be longer, with padding.
+#define MACB_FORK_LIMIT 0xffffffffll
+
 /* Request.
  **************************************************/
  
@@ -18,10 +26,75 @@ struct macb_request {
   char *dfpath; int dfpathc; // Data fork
   char *rfpath; int rfpathc; // Resource fork
   char *fipath; int fipathc; // Finder info (MacBinary header)
-  char command; // [cxth]
+  char command; // [cxthiquv] For 'i' (--index), (arpath) is the directory to scan. For 'v' (--serve), it's the socket.
   uint32_t type,creator; // zero if unset, otherwise OSType; will write big-endianly
+  
+  // Header fields for '-u' (--update), besides type and creator. Times are Mac time, zero if unset.
+  int flagsset; uint16_t flags; // Finder flags, high byte at 0x49 and low at 0x65.
+  uint32_t ctime,mtime;
+  
+  // Batch mode: More archive paths after (arpath). If there are none at all, we read a NUL-delimited list from stdin.
+  int batch;
+  int jobc; // Worker count, zero for one per core.
+  char **batchv; int batchc,batcha;
+  
+  // Catalog (--index, --query). Query filters are zero if unset.
+  char *catpath; int catpathc; // Default "macb.catalog".
+  int64_t minsize,maxsize; // Combined length of both forks.
+  uint32_t after,before; // Mac time, compared against modify time.
+  
+  int format; // MACB_FORMAT_*, for '-t'.
+  int io; // MACB_IO_*, for '--batch'.
+  int resources; // '-t' lists the resource map instead of the header.
+  char *storepath; int storepathc; // '-x' keeps forks in this content-addressed store, see macb_store_fork.
+  int digest; // MACB_DIGEST_*: '-x' and '-c' hash forks as they copy. '-t --deep' hashes them too.
+  char *manifestpath; int manifestpathc; // Where digests go, or come from with '--deep'. Null for reports.
+  int deep; // '-t' reads both forks and checks them against the manifest.
+  char *bundlepath; int bundlepathc; // '-c' packs archives into this bundle; '-x' and '-t' take (arpath) from it.
+  char *cachepath; int cachepathc; // '-c' skips archives whose inputs haven't changed since this cache recorded them.
+  int stats; // Print where the time went to stderr at exit, see macb_stats_report.
+  int tar; // '-x' reads a tar of archives (arpath, default stdin) and writes a tar of forks to stdout. '-c' the reverse.
+  int rsrcsel; // MACB_RSRC_*: '-x' extracts selected resources instead of forks.
+  uint32_t rsrctype; int rsrcid;
+  int as; // MACB_AS_*, for '-x' and '-c'. Changes the meaning of (dfpath,rfpath), see macb_main_apple_* and macb_main_hqx_*.
+  
+  // Header already read by the batch engine, or null to read it ourselves. Only '-t' uses it.
+  const struct macb_prefetch *prefetch;
+  
+  // Manifest already loaded by the batch engine, or null to load it ourselves. Only '-t --deep' uses it.
+  const struct macb_manifest *manifest;
+  
+  // Cache already loaded by the batch engine, or null to load it ourselves. Only '-c --cache' uses it.
+  const struct macb_cache *cache;
+  
+  // Where reports go. Null for stdout and stderr. Set (err) before macb_request_init and its complaints go there too.
+  FILE *out,*err;
 };
 
+#define MACB_FORMAT_TEXT 0 /* Human-readable prose, one line per observation. */
+#define MACB_FORMAT_JSON 1 /* JSON Lines, one object per archive. */
+#define MACB_FORMAT_TSV  2 /* Tab-separated, one row per archive, with a header row. */
+
+#define MACB_IO_AUTO  0 /* io_uring where it helps and the kernel has it, otherwise blocking. */
+#define MACB_IO_SYNC  1 /* Always blocking syscalls. */
+#define MACB_IO_URING 2 /* Insist on io_uring, fail if unavailable. */
+
+#define MACB_AS_MACBINARY 0 /* Plain forks. */
+#define MACB_AS_SINGLE    1 /* AppleSingle: One file with everything. */
+#define MACB_AS_DOUBLE    2 /* AppleDouble: Plain data file, and "._NAME" with everything else. */
+#define MACB_AS_BINHEX    3 /* BinHex 4.0 text. */
+
+#define MACB_RSRC_NONE        0
+#define MACB_RSRC_TYPE        1 /* Every resource of (rsrctype). */
+#define MACB_RSRC_TYPE_AND_ID 2 /* Just (rsrctype,rsrcid). */
+
+#define MACB_DIGEST_NONE   0
+#define MACB_DIGEST_SHA256 1 /* "sha256:HEX", same as sha256sum. */
+#define MACB_DIGEST_FAST   2 /* "xxh64-4m:HEX", XXH64 of each 4 MB chunk, then XXH64 of those. See macb_digest_update. */
+
+#define MACB_OUT(request) ((request)->out?(request)->out:stdout)
+#define MACB_ERR(request) ((request)->err?(request)->err:stderr)
+
 void macb_request_cleanup(struct macb_request *request);
 
 /* Populate the request from command line.
@@ -41,30 +114,397 @@ void macb_print_usage(const char *exename);
  */
 int macb_request_infer_archive_path_if_missing(struct macb_request *request);
 
+/* The reverse: If no forks are named, look for "NAME.data" and "NAME.res" beside "NAME.bin".
+ * Quietly does nothing if the archive path is empty or either fork is already named.
+ * Returns >0 if it changes something.
+ */
+int macb_request_infer_fork_paths_if_missing(struct macb_request *request);
+
+/* Commands.
+ *********************************************************/
+
+/* Run one create, extract, or tell, according to (request->command).
+ * Reports to MACB_OUT(request) and MACB_ERR(request).
+ */
+int macb_run_request(struct macb_request *request);
+
+/* Scan the directory tree at (request->arpath) and bring the catalog up to date.
+ * Files already in the catalog with the same device, inode, size, and mtime are not read again.
+ */
+int macb_main_index(struct macb_request *request);
+
+/* Print the path of every cataloged archive matching the filters in (request).
+ * Reads only the catalog, never the archives.
+ */
+int macb_main_query(struct macb_request *request);
+
+/* Convert between MacBinary and AppleSingle or AppleDouble, in one pass, according to (request->as).
+ * (dfpath) is the AppleSingle file, or the AppleDouble data file.
+ * (rfpath) is the AppleDouble header file, default "._" plus the data file's base name, in the same directory.
+ * Both default to "NAME.as", or "NAME" and "._NAME", beside "NAME.bin". So these work with '--batch' too.
+ */
+int macb_main_apple_extract(struct macb_request *request);
+int macb_main_apple_create(struct macb_request *request);
+
+/* Convert between MacBinary and BinHex 4.0, in one pass, streaming both ways.
+ * (dfpath) is the .hqx file, default "NAME.hqx" beside "NAME.bin".
+ * Fails on any BinHex CRC mismatch.
+ */
+int macb_main_hqx_extract(struct macb_request *request);
+int macb_main_hqx_create(struct macb_request *request);
+
+/* Run (request->command) against every archive in the batch, on a pool of worker threads.
+ * Each archive's output is buffered and emitted in one piece.
+ * Fails if any job fails.
+ */
+int macb_main_batch(struct macb_request *request);
+
+/* List every resource in the archive's resource fork, according to (request->format).
+ * Reads the resource header and map only, never resource data. See macb_resmap_read.
+ */
+int macb_main_resources(struct macb_request *request);
+
+/* Extract the resources selected by (request->rsrcsel) to separate files, each body streamed straight from the archive.
+ * Reads the map, then only the selected resources, in data order. Needs a seekable archive.
+ */
+int macb_main_extract_resources(struct macb_request *request);
+
+/* Machine-readable tell records, for MACB_FORMAT_JSON and MACB_FORMAT_TSV.
+ * (flen) is the archive length, <0 if unknown.
+ * The header row is only for TSV; for other formats it does nothing.
+ * An error record has the path and error message, and every other field empty.
+ * (kind) is MACB_RECORD_HEADER for one record per archive, or MACB_RECORD_RESOURCE for one per resource.
+ * A resource's (offset) is where its body starts in the archive.
+ */
+#define MACB_RECORD_HEADER   0
+#define MACB_RECORD_RESOURCE 1
+struct macb_resource;
+void macb_record_write_header(FILE *f,int format,int kind);
+void macb_record_write(FILE *f,int format,const char *path,const uint8_t *hdr,int64_t flen);
+void macb_record_write_resource(FILE *f,int format,const char *path,const struct macb_resource *resource,int64_t offset);
+void macb_record_write_error(FILE *f,int format,int kind,const char *path,const char *error);
+
 /* FS.
  *********************************************************/
 
 /* Successful read always allocates its output buffer, even if the returned length is zero.
  * No arguments are checked, caller must sanitize.
+ * Paths for macb_file_openr, macb_file_openw, macb_file_write, macb_file_write_from_fd may be "-" for stdin or stdout.
  */
 int macb_file_read_fd(void *dstpp,int fd);
 int macb_file_read(void *dstpp,const char *path);
 int macb_file_write(const char *path,const void *src,int srcc);
+int macb_file_write_at(int fd,const void *src,int srcc,int64_t p);
+int macb_file_read_at(int fd,void *dst,int dstc,int64_t p); // Exactly (dstc) bytes, or fail.
 
 /* Read the first 128 bytes and return the total length.
  * If the file is not seekable, return zero instead -- caller should issue a warning then.
+ * A pipe is read sequentially, so afterward its position is just past the header.
  */
-int macb_file_read_header(void *dst_128b,const char *path);
+int64_t macb_file_read_header(void *dst_128b,const char *path);
+int64_t macb_file_read_header_fd(void *dst_128b,int fd);
+int macb_file_at_eof(int fd,int64_t p); // >0 if nothing follows (p), 0 if something does. Pipes: Whatever's next.
+
+int macb_file_openr(const char *path); // => fd
+
+/* Stream (srcc) bytes starting at (srcp) in (srcfd) into another file.
+ * On Linux the bytes stay in the kernel: copy_file_range if the filesystems allow it, otherwise splice.
+ * Anywhere else, or if both of those refuse, we use a small fixed buffer.
+ * Memory does not grow with the length in any case.
+ * (srcp<0) to read sequentially from the current position, eg from a pipe.
+ * macb_file_write_from_fd replaces (path) atomically, see macb_output_open.
+ */
+int macb_file_copy(int dstfd,int srcfd,int64_t srcp,int64_t srcc);
+int macb_file_write_from_fd(const char *path,int srcfd,int64_t srcp,int64_t srcc);
+
+/* For sequential inputs: Copy everything that's left and return its length, or discard exactly (c) bytes.
+ */
+int64_t macb_file_copy_to_eof(int dstfd,int srcfd);
+int macb_file_skip(int fd,int64_t c);
 
 int macb_file_openw(const char *path); // => fd
+int macb_file_openrw(const char *path); // => fd, existing regular files only, never "-".
+
+/* Current position if (fd) is a regular file we can pwrite into later, otherwise <0.
+ */
+int64_t macb_file_tell_if_seekable(int fd);
 int macb_file_append(int fd,const void *src,int srcc); // (src) null to append zeroes.
+int macb_file_writev_at(int fd,struct iovec *iov,int iovc,int64_t p); // Consumes (iov). (p<0) for current position.
+int macb_file_open_tmp(); // Anonymous, read/write, gone when closed.
 int macb_file_close(int fd);
 
-/* Read file timestamps and convert to Mac format.
- * Zero on any error; guaranteed safe if null, empty, etc.
+// Padding comes from here, never a fresh allocation. Always at least 128 bytes.
+#define MACB_ZERO_PAGE_SIZE 4096
+extern const uint8_t macb_zero_page[MACB_ZERO_PAGE_SIZE];
+
+/* Atomic output.
+ * macb_output_open starts a nameless file in (path)'s directory (O_TMPFILE, or a hidden temp name where that's
+ * unsupported), preallocated to (size) if known (>=0). Write to (fd) any way you like.
+ * macb_output_commit flushes it to disk and then puts it at (path) in one rename: Readers see the old file or
+ * the whole new one, never a torn one, even if we crash. macb_output_abort throws it away and leaves (path) alone.
+ * "-", and existing paths that aren't regular files (FIFOs, devices), are written directly, as before.
+ * A symlink is followed, and the file it points to is replaced; the link stays. A replaced file keeps its mode,
+ * and its owner if we're allowed to set it.
+ * (path) is borrowed; keep it alive until commit or abort.
+ * macb_output_link does the same with a hardlink to (srcpath), and fails for paths that can't be linked over.
+ */
+struct macb_output {
+  int fd;
+  const char *path; // Where we publish: The caller's (path), or (ownpath).
+  int mode; // MACB_OUTPUT_*
+  char *tmppath; // MACB_OUTPUT_NAMED only.
+  char *ownpath; // Target of a symlink, if that's what (path) was.
+};
+#define MACB_OUTPUT_DIRECT  0
+#define MACB_OUTPUT_TMPFILE 1
+#define MACB_OUTPUT_NAMED   2
+int macb_output_open(struct macb_output *output,const char *path,int64_t size);
+int macb_output_commit(struct macb_output *output);
+void macb_output_abort(struct macb_output *output);
+int macb_output_link(const char *path,const char *srcpath);
+
+/* An input fork, opened once and fstat'd once.
+ * Opening a null or empty path succeeds, with (fd<0) and everything zero.
+ * "-" is stdin. Directories are refused.
+ * (len) can be anything the filesystem allows; callers must check it against MACB_FORK_LIMIT.
+ * If it's not a regular file, (len) is -1 until you read it to the end, or spool it.
+ * macb_input_spool copies a stream to an anonymous temp file, so (len) is known. Noop for regular files.
+ * Timestamps are converted to Mac format, zero if unknown.
+ */
+struct macb_input {
+  int fd;
+  int64_t len;
+  uint32_t ctime,mtime;
+};
+int macb_input_open(struct macb_input *input,const char *path);
+int macb_input_spool(struct macb_input *input);
+void macb_input_close(struct macb_input *input);
+
+/* io_uring header prefetch, Linux only.
+ * Opens, stats, reads 128 bytes, and closes many archives in a couple of submissions.
+ * macb_uring_new returns null if the kernel or platform doesn't have io_uring with OPENAT, STATX, READ and CLOSE;
+ * use the blocking calls then. If macb_uring_prefetch_headers fails, stop using that ring.
+ * Each prefetch gets (status) 1 if its header and length are good, or -1 to read it the blocking way.
+ * (flen) has the same meaning as macb_file_read_header's return value.
+ */
+struct macb_uring;
+struct macb_prefetch {
+  const char *path;
+  uint8_t hdr[128];
+  int64_t flen;
+  int status;
+};
+struct macb_uring *macb_uring_new(int entries);
+void macb_uring_del(struct macb_uring *uring);
+int macb_uring_prefetch_headers(struct macb_uring *uring,struct macb_prefetch *v,int c);
+
+/* Resource fork map.
+ * macb_resmap_read reads the 16-byte resource header and the map, and nothing else.
+ * (fd) is the archive and (forkp,forklen) locate the resource fork in it, as from macb_layout_compute.
+ * (streamp) is the current position if (fd) is a pipe, which must be at or before (forkp), or <0 if seekable.
+ * Sizes come from the gaps between data offsets, so the data area is never touched.
+ * That's exact for forks the Resource Manager wrote, since it packs data with no gaps.
+ * Resources are in map order: types as listed, then references as listed.
+ * Logs errors against (request->arpath).
+ */
+struct macb_resource {
+  uint32_t type;
+  int id;
+  uint8_t attributes;
+  const char *name; int namec; // Points into (map). Null if unnamed.
+  int64_t datap; // Offset of the 4-byte length prefix, from the start of the fork.
+  int64_t len; // Body only. <0 if the map doesn't tell us.
+};
+struct macb_resmap {
+  uint8_t *map; int mapc;
+  int64_t datap,datalen,mapp; // Relative to the fork.
+  uint16_t attributes;
+  int typec;
+  struct macb_resource *v; int c;
+};
+int macb_resmap_read(
+  struct macb_resmap *resmap,struct macb_request *request,
+  int fd,int64_t streamp,int64_t forkp,int64_t forklen
+);
+void macb_resmap_cleanup(struct macb_resmap *resmap);
+
+/* Content-addressed fork store, for '-x --store=DIR'.
+ * macb_store_fork hashes (c) bytes at (p) in (fd) and makes sure DIR has an object for them.
+ * (*streamp) is the current position of a pipe, or <0 if (fd) is seekable, same as extract.
+ * (hex) receives the SHA-256 in hex, 65 bytes with terminator. (*fresh) nonzero if the object is new.
+ * macb_store_link puts a copy of an object at (dstpath): Reflink if possible, then hardlink, then a real copy.
+ * macb_store_write_manifest appends one line to DIR/manifest.tsv:
+ *   ARCHIVE PATH, "sha256:" DATA DIGEST, DATA LENGTH, "sha256:" RESOURCE DIGEST, RESOURCE LENGTH
+ */
+int macb_store_fork(struct macb_request *request,char *hex,int *fresh,int fd,int64_t *streamp,int64_t p,int64_t c);
+int macb_store_link(struct macb_request *request,const char *hex,const char *dstpath);
+int macb_store_write_manifest(struct macb_request *request,const char *dfhex,int64_t dflen,const char *rfhex,int64_t rflen);
+
+/* SHA-256.
+ * Call update as often as you like, then final once for the 32-byte digest.
+ */
+struct macb_sha256 {
+  uint32_t h[8];
+  uint64_t len;
+  uint8_t buf[64]; int bufc;
+};
+void macb_sha256_init(struct macb_sha256 *sha);
+void macb_sha256_update(struct macb_sha256 *sha,const void *src,int64_t srcc);
+void macb_sha256_final(uint8_t *dst,struct macb_sha256 *sha);
+void macb_sha256_hex(char *dst,const uint8_t *digest); // 65 bytes, with terminator.
+
+/* XXH64.
+ * Same shape as SHA-256, but final doesn't disturb the state.
  */
-uint32_t macb_stat_ctime(const char *path);
-uint32_t macb_stat_mtime(const char *path);
+struct macb_xxh64 {
+  uint64_t v[4];
+  uint64_t seed,len;
+  uint8_t buf[32]; int bufc;
+};
+void macb_xxh64_init(struct macb_xxh64 *xxh,uint64_t seed);
+void macb_xxh64_update(struct macb_xxh64 *xxh,const void *src,int64_t srcc);
+uint64_t macb_xxh64_final(const struct macb_xxh64 *xxh);
+
+/* Fork digests, for '--digest'.
+ * A digest is text like "sha256:HEX", with the algorithm up front, so manifests can mix them.
+ * macb_digest_copy and friends are macb_file_copy etc, reading through a buffer so every byte gets hashed on the way.
+ * (dstfd) <0 to only hash. They never use the kernel copy engines: The bytes have to pass through us anyway.
+ * macb_digest_fd hashes (c) bytes at (p) in a seekable file.
+ * With MACB_DIGEST_FAST and (threadc)>1, chunks hash in parallel; it comes out the same either way.
+ */
+#define MACB_DIGEST_SIZE 80
+#define MACB_DIGEST_CHUNK_SIZE (4<<20)
+struct macb_digest {
+  int algo;
+  struct macb_sha256 sha256;
+  struct macb_xxh64 chunk,outer;
+  int64_t chunkc;
+};
+void macb_digest_init(struct macb_digest *digest,int algo);
+void macb_digest_update(struct macb_digest *digest,const void *src,int64_t srcc);
+void macb_digest_final(char *dst,struct macb_digest *digest); // (dst) MACB_DIGEST_SIZE
+int macb_digest_algo_of(const char *src); // MACB_DIGEST_* from a digest string's prefix, or <0.
+int macb_digest_copy(struct macb_digest *digest,int dstfd,int srcfd,int64_t srcp,int64_t srcc);
+int64_t macb_digest_copy_to_eof(struct macb_digest *digest,int dstfd,int srcfd);
+int macb_digest_write_from_fd(struct macb_digest *digest,const char *path,int srcfd,int64_t srcp,int64_t srcc);
+int macb_digest_fd(char *dst,int algo,int fd,int64_t p,int64_t c,int threadc);
+
+/* Digest manifest.
+ * One line per archive, tab-separated:
+ *   ARCHIVE PATH, DATA DIGEST, DATA LENGTH, RESOURCE DIGEST, RESOURCE LENGTH
+ * macb_manifest_append writes one line with one write(), so concurrent jobs don't interleave.
+ * macb_manifest_emit does that to (request->manifestpath), or prints the line to reports if there isn't one.
+ * If an archive appears more than once, the last line wins.
+ */
+struct macb_manifest_entry {
+  const char *path; int pathc; // All point into (map), and aren't terminated.
+  const char *dfdigest,*rfdigest; int dfdigestc,rfdigestc; // Shorter than MACB_DIGEST_SIZE.
+  int64_t dflen,rflen;
+  int seq; // Line number, to keep the last of duplicates.
+};
+struct macb_manifest {
+  const char *map; size_t mapc;
+  struct macb_manifest_entry *v; int c; // Sorted by path.
+};
+int macb_manifest_append(const char *path,const char *arpath,const char *dfdigest,int64_t dflen,const char *rfdigest,int64_t rflen);
+int macb_manifest_emit(struct macb_request *request,const char *dfdigest,int64_t dflen,const char *rfdigest,int64_t rflen);
+int macb_manifest_load(struct macb_manifest *manifest,const struct macb_request *request); // (request->manifestpath). Reports its own errors, to MACB_ERR.
+void macb_manifest_cleanup(struct macb_manifest *manifest);
+const struct macb_manifest_entry *macb_manifest_find(const struct macb_manifest *manifest,const char *path);
+
+/* Input fingerprint cache for '-c --cache'. Format in macb_cache.c.
+ * macb_cache_check fills (fingerprint) (MACB_CACHE_LINE_SIZE) with the inputs' identity, and returns >0 if the archive
+ * is fresh, ie it and its inputs are just as the last recorded create left them. 0 to create, <0 for real errors.
+ * After a successful create, macb_cache_record appends that fingerprint, with the new archive's, and now and then
+ * compacts the file down to one line per archive.
+ * A missing cache file is empty. If an archive appears more than once, the last line wins.
+ * macb_cache_load reads and sorts all of it, for the batch engine; a lone check only scans for its own archive.
+ */
+#define MACB_CACHE_LINE_SIZE 8192
+struct macb_cache_entry {
+  const char *path; // Both point into (src).
+  const char *fingerprint; // The rest of the line.
+  int seq;
+};
+struct macb_cache {
+  char *src; int srcc;
+  struct macb_cache_entry *v; int c; // Sorted by path.
+};
+int macb_cache_load(struct macb_cache *cache,const char *path);
+void macb_cache_cleanup(struct macb_cache *cache);
+int macb_cache_check(struct macb_request *request,char *fingerprint);
+int macb_cache_record(struct macb_request *request,const char *fingerprint);
+
+/* '-t --deep': Hash both forks of (request->arpath) and check against the manifest,
+ * or print a manifest line if there isn't one.
+ */
+int macb_main_deep(struct macb_request *request);
+
+/* Bundles: Many archives in one file, with a sorted index at the end. Format in macb_bundle.c.
+ * macb_bundle_open maps the whole file and checks the index. Members are in name order.
+ * macb_bundle_find returns the member's index, or <0 if absent, and fills (member).
+ * Members' names and headers point into the map, valid until close.
+ */
+struct macb_bundle {
+  int fd;
+  const uint8_t *map; int64_t mapc;
+  const uint8_t *entries; int entryc;
+  const uint8_t *names; int64_t namesc;
+};
+struct macb_bundle_member {
+  const char *name; int namec; // Not terminated.
+  int64_t p,c; // Position and length of the whole archive in the bundle.
+  uint32_t dflen,rflen;
+  const uint8_t *hdr; // 128 bytes.
+};
+int macb_bundle_open(struct macb_bundle *bundle,const char *path);
+void macb_bundle_close(struct macb_bundle *bundle);
+void macb_bundle_member(struct macb_bundle_member *member,const struct macb_bundle *bundle,int p);
+int macb_bundle_find(struct macb_bundle_member *member,const struct macb_bundle *bundle,const char *name,int namec);
+
+/* '-c --bundle': Pack (arpath) and (batchv), or a NUL-delimited list from stdin, into (bundlepath).
+ * '-t --bundle' without an archive: List members.
+ * '-x' and '-t' with an archive look it up in the bundle and proceed as usual, see macb_main_extract and macb_main_tell.
+ */
+int macb_main_bundle_create(struct macb_request *request);
+int macb_main_bundle_list(struct macb_request *request);
+
+/* '-x --tar' and '-c --tar'. Streams both ways, see macb_tar.c.
+ */
+int macb_main_tar(struct macb_request *request);
+
+/* '--serve': Listen on the Unix socket (arpath) and run requests from clients on (jobc) workers. Protocol in macb_serve.c.
+ * Returns only on failure.
+ */
+int macb_main_serve(struct macb_request *request);
+
+/* '--stats': Per-phase time, bytes, and syscalls, and per-archive latency. Details in macb_stats.c.
+ * Wrap work in macb_stats_begin and macb_stats_end; with stats off that's one branch.
+ * Only the leaf I/O helpers record, never something that calls another recording helper, so nothing counts twice.
+ * Kernel copies (copy_file_range, splice) read and write in one call, and count as fork write.
+ * macb_stats_syscallc is bumped at every syscall in macb_fs.c, see MACB_SYSCALL.
+ * macb_stats_archive records one archive's whole run. macb_stats_report sums every thread's counts: Call it once
+ * the workers are done.
+ */
+#define MACB_STATS_ARGS       0
+#define MACB_STATS_HEADER     1
+#define MACB_STATS_FORK_READ  2
+#define MACB_STATS_CRC        3
+#define MACB_STATS_FORK_WRITE 4
+#define MACB_STATS_SYNC       5 /* fdatasync, link and rename of atomic output, and close. */
+#define MACB_STATS_PHASE_COUNT 6
+struct macb_stats_mark {
+  int64_t ns; // Zero if stats are off.
+  int64_t syscallc;
+};
+extern int macb_stats_enabled;
+extern __thread int64_t macb_stats_syscallc;
+#define MACB_SYSCALL(call) (macb_stats_syscallc++,(call))
+int64_t macb_stats_now(); // CLOCK_MONOTONIC, in ns.
+void macb_stats_begin(struct macb_stats_mark *mark);
+void macb_stats_end(const struct macb_stats_mark *mark,int phase,int64_t bytes);
+void macb_stats_archive(int64_t ns);
+void macb_stats_report(FILE *f,int64_t wallns);
 
 /* General MacBinary stuff.
  ********************************************************/
@@ -76,9 +516,14 @@ uint32_t macb_stat_mtime(const char *path);
 void macb_initialize_header(void *hdr,const struct macb_request *request);
 
 /* Selectively overwrite (hdr) with fork lengths, type, and creator.
+ * Timestamps come from the inputs if the header doesn't have them yet.
  * Then calculate and write the CRC.
+ * (df,rf) are optional.
  */
-int macb_finish_header(void *hdr,const struct macb_request *request,int dfc,int rfc);
+int macb_finish_header(
+  void *hdr,const struct macb_request *request,
+  const struct macb_input *df,const struct macb_input *rf
+);
 
 void macb_wr32(uint8_t *dst,int p,uint32_t v);
 void macb_wr16(uint8_t *dst,int p,uint16_t v);
@@ -0,0 +1,470 @@
+#include "macb.h"
+#include <unistd.h>
+
+/* AppleSingle and AppleDouble, per RFC 1740.
+ *
+ * 0000   4 magic: 0x00051600 single, 0x00051607 double
+ * 0004   4 version: 0x00020000 (we also read 0x00010000)
+ * 0008  16 filler
+ * 0018   2 entry count
+ * 001a  12*n entries: id, offset, length
+ *
+ * Entries we write, in this order:
+ *    3 Real name       Raw bytes from the MacBinary header.
+ *    9 Finder info     32 bytes: FInfo (type, creator, flags, location, folder) then FXInfo, which MacBinary doesn't have.
+ *    8 File dates      Create, modify, backup, access. Signed seconds since 2000-01-01 GMT, 0x80000000 if unknown.
+ *   10 Macintosh info  32 bits; 0x02 is the protected bit.
+ *    1 Data fork       AppleSingle only. AppleDouble keeps it in a plain file beside the header.
+ *    2 Resource fork
+ * Data before resource is the same order as MacBinary, so a piped archive can convert in one sequential pass.
+ * Comments are not carried across, same as extracting to plain forks.
+ */
+
+#define MACB_APPLE_SINGLE_MAGIC 0x00051600
+#define MACB_APPLE_DOUBLE_MAGIC 0x00051607
+#define MACB_APPLE_VERSION_1    0x00010000
+#define MACB_APPLE_VERSION_2    0x00020000
+
+#define MACB_APPLE_ENTRY_DATA   1
+#define MACB_APPLE_ENTRY_RES    2
+#define MACB_APPLE_ENTRY_NAME   3
+#define MACB_APPLE_ENTRY_DATES  8
+#define MACB_APPLE_ENTRY_FINFO  9
+#define MACB_APPLE_ENTRY_MACINFO 10
+
+#define MACB_APPLE_ENTRY_LIMIT 64 /* Reading. Real files have a handful. */
+
+// AppleSingle dates count from 2000, Mac dates from 1904.
+#define MACB_APPLE_EPOCH_IN_MAC_TIME 3029529600u
+#define MACB_APPLE_DATE_UNKNOWN 0x80000000u
+
+static uint32_t macb_apple_date_from_mac(uint32_t mac) {
+  if (!mac) return MACB_APPLE_DATE_UNKNOWN;
+  return (uint32_t)((int64_t)mac-MACB_APPLE_EPOCH_IN_MAC_TIME);
+}
+
+static uint32_t macb_apple_date_to_mac(uint32_t as) {
+  if (as==MACB_APPLE_DATE_UNKNOWN) return 0;
+  int64_t mac=(int64_t)(int32_t)as+MACB_APPLE_EPOCH_IN_MAC_TIME;
+  if ((mac<0)||(mac>UINT32_MAX)) return 0;
+  return mac;
+}
+
+/* Output paths.
+ * "PREFIX.as" for AppleSingle, or "PREFIX" and "DIR/._BASE" for AppleDouble,
+ * where PREFIX is the archive path without ".bin".
+ */
+
+static int macb_apple_set_path(char **dst,int *dstc,const char *pfx,int pfxc,const char *sfx) {
+  int sfxc=sfx?strlen(sfx):0;
+  char *path=malloc(pfxc+sfxc+1);
+  if (!path) return -1;
+  memcpy(path,pfx,pfxc);
+  memcpy(path+pfxc,sfx,sfxc);
+  path[pfxc+sfxc]=0;
+  if (*dst) free(*dst);
+  *dst=path;
+  *dstc=pfxc+sfxc;
+  return 0;
+}
+
+static int macb_apple_sidecar_path(char **dst,int *dstc,const char *path,int pathc) {
+  int slashp=pathc;
+  while ((slashp>0)&&(path[slashp-1]!='/')) slashp--;
+  char *sidecar=malloc(pathc+3);
+  if (!sidecar) return -1;
+  memcpy(sidecar,path,slashp);
+  memcpy(sidecar+slashp,"._",2);
+  memcpy(sidecar+slashp+2,path+slashp,pathc-slashp);
+  sidecar[pathc+2]=0;
+  if (*dst) free(*dst);
+  *dst=sidecar;
+  *dstc=pathc+2;
+  return 0;
+}
+
+static int macb_apple_guess_outputs(struct macb_request *request) {
+  if (request->dfpathc&&((request->as==MACB_AS_SINGLE)||request->rfpathc)) return 0;
+  const char *pfx=request->arpath;
+  int pfxc=request->arpathc;
+  if ((pfxc>=4)&&!memcmp(pfx+pfxc-4,".bin",4)) pfxc-=4;
+  if (!request->dfpathc) {
+    if (MACB_PATH_IS_STDIO(request->arpath)) {
+      fprintf(MACB_ERR(request),"Output path (-d) required when the archive is stdin.\n");
+      return -1;
+    }
+    if (macb_apple_set_path(&request->dfpath,&request->dfpathc,pfx,pfxc,(request->as==MACB_AS_SINGLE)?".as":0)<0) return -1;
+  }
+  if ((request->as==MACB_AS_DOUBLE)&&!request->rfpathc) {
+    if (MACB_PATH_IS_STDIO(request->dfpath)) {
+      fprintf(MACB_ERR(request),"AppleDouble header path (-r) required when the data file is stdout.\n");
+      return -1;
+    }
+    if (macb_apple_sidecar_path(&request->rfpath,&request->rfpathc,request->dfpath,request->dfpathc)<0) return -1;
+  }
+  return 0;
+}
+
+/* Encode the AppleSingle or AppleDouble header and metadata entries, everything before the forks.
+ * (dst) must hold at least 512 bytes. Returns length.
+ */
+
+static int macb_apple_encode_meta(uint8_t *dst,const uint8_t *hdr,const struct macb_header *header,int single) {
+  int namec=(header->namec<=63)?header->namec:63;
+  int entryc=single?6:5;
+  int dstc=26+entryc*12;
+  int entryp=26;
+  #define ENTRY(id,len) { \
+    macb_wr32(dst,entryp,id); \
+    macb_wr32(dst,entryp+4,dstc); \
+    macb_wr32(dst,entryp+8,len); \
+    entryp+=12; \
+  }
+
+  memset(dst,0,dstc);
+  macb_wr32(dst,0,single?MACB_APPLE_SINGLE_MAGIC:MACB_APPLE_DOUBLE_MAGIC);
+  macb_wr32(dst,4,MACB_APPLE_VERSION_2);
+  macb_wr16(dst,24,entryc);
+
+  ENTRY(MACB_APPLE_ENTRY_NAME,namec)
+  memcpy(dst+dstc,hdr+0x02,namec);
+  dstc+=namec;
+
+  ENTRY(MACB_APPLE_ENTRY_FINFO,32)
+  memset(dst+dstc,0,32);
+  memcpy(dst+dstc,hdr+0x41,8); // type, creator
+  dst[dstc+8]=header->flags_hi;
+  dst[dstc+9]=header->flags_lo;
+  macb_wr16(dst,dstc+10,header->vpos);
+  macb_wr16(dst,dstc+12,header->hpos);
+  macb_wr16(dst,dstc+14,header->folder);
+  dstc+=32;
+
+  ENTRY(MACB_APPLE_ENTRY_DATES,16)
+  macb_wr32(dst,dstc,macb_apple_date_from_mac(header->ctime));
+  macb_wr32(dst,dstc+4,macb_apple_date_from_mac(header->mtime));
+  macb_wr32(dst,dstc+8,MACB_APPLE_DATE_UNKNOWN);
+  macb_wr32(dst,dstc+12,MACB_APPLE_DATE_UNKNOWN);
+  dstc+=16;
+
+  ENTRY(MACB_APPLE_ENTRY_MACINFO,4)
+  macb_wr32(dst,dstc,(header->protect==1)?0x02:0x00);
+  dstc+=4;
+
+  if (single) ENTRY(MACB_APPLE_ENTRY_DATA,header->dflen)
+  // Data fork goes right before the resource fork, so its offset depends on it.
+  if (single) macb_wr32(dst,entryp+4,dstc+header->dflen);
+  else macb_wr32(dst,entryp+4,dstc);
+  macb_wr32(dst,entryp,MACB_APPLE_ENTRY_RES);
+  macb_wr32(dst,entryp+8,header->rflen);
+  #undef ENTRY
+  return dstc;
+}
+
+/* Extract: MacBinary to AppleSingle or AppleDouble.
+ */
+
+// Same as macb_extract_seek: (*streamp<0) means the archive is seekable and we pass offsets instead.
+static int macb_apple_seek(struct macb_request *request,int fd,int64_t *streamp,int64_t p) {
+  if (*streamp<0) return 0;
+  if (macb_file_skip(fd,p-*streamp)<0) {
+    fprintf(MACB_ERR(request),"%s: Archive ended before offset %lld.\n",request->arpath,(long long)p);
+    return -1;
+  }
+  *streamp=p;
+  return 0;
+}
+
+static int macb_apple_copy_fork(struct macb_request *request,int dstfd,int srcfd,int64_t *streamp,int64_t p,int64_t c,const char *what) {
+  if (macb_apple_seek(request,srcfd,streamp,p)<0) return -1;
+  if (macb_file_copy(dstfd,srcfd,(*streamp<0)?p:-1,c)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to copy %lld-byte %s fork.\n",request->arpath,(long long)c,what);
+    return -1;
+  }
+  if (*streamp>=0) *streamp+=c;
+  return 0;
+}
+
+int macb_main_apple_extract(struct macb_request *request) {
+  int result=-1,fd=-1;
+  struct macb_output dst={.fd=-1};
+  uint8_t hdr[128],meta[512];
+
+  if (!request->arpathc) {
+    fprintf(MACB_ERR(request),"Archive path required with '-x'\n");
+    return -1;
+  }
+  if ((fd=macb_file_openr(request->arpath))<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open archive file.\n",request->arpath);
+    return -1;
+  }
+  int64_t flen=macb_file_read_header_fd(hdr,fd);
+  if (flen<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to read 128-byte header, this can't be MacBinary.\n",request->arpath);
+    goto _done_;
+  }
+  struct macb_header header;
+  struct macb_layout layout;
+  macb_header_decode(&header,hdr,128);
+  macb_layout_compute(&layout,&header);
+  uint32_t findings=macb_header_validate(hdr,flen?flen:-1);
+  if (findings&MACB_FINDINGS_FATAL) {
+    fprintf(MACB_ERR(request),"%s:ERROR: Forks extend past the end of the %lld-byte archive.\n",request->arpath,(long long)flen);
+    goto _done_;
+  }
+  int64_t streamp=flen?-1:MACB_HEADER_SIZE;
+  if (macb_apple_guess_outputs(request)<0) goto _done_;
+  int metac=macb_apple_encode_meta(meta,hdr,&header,request->as==MACB_AS_SINGLE);
+
+  // Each output appears whole or not at all, see macb_output_open.
+  if (request->as==MACB_AS_SINGLE) {
+    if (macb_output_open(&dst,request->dfpath,metac+layout.dflen+layout.rflen)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to open file for writing.\n",request->dfpath);
+      goto _done_;
+    }
+    if (macb_file_append(dst.fd,meta,metac)<0) goto _done_;
+    if (macb_apple_copy_fork(request,dst.fd,fd,&streamp,layout.dfp,layout.dflen,"data")<0) goto _done_;
+    if (macb_apple_copy_fork(request,dst.fd,fd,&streamp,layout.rfp,layout.rflen,"resource")<0) goto _done_;
+    if (macb_output_commit(&dst)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to write file.\n",request->dfpath);
+      goto _done_;
+    }
+    fprintf(MACB_OUT(request),"%s: Wrote AppleSingle, %lld bytes.\n",request->dfpath,(long long)(metac+layout.dflen+layout.rflen));
+  } else {
+    if (macb_output_open(&dst,request->dfpath,layout.dflen)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to open file for writing.\n",request->dfpath);
+      goto _done_;
+    }
+    if (macb_apple_copy_fork(request,dst.fd,fd,&streamp,layout.dfp,layout.dflen,"data")<0) goto _done_;
+    if (macb_output_commit(&dst)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to write file.\n",request->dfpath);
+      goto _done_;
+    }
+    fprintf(MACB_OUT(request),"%s: Wrote data file, %lld bytes.\n",request->dfpath,(long long)layout.dflen);
+    if (macb_output_open(&dst,request->rfpath,metac+layout.rflen)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to open file for writing.\n",request->rfpath);
+      goto _done_;
+    }
+    if (macb_file_append(dst.fd,meta,metac)<0) goto _done_;
+    if (macb_apple_copy_fork(request,dst.fd,fd,&streamp,layout.rfp,layout.rflen,"resource")<0) goto _done_;
+    if (macb_output_commit(&dst)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to write file.\n",request->rfpath);
+      goto _done_;
+    }
+    fprintf(MACB_OUT(request),"%s: Wrote AppleDouble header, %lld bytes.\n",request->rfpath,(long long)(metac+layout.rflen));
+  }
+  result=0;
+
+ _done_:
+  macb_output_abort(&dst);
+  macb_file_close(fd);
+  return result;
+}
+
+/* Read an AppleSingle or AppleDouble header and apply its metadata to a MacBinary header.
+ * Records where the forks are, if present. Lengths stay zero otherwise.
+ */
+
+struct macb_apple_forks {
+  int64_t dfp,dflen;
+  int64_t rfp,rflen;
+};
+
+static int macb_apple_read_exactly(int fd,void *dst,int c,int64_t p) {
+  uint8_t *DST=dst;
+  while (c>0) {
+    int err=pread(fd,DST,c,p);
+    if (err<=0) return -1;
+    DST+=err;
+    c-=err;
+    p+=err;
+  }
+  return 0;
+}
+
+static int macb_apple_decode(
+  struct macb_request *request,uint8_t *hdr,struct macb_apple_forks *forks,
+  const struct macb_input *src,const char *path,uint32_t magic
+) {
+  uint8_t head[26],entryv[MACB_APPLE_ENTRY_LIMIT*12],buf[64];
+  if ((src->len<26)||(macb_apple_read_exactly(src->fd,head,26,0)<0)) {
+    fprintf(MACB_ERR(request),"%s: Too short for an AppleSingle or AppleDouble header.\n",path);
+    return -1;
+  }
+  if (macb_rd32(head,0)!=magic) {
+    fprintf(MACB_ERR(request),
+      "%s: Expected %s signature 0x%08x, found 0x%08x.\n",
+      path,(magic==MACB_APPLE_SINGLE_MAGIC)?"AppleSingle":"AppleDouble",magic,macb_rd32(head,0)
+    );
+    return -1;
+  }
+  uint32_t version=macb_rd32(head,4);
+  if ((version!=MACB_APPLE_VERSION_1)&&(version!=MACB_APPLE_VERSION_2)) {
+    fprintf(MACB_ERR(request),"%s: Unsupported version 0x%08x.\n",path,version);
+    return -1;
+  }
+  int entryc=macb_rd16(head,24);
+  if (entryc>MACB_APPLE_ENTRY_LIMIT) {
+    fprintf(MACB_ERR(request),"%s: Too many entries (%d).\n",path,entryc);
+    return -1;
+  }
+  if ((26+entryc*12>src->len)||(macb_apple_read_exactly(src->fd,entryv,entryc*12,26)<0)) {
+    fprintf(MACB_ERR(request),"%s: Entry table truncated.\n",path);
+    return -1;
+  }
+
+  int i=0; for (;i<entryc;i++) {
+    uint32_t id=macb_rd32(entryv,i*12);
+    int64_t p=macb_rd32(entryv,i*12+4);
+    int64_t c=macb_rd32(entryv,i*12+8);
+    if (p+c>src->len) {
+      fprintf(MACB_ERR(request),"%s: Entry %u (%lld bytes at %lld) extends past end of file.\n",path,id,(long long)c,(long long)p);
+      return -1;
+    }
+    switch (id) {
+      case MACB_APPLE_ENTRY_DATA: forks->dfp=p; forks->dflen=c; break;
+      case MACB_APPLE_ENTRY_RES: forks->rfp=p; forks->rflen=c; break;
+      case MACB_APPLE_ENTRY_NAME: if (c>0) {
+          if (c>63) c=63;
+          if (macb_apple_read_exactly(src->fd,buf,c,p)<0) return -1;
+          hdr[0x01]=c;
+          memset(hdr+0x02,0,63);
+          memcpy(hdr+0x02,buf,c);
+        } break;
+      case MACB_APPLE_ENTRY_FINFO: if (c>=16) {
+          if (macb_apple_read_exactly(src->fd,buf,16,p)<0) return -1;
+          memcpy(hdr+0x41,buf,8);
+          hdr[0x49]=buf[8];
+          hdr[0x65]=buf[9];
+          memcpy(hdr+0x4b,buf+10,6); // vpos, hpos, folder
+        } break;
+      case MACB_APPLE_ENTRY_DATES: if (c>=8) {
+          if (macb_apple_read_exactly(src->fd,buf,8,p)<0) return -1;
+          macb_wr32(hdr,0x5b,macb_apple_date_to_mac(macb_rd32(buf,0)));
+          macb_wr32(hdr,0x5f,macb_apple_date_to_mac(macb_rd32(buf,4)));
+        } break;
+      case MACB_APPLE_ENTRY_MACINFO: if (c>=4) {
+          if (macb_apple_read_exactly(src->fd,buf,4,p)<0) return -1;
+          hdr[0x51]=(macb_rd32(buf,0)&0x02)?1:0;
+        } break;
+    }
+  }
+  return 0;
+}
+
+/* Create: AppleSingle or AppleDouble to MacBinary.
+ * -d is the AppleSingle file, or the AppleDouble data file. -r overrides the AppleDouble header path.
+ * We can infer the archive path from -d, or -d from the archive path.
+ */
+
+static int macb_apple_infer_paths(struct macb_request *request) {
+  if (request->arpathc) {
+    if (request->dfpathc) return 0;
+    // Batch mode, or just '-c NAME.bin': Read "NAME.as", or "NAME" and "._NAME".
+    int pfxc=request->arpathc;
+    if ((pfxc>=4)&&!memcmp(request->arpath+pfxc-4,".bin",4)) pfxc-=4;
+    if (MACB_PATH_IS_STDIO(request->arpath)||(pfxc==request->arpathc)) {
+      fprintf(MACB_ERR(request),"'-d' required with '--as': the AppleSingle file, or the AppleDouble data file.\n");
+      return -1;
+    }
+    return macb_apple_set_path(&request->dfpath,&request->dfpathc,request->arpath,pfxc,(request->as==MACB_AS_SINGLE)?".as":0);
+  }
+  if (!request->dfpathc) {
+    fprintf(MACB_ERR(request),"'-d' required with '--as': the AppleSingle file, or the AppleDouble data file.\n");
+    return -1;
+  }
+  if (MACB_PATH_IS_STDIO(request->dfpath)) {
+    fprintf(MACB_ERR(request),"Archive path required when the input is stdin.\n");
+    return -1;
+  }
+  int pfxc=request->dfpathc;
+  if ((request->as==MACB_AS_SINGLE)&&(pfxc>=3)&&!memcmp(request->dfpath+pfxc-3,".as",3)) pfxc-=3;
+  return macb_apple_set_path(&request->arpath,&request->arpathc,request->dfpath,pfxc,".bin");
+}
+
+int macb_main_apple_create(struct macb_request *request) {
+  int result=-1,fd=-1;
+  struct macb_input src={.fd=-1},data={.fd=-1};
+  struct macb_output output={.fd=-1};
+  struct macb_apple_forks forks={0};
+  uint8_t hdr[128];
+  const char *srcpath;
+
+  if (macb_apple_infer_paths(request)<0) return -1;
+  macb_initialize_header(hdr,request);
+
+  if (request->as==MACB_AS_SINGLE) {
+    srcpath=request->dfpath;
+    if ((macb_input_open(&src,srcpath)<0)||(macb_input_spool(&src)<0)) {
+      fprintf(MACB_ERR(request),"%s: Failed to open AppleSingle file.\n",srcpath);
+      goto _done_;
+    }
+    if (macb_apple_decode(request,hdr,&forks,&src,srcpath,MACB_APPLE_SINGLE_MAGIC)<0) goto _done_;
+  } else {
+    if ((macb_input_open(&data,request->dfpath)<0)||(macb_input_spool(&data)<0)) {
+      fprintf(MACB_ERR(request),"%s: Failed to open data file.\n",request->dfpath);
+      goto _done_;
+    }
+    if (data.len>MACB_FORK_LIMIT) {
+      fprintf(MACB_ERR(request),"%s: Data fork of %lld bytes exceeds MacBinary's limit of %lld.\n",request->dfpath,(long long)data.len,MACB_FORK_LIMIT);
+      goto _done_;
+    }
+    forks.dflen=data.len;
+    if (!request->rfpathc) {
+      if (macb_apple_sidecar_path(&request->rfpath,&request->rfpathc,request->dfpath,request->dfpathc)<0) goto _done_;
+    }
+    srcpath=request->rfpath;
+    if (macb_input_open(&src,srcpath)<0) {
+      // A plain file with no sidecar is fine, it just has no resource fork or Finder info.
+      fprintf(MACB_ERR(request),"%s:WARNING: No AppleDouble header, using data file only.\n",srcpath);
+    } else if (macb_input_spool(&src)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to read AppleDouble header.\n",srcpath);
+      goto _done_;
+    } else {
+      struct macb_apple_forks sidecar={0};
+      if (macb_apple_decode(request,hdr,&sidecar,&src,srcpath,MACB_APPLE_DOUBLE_MAGIC)<0) goto _done_;
+      forks.rfp=sidecar.rfp;
+      forks.rflen=sidecar.rflen;
+    }
+  }
+
+  // Type and creator from the command line win. Lengths and CRC; timestamps from the data file if the entries didn't have them.
+  struct macb_input dfin={.fd=-1,.len=forks.dflen,.ctime=data.ctime,.mtime=data.mtime};
+  struct macb_input rfin={.fd=-1,.len=forks.rflen};
+  if (macb_finish_header(hdr,request,&dfin,&rfin)<0) goto _done_;
+
+  int64_t total=128+((forks.dflen+127)&~127ll)+((forks.rflen+127)&~127ll);
+  if (macb_output_open(&output,request->arpath,total)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open file for writing.\n",request->arpath);
+    goto _done_;
+  }
+  fd=output.fd;
+  if (macb_file_append(fd,hdr,128)<0) goto _done_;
+  int dffd=(request->as==MACB_AS_SINGLE)?src.fd:data.fd;
+  int64_t dfp=(request->as==MACB_AS_SINGLE)?forks.dfp:0;
+  if (macb_file_copy(fd,dffd,dfp,forks.dflen)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to copy %lld-byte data fork.\n",request->dfpath,(long long)forks.dflen);
+    goto _done_;
+  }
+  if (forks.dflen&127) {
+    if (macb_file_append(fd,0,128-(forks.dflen&127))<0) goto _done_;
+  }
+  if (macb_file_copy(fd,src.fd,forks.rfp,forks.rflen)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to copy %lld-byte resource fork.\n",srcpath,(long long)forks.rflen);
+    goto _done_;
+  }
+  if (forks.rflen&127) {
+    if (macb_file_append(fd,0,128-(forks.rflen&127))<0) goto _done_;
+  }
+  if (macb_output_commit(&output)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to write archive.\n",request->arpath);
+    goto _done_;
+  }
+  result=0;
+
+ _done_:
+  macb_output_abort(&output);
+  macb_input_close(&src);
+  macb_input_close(&data);
+  return result;
+}
@@ -0,0 +1,403 @@
+#include "macb.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+/* Batch mode.
+ * Every job is known before we start, so each worker gets an equal contiguous slice of the job list up front.
+ * A worker takes jobs from the front of its own slice, and when that runs dry,
+ * it steals the back half of whichever slice has the most left.
+ * Jobs report into memory streams, and we emit each job's output in one piece under a lock.
+ *
+ * For '-t', when io_uring is available, a worker claims a window of jobs from its own slice at once,
+ * prefetches all their headers through its own ring, then runs them. A steal hands back one job, which runs with a
+ * blocking header read; the rest of the stolen range becomes the thief's own slice, and goes through windows as usual.
+ */
+
+#define MACB_BATCH_WINDOW 32
+
+struct macb_batch_job {
+  const char *path;
+  int status; // 0 if not done yet, 1 if ok, -1 if failed
+};
+
+struct macb_batch_worker {
+  struct macb_batch *batch;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  int head,tail; // Range in (batch->jobv) still owned by this worker. Change under (mutex), with atomic stores for thieves' peeks.
+};
+
+struct macb_batch {
+  const struct macb_request *request; // The template. Each job gets its own request.
+  struct macb_batch_job *jobv;
+  int jobc,joba;
+  char **ownv; // Paths we read from stdin.
+  int ownc;
+  struct macb_batch_worker *workerv;
+  int workerc;
+  pthread_mutex_t outmutex;
+  int okc,failc;
+  int uring; // Nonzero to prefetch headers through io_uring.
+  struct macb_manifest *manifest; // For '-t --deep', loaded once for all jobs.
+  struct macb_cache *cache; // For '-c --cache', same.
+};
+
+static double macb_batch_now() {
+  struct timespec ts={0};
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec/1000000000.0;
+}
+
+/* Cleanup.
+ */
+
+static void macb_batch_cleanup(struct macb_batch *batch) {
+  if (batch->jobv) free(batch->jobv);
+  if (batch->ownv) {
+    while (batch->ownc-->0) free(batch->ownv[batch->ownc]);
+    free(batch->ownv);
+  }
+  if (batch->workerv) free(batch->workerv);
+  if (batch->manifest) {
+    macb_manifest_cleanup(batch->manifest);
+    free(batch->manifest);
+  }
+  if (batch->cache) {
+    macb_cache_cleanup(batch->cache);
+    free(batch->cache);
+  }
+}
+
+/* Job list.
+ */
+
+static int macb_batch_add_job(struct macb_batch *batch,const char *path) {
+  if (batch->jobc>=batch->joba) {
+    int na=batch->joba?(batch->joba<<1):256;
+    if (na>INT_MAX/sizeof(struct macb_batch_job)) return -1;
+    void *nv=realloc(batch->jobv,sizeof(struct macb_batch_job)*na);
+    if (!nv) return -1;
+    batch->jobv=nv;
+    batch->joba=na;
+  }
+  struct macb_batch_job *job=batch->jobv+batch->jobc++;
+  job->path=path;
+  job->status=0;
+  return 0;
+}
+
+/* NUL-delimited paths from stdin. Stray newlines are part of the path, same as xargs -0.
+ */
+
+static int macb_batch_read_stdin(struct macb_batch *batch) {
+  int owna=0;
+  char *line=0;
+  size_t linea=0;
+  ssize_t linec;
+  while ((linec=getdelim(&line,&linea,0,stdin))>0) {
+    if (line[linec-1]==0) linec--;
+    if (!linec) continue;
+    if (batch->ownc>=owna) {
+      int na=owna?(owna<<1):256;
+      if (na>INT_MAX/sizeof(void*)) { free(line); return -1; }
+      void *nv=realloc(batch->ownv,sizeof(void*)*na);
+      if (!nv) { free(line); return -1; }
+      batch->ownv=nv;
+      owna=na;
+    }
+    char *path=malloc(linec+1);
+    if (!path) { free(line); return -1; }
+    memcpy(path,line,linec);
+    path[linec]=0;
+    batch->ownv[batch->ownc++]=path;
+    if (macb_batch_add_job(batch,path)<0) { free(line); return -1; }
+  }
+  if (line) free(line);
+  return 0;
+}
+
+/* Run one job.
+ */
+
+static void macb_batch_run_job(struct macb_batch *batch,struct macb_batch_job *job,const struct macb_prefetch *prefetch) {
+  const struct macb_request *tmpl=batch->request;
+  struct macb_request request={0};
+  char *outv=0,*errv=0;
+  size_t outc=0,errc=0;
+  double start=macb_batch_now();
+  int err=-1;
+
+  request.command=tmpl->command;
+  request.type=tmpl->type;
+  request.creator=tmpl->creator;
+  request.flagsset=tmpl->flagsset;
+  request.flags=tmpl->flags;
+  request.ctime=tmpl->ctime;
+  request.mtime=tmpl->mtime;
+  request.format=tmpl->format;
+  request.as=tmpl->as;
+  request.resources=tmpl->resources;
+  request.rsrcsel=tmpl->rsrcsel;
+  request.rsrctype=tmpl->rsrctype;
+  request.rsrcid=tmpl->rsrcid;
+  request.prefetch=prefetch;
+  if (tmpl->storepath&&!(request.storepath=strdup(tmpl->storepath))) goto _done_;
+  request.storepathc=tmpl->storepathc;
+  request.digest=tmpl->digest;
+  request.deep=tmpl->deep;
+  request.jobc=1; // For '--deep': Archives are already in parallel, don't split forks too.
+  if (tmpl->manifestpath&&!(request.manifestpath=strdup(tmpl->manifestpath))) goto _done_;
+  request.manifestpathc=tmpl->manifestpathc;
+  request.manifest=batch->manifest;
+  if (tmpl->cachepath&&!(request.cachepath=strdup(tmpl->cachepath))) goto _done_;
+  request.cachepathc=tmpl->cachepathc;
+  request.cache=batch->cache;
+  request.out=open_memstream(&outv,&outc);
+  request.err=open_memstream(&errv,&errc);
+  if (!request.out||!request.err) goto _done_;
+
+  int pathc=0;
+  while (job->path[pathc]) pathc++;
+  if (!(request.arpath=malloc(pathc+1))) goto _done_;
+  memcpy(request.arpath,job->path,pathc+1);
+  request.arpathc=pathc;
+
+  if ((request.command=='c')&&!request.as) {
+    if (macb_request_infer_fork_paths_if_missing(&request)<0) goto _done_;
+    if (!request.dfpathc&&!request.rfpathc) {
+      fprintf(request.err,"%s: No data or resource fork found beside archive.\n",request.arpath);
+      goto _done_;
+    }
+  }
+
+  err=macb_run_request(&request);
+
+ _done_:;
+  double elapsed=macb_batch_now()-start;
+  macb_stats_archive((int64_t)(elapsed*1000000000.0));
+  if (request.out) fclose(request.out);
+  if (request.err) fclose(request.err);
+  request.out=request.err=0;
+
+  job->status=(err<0)?-1:1;
+  pthread_mutex_lock(&batch->outmutex);
+  if (outc) fwrite(outv,1,outc,stdout);
+  if (errc) fwrite(errv,1,errc,stderr);
+  // Machine-readable records speak for themselves; only call out the failures.
+  if ((err<0)||!tmpl->format) {
+    fprintf(stderr,"%s:RESULT: %s (%.3f ms)\n",job->path,(err<0)?"FAILED":"ok",elapsed*1000.0);
+  }
+  if (err<0) batch->failc++;
+  else batch->okc++;
+  pthread_mutex_unlock(&batch->outmutex);
+
+  if (outv) free(outv);
+  if (errv) free(errv);
+  macb_request_cleanup(&request);
+}
+
+/* Take the next job for a worker, stealing if needed.
+ * Returns <0 when everything is taken.
+ */
+
+static int macb_batch_take_own(struct macb_batch_worker *worker) {
+  int jobp=-1;
+  pthread_mutex_lock(&worker->mutex);
+  if (worker->head<worker->tail) {
+    jobp=worker->head;
+    __atomic_store_n(&worker->head,jobp+1,__ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&worker->mutex);
+  return jobp;
+}
+
+static int macb_batch_take_own_window(struct macb_batch_worker *worker,int *head) {
+  int c=0;
+  pthread_mutex_lock(&worker->mutex);
+  if (worker->head<worker->tail) {
+    *head=worker->head;
+    c=worker->tail-worker->head;
+    if (c>MACB_BATCH_WINDOW) c=MACB_BATCH_WINDOW;
+    __atomic_store_n(&worker->head,worker->head+c,__ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&worker->mutex);
+  return c;
+}
+
+static int macb_batch_steal(struct macb_batch_worker *worker) {
+  struct macb_batch *batch=worker->batch;
+  while (1) {
+
+    // Find the victim with the most left. Peeking without the lock is fine, we'll check again under it.
+    struct macb_batch_worker *victim=0;
+    int victimc=0,i=0;
+    for (;i<batch->workerc;i++) {
+      struct macb_batch_worker *other=batch->workerv+i;
+      if (other==worker) continue;
+      int c=__atomic_load_n(&other->tail,__ATOMIC_RELAXED)-__atomic_load_n(&other->head,__ATOMIC_RELAXED);
+      if (c>victimc) {
+        victim=other;
+        victimc=c;
+      }
+    }
+    if (!victim) return -1;
+
+    // Take the back half. If the victim has just one left, take that.
+    int head=-1,tail=-1;
+    pthread_mutex_lock(&victim->mutex);
+    if (victim->head<victim->tail) {
+      int mid=victim->head+(victim->tail-victim->head)/2;
+      head=mid;
+      tail=victim->tail;
+      __atomic_store_n(&victim->tail,mid,__ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&victim->mutex);
+    if (head<0) continue;
+
+    pthread_mutex_lock(&worker->mutex);
+    __atomic_store_n(&worker->head,head+1,__ATOMIC_RELAXED);
+    __atomic_store_n(&worker->tail,tail,__ATOMIC_RELAXED);
+    pthread_mutex_unlock(&worker->mutex);
+    return head;
+  }
+}
+
+static void *macb_batch_worker_main(void *arg) {
+  struct macb_batch_worker *worker=arg;
+  struct macb_batch *batch=worker->batch;
+  struct macb_uring *uring=0;
+  struct macb_prefetch *prefetchv=0;
+  if (batch->uring) {
+    if ((prefetchv=malloc(sizeof(struct macb_prefetch)*MACB_BATCH_WINDOW))) {
+      uring=macb_uring_new(MACB_BATCH_WINDOW*2);
+    }
+  }
+  while (1) {
+    if (uring) {
+      int head=0,c=macb_batch_take_own_window(worker,&head);
+      if (c>0) {
+        int i=0; for (;i<c;i++) prefetchv[i].path=batch->jobv[head+i].path;
+        // If the window fails, each job reads its own header; statuses say so. A ring that failed once is done.
+        if (macb_uring_prefetch_headers(uring,prefetchv,c)<0) {
+          macb_uring_del(uring);
+          uring=0;
+        }
+        for (i=0;i<c;i++) macb_batch_run_job(batch,batch->jobv+head+i,prefetchv+i);
+        continue;
+      }
+    }
+    int jobp=macb_batch_take_own(worker);
+    if (jobp<0) jobp=macb_batch_steal(worker);
+    if (jobp<0) break;
+    macb_batch_run_job(batch,batch->jobv+jobp,0);
+  }
+  macb_uring_del(uring);
+  if (prefetchv) free(prefetchv);
+  return 0;
+}
+
+/* Batch, main entry point.
+ */
+
+int macb_main_batch(struct macb_request *request) {
+  struct macb_batch batch={.request=request};
+  int result=0,i;
+
+  if (request->arpathc) {
+    if (macb_batch_add_job(&batch,request->arpath)<0) { result=-1; goto _done_; }
+  }
+  for (i=0;i<request->batchc;i++) {
+    if (macb_batch_add_job(&batch,request->batchv[i])<0) { result=-1; goto _done_; }
+  }
+  if (!batch.jobc) {
+    if (macb_batch_read_stdin(&batch)<0) {
+      fprintf(stderr,"Failed to read archive paths from stdin.\n");
+      result=-1;
+      goto _done_;
+    }
+    if (!batch.jobc) {
+      fprintf(stderr,"No archives for batch.\n");
+      goto _done_;
+    }
+  }
+
+  if (request->deep&&request->manifestpathc) {
+    if (!(batch.manifest=calloc(1,sizeof(struct macb_manifest)))) { result=-1; goto _done_; }
+    if (macb_manifest_load(batch.manifest,request)<0) {
+      result=-1;
+      goto _done_;
+    }
+  }
+
+  // Jobs only append to the cache, and only ever ask about the state before this run, so one snapshot serves them all.
+  if (request->cachepathc) {
+    if (!(batch.cache=calloc(1,sizeof(struct macb_cache)))) { result=-1; goto _done_; }
+    if (macb_cache_load(batch.cache,request->cachepath)<0) {
+      fprintf(stderr,"%s: Failed to read cache.\n",request->cachepath);
+      result=-1;
+      goto _done_;
+    }
+  }
+
+  // io_uring only pays off where the whole job is reading a header.
+  if ((request->command=='t')&&!request->deep&&(request->io!=MACB_IO_SYNC)) {
+    struct macb_uring *probe=macb_uring_new(2);
+    if (probe) {
+      batch.uring=1;
+      macb_uring_del(probe);
+    }
+  }
+  if ((request->io==MACB_IO_URING)&&!batch.uring) {
+    fprintf(stderr,"io_uring is not available%s.\n",(request->command=='t')?"":" for this command");
+    result=-1;
+    goto _done_;
+  }
+
+  batch.workerc=request->jobc;
+  if (batch.workerc<1) {
+    long cpuc=sysconf(_SC_NPROCESSORS_ONLN);
+    batch.workerc=(cpuc<1)?1:(cpuc>256)?256:cpuc;
+  }
+  if (batch.workerc>batch.jobc) batch.workerc=batch.jobc;
+  if (!(batch.workerv=calloc(batch.workerc,sizeof(struct macb_batch_worker)))) { result=-1; goto _done_; }
+  pthread_mutex_init(&batch.outmutex,0);
+
+  double start=macb_batch_now();
+  int startedc=0;
+  for (i=0;i<batch.workerc;i++) {
+    struct macb_batch_worker *worker=batch.workerv+i;
+    worker->batch=&batch;
+    worker->head=(int)(((int64_t)batch.jobc*i)/batch.workerc);
+    worker->tail=(int)(((int64_t)batch.jobc*(i+1))/batch.workerc);
+    pthread_mutex_init(&worker->mutex,0);
+  }
+  // Worker zero is this thread. If we can't start some others, the ones that did will steal their work.
+  for (i=1;i<batch.workerc;i++) {
+    struct macb_batch_worker *worker=batch.workerv+i;
+    if (pthread_create(&worker->thread,0,macb_batch_worker_main,worker)) break;
+    startedc++;
+  }
+  macb_batch_worker_main(batch.workerv);
+  for (i=1;i<=startedc;i++) pthread_join(batch.workerv[i].thread,0);
+  // Anything left in a worker we failed to start, run it here.
+  for (i=startedc+1;i<batch.workerc;i++) {
+    struct macb_batch_worker *worker=batch.workerv+i;
+    for (;worker->head<worker->tail;worker->head++) macb_batch_run_job(&batch,batch.jobv+worker->head,0);
+  }
+  double elapsed=macb_batch_now()-start;
+
+  for (i=0;i<batch.workerc;i++) pthread_mutex_destroy(&batch.workerv[i].mutex);
+  pthread_mutex_destroy(&batch.outmutex);
+
+  fflush(stdout);
+  fprintf(stderr,
+    "batch: %d archives, %d ok, %d failed, %d workers, %.3f s (%.0f archives/s)\n",
+    batch.jobc,batch.okc,batch.failc,batch.workerc,elapsed,(elapsed>0.0)?(batch.jobc/elapsed):0.0
+  );
+  if (batch.failc) result=-1;
+
+ _done_:
+  macb_batch_cleanup(&batch);
+  return result;
+}
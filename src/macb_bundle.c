@@ -0,0 +1,311 @@
+#include "macb.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* Bundles: Many MacBinary archives in one file, with an index at the end.
+ *
+ * Members are complete archives, back to back, each starting on a 128-byte boundary.
+ * The first member starts at zero, so a bundle is also a valid MacBinary file, of its first member.
+ * After the last member:
+ *   Index: One 160-byte entry per member, sorted bytewise by name:
+ *     0000   8 Offset of member in bundle.
+ *     0008   8 Length of member, before padding.
+ *     0010   4 Data fork length.
+ *     0014   4 Resource fork length.
+ *     0018   4 Name offset in string table.
+ *     001c   4 Name length.
+ *     0020 128 Copy of the member's header.
+ *   String table: Names, no terminators.
+ *   Trailer, last 32 bytes of the file:
+ *     0000   8 "macbBNDL"
+ *     0008   4 Version, 1.
+ *     000c   4 Member count.
+ *     0010   8 Index offset.
+ *     0018   8 String table offset.
+ * All integers big-endian, like MacBinary.
+ *
+ * Readers map the whole bundle. Finding a member is a binary search of the index,
+ * telling it reads nothing more, and extracting it is copies straight from the member's forks.
+ */
+
+#define MACB_BUNDLE_ENTRY_SIZE 160
+#define MACB_BUNDLE_TRAILER_SIZE 32
+#define MACB_BUNDLE_VERSION 1
+
+static void macb_bundle_wr64(uint8_t *dst,int p,uint64_t v) {
+  macb_wr32(dst,p,v>>32);
+  macb_wr32(dst,p+4,v);
+}
+
+static uint64_t macb_bundle_rd64(const uint8_t *src,int p) {
+  return ((uint64_t)macb_rd32(src,p)<<32)|macb_rd32(src,p+4);
+}
+
+/* Open for reading.
+ */
+
+int macb_bundle_open(struct macb_bundle *bundle,const char *path) {
+  memset(bundle,0,sizeof(struct macb_bundle));
+  if ((bundle->fd=open(path,O_RDONLY))<0) return -1;
+  struct stat st={0};
+  if ((fstat(bundle->fd,&st)<0)||!S_ISREG(st.st_mode)||(st.st_size<MACB_BUNDLE_TRAILER_SIZE)) goto _invalid_;
+  bundle->mapc=st.st_size;
+  void *map=mmap(0,bundle->mapc,PROT_READ,MAP_SHARED,bundle->fd,0);
+  if (map==MAP_FAILED) goto _invalid_;
+  bundle->map=map;
+
+  const uint8_t *trailer=bundle->map+bundle->mapc-MACB_BUNDLE_TRAILER_SIZE;
+  if (memcmp(trailer,"macbBNDL",8)||(macb_rd32(trailer,8)!=MACB_BUNDLE_VERSION)) goto _invalid_;
+  uint64_t entryc=macb_rd32(trailer,12);
+  uint64_t indexp=macb_bundle_rd64(trailer,16);
+  uint64_t namesp=macb_bundle_rd64(trailer,24);
+  uint64_t trailerp=bundle->mapc-MACB_BUNDLE_TRAILER_SIZE;
+  if ((indexp>namesp)||(namesp>trailerp)||(entryc>(namesp-indexp)/MACB_BUNDLE_ENTRY_SIZE)) goto _invalid_;
+  if (entryc*MACB_BUNDLE_ENTRY_SIZE!=namesp-indexp) goto _invalid_;
+  bundle->entries=bundle->map+indexp;
+  bundle->entryc=entryc;
+  bundle->names=bundle->map+namesp;
+  bundle->namesc=trailerp-namesp;
+
+  // Check every entry now, so lookups don't have to.
+  int i=0; for (;i<bundle->entryc;i++) {
+    const uint8_t *entry=bundle->entries+i*MACB_BUNDLE_ENTRY_SIZE;
+    uint64_t p=macb_bundle_rd64(entry,0),c=macb_bundle_rd64(entry,8);
+    uint64_t namep=macb_rd32(entry,24),namec=macb_rd32(entry,28);
+    if ((p>indexp)||(c>indexp-p)||(c<MACB_HEADER_SIZE)||(namep>bundle->namesc)||(namec>bundle->namesc-namep)) goto _invalid_;
+  }
+  return 0;
+ _invalid_:
+  macb_bundle_close(bundle);
+  return -1;
+}
+
+void macb_bundle_close(struct macb_bundle *bundle) {
+  if (bundle->map) munmap((void*)bundle->map,bundle->mapc);
+  if (bundle->fd>=0) close(bundle->fd);
+  memset(bundle,0,sizeof(struct macb_bundle));
+  bundle->fd=-1;
+}
+
+void macb_bundle_member(struct macb_bundle_member *member,const struct macb_bundle *bundle,int p) {
+  const uint8_t *entry=bundle->entries+p*MACB_BUNDLE_ENTRY_SIZE;
+  member->p=macb_bundle_rd64(entry,0);
+  member->c=macb_bundle_rd64(entry,8);
+  member->dflen=macb_rd32(entry,16);
+  member->rflen=macb_rd32(entry,20);
+  member->name=(const char*)bundle->names+macb_rd32(entry,24);
+  member->namec=macb_rd32(entry,28);
+  member->hdr=entry+32;
+}
+
+static int macb_bundle_namecmp(const char *a,int ac,const char *b,int bc) {
+  int cmp=memcmp(a,b,(ac<bc)?ac:bc);
+  if (cmp) return cmp;
+  return ac-bc;
+}
+
+int macb_bundle_find(struct macb_bundle_member *member,const struct macb_bundle *bundle,const char *name,int namec) {
+  int lo=0,hi=bundle->entryc;
+  while (lo<hi) {
+    int ck=(lo+hi)>>1;
+    macb_bundle_member(member,bundle,ck);
+    int cmp=macb_bundle_namecmp(name,namec,member->name,member->namec);
+    if (cmp<0) hi=ck;
+    else if (cmp>0) lo=ck+1;
+    else return ck;
+  }
+  return -1;
+}
+
+/* Create.
+ */
+
+struct macb_bundle_pending {
+  const char *name; int namec;
+  int64_t p,c;
+  uint8_t hdr[128];
+};
+
+static int macb_bundle_pending_cmp(const void *a,const void *b) {
+  const struct macb_bundle_pending *A=a,*B=b;
+  return macb_bundle_namecmp(A->name,A->namec,B->name,B->namec);
+}
+
+// Member name is the path as given, less any leading "./", as find likes to add.
+static void macb_bundle_member_name(struct macb_bundle_pending *pending,const char *path) {
+  while ((path[0]=='.')&&(path[1]=='/')) {
+    path+=2;
+    while (path[0]=='/') path++;
+  }
+  pending->name=path;
+  pending->namec=0;
+  while (path[pending->namec]) pending->namec++;
+}
+
+static int macb_bundle_add_member(struct macb_request *request,int dstfd,int64_t *dstp,struct macb_bundle_pending *pending,const char *path) {
+  int fd=macb_file_openr(path);
+  if (fd<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open archive file.\n",path);
+    return -1;
+  }
+  int64_t c=macb_file_read_header_fd(pending->hdr,fd);
+  uint32_t findings=(c>0)?macb_header_validate(pending->hdr,c):MACB_FINDING_VERSION;
+  if (findings&(MACB_FINDING_VERSION|MACB_FINDINGS_FATAL)) {
+    fprintf(MACB_ERR(request),"%s: Not a MacBinary file, or not a complete one.\n",path);
+    close(fd);
+    return -1;
+  }
+  if (macb_file_copy(dstfd,fd,0,c)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to copy %lld bytes into bundle.\n",path,(long long)c);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  if (c&127) {
+    if (macb_file_append(dstfd,0,128-(c&127))<0) return -1;
+  }
+  macb_bundle_member_name(pending,path);
+  pending->p=*dstp;
+  pending->c=c;
+  *dstp+=(c+127)&~127ll;
+  return 0;
+}
+
+static int macb_bundle_write_index(int fd,int64_t indexp,struct macb_bundle_pending *v,int c) {
+  uint8_t entry[MACB_BUNDLE_ENTRY_SIZE];
+  int64_t namep=0;
+  int i;
+  for (i=0;i<c;i++) {
+    memset(entry,0,sizeof(entry));
+    macb_bundle_wr64(entry,0,v[i].p);
+    macb_bundle_wr64(entry,8,v[i].c);
+    memcpy(entry+16,v[i].hdr+0x53,4); // Fork lengths, straight from the header.
+    memcpy(entry+20,v[i].hdr+0x57,4);
+    macb_wr32(entry,24,namep);
+    macb_wr32(entry,28,v[i].namec);
+    memcpy(entry+32,v[i].hdr,128);
+    if (macb_file_append(fd,entry,sizeof(entry))<0) return -1;
+    namep+=v[i].namec;
+  }
+  for (i=0;i<c;i++) {
+    if (macb_file_append(fd,v[i].name,v[i].namec)<0) return -1;
+  }
+  uint8_t trailer[MACB_BUNDLE_TRAILER_SIZE];
+  memcpy(trailer,"macbBNDL",8);
+  macb_wr32(trailer,8,MACB_BUNDLE_VERSION);
+  macb_wr32(trailer,12,c);
+  macb_bundle_wr64(trailer,16,indexp);
+  macb_bundle_wr64(trailer,24,indexp+(int64_t)c*MACB_BUNDLE_ENTRY_SIZE);
+  return macb_file_append(fd,trailer,sizeof(trailer));
+}
+
+// NUL-delimited from stdin, same as '--batch'.
+static int macb_bundle_read_stdin(struct macb_request *request) {
+  char *line=0;
+  size_t linea=0;
+  ssize_t linec;
+  while ((linec=getdelim(&line,&linea,0,stdin))>0) {
+    if (line[linec-1]==0) linec--;
+    if (!linec) continue;
+    if (!request->arpath) {
+      if (!(request->arpath=strdup(line))) { free(line); return -1; }
+      request->arpathc=linec;
+      continue;
+    }
+    if (request->batchc>=request->batcha) {
+      int na=request->batcha?(request->batcha<<1):256;
+      if (na>INT_MAX/sizeof(void*)) { free(line); return -1; }
+      void *nv=realloc(request->batchv,sizeof(void*)*na);
+      if (!nv) { free(line); return -1; }
+      request->batchv=nv;
+      request->batcha=na;
+    }
+    if (!(request->batchv[request->batchc]=strdup(line))) { free(line); return -1; }
+    request->batchc++;
+  }
+  if (line) free(line);
+  return 0;
+}
+
+int macb_main_bundle_create(struct macb_request *request) {
+  struct macb_bundle_pending *pendingv=0;
+  struct macb_output output={.fd=-1};
+  int result=0,fd=-1,i;
+  #define FAIL { result=-1; goto _done_; }
+
+  if (!request->arpathc&&(macb_bundle_read_stdin(request)<0)) {
+    fprintf(MACB_ERR(request),"Failed to read archive paths from stdin.\n");
+    FAIL
+  }
+  int pendingc=(request->arpathc?1:0)+request->batchc;
+  if (!pendingc) {
+    fprintf(MACB_ERR(request),"No archives for bundle.\n");
+    FAIL
+  }
+  if (!(pendingv=calloc(pendingc,sizeof(struct macb_bundle_pending)))) FAIL
+  // A failed pack leaves the previous bundle in place, see macb_output_open.
+  if (macb_output_open(&output,request->bundlepath,-1)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open file for writing.\n",request->bundlepath);
+    FAIL
+  }
+  fd=output.fd;
+
+  int64_t p=0;
+  for (i=0;i<pendingc;i++) {
+    const char *path=request->arpathc?(i?request->batchv[i-1]:request->arpath):request->batchv[i];
+    if (macb_bundle_add_member(request,fd,&p,pendingv+i,path)<0) FAIL
+  }
+
+  qsort(pendingv,pendingc,sizeof(struct macb_bundle_pending),macb_bundle_pending_cmp);
+  for (i=1;i<pendingc;i++) {
+    if (!macb_bundle_pending_cmp(pendingv+i-1,pendingv+i)) {
+      fprintf(MACB_ERR(request),"%.*s: Appears twice in bundle.\n",pendingv[i].namec,pendingv[i].name);
+      FAIL
+    }
+  }
+  if (macb_bundle_write_index(fd,p,pendingv,pendingc)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to write index.\n",request->bundlepath);
+    FAIL
+  }
+  if (macb_output_commit(&output)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to write bundle.\n",request->bundlepath);
+    FAIL
+  }
+  fprintf(MACB_OUT(request),"%s: Bundled %d archives, %lld bytes.\n",request->bundlepath,pendingc,(long long)p);
+
+ _done_:
+  #undef FAIL
+  macb_output_abort(&output);
+  if (pendingv) free(pendingv);
+  return result;
+}
+
+/* List members, for '-t --bundle' without a member name.
+ */
+
+int macb_main_bundle_list(struct macb_request *request) {
+  struct macb_bundle bundle;
+  if (macb_bundle_open(&bundle,request->bundlepath)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open bundle.\n",request->bundlepath);
+    return -1;
+  }
+  struct macb_bundle_member member;
+  int i=0; for (;i<bundle.entryc;i++) {
+    macb_bundle_member(&member,&bundle,i);
+    if (request->format) {
+      char name[1024];
+      snprintf(name,sizeof(name),"%.*s",member.namec,member.name);
+      macb_record_write(MACB_OUT(request),request->format,name,member.hdr,member.c);
+    } else {
+      fprintf(MACB_OUT(request),
+        "%.*s:INFO: %lld bytes at %lld, data fork %u, resource fork %u.\n",
+        member.namec,member.name,(long long)member.c,(long long)member.p,member.dflen,member.rflen
+      );
+    }
+  }
+  macb_bundle_close(&bundle);
+  return 0;
+}
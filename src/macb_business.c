@@ -78,7 +78,7 @@ uint16_t macb_rd16(const uint8_t *src,int p) {
 /* Write file name to header, mangle as needed.
  */
  
-static void macb_header_apply_file_name(unsigned char *hdr,const char *src,int srcc) {
+static void macb_header_apply_file_name(unsigned char *hdr,const char *src,int srcc,const char *sfx) {
 
   // Remove trailing slashes (the hell, user?) and trim to basename.
   while ((srcc>0)&&(src[srcc-1]=='/')) srcc--;
@@ -95,8 +95,9 @@ static void macb_header_apply_file_name(unsigned char *hdr,const char *src,int s
     srcc=srcc-slashp-1;
   }
 
-  // If it ends with ".bin", strike that.
-  if ((srcc>=4)&&!memcmp(src+srcc-4,".bin",4)) srcc-=4;
+  // If it ends with ".bin" (or whatever the caller says), strike that.
+  int sfxc=sfx?strlen(sfx):0;
+  if (sfxc&&(srcc>=sfxc)&&!memcmp(src+srcc-sfxc,sfx,sfxc)) srcc-=sfxc;
   
   // Trim leading and trailing space.
   while (srcc&&((unsigned char)src[0]<=0x20)) { srcc--; src++; }
@@ -126,8 +127,16 @@ void macb_initialize_header(void *hdr,const struct macb_request *request) {
 
   memset(hdr,0,128);
   
-  // File name from the archive path.
-  macb_header_apply_file_name(hdr,request->arpath,request->arpathc);
+  // File name from the archive path, or if that's stdout, whichever fork is a real file.
+  if (!MACB_PATH_IS_STDIO(request->arpath)) {
+    macb_header_apply_file_name(hdr,request->arpath,request->arpathc,".bin");
+  } else if (request->dfpathc&&!MACB_PATH_IS_STDIO(request->dfpath)) {
+    macb_header_apply_file_name(hdr,request->dfpath,request->dfpathc,".data");
+  } else if (request->rfpathc&&!MACB_PATH_IS_STDIO(request->rfpath)) {
+    macb_header_apply_file_name(hdr,request->rfpath,request->rfpathc,".res");
+  } else {
+    macb_header_apply_file_name(hdr,"untitled",8,0);
+  }
   
   // Default type and creator. (if stipulated in (request), we'll pick that up later).
   memcpy(HDR+0x41,"File????",8);
@@ -153,9 +162,9 @@ static uint32_t macb_time_now() {
   return tv.tv_sec+UNIX_EPOCH_IN_MAC_TIME;
 }
  
-static uint32_t macb_guess_ctime(const struct macb_request *request) {
-  uint32_t dtime=macb_stat_ctime(request->dfpath);
-  uint32_t rtime=macb_stat_ctime(request->rfpath);
+static uint32_t macb_guess_ctime(const struct macb_input *df,const struct macb_input *rf) {
+  uint32_t dtime=df?df->ctime:0;
+  uint32_t rtime=rf?rf->ctime:0;
   if (!dtime&&!rtime) return macb_time_now();
   if (!dtime) return rtime;
   if (!rtime) return dtime;
@@ -163,9 +172,9 @@ static uint32_t macb_guess_ctime(const struct macb_request *request) {
   return rtime;
 }
 
-static uint32_t macb_guess_mtime(const struct macb_request *request) {
-  uint32_t dtime=macb_stat_mtime(request->dfpath);
-  uint32_t rtime=macb_stat_mtime(request->rfpath);
+static uint32_t macb_guess_mtime(const struct macb_input *df,const struct macb_input *rf) {
+  uint32_t dtime=df?df->mtime:0;
+  uint32_t rtime=rf?rf->mtime:0;
   if (!dtime&&!rtime) return macb_time_now();
   if (!dtime) return rtime;
   if (!rtime) return dtime;
@@ -176,23 +185,29 @@ static uint32_t macb_guess_mtime(const struct macb_request *request) {
 /* Finish header.
  */
 
-int macb_finish_header(void *hdr,const struct macb_request *request,int dfc,int rfc) {
+int macb_finish_header(
+  void *hdr,const struct macb_request *request,
+  const struct macb_input *df,const struct macb_input *rf
+) {
 
   // If type or creator was supplied, overwrite it.
   if (request->type) macb_wr32(hdr,0x41,request->type);
   if (request->creator) macb_wr32(hdr,0x45,request->creator);
   
   // Fork lengths.
-  macb_wr32(hdr,0x53,dfc);
-  macb_wr32(hdr,0x57,rfc);
+  // Unknown (<0) counts as zero. Caller must rewrite the header once it knows.
+  macb_wr32(hdr,0x53,(df&&(df->len>0))?df->len:0);
+  macb_wr32(hdr,0x57,(rf&&(rf->len>0))?rf->len:0);
   
   // Timestamps. Overwrite only if zero.
-  if (!macb_rd32(hdr,0x5b)) macb_wr32(hdr,0x5b,macb_guess_ctime(request));
-  if (!macb_rd32(hdr,0x5f)) macb_wr32(hdr,0x5f,macb_guess_mtime(request));
+  if (!macb_rd32(hdr,0x5b)) macb_wr32(hdr,0x5b,macb_guess_ctime(df,rf));
+  if (!macb_rd32(hdr,0x5f)) macb_wr32(hdr,0x5f,macb_guess_mtime(df,rf));
   
   // CRC.
-  uint16_t crc=crc_macb(hdr,124,0);
-  macb_wr16(hdr,0x7c,crc);
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  macb_header_seal(hdr);
+  macb_stats_end(&mark,MACB_STATS_CRC,128);
 
   return 0;
 }
@@ -0,0 +1,265 @@
+#if defined(__linux__)
+  #define _GNU_SOURCE 1 // memrchr
+#endif
+#include "macb.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+/* Input fingerprint cache, for '-c --cache'.
+ * One line per create, tab-separated:
+ *   ARCHIVE, DATA PATH, DATA STAT, RESOURCE PATH, RESOURCE STAT, FINFO PATH, FINFO STAT, TYPE, CREATOR, ARCHIVE STAT
+ * A STAT is "DEV:INO:SIZE:MTIME" with mtime in ns, or "-" for no such input. TYPE and CREATOR are hex, zero if unset.
+ * An archive is fresh if everything after its path matches its last line exactly, the archive's own stat included,
+ * so an archive touched or replaced by anything else gets rebuilt.
+ * Lines are only ever appended, each in one write(), so concurrent creates sharing a cache don't interleave.
+ * A single create doesn't parse the file: It maps it and walks lines backward from the end until its own archive's.
+ * Only the batch engine, which asks about many archives, loads and sorts the whole thing.
+ */
+
+/* Stat for fingerprints.
+ */
+
+static int macb_cache_stat(char *dst,int dsta,const char *path) {
+  if (!path||!path[0]) return snprintf(dst,dsta,"-");
+  struct stat st;
+  if (stat(path,&st)<0) return -1;
+  if (!S_ISREG(st.st_mode)) return -1; // Pipes have no identity to compare.
+  return snprintf(dst,dsta,"%llx:%llx:%lld:%lld",
+    (unsigned long long)st.st_dev,(unsigned long long)st.st_ino,(long long)st.st_size,
+    (long long)st.st_mtim.tv_sec*1000000000ll+st.st_mtim.tv_nsec
+  );
+}
+
+// Inputs as they stand now, everything but the archive's stat. <0 if something can't be fingerprinted.
+static int macb_cache_fingerprint(char *dst,int dsta,const struct macb_request *request) {
+  const char *pathv[3]={request->dfpath,request->rfpath,request->fipath};
+  char statv[3][64];
+  int i=0; for (;i<3;i++) {
+    if (pathv[i]&&strpbrk(pathv[i],"\t\n")) return -1;
+    if (macb_cache_stat(statv[i],sizeof(statv[i]),pathv[i])<0) return -1;
+  }
+  if (strpbrk(request->arpath,"\t\n")) return -1;
+  int dstc=snprintf(dst,dsta,"%s\t%s\t%s\t%s\t%s\t%s\t%08x\t%08x",
+    pathv[0]?pathv[0]:"",statv[0],pathv[1]?pathv[1]:"",statv[1],pathv[2]?pathv[2]:"",statv[2],
+    request->type,request->creator
+  );
+  if ((dstc<0)||(dstc>=dsta)) return -1;
+  return dstc;
+}
+
+/* Load.
+ */
+
+static int macb_cache_entry_cmp(const void *a,const void *b) {
+  const struct macb_cache_entry *A=a,*B=b;
+  int cmp=strcmp(A->path,B->path);
+  if (cmp) return cmp;
+  return A->seq-B->seq;
+}
+
+static int macb_cache_parse(struct macb_cache *cache,int srcc) {
+  cache->srcc=srcc;
+  cache->src[srcc]=0; // macb_file_read always leaves room.
+  int linec=0,i;
+  for (i=0;i<srcc;i++) if (cache->src[i]=='\n') linec++;
+  if (!(cache->v=malloc(sizeof(struct macb_cache_entry)*(linec+1)))) {
+    macb_cache_cleanup(cache);
+    return -1;
+  }
+  char *line=cache->src;
+  int lineno=0;
+  while (*line) {
+    char *next=strchr(line,'\n');
+    if (next) *(next++)=0;
+    else next=line+strlen(line);
+    lineno++;
+    // A torn or foreign line costs only a rebuild, so skip it quietly.
+    char *tab=strchr(line,'\t');
+    if (tab) {
+      struct macb_cache_entry *entry=cache->v+cache->c++;
+      *tab=0;
+      entry->path=line;
+      entry->fingerprint=tab+1;
+      entry->seq=lineno;
+    }
+    line=next;
+  }
+  qsort(cache->v,cache->c,sizeof(struct macb_cache_entry),macb_cache_entry_cmp);
+  return 0;
+}
+
+int macb_cache_load(struct macb_cache *cache,const char *path) {
+  memset(cache,0,sizeof(struct macb_cache));
+  int srcc=macb_file_read(&cache->src,path);
+  if (srcc<0) return (errno==ENOENT)?0:-1;
+  return macb_cache_parse(cache,srcc);
+}
+
+static int macb_cache_load_fd(struct macb_cache *cache,int fd) {
+  memset(cache,0,sizeof(struct macb_cache));
+  int srcc=macb_file_read_fd(&cache->src,fd);
+  if (srcc<0) return -1;
+  return macb_cache_parse(cache,srcc);
+}
+
+void macb_cache_cleanup(struct macb_cache *cache) {
+  if (cache->src) free(cache->src);
+  if (cache->v) free(cache->v);
+  memset(cache,0,sizeof(struct macb_cache));
+}
+
+// Last entry for (path), ie the newest.
+static const struct macb_cache_entry *macb_cache_find(const struct macb_cache *cache,const char *path) {
+  int lo=0,hi=cache->c;
+  while (lo<hi) {
+    int ck=(lo+hi)>>1;
+    if (strcmp(path,cache->v[ck].path)<0) hi=ck;
+    else lo=ck+1;
+  }
+  if (lo&&!strcmp(cache->v[lo-1].path,path)) return cache->v+lo-1;
+  return 0;
+}
+
+/* Check and record.
+ */
+
+// Everything after the archive's path on its line, against what it would be now.
+static int macb_cache_match(const char *rest,int restc,const char *fingerprint,int fingerprintc,const char *arstat) {
+  int arstatc=strlen(arstat);
+  if (restc!=fingerprintc+1+arstatc) return 0;
+  if (memcmp(rest,fingerprint,fingerprintc)||(rest[fingerprintc]!='\t')) return 0;
+  return memcmp(rest+fingerprintc+1,arstat,arstatc)?0:1;
+}
+
+// Newest line for (path) in the file, walking back from the end. A torn last line without its newline is ignored.
+static int macb_cache_check_file(const char *cachepath,const char *path,const char *fingerprint,int fingerprintc,const char *arstat) {
+  int fd=open(cachepath,O_RDONLY);
+  if (fd<0) return (errno==ENOENT)?0:-1;
+  struct stat st;
+  if (fstat(fd,&st)<0) {
+    close(fd);
+    return -1;
+  }
+  if (!st.st_size) {
+    close(fd);
+    return 0;
+  }
+  const char *map=mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if (map==MAP_FAILED) return -1;
+  int pathc=strlen(path),fresh=0;
+  const char *nl=memrchr(map,'\n',st.st_size);
+  while (nl) {
+    const char *prev=memrchr(map,'\n',nl-map);
+    const char *line=prev?(prev+1):map;
+    int linec=nl-line;
+    if ((linec>pathc)&&(line[pathc]=='\t')&&!memcmp(line,path,pathc)) {
+      fresh=macb_cache_match(line+pathc+1,linec-pathc-1,fingerprint,fingerprintc,arstat);
+      break;
+    }
+    nl=prev;
+  }
+  munmap((void*)map,st.st_size);
+  return fresh;
+}
+
+int macb_cache_check(struct macb_request *request,char *fingerprint) {
+  fingerprint[0]=0;
+  int fingerprintc=macb_cache_fingerprint(fingerprint,MACB_CACHE_LINE_SIZE,request);
+  if (fingerprintc<0) {
+    fingerprint[0]=0;
+    return 0;
+  }
+  char arstat[64];
+  if (macb_cache_stat(arstat,sizeof(arstat),request->arpath)<0) return 0; // No archive yet.
+  if (!request->cache) {
+    int fresh=macb_cache_check_file(request->cachepath,request->arpath,fingerprint,fingerprintc,arstat);
+    if (fresh<0) fprintf(MACB_ERR(request),"%s: Failed to read cache.\n",request->cachepath);
+    return fresh;
+  }
+  const struct macb_cache_entry *entry=macb_cache_find(request->cache,request->arpath);
+  if (!entry) return 0;
+  return macb_cache_match(entry->fingerprint,strlen(entry->fingerprint),fingerprint,fingerprintc,arstat);
+}
+
+/* Compact.
+ * Every create appends, so a cache that keeps seeing the same archives rebuilt would grow forever.
+ * When an append carries the file past a power of two, we rewrite it with only the last line per archive, if that
+ * at least halves it. So the file stays within a few times its live size, and rewrites cost O(1) per append, amortized.
+ * Appenders never lock. Compactors take flock on the file, and skip if someone else has it or already replaced it.
+ * Lines appended while we work are copied over just before the rename; one that slips in after only costs a rebuild.
+ */
+
+#define MACB_CACHE_COMPACT_MIN (64*1024)
+
+static int macb_cache_compact(const char *path) {
+  int fd=open(path,O_RDONLY);
+  if (fd<0) return -1;
+  struct stat st,pathst;
+  if (
+    (flock(fd,LOCK_EX|LOCK_NB)<0)||(fstat(fd,&st)<0)||(stat(path,&pathst)<0)||
+    (st.st_dev!=pathst.st_dev)||(st.st_ino!=pathst.st_ino)
+  ) {
+    close(fd);
+    return 0;
+  }
+  struct macb_cache cache={0};
+  struct macb_output output={.fd=-1};
+  char *dst=0;
+  int result=-1,dstc=0,i;
+  if (macb_cache_load_fd(&cache,fd)<0) goto _done_;
+  // Sorted by path and then line, so an entry is live if the next one is for some other path.
+  for (i=0;i<cache.c;i++) {
+    if ((i+1<cache.c)&&!strcmp(cache.v[i].path,cache.v[i+1].path)) continue;
+    dstc+=strlen(cache.v[i].path)+1+strlen(cache.v[i].fingerprint)+1;
+  }
+  if (dstc*2>cache.srcc) {
+    result=0;
+    goto _done_;
+  }
+  if (!(dst=malloc(dstc+1))) goto _done_;
+  dstc=0;
+  for (i=0;i<cache.c;i++) {
+    if ((i+1<cache.c)&&!strcmp(cache.v[i].path,cache.v[i+1].path)) continue;
+    dstc+=sprintf(dst+dstc,"%s\t%s\n",cache.v[i].path,cache.v[i].fingerprint);
+  }
+  if (macb_output_open(&output,path,-1)<0) goto _done_;
+  if (macb_file_append(output.fd,dst,dstc)<0) goto _done_;
+  if (macb_file_copy_to_eof(output.fd,fd)<0) goto _done_; // (fd) is where our read stopped.
+  if (macb_output_commit(&output)<0) goto _done_;
+  result=0;
+ _done_:
+  macb_output_abort(&output);
+  macb_cache_cleanup(&cache);
+  if (dst) free(dst);
+  close(fd);
+  return result;
+}
+
+// (fingerprint) from macb_cache_check, taken before we read the inputs, so a change during create isn't missed.
+int macb_cache_record(struct macb_request *request,const char *fingerprint) {
+  if (!fingerprint[0]) return 0; // Not cacheable, it will just build every time.
+  char line[MACB_CACHE_LINE_SIZE*2],arstat[64];
+  if (macb_cache_stat(arstat,sizeof(arstat),request->arpath)<0) return 0;
+  int linec=snprintf(line,sizeof(line),"%s\t%s\t%s\n",request->arpath,fingerprint,arstat);
+  if ((linec<0)||(linec>=sizeof(line))) return 0;
+  int fd=open(request->cachepath,O_WRONLY|O_APPEND|O_CREAT,0666);
+  if ((fd<0)||(write(fd,line,linec)!=linec)) {
+    fprintf(MACB_ERR(request),"%s: Failed to append to cache. '%s' will be rebuilt next time.\n",request->cachepath,request->arpath);
+    if (fd>=0) close(fd);
+    return -1;
+  }
+  off_t end=lseek(fd,0,SEEK_CUR); // Just past our line, wherever O_APPEND put it.
+  close(fd);
+  if ((end>=MACB_CACHE_COMPACT_MIN)&&((end^(end-linec))>(end-linec))) {
+    // A failed compaction leaves the file as it was, which still works.
+    if (macb_cache_compact(request->cachepath)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to compact cache.\n",request->cachepath);
+    }
+  }
+  return 0;
+}
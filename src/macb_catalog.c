@@ -0,0 +1,493 @@
+#include "macb.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* Catalog file format.
+ * Host byte order, meant to be mmapped on the same machine that wrote it.
+ *
+ * Header (256 bytes):
+ *   0000   8 magic "MACBCAT1"
+ *   0008   4 byte order mark 0x01020304
+ *   000c   4 record count
+ *   0010   8 total file length
+ *   0018 8*n column offsets, in the order of MACB_CATCOL_*
+ *
+ * Then each column, 8-byte aligned: one fixed-size value per record, records sorted by path.
+ * The last column is the string heap, which holds paths without terminators.
+ * A query only touches the columns it filters on, and the paths of the matches.
+ */
+
+#define MACB_CATALOG_MAGIC "MACBCAT1"
+#define MACB_CATALOG_BOM 0x01020304
+#define MACB_CATALOG_HEADER_SIZE 256
+
+#define MACB_CATCOL_PATHP    0 /* u64: Offset in string heap. */
+#define MACB_CATCOL_PATHC    1 /* u32: Path length. */
+#define MACB_CATCOL_DEV      2 /* u64 */
+#define MACB_CATCOL_INO      3 /* u64 */
+#define MACB_CATCOL_FSIZE    4 /* u64: Archive file length. */
+#define MACB_CATCOL_FMTIME   5 /* i64: Archive file mtime, ns since Unix epoch. */
+#define MACB_CATCOL_TYPE     6 /* u32 */
+#define MACB_CATCOL_CREATOR  7 /* u32 */
+#define MACB_CATCOL_DFLEN    8 /* u32 */
+#define MACB_CATCOL_RFLEN    9 /* u32 */
+#define MACB_CATCOL_CTIME   10 /* u32: Mac time, from the header. */
+#define MACB_CATCOL_MTIME   11 /* u32: Mac time, from the header. */
+#define MACB_CATCOL_FLAGS   12 /* u16: Finder flags, 0x49 high and 0x65 low. */
+#define MACB_CATCOL_STATUS  13 /* u16: MACB_CATSTATUS_* */
+#define MACB_CATCOL_STRINGS 14 /* u8 */
+#define MACB_CATCOL_COUNT   15
+
+// Status bits. Anything UNREADABLE or NOT_MACB stays in the catalog, so we don't read it again, but queries skip it.
+#define MACB_CATSTATUS_UNREADABLE 0x0001
+#define MACB_CATSTATUS_NOT_MACB   0x0002
+#define MACB_CATSTATUS_CRC        0x0004
+#define MACB_CATSTATUS_LENGTH     0x0008
+
+static const int macb_catalog_column_size[MACB_CATCOL_COUNT]={8,4,8,8,8,8,4,4,4,4,4,4,2,2,1};
+
+/* One record while building.
+ */
+
+struct macb_catalog_record {
+  char *path;
+  int pathc;
+  uint64_t dev,ino,fsize;
+  int64_t fmtime;
+  uint32_t type,creator,dflen,rflen,ctime,mtime;
+  uint16_t flags,status;
+};
+
+/* An existing catalog, mapped.
+ */
+
+struct macb_catalog {
+  void *map;
+  size_t mapc;
+  uint32_t count;
+  const void *colv[MACB_CATCOL_COUNT];
+  uint64_t strc;
+};
+
+#define COL(catalog,tag,ctype) ((const ctype*)(catalog)->colv[MACB_CATCOL_##tag])
+
+static void macb_catalog_unmap(struct macb_catalog *catalog) {
+  if (catalog->map) munmap(catalog->map,catalog->mapc);
+  memset(catalog,0,sizeof(struct macb_catalog));
+}
+
+/* Map a catalog and validate its layout.
+ * Returns >0 if mapped, 0 if the file doesn't exist, <0 for real errors.
+ */
+
+static int macb_catalog_map(struct macb_catalog *catalog,const char *path) {
+  memset(catalog,0,sizeof(struct macb_catalog));
+  int fd=open(path,O_RDONLY);
+  if (fd<0) {
+    if (errno==ENOENT) return 0;
+    return -1;
+  }
+  struct stat st={0};
+  if ((fstat(fd,&st)<0)||(st.st_size<MACB_CATALOG_HEADER_SIZE)) {
+    close(fd);
+    return -1;
+  }
+  catalog->mapc=st.st_size;
+  catalog->map=mmap(0,catalog->mapc,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if (catalog->map==MAP_FAILED) {
+    catalog->map=0;
+    return -1;
+  }
+
+  const uint8_t *src=catalog->map;
+  if (memcmp(src,MACB_CATALOG_MAGIC,8)) goto _invalid_;
+  if (*(const uint32_t*)(src+8)!=MACB_CATALOG_BOM) goto _invalid_;
+  catalog->count=*(const uint32_t*)(src+12);
+  if (*(const uint64_t*)(src+16)!=catalog->mapc) goto _invalid_;
+  const uint64_t *colp=(const uint64_t*)(src+24);
+  int i=0; for (;i<MACB_CATCOL_COUNT;i++) {
+    uint64_t len=(uint64_t)catalog->count*macb_catalog_column_size[i];
+    if (i==MACB_CATCOL_STRINGS) len=catalog->mapc-colp[i];
+    if ((colp[i]<MACB_CATALOG_HEADER_SIZE)||(colp[i]&7)||(colp[i]>catalog->mapc)||(len>catalog->mapc-colp[i])) goto _invalid_;
+    catalog->colv[i]=src+colp[i];
+  }
+  catalog->strc=catalog->mapc-colp[MACB_CATCOL_STRINGS];
+  const uint64_t *pathp=COL(catalog,PATHP,uint64_t);
+  const uint32_t *pathc=COL(catalog,PATHC,uint32_t);
+  for (i=0;i<catalog->count;i++) {
+    if ((pathp[i]>catalog->strc)||(pathc[i]>catalog->strc-pathp[i])) goto _invalid_;
+  }
+  return 1;
+
+ _invalid_:
+  macb_catalog_unmap(catalog);
+  return -1;
+}
+
+/* Path order: bytewise, shorter first on ties.
+ */
+
+static int macb_catalog_pathcmp(const char *a,int ac,const char *b,int bc) {
+  int c=(ac<bc)?ac:bc;
+  int cmp=memcmp(a,b,c);
+  if (cmp) return cmp;
+  return ac-bc;
+}
+
+static int macb_catalog_recordcmp(const void *a,const void *b) {
+  const struct macb_catalog_record *A=a,*B=b;
+  return macb_catalog_pathcmp(A->path,A->pathc,B->path,B->pathc);
+}
+
+static int macb_catalog_search(const struct macb_catalog *catalog,const char *path,int pathc) {
+  const uint64_t *pathp=COL(catalog,PATHP,uint64_t);
+  const uint32_t *pathcv=COL(catalog,PATHC,uint32_t);
+  const char *strv=catalog->colv[MACB_CATCOL_STRINGS];
+  int lo=0,hi=catalog->count;
+  while (lo<hi) {
+    int ck=(lo+hi)>>1;
+    int cmp=macb_catalog_pathcmp(path,pathc,strv+pathp[ck],pathcv[ck]);
+    if (cmp<0) hi=ck;
+    else if (cmp>0) lo=ck+1;
+    else return ck;
+  }
+  return -1;
+}
+
+/* Read and decode one archive header.
+ */
+
+static void macb_catalog_decode(struct macb_catalog_record *record,int dirfd,const char *name) {
+  int fd=openat(dirfd,name,O_RDONLY|O_NOFOLLOW);
+  if (fd<0) {
+    record->status=MACB_CATSTATUS_UNREADABLE;
+    return;
+  }
+  uint8_t hdr[128];
+  int err=pread(fd,hdr,128,0);
+  close(fd);
+  if (err!=128) {
+    record->status=(err<0)?MACB_CATSTATUS_UNREADABLE:MACB_CATSTATUS_NOT_MACB;
+    return;
+  }
+  uint32_t findings=macb_header_validate(hdr,record->fsize);
+  if (findings&(MACB_FINDING_VERSION|MACB_FINDING_PAD4A|MACB_FINDING_PAD52|MACB_FINDING_NAME_LENGTH)) {
+    record->status=MACB_CATSTATUS_NOT_MACB;
+    return;
+  }
+  struct macb_header header;
+  macb_header_decode(&header,hdr,128);
+  record->type=header.type;
+  record->creator=header.creator;
+  record->dflen=header.dflen;
+  record->rflen=header.rflen;
+  record->ctime=header.ctime;
+  record->mtime=header.mtime;
+  record->flags=(header.flags_hi<<8)|header.flags_lo;
+  if (findings&MACB_FINDING_CRC) record->status|=MACB_CATSTATUS_CRC;
+  if (findings&MACB_FINDINGS_FATAL) record->status|=MACB_CATSTATUS_LENGTH;
+}
+
+/* Index: Walk the tree.
+ */
+
+struct macb_catalog_builder {
+  struct macb_request *request;
+  const struct macb_catalog *old;
+  struct macb_catalog_record *recordv;
+  int recordc,recorda;
+  int readc,reusec,skipc;
+  char path[4096];
+};
+
+static void macb_catalog_builder_cleanup(struct macb_catalog_builder *builder) {
+  if (builder->recordv) {
+    while (builder->recordc-->0) free(builder->recordv[builder->recordc].path);
+    free(builder->recordv);
+  }
+}
+
+static struct macb_catalog_record *macb_catalog_builder_add(struct macb_catalog_builder *builder,int pathc) {
+  if (builder->recordc>=builder->recorda) {
+    int na=builder->recorda?(builder->recorda<<1):1024;
+    if (na>INT_MAX/sizeof(struct macb_catalog_record)) return 0;
+    void *nv=realloc(builder->recordv,sizeof(struct macb_catalog_record)*na);
+    if (!nv) return 0;
+    builder->recordv=nv;
+    builder->recorda=na;
+  }
+  struct macb_catalog_record *record=builder->recordv+builder->recordc;
+  memset(record,0,sizeof(struct macb_catalog_record));
+  if (!(record->path=malloc(pathc+1))) return 0;
+  memcpy(record->path,builder->path,pathc);
+  record->path[pathc]=0;
+  record->pathc=pathc;
+  builder->recordc++;
+  return record;
+}
+
+static int macb_catalog_add_file(struct macb_catalog_builder *builder,int pathc,int dirfd,const char *name,const struct stat *st) {
+  struct macb_catalog_record *record=macb_catalog_builder_add(builder,pathc);
+  if (!record) return -1;
+  record->dev=st->st_dev;
+  record->ino=st->st_ino;
+  record->fsize=st->st_size;
+  record->fmtime=(int64_t)st->st_mtim.tv_sec*1000000000ll+st->st_mtim.tv_nsec;
+
+  // Same file as last time? Copy the old record.
+  const struct macb_catalog *old=builder->old;
+  int p=old->count?macb_catalog_search(old,record->path,pathc):-1;
+  if (
+    (p>=0)&&
+    (COL(old,DEV,uint64_t)[p]==record->dev)&&
+    (COL(old,INO,uint64_t)[p]==record->ino)&&
+    (COL(old,FSIZE,uint64_t)[p]==record->fsize)&&
+    (COL(old,FMTIME,int64_t)[p]==record->fmtime)
+  ) {
+    record->type=COL(old,TYPE,uint32_t)[p];
+    record->creator=COL(old,CREATOR,uint32_t)[p];
+    record->dflen=COL(old,DFLEN,uint32_t)[p];
+    record->rflen=COL(old,RFLEN,uint32_t)[p];
+    record->ctime=COL(old,CTIME,uint32_t)[p];
+    record->mtime=COL(old,MTIME,uint32_t)[p];
+    record->flags=COL(old,FLAGS,uint16_t)[p];
+    record->status=COL(old,STATUS,uint16_t)[p];
+    builder->reusec++;
+    return 0;
+  }
+
+  macb_catalog_decode(record,dirfd,name);
+  builder->readc++;
+  return 0;
+}
+
+// (builder->path) contains the directory's path, length (pathc), no trailing slash.
+static int macb_catalog_walk(struct macb_catalog_builder *builder,int pathc) {
+  DIR *dir=opendir(builder->path);
+  if (!dir) {
+    fprintf(MACB_ERR(builder->request),"%s: Failed to open directory.\n",builder->path);
+    builder->skipc++;
+    return 0;
+  }
+  int dirfd_=dirfd(dir);
+  struct dirent *de;
+  while ((de=readdir(dir))) {
+    const char *name=de->d_name;
+    if ((name[0]=='.')&&(!name[1]||((name[1]=='.')&&!name[2]))) continue;
+    int namec=0; while (name[namec]) namec++;
+    if (pathc+1+namec>=sizeof(builder->path)) {
+      fprintf(MACB_ERR(builder->request),"%s/%s: Path too long.\n",builder->path,name);
+      builder->skipc++;
+      continue;
+    }
+    struct stat st;
+    if (fstatat(dirfd_,name,&st,AT_SYMLINK_NOFOLLOW)<0) {
+      builder->skipc++;
+      continue;
+    }
+    builder->path[pathc]='/';
+    memcpy(builder->path+pathc+1,name,namec+1);
+    int subpathc=pathc+1+namec;
+    if (S_ISDIR(st.st_mode)) {
+      if (macb_catalog_walk(builder,subpathc)<0) {
+        closedir(dir);
+        return -1;
+      }
+    } else if (S_ISREG(st.st_mode)) {
+      if (macb_catalog_add_file(builder,subpathc,dirfd_,name,&st)<0) {
+        closedir(dir);
+        return -1;
+      }
+    }
+    builder->path[pathc]=0;
+  }
+  closedir(dir);
+  return 0;
+}
+
+/* Index: Write the catalog.
+ */
+
+static int macb_catalog_write_column(FILE *f,const struct macb_catalog_builder *builder,int col) {
+  const struct macb_catalog_record *record=builder->recordv;
+  int i=builder->recordc;
+  uint64_t strp=0;
+  for (;i-->0;record++) {
+    const void *src=0;
+    uint64_t u64;
+    uint32_t u32;
+    switch (col) {
+      case MACB_CATCOL_PATHP: u64=strp; strp+=record->pathc; src=&u64; break;
+      case MACB_CATCOL_PATHC: u32=record->pathc; src=&u32; break;
+      case MACB_CATCOL_DEV: src=&record->dev; break;
+      case MACB_CATCOL_INO: src=&record->ino; break;
+      case MACB_CATCOL_FSIZE: src=&record->fsize; break;
+      case MACB_CATCOL_FMTIME: src=&record->fmtime; break;
+      case MACB_CATCOL_TYPE: src=&record->type; break;
+      case MACB_CATCOL_CREATOR: src=&record->creator; break;
+      case MACB_CATCOL_DFLEN: src=&record->dflen; break;
+      case MACB_CATCOL_RFLEN: src=&record->rflen; break;
+      case MACB_CATCOL_CTIME: src=&record->ctime; break;
+      case MACB_CATCOL_MTIME: src=&record->mtime; break;
+      case MACB_CATCOL_FLAGS: src=&record->flags; break;
+      case MACB_CATCOL_STATUS: src=&record->status; break;
+      case MACB_CATCOL_STRINGS: {
+          if (fwrite(record->path,1,record->pathc,f)!=record->pathc) return -1;
+        } continue;
+    }
+    if (fwrite(src,macb_catalog_column_size[col],1,f)!=1) return -1;
+  }
+  return 0;
+}
+
+static int macb_catalog_write(const struct macb_catalog_builder *builder,const char *path) {
+  uint8_t hdr[MACB_CATALOG_HEADER_SIZE]={0};
+  memcpy(hdr,MACB_CATALOG_MAGIC,8);
+  *(uint32_t*)(hdr+8)=MACB_CATALOG_BOM;
+  *(uint32_t*)(hdr+12)=builder->recordc;
+  uint64_t *colp=(uint64_t*)(hdr+24);
+  uint64_t p=MACB_CATALOG_HEADER_SIZE;
+  int i=0; for (;i<MACB_CATCOL_COUNT;i++) {
+    colp[i]=p;
+    if (i==MACB_CATCOL_STRINGS) {
+      int j=builder->recordc; while (j-->0) p+=builder->recordv[j].pathc;
+    } else {
+      p+=(uint64_t)builder->recordc*macb_catalog_column_size[i];
+      p=(p+7)&~7ull;
+    }
+  }
+  *(uint64_t*)(hdr+16)=p;
+
+  // Write beside the real thing and rename, so readers never see a partial catalog.
+  int pathc=0; while (path[pathc]) pathc++;
+  char *tmppath=malloc(pathc+5);
+  if (!tmppath) return -1;
+  memcpy(tmppath,path,pathc);
+  memcpy(tmppath+pathc,".tmp",5);
+  FILE *f=fopen(tmppath,"wb");
+  if (!f) {
+    free(tmppath);
+    return -1;
+  }
+  setvbuf(f,0,_IOFBF,1<<20);
+  int err=0;
+  if (fwrite(hdr,1,sizeof(hdr),f)!=sizeof(hdr)) err=-1;
+  for (i=0;!err&&(i<MACB_CATCOL_COUNT);i++) {
+    long pad=(long)colp[i]-ftell(f);
+    while (pad-->0) fputc(0,f);
+    err=macb_catalog_write_column(f,builder,i);
+  }
+  if (fclose(f)) err=-1;
+  if (!err&&(rename(tmppath,path)<0)) err=-1;
+  if (err) unlink(tmppath);
+  free(tmppath);
+  return err;
+}
+
+/* Index, main entry point.
+ */
+
+int macb_main_index(struct macb_request *request) {
+  if (!request->arpathc) {
+    fprintf(MACB_ERR(request),"Directory required with '--index'\n");
+    return -1;
+  }
+  const char *catpath=request->catpathc?request->catpath:"macb.catalog";
+  struct macb_catalog old={0};
+  struct macb_catalog_builder builder={.request=request,.old=&old};
+  int result=0;
+
+  if (macb_catalog_map(&old,catpath)<0) {
+    fprintf(MACB_ERR(request),"%s:WARNING: Existing catalog is unreadable. Rebuilding from scratch.\n",catpath);
+  }
+
+  int pathc=request->arpathc;
+  while ((pathc>1)&&(request->arpath[pathc-1]=='/')) pathc--;
+  if (pathc>=sizeof(builder.path)) {
+    fprintf(MACB_ERR(request),"%s: Path too long.\n",request->arpath);
+    result=-1;
+    goto _done_;
+  }
+  memcpy(builder.path,request->arpath,pathc);
+  builder.path[pathc]=0;
+  if (macb_catalog_walk(&builder,pathc)<0) {
+    result=-1;
+    goto _done_;
+  }
+
+  qsort(builder.recordv,builder.recordc,sizeof(struct macb_catalog_record),macb_catalog_recordcmp);
+
+  // Count records that disappeared, before we drop the old catalog.
+  int matchc=0,i=0;
+  for (;i<builder.recordc;i++) {
+    if (old.count&&(macb_catalog_search(&old,builder.recordv[i].path,builder.recordv[i].pathc)>=0)) matchc++;
+  }
+  int removec=old.count-matchc;
+  macb_catalog_unmap(&old);
+
+  if (macb_catalog_write(&builder,catpath)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to write catalog.\n",catpath);
+    result=-1;
+    goto _done_;
+  }
+
+  int archivec=0;
+  for (i=0;i<builder.recordc;i++) {
+    if (!(builder.recordv[i].status&(MACB_CATSTATUS_UNREADABLE|MACB_CATSTATUS_NOT_MACB))) archivec++;
+  }
+  fprintf(MACB_OUT(request),
+    "%s: Cataloged %d files (%d MacBinary). Read %d, unchanged %d, removed %d, skipped %d.\n",
+    catpath,builder.recordc,archivec,builder.readc,builder.reusec,removec,builder.skipc
+  );
+
+ _done_:
+  macb_catalog_unmap(&old);
+  macb_catalog_builder_cleanup(&builder);
+  return result;
+}
+
+/* Query, main entry point.
+ */
+
+int macb_main_query(struct macb_request *request) {
+  const char *catpath=request->catpathc?request->catpath:"macb.catalog";
+  struct macb_catalog catalog={0};
+  int err=macb_catalog_map(&catalog,catpath);
+  if (err<=0) {
+    fprintf(MACB_ERR(request),"%s: Failed to read catalog.%s\n",catpath,err?"":" Create it with '--index'.");
+    return -1;
+  }
+
+  const uint16_t *status=COL(&catalog,STATUS,uint16_t);
+  const uint32_t *type=COL(&catalog,TYPE,uint32_t);
+  const uint32_t *creator=COL(&catalog,CREATOR,uint32_t);
+  const uint32_t *dflen=COL(&catalog,DFLEN,uint32_t);
+  const uint32_t *rflen=COL(&catalog,RFLEN,uint32_t);
+  const uint32_t *mtime=COL(&catalog,MTIME,uint32_t);
+  const uint64_t *pathp=COL(&catalog,PATHP,uint64_t);
+  const uint32_t *pathc=COL(&catalog,PATHC,uint32_t);
+  const char *strv=catalog.colv[MACB_CATCOL_STRINGS];
+  FILE *out=MACB_OUT(request);
+
+  int i=0; for (;i<catalog.count;i++) {
+    if (status[i]&(MACB_CATSTATUS_UNREADABLE|MACB_CATSTATUS_NOT_MACB)) continue;
+    if (request->type&&(type[i]!=request->type)) continue;
+    if (request->creator&&(creator[i]!=request->creator)) continue;
+    if (request->minsize||request->maxsize) {
+      int64_t size=(int64_t)dflen[i]+rflen[i];
+      if (request->minsize&&(size<request->minsize)) continue;
+      if (request->maxsize&&(size>request->maxsize)) continue;
+    }
+    if (request->after&&(mtime[i]<request->after)) continue;
+    if (request->before&&(mtime[i]>=request->before)) continue;
+    fprintf(out,"%.*s\n",(int)pathc[i],strv+pathp[i]);
+  }
+
+  macb_catalog_unmap(&catalog);
+  return 0;
+}
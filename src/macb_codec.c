@@ -0,0 +1,218 @@
+#include "macb_codec.h"
+#include <string.h>
+
+/* Big-endian integers.
+ * Private copies, so the library doesn't need macb_business.c.
+ */
+
+static uint32_t codec_rd32(const uint8_t *src) {
+  return ((uint32_t)src[0]<<24)|(src[1]<<16)|(src[2]<<8)|src[3];
+}
+
+static uint16_t codec_rd16(const uint8_t *src) {
+  return (src[0]<<8)|src[1];
+}
+
+static void codec_wr32(uint8_t *dst,uint32_t v) {
+  dst[0]=v>>24;
+  dst[1]=v>>16;
+  dst[2]=v>>8;
+  dst[3]=v;
+}
+
+static void codec_wr16(uint8_t *dst,uint16_t v) {
+  dst[0]=v>>8;
+  dst[1]=v;
+}
+
+/* Decode.
+ */
+
+int macb_header_decode(struct macb_header *header,const void *src,int srcc) {
+  if (!header||!src||(srcc<MACB_HEADER_SIZE)) return -1;
+  const uint8_t *SRC=src;
+  header->version=SRC[0x00];
+  header->namec=SRC[0x01];
+  memcpy(header->name,SRC+0x02,63);
+  header->name[(header->namec<=63)?header->namec:63]=0;
+  header->name[63]=0;
+  header->type=codec_rd32(SRC+0x41);
+  header->creator=codec_rd32(SRC+0x45);
+  header->flags_hi=SRC[0x49];
+  header->vpos=codec_rd16(SRC+0x4b);
+  header->hpos=codec_rd16(SRC+0x4d);
+  header->folder=codec_rd16(SRC+0x4f);
+  header->protect=SRC[0x51];
+  header->dflen=codec_rd32(SRC+0x53);
+  header->rflen=codec_rd32(SRC+0x57);
+  header->ctime=codec_rd32(SRC+0x5b);
+  header->mtime=codec_rd32(SRC+0x5f);
+  header->cmtlen=codec_rd16(SRC+0x63);
+  header->flags_lo=SRC[0x65];
+  header->unpacklen=codec_rd32(SRC+0x74);
+  header->addlhdrlen=codec_rd16(SRC+0x78);
+  header->srcversion=SRC[0x7a];
+  header->minversion=SRC[0x7b];
+  header->crc=codec_rd16(SRC+0x7c);
+  return 0;
+}
+
+/* Encode.
+ */
+
+int macb_header_encode(void *dst,int dsta,const struct macb_header *header) {
+  if (!dst||!header||(dsta<MACB_HEADER_SIZE)) return -1;
+  uint8_t *DST=dst;
+  memset(DST,0,MACB_HEADER_SIZE);
+  DST[0x00]=header->version;
+  int namec=(header->namec<=63)?header->namec:63;
+  DST[0x01]=namec;
+  memcpy(DST+0x02,header->name,namec);
+  codec_wr32(DST+0x41,header->type);
+  codec_wr32(DST+0x45,header->creator);
+  DST[0x49]=header->flags_hi;
+  codec_wr16(DST+0x4b,header->vpos);
+  codec_wr16(DST+0x4d,header->hpos);
+  codec_wr16(DST+0x4f,header->folder);
+  DST[0x51]=header->protect;
+  codec_wr32(DST+0x53,header->dflen);
+  codec_wr32(DST+0x57,header->rflen);
+  codec_wr32(DST+0x5b,header->ctime);
+  codec_wr32(DST+0x5f,header->mtime);
+  codec_wr16(DST+0x63,header->cmtlen);
+  DST[0x65]=header->flags_lo;
+  codec_wr32(DST+0x74,header->unpacklen);
+  codec_wr16(DST+0x78,header->addlhdrlen);
+  DST[0x7a]=header->srcversion;
+  DST[0x7b]=header->minversion;
+  macb_header_seal(DST);
+  return MACB_HEADER_SIZE;
+}
+
+void macb_header_seal(void *hdr) {
+  uint8_t *HDR=hdr;
+  codec_wr16(HDR+0x7c,macb_crc_macb(HDR,124,0));
+}
+
+/* Layout.
+ * Sections in order: Header, additional header, data fork, resource fork, comment.
+ * The spec doesn't say whether the comment pads to 128 bytes; since everything else does, we assume it does too.
+ */
+
+#define CODEC_PAD128(n) (((n)+127)&~(int64_t)127)
+
+void macb_layout_compute(struct macb_layout *layout,const struct macb_header *header) {
+  layout->addlp=MACB_HEADER_SIZE;
+  layout->addllen=header->addlhdrlen;
+  layout->dfp=layout->addlp+CODEC_PAD128(layout->addllen);
+  layout->dflen=header->dflen;
+  layout->rfp=layout->dfp+CODEC_PAD128(layout->dflen);
+  layout->rflen=header->rflen;
+  layout->cmtp=layout->rfp+CODEC_PAD128(layout->rflen);
+  layout->cmtlen=header->cmtlen;
+  layout->total=layout->cmtp+CODEC_PAD128(layout->cmtlen);
+  layout->minimum=layout->dfp+layout->dflen;
+  if (layout->rflen) layout->minimum=layout->rfp+layout->rflen;
+}
+
+/* Validate.
+ */
+
+static int codec_ostype_printable(const uint8_t *src) {
+  int i=4; while (i-->0) {
+    if ((src[i]<0x20)||(src[i]>0x7e)) return 0;
+  }
+  return 1;
+}
+
+uint32_t macb_header_validate(const void *hdr,int64_t flen) {
+  const uint8_t *HDR=hdr;
+  uint32_t findings=0;
+  struct macb_header header;
+  macb_header_decode(&header,hdr,MACB_HEADER_SIZE);
+
+  // Signature-ish bytes.
+  if (HDR[0x00]) findings|=MACB_FINDING_VERSION;
+  if (HDR[0x4a]) findings|=MACB_FINDING_PAD4A;
+  if (HDR[0x52]) findings|=MACB_FINDING_PAD52;
+  if (!memcmp(HDR+0x66,"mBIN",4)) findings|=MACB_FINDING_MACBINARY3;
+  else if (memcmp(HDR+0x66,"\0\0\0\0\0\0\0\0\0\0\0\0\0\0",14)) findings|=MACB_FINDING_UNUSED66;
+  if (HDR[0x7e]||HDR[0x7f]) findings|=MACB_FINDING_TRAILER;
+
+  // Name.
+  if (!header.namec||(header.namec>63)) {
+    findings|=MACB_FINDING_NAME_LENGTH;
+  } else {
+    const uint8_t *name=HDR+0x02;
+    int i=header.namec; while (i-->0) {
+      if (name[i]<0x20) findings|=MACB_FINDING_NAME_CONTROL;
+      else if (name[i]>0x7e) findings|=MACB_FINDING_NAME_HIGH;
+    }
+  }
+
+  // Other fields.
+  if (!codec_ostype_printable(HDR+0x41)) findings|=MACB_FINDING_TYPE_BINARY;
+  if (!codec_ostype_printable(HDR+0x45)) findings|=MACB_FINDING_CREATOR_BINARY;
+  if (header.protect>1) findings|=MACB_FINDING_PROTECT;
+  if (header.addlhdrlen) findings|=MACB_FINDING_ADDL_HEADER;
+  if (macb_crc_macb(HDR,124,0)!=header.crc) findings|=MACB_FINDING_CRC;
+
+  // Layout against the archive length.
+  if (flen<0) {
+    findings|=MACB_FINDING_LENGTH_UNKNOWN;
+  } else {
+    struct macb_layout layout;
+    macb_layout_compute(&layout,&header);
+    if (layout.dfp+layout.dflen>flen) findings|=MACB_FINDING_DATA_BEYOND_EOF;
+    if (layout.rfp+layout.rflen>flen) findings|=MACB_FINDING_RES_BEYOND_EOF;
+    if (layout.total>flen) findings|=MACB_FINDING_TRUNCATED;
+    else if (layout.total<flen) findings|=MACB_FINDING_EXTRA_DATA;
+  }
+
+  return findings;
+}
+
+/* Finding metadata.
+ */
+
+const char *macb_finding_name(uint32_t finding) {
+  switch (finding) {
+    case MACB_FINDING_VERSION: return "version-nonzero";
+    case MACB_FINDING_PAD4A: return "pad-4a-nonzero";
+    case MACB_FINDING_PAD52: return "pad-52-nonzero";
+    case MACB_FINDING_UNUSED66: return "unused-66-nonzero";
+    case MACB_FINDING_TRAILER: return "trailer-nonzero";
+    case MACB_FINDING_NAME_LENGTH: return "name-length";
+    case MACB_FINDING_NAME_CONTROL: return "name-control-chars";
+    case MACB_FINDING_NAME_HIGH: return "name-high-chars";
+    case MACB_FINDING_TYPE_BINARY: return "type-unprintable";
+    case MACB_FINDING_CREATOR_BINARY: return "creator-unprintable";
+    case MACB_FINDING_PROTECT: return "protect-invalid";
+    case MACB_FINDING_CRC: return "crc-mismatch";
+    case MACB_FINDING_ADDL_HEADER: return "additional-header";
+    case MACB_FINDING_LENGTH_UNKNOWN: return "length-unknown";
+    case MACB_FINDING_TRUNCATED: return "truncated";
+    case MACB_FINDING_DATA_BEYOND_EOF: return "data-beyond-eof";
+    case MACB_FINDING_RES_BEYOND_EOF: return "resource-beyond-eof";
+    case MACB_FINDING_EXTRA_DATA: return "extra-data";
+    case MACB_FINDING_MACBINARY3: return "macbinary3";
+  }
+  return "unknown";
+}
+
+int macb_finding_severity(uint32_t finding) {
+  switch (finding) {
+    case MACB_FINDING_VERSION:
+    case MACB_FINDING_PAD4A:
+    case MACB_FINDING_PAD52:
+    case MACB_FINDING_NAME_LENGTH:
+    case MACB_FINDING_CRC:
+    case MACB_FINDING_TRUNCATED:
+    case MACB_FINDING_DATA_BEYOND_EOF:
+    case MACB_FINDING_RES_BEYOND_EOF:
+      return MACB_SEVERITY_ERROR;
+    case MACB_FINDING_MACBINARY3:
+      return MACB_SEVERITY_INFO;
+  }
+  return MACB_SEVERITY_WARNING;
+}
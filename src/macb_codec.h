@@ -0,0 +1,125 @@
+/* macb_codec.h
+ * MacBinary header codec. This is the public interface of libmacb.
+ * Nothing here allocates, prints, or touches the filesystem; everything works on caller-supplied buffers.
+ * Only needs <stdint.h>, so it can be included without the rest of macb.
+ */
+
+#ifndef MACB_CODEC_H
+#define MACB_CODEC_H
+
+#include <stdint.h>
+
+#define MACB_HEADER_SIZE 128
+
+/* Decoded header.
+ * Offsets in the 128-byte header are noted beside each field.
+ */
+struct macb_header {
+  uint8_t version;          // 00 Should be zero.
+  uint8_t namec;            // 01 1..63
+  char name[64];            // 02 Raw bytes, and we add a terminator.
+  uint32_t type,creator;    // 41,45
+  uint8_t flags_hi;         // 49 locked,invisible,bundle,system,bozo,busy,changed,inited
+  uint16_t vpos,hpos;       // 4b,4d Position in Finder window.
+  uint16_t folder;          // 4f Window or folder ID.
+  uint8_t protect;          // 51 Zero or one.
+  uint32_t dflen,rflen;     // 53,57
+  uint32_t ctime,mtime;     // 5b,5f Mac time, ie seconds since 1904.
+  uint16_t cmtlen;          // 63 Comment length.
+  uint8_t flags_lo;         // 65 hasNoInits,isShared,requiresSwitchLaunch,ColorReserved,color*3,isOnDesk
+  uint32_t unpacklen;       // 74
+  uint16_t addlhdrlen;      // 78 Additional header length.
+  uint8_t srcversion;       // 7a MacBinary version of the encoder.
+  uint8_t minversion;       // 7b MacBinary version required to decode.
+  uint16_t crc;             // 7c As stated in the header.
+};
+
+/* Where everything lives in an archive, according to its header.
+ * Each section starts on a 128-byte boundary.
+ * (minimum) is the smallest archive length that contains both forks; (total) includes every section and padding.
+ */
+struct macb_layout {
+  int64_t addlp,addllen;
+  int64_t dfp,dflen;
+  int64_t rfp,rflen;
+  int64_t cmtp,cmtlen;
+  int64_t minimum;
+  int64_t total;
+};
+
+/* Validation findings, a bitmask.
+ * macb_finding_severity tells you how much to worry about each.
+ */
+#define MACB_FINDING_VERSION          0x00000001 /* ERROR: [0x00] nonzero, probably not MacBinary. */
+#define MACB_FINDING_PAD4A            0x00000002 /* ERROR: [0x4a] nonzero. */
+#define MACB_FINDING_PAD52            0x00000004 /* ERROR: [0x52] nonzero. */
+#define MACB_FINDING_UNUSED66         0x00000008 /* WARNING: [0x66..0x73] nonzero and not a MacBinary III signature. */
+#define MACB_FINDING_TRAILER          0x00000010 /* WARNING: [0x7e,0x7f] nonzero. */
+#define MACB_FINDING_NAME_LENGTH      0x00000020 /* ERROR: Name length zero or over 63. */
+#define MACB_FINDING_NAME_CONTROL     0x00000040 /* WARNING: Name contains bytes below 0x20. */
+#define MACB_FINDING_NAME_HIGH        0x00000080 /* WARNING: Name contains bytes above 0x7e. */
+#define MACB_FINDING_TYPE_BINARY      0x00000100 /* WARNING: Type is not printable ASCII. */
+#define MACB_FINDING_CREATOR_BINARY   0x00000200 /* WARNING: Creator is not printable ASCII. */
+#define MACB_FINDING_PROTECT          0x00000400 /* WARNING: Protected byte not zero or one. */
+#define MACB_FINDING_CRC              0x00000800 /* ERROR: CRC mismatch. */
+#define MACB_FINDING_ADDL_HEADER      0x00001000 /* WARNING: Additional header present; rarely seen, handling is a guess. */
+#define MACB_FINDING_LENGTH_UNKNOWN   0x00002000 /* WARNING: Archive length not provided, can't check layout. */
+#define MACB_FINDING_TRUNCATED        0x00004000 /* ERROR: Archive shorter than its sections and padding. */
+#define MACB_FINDING_DATA_BEYOND_EOF  0x00008000 /* ERROR: Data fork extends past the end of the archive. */
+#define MACB_FINDING_RES_BEYOND_EOF   0x00010000 /* ERROR: Resource fork extends past the end of the archive. */
+#define MACB_FINDING_EXTRA_DATA       0x00020000 /* WARNING: Archive longer than expected. */
+#define MACB_FINDING_MACBINARY3       0x00040000 /* INFO: MacBinary III signature 'mBIN' at 0x66. */
+#define MACB_FINDING_COUNT 19
+
+#define MACB_SEVERITY_INFO    0
+#define MACB_SEVERITY_WARNING 1
+#define MACB_SEVERITY_ERROR   2
+
+/* Findings that make extraction impossible.
+ */
+#define MACB_FINDINGS_FATAL (MACB_FINDING_DATA_BEYOND_EOF|MACB_FINDING_RES_BEYOND_EOF)
+
+/* Decode 128 bytes at (src) into (header).
+ * Fails only if (srcc<128).
+ */
+int macb_header_decode(struct macb_header *header,const void *src,int srcc);
+
+/* Encode (header) into 128 bytes at (dst), including a fresh CRC (header->crc is ignored).
+ * Unused and padding bytes are zeroed. Returns 128, or <0 if (dsta<128).
+ */
+int macb_header_encode(void *dst,int dsta,const struct macb_header *header);
+
+/* Compute and store the CRC of a 128-byte header, in place.
+ */
+void macb_header_seal(void *hdr);
+
+/* Section positions and lengths from a decoded header.
+ */
+void macb_layout_compute(struct macb_layout *layout,const struct macb_header *header);
+
+/* Check a raw 128-byte header, and optionally the archive length (<0 if unknown).
+ * Returns a mask of MACB_FINDING_*, zero if everything looks perfect.
+ */
+uint32_t macb_header_validate(const void *hdr,int64_t flen);
+
+/* Describe one finding bit. Name is a stable short identifier like "crc-mismatch", suitable for machines.
+ */
+const char *macb_finding_name(uint32_t finding);
+int macb_finding_severity(uint32_t finding);
+
+/* CRC-16 as used by MacBinary and BinHex, fast.
+ * Same results as crc_macb and crc_binh in crc.c, which remain the reference implementations.
+ * We pick the fastest kernel the CPU supports at startup; macb_crc_set_kernel overrides that,
+ * mostly for benchmarking. It fails if the kernel is not available on this host.
+ */
+#define MACB_CRC_KERNEL_AUTO     0
+#define MACB_CRC_KERNEL_BYTE     1
+#define MACB_CRC_KERNEL_SLICE8   2
+#define MACB_CRC_KERNEL_SLICE16  3
+#define MACB_CRC_KERNEL_CLMUL    4
+uint16_t macb_crc_macb(const void *src,int srcc,uint16_t crc);
+uint16_t macb_crc_binh(const void *src,int srcc,uint16_t crc);
+int macb_crc_set_kernel(int kernel);
+const char *macb_crc_kernel_name(int kernel);
+
+#endif
@@ -0,0 +1,220 @@
+#include "macb.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Fork digests.
+ *
+ * "sha256" is plain SHA-256 of the fork, so it agrees with sha256sum. It can only run front to back.
+ * "xxh64-4m" cuts the fork into 4 MB chunks, takes XXH64 of each, and then XXH64 of the chunk digests
+ * (8 bytes each, big-endian, in order). Streaming, we fold each chunk in as it completes.
+ * Verifying, any number of threads can take chunks in any order, and the outer hash comes out the same.
+ */
+
+#define MACB_DIGEST_BUFFER_SIZE 65536
+
+/* Streaming.
+ */
+
+void macb_digest_init(struct macb_digest *digest,int algo) {
+  digest->algo=algo;
+  digest->chunkc=0;
+  switch (algo) {
+    case MACB_DIGEST_SHA256: macb_sha256_init(&digest->sha256); break;
+    case MACB_DIGEST_FAST: {
+        macb_xxh64_init(&digest->chunk,0);
+        macb_xxh64_init(&digest->outer,0);
+      } break;
+  }
+}
+
+static void macb_digest_fold_chunk(struct macb_xxh64 *outer,uint64_t chunk) {
+  uint8_t be[8];
+  int i=8; while (i-->0) { be[i]=chunk; chunk>>=8; }
+  macb_xxh64_update(outer,be,8);
+}
+
+void macb_digest_update(struct macb_digest *digest,const void *src,int64_t srcc) {
+  switch (digest->algo) {
+    case MACB_DIGEST_SHA256: macb_sha256_update(&digest->sha256,src,srcc); break;
+    case MACB_DIGEST_FAST: {
+        const uint8_t *SRC=src;
+        while (srcc>0) {
+          int64_t cpc=MACB_DIGEST_CHUNK_SIZE-digest->chunkc;
+          if (cpc>srcc) cpc=srcc;
+          macb_xxh64_update(&digest->chunk,SRC,cpc);
+          digest->chunkc+=cpc;
+          SRC+=cpc;
+          srcc-=cpc;
+          if (digest->chunkc>=MACB_DIGEST_CHUNK_SIZE) {
+            macb_digest_fold_chunk(&digest->outer,macb_xxh64_final(&digest->chunk));
+            macb_xxh64_init(&digest->chunk,0);
+            digest->chunkc=0;
+          }
+        }
+      } break;
+  }
+}
+
+void macb_digest_final(char *dst,struct macb_digest *digest) {
+  switch (digest->algo) {
+    case MACB_DIGEST_SHA256: {
+        uint8_t bin[32];
+        macb_sha256_final(bin,&digest->sha256);
+        memcpy(dst,"sha256:",7);
+        macb_sha256_hex(dst+7,bin);
+      } break;
+    case MACB_DIGEST_FAST: {
+        if (digest->chunkc) macb_digest_fold_chunk(&digest->outer,macb_xxh64_final(&digest->chunk));
+        snprintf(dst,MACB_DIGEST_SIZE,"xxh64-4m:%016llx",(unsigned long long)macb_xxh64_final(&digest->outer));
+      } break;
+    default: dst[0]=0;
+  }
+}
+
+int macb_digest_algo_of(const char *src) {
+  if (!strncmp(src,"sha256:",7)) return MACB_DIGEST_SHA256;
+  if (!strncmp(src,"xxh64-4m:",9)) return MACB_DIGEST_FAST;
+  return -1;
+}
+
+/* Copy while hashing.
+ */
+
+int macb_digest_copy(struct macb_digest *digest,int dstfd,int srcfd,int64_t srcp,int64_t srcc) {
+  char buf[MACB_DIGEST_BUFFER_SIZE];
+  while (srcc>0) {
+    int cpc=(srcc>MACB_DIGEST_BUFFER_SIZE)?MACB_DIGEST_BUFFER_SIZE:srcc;
+    struct macb_stats_mark mark;
+    macb_stats_begin(&mark);
+    ssize_t err=MACB_SYSCALL((srcp<0)?read(srcfd,buf,cpc):pread(srcfd,buf,cpc,srcp));
+    if (err<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    if (!err) return -1;
+    macb_stats_end(&mark,MACB_STATS_FORK_READ,err);
+    macb_digest_update(digest,buf,err);
+    if ((dstfd>=0)&&(macb_file_append(dstfd,buf,err)<0)) return -1;
+    if (srcp>=0) srcp+=err;
+    srcc-=err;
+  }
+  return 0;
+}
+
+int64_t macb_digest_copy_to_eof(struct macb_digest *digest,int dstfd,int srcfd) {
+  char buf[MACB_DIGEST_BUFFER_SIZE];
+  int64_t total=0;
+  while (1) {
+    struct macb_stats_mark mark;
+    macb_stats_begin(&mark);
+    ssize_t err=MACB_SYSCALL(read(srcfd,buf,sizeof(buf)));
+    if (err<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    if (!err) return total;
+    macb_stats_end(&mark,MACB_STATS_FORK_READ,err);
+    macb_digest_update(digest,buf,err);
+    if ((dstfd>=0)&&(macb_file_append(dstfd,buf,err)<0)) return -1;
+    total+=err;
+  }
+}
+
+int macb_digest_write_from_fd(struct macb_digest *digest,const char *path,int srcfd,int64_t srcp,int64_t srcc) {
+  struct macb_output output;
+  if (macb_output_open(&output,path,srcc)<0) return -1;
+  if (macb_digest_copy(digest,output.fd,srcfd,srcp,srcc)<0) {
+    macb_output_abort(&output);
+    return -1;
+  }
+  return macb_output_commit(&output);
+}
+
+/* Hash a range of a seekable file, in parallel if we can.
+ */
+
+struct macb_digest_chunks {
+  int fd;
+  int64_t p,c;
+  uint64_t *v; // One per chunk.
+  int chunkc;
+  int next; // Next chunk to take. Atomic.
+  int failed; // Atomic, any thread can set it while the others poll.
+};
+
+static void *macb_digest_chunks_main(void *arg) {
+  struct macb_digest_chunks *chunks=arg;
+  char buf[MACB_DIGEST_BUFFER_SIZE];
+  while (!__atomic_load_n(&chunks->failed,__ATOMIC_RELAXED)) {
+    int chunkp=__atomic_fetch_add(&chunks->next,1,__ATOMIC_RELAXED);
+    if (chunkp>=chunks->chunkc) break;
+    int64_t p=(int64_t)chunkp*MACB_DIGEST_CHUNK_SIZE;
+    int64_t c=chunks->c-p;
+    if (c>MACB_DIGEST_CHUNK_SIZE) c=MACB_DIGEST_CHUNK_SIZE;
+    p+=chunks->p;
+    struct macb_xxh64 xxh;
+    macb_xxh64_init(&xxh,0);
+    while (c>0) {
+      int cpc=(c>MACB_DIGEST_BUFFER_SIZE)?MACB_DIGEST_BUFFER_SIZE:c;
+      struct macb_stats_mark mark;
+      macb_stats_begin(&mark);
+      ssize_t err=MACB_SYSCALL(pread(chunks->fd,buf,cpc,p));
+      if (err<0) {
+        if (errno==EINTR) continue;
+        __atomic_store_n(&chunks->failed,1,__ATOMIC_RELAXED);
+        return 0;
+      }
+      if (!err) {
+        __atomic_store_n(&chunks->failed,1,__ATOMIC_RELAXED);
+        return 0;
+      }
+      macb_stats_end(&mark,MACB_STATS_FORK_READ,err);
+      macb_xxh64_update(&xxh,buf,err);
+      p+=err;
+      c-=err;
+    }
+    chunks->v[chunkp]=macb_xxh64_final(&xxh);
+  }
+  return 0;
+}
+
+int macb_digest_fd(char *dst,int algo,int fd,int64_t p,int64_t c,int threadc) {
+  struct macb_digest digest;
+  macb_digest_init(&digest,algo);
+  int64_t chunkc=(c+MACB_DIGEST_CHUNK_SIZE-1)/MACB_DIGEST_CHUNK_SIZE;
+  if ((algo!=MACB_DIGEST_FAST)||(threadc<2)||(chunkc<2)) {
+    if (macb_digest_copy(&digest,-1,fd,p,c)<0) return -1;
+    macb_digest_final(dst,&digest);
+    return 0;
+  }
+
+  // Forks are at most 4 GB, so a thousand or so chunks at most.
+  struct macb_digest_chunks chunks={.fd=fd,.p=p,.c=c,.chunkc=chunkc};
+  if (!(chunks.v=malloc(sizeof(uint64_t)*chunkc))) return -1;
+  if (threadc>chunkc) threadc=chunkc;
+  pthread_t *threadv=malloc(sizeof(pthread_t)*threadc);
+  if (!threadv) {
+    free(chunks.v);
+    return -1;
+  }
+  // This thread is one of the workers. If some won't start, the rest pick up their chunks.
+  int startedc=0,i;
+  for (i=1;i<threadc;i++) {
+    if (pthread_create(threadv+startedc,0,macb_digest_chunks_main,&chunks)) break;
+    startedc++;
+  }
+  macb_digest_chunks_main(&chunks);
+  for (i=0;i<startedc;i++) pthread_join(threadv[i],0);
+  free(threadv);
+  if (chunks.failed) {
+    free(chunks.v);
+    return -1;
+  }
+
+  for (i=0;i<chunkc;i++) macb_digest_fold_chunk(&digest.outer,chunks.v[i]);
+  free(chunks.v);
+  macb_digest_final(dst,&digest);
+  return 0;
+}
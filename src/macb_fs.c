@@ -1,8 +1,21 @@
+#if defined(__linux__)
+  #define _GNU_SOURCE 1 // copy_file_range, splice, fallocate, O_TMPFILE
+  #define MACB_USE_KERNEL_COPY 1
+#else
+  #define MACB_USE_KERNEL_COPY 0
+#endif
 #include "macb.h"
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/stat.h>
 
+/* Public helpers that move bytes record them for '--stats'. They call each other only through these,
+ * which don't, so nothing is counted twice.
+ */
+static int macb_file_append_unrecorded(int fd,const void *src,int srcc);
+static int macb_output_commit_unrecorded(struct macb_output *output);
+
 /* Read file in one shot.
  */
  
@@ -29,7 +42,7 @@ int macb_file_read_fd(void *dstpp,int fd) {
       dst=nv;
     }
     
-    int err=read(fd,dst+dstc,dsta-dstc);
+    int err=MACB_SYSCALL(read(fd,dst+dstc,dsta-dstc));
     if (err<0) {
       free(dst);
       return -1;
@@ -44,10 +57,10 @@ int macb_file_read_fd(void *dstpp,int fd) {
 }
  
 int macb_file_read(void *dstpp,const char *path) {
-  int fd=open(path,O_RDONLY);
+  int fd=MACB_SYSCALL(open(path,O_RDONLY));
   if (fd<0) return -1;
   int dstc=macb_file_read_fd(dstpp,fd);
-  close(fd);
+  MACB_SYSCALL(close(fd));
   return dstc;
 }
 
@@ -55,35 +68,316 @@ int macb_file_read(void *dstpp,const char *path) {
  */
  
 int macb_file_write(const char *path,const void *src,int srcc) {
-  int fd=open(path,O_WRONLY|O_CREAT|O_TRUNC,0666);
-  if (fd<0) return -1;
+  struct macb_output output;
+  if (macb_output_open(&output,path,srcc)<0) return -1;
+  if (macb_file_append(output.fd,src,srcc)<0) {
+    macb_output_abort(&output);
+    return -1;
+  }
+  return macb_output_commit(&output);
+}
+
+int macb_file_read_at(int fd,void *dst,int dstc,int64_t p) {
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  int dstp=0;
+  while (dstp<dstc) {
+    ssize_t err=MACB_SYSCALL(pread(fd,(char*)dst+dstp,dstc-dstp,p+dstp));
+    if (err<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    if (!err) return -1;
+    dstp+=err;
+  }
+  macb_stats_end(&mark,MACB_STATS_FORK_READ,dstc);
+  return 0;
+}
+
+int macb_file_write_at(int fd,const void *src,int srcc,int64_t p) {
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
   int srcp=0;
   while (srcp<srcc) {
-    int err=write(fd,(char*)src+srcp,srcc-srcp);
-    if (err<=0) {
-      close(fd);
-      unlink(path);
+    ssize_t err=MACB_SYSCALL(pwrite(fd,(char*)src+srcp,srcc-srcp,p+srcp));
+    if (err<=0) return -1;
+    srcp+=err;
+  }
+  macb_stats_end(&mark,MACB_STATS_FORK_WRITE,srcc);
+  return 0;
+}
+
+/* Copy a range of one file into another.
+ * Each engine advances (srcp,srcc) as it goes. (srcp<0) means read sequentially from the current position.
+ * Returns >0 if the engine can't be used here and the next one should pick up where it left off.
+ */
+ 
+#define MACB_COPY_BUFFER_SIZE 65536
+
+// Largest single kernel copy request. Keeps size_t happy on 32-bit hosts; the loops take care of the rest.
+#define MACB_COPY_CHUNK_LIMIT 0x40000000
+
+#if MACB_USE_KERNEL_COPY
+
+// Errors that mean "not for this pair of files", rather than a real I/O failure.
+static int macb_copy_errno_is_unsupported(int e) {
+  switch (e) {
+    case ENOSYS:
+    case EXDEV:
+    case EINVAL:
+    case EBADF:
+    case EOPNOTSUPP:
+    case ESPIPE:
+      return 1;
+  }
+  return 0;
+}
+
+/* copy_file_range: No trip through userspace at all, and the filesystem may share extents.
+ */
+
+static int macb_file_copy_range(int dstfd,int srcfd,int64_t *srcp,int64_t *srcc) {
+  while (*srcc>0) {
+    loff_t inp=*srcp;
+    size_t cpc=(*srcc>MACB_COPY_CHUNK_LIMIT)?MACB_COPY_CHUNK_LIMIT:*srcc;
+    ssize_t err=MACB_SYSCALL(copy_file_range(srcfd,(*srcp<0)?0:&inp,dstfd,0,cpc,0));
+    if (err<0) {
+      if (errno==EINTR) continue;
+      if (macb_copy_errno_is_unsupported(errno)) return 1;
       return -1;
     }
-    srcp+=err;
+    if (!err) return -1; // Premature EOF.
+    if (*srcp>=0) *srcp+=err;
+    *srcc-=err;
   }
-  close(fd);
   return 0;
 }
 
-/* Read header and report total length.
+static int macb_file_drain_pipe(int dstfd,int pipefd,int c) {
+  char buf[4096];
+  while (c>0) {
+    int cpc=c;
+    if (cpc>(int)sizeof(buf)) cpc=sizeof(buf);
+    int err=MACB_SYSCALL(read(pipefd,buf,cpc));
+    if (err<=0) return -1;
+    if (macb_file_append_unrecorded(dstfd,buf,err)<0) return -1;
+    c-=err;
+  }
+  return 0;
+}
+
+/* splice through a pipe: Still two syscalls per chunk, but the bytes stay in the kernel.
  */
+
+static int macb_file_copy_splice(int dstfd,int srcfd,int64_t *srcp,int64_t *srcc) {
+  int pipev[2];
+  if (MACB_SYSCALL(pipe(pipev))<0) return 1;
+  int result=0;
+  while (*srcc>0) {
+    loff_t inp=*srcp;
+    size_t cpc=(*srcc>MACB_COPY_CHUNK_LIMIT)?MACB_COPY_CHUNK_LIMIT:*srcc;
+    ssize_t inc=MACB_SYSCALL(splice(srcfd,(*srcp<0)?0:&inp,pipev[1],0,cpc,SPLICE_F_MOVE));
+    if (inc<0) {
+      if (errno==EINTR) continue;
+      result=macb_copy_errno_is_unsupported(errno)?1:-1;
+      break;
+    }
+    if (!inc) { result=-1; break; }
+    // Once bytes are in the pipe, they have to come out. If the output refuses splice, drain it the slow way.
+    ssize_t outc=0;
+    while (outc<inc) {
+      ssize_t err=MACB_SYSCALL(splice(pipev[0],0,dstfd,0,inc-outc,SPLICE_F_MOVE));
+      if (err<0) {
+        if (errno==EINTR) continue;
+        if (macb_copy_errno_is_unsupported(errno)) {
+          result=macb_file_drain_pipe(dstfd,pipev[0],inc-outc)?-1:1;
+        } else {
+          result=-1;
+        }
+        break;
+      }
+      if (!err) { result=-1; break; }
+      outc+=err;
+    }
+    if (result<0) break;
+    if (*srcp>=0) *srcp+=inc;
+    *srcc-=inc;
+    if (result) break; // Drained by hand; let the next engine finish.
+  }
+  MACB_SYSCALL(close(pipev[0]));
+  MACB_SYSCALL(close(pipev[1]));
+  return result;
+}
+
+#endif
+
+/* Plain read and write through a small fixed buffer. Always works.
+ */
+ 
+static int macb_file_copy_buffered(int dstfd,int srcfd,int64_t *srcp,int64_t *srcc) {
+  char buf[MACB_COPY_BUFFER_SIZE];
+  while (*srcc>0) {
+    int cpc=(*srcc>MACB_COPY_BUFFER_SIZE)?MACB_COPY_BUFFER_SIZE:*srcc;
+    ssize_t err=MACB_SYSCALL((*srcp<0)?read(srcfd,buf,cpc):pread(srcfd,buf,cpc,*srcp));
+    if (err<=0) return -1; // Premature EOF is an error; caller should have validated lengths.
+    if (macb_file_append_unrecorded(dstfd,buf,err)<0) return -1;
+    if (*srcp>=0) *srcp+=err;
+    *srcc-=err;
+  }
+  return 0;
+}
+ 
+static int macb_file_copy_unrecorded(int dstfd,int srcfd,int64_t srcp,int64_t srcc) {
+  int err;
+  #if MACB_USE_KERNEL_COPY
+    if ((err=macb_file_copy_range(dstfd,srcfd,&srcp,&srcc))<=0) return err;
+    if ((err=macb_file_copy_splice(dstfd,srcfd,&srcp,&srcc))<=0) return err;
+  #endif
+  if ((err=macb_file_copy_buffered(dstfd,srcfd,&srcp,&srcc))<=0) return err;
+  return -1;
+}
  
-int macb_file_read_header(void *dst_128b,const char *path) {
-  int fd=open(path,O_RDONLY);
-  if (!fd) return -1;
-  if (read(fd,dst_128b,128)!=128) {
-    close(fd);
+int macb_file_copy(int dstfd,int srcfd,int64_t srcp,int64_t srcc) {
+  if (!srcc) return 0;
+  if ((dstfd<0)||(srcfd<0)||(srcc<0)) return -1;
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  int err=macb_file_copy_unrecorded(dstfd,srcfd,srcp,srcc);
+  if (!err) macb_stats_end(&mark,MACB_STATS_FORK_WRITE,srcc);
+  return err;
+}
+
+int macb_file_write_from_fd(const char *path,int srcfd,int64_t srcp,int64_t srcc) {
+  struct macb_output output;
+  if (macb_output_open(&output,path,srcc)<0) return -1;
+  if (macb_file_copy(output.fd,srcfd,srcp,srcc)<0) {
+    macb_output_abort(&output);
     return -1;
   }
-  off_t flen=lseek(fd,0,SEEK_END);
-  close(fd);
-  if ((flen<0)||(flen>INT_MAX)) return 0; // Not seekable or giant file. Indicate "got header but not length".
+  return macb_output_commit(&output);
+}
+
+/* Copy from the current position to end of file, for inputs whose length we can't know up front.
+ * If the source is a pipe, splice straight from it. Otherwise, or if splice refuses, read and write.
+ */
+
+static int64_t macb_file_copy_to_eof_unrecorded(int dstfd,int srcfd) {
+  int64_t total=0;
+  #if MACB_USE_KERNEL_COPY
+    while (1) {
+      ssize_t err=MACB_SYSCALL(splice(srcfd,0,dstfd,0,MACB_COPY_CHUNK_LIMIT,SPLICE_F_MOVE));
+      if (err<0) {
+        if (errno==EINTR) continue;
+        if (macb_copy_errno_is_unsupported(errno)) break;
+        return -1;
+      }
+      if (!err) return total;
+      total+=err;
+    }
+  #endif
+  char buf[MACB_COPY_BUFFER_SIZE];
+  while (1) {
+    ssize_t err=MACB_SYSCALL(read(srcfd,buf,sizeof(buf)));
+    if (err<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    if (!err) return total;
+    if (macb_file_append_unrecorded(dstfd,buf,err)<0) return -1;
+    total+=err;
+  }
+}
+
+int64_t macb_file_copy_to_eof(int dstfd,int srcfd) {
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  int64_t total=macb_file_copy_to_eof_unrecorded(dstfd,srcfd);
+  if (total>=0) macb_stats_end(&mark,MACB_STATS_FORK_WRITE,total);
+  return total;
+}
+
+/* Discard (c) bytes from a sequential input.
+ */
+
+int macb_file_skip(int fd,int64_t c) {
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  int64_t skipc=c;
+  char buf[4096];
+  while (c>0) {
+    int cpc=(c>(int64_t)sizeof(buf))?sizeof(buf):c;
+    ssize_t err=MACB_SYSCALL(read(fd,buf,cpc));
+    if (err<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    if (!err) return -1;
+    c-=err;
+  }
+  macb_stats_end(&mark,MACB_STATS_FORK_READ,skipc);
+  return 0;
+}
+
+/* Read header and report total length.
+ */
+ 
+int macb_file_openr(const char *path) {
+  if (MACB_PATH_IS_STDIO(path)) return MACB_SYSCALL(dup(STDIN_FILENO));
+  return MACB_SYSCALL(open(path,O_RDONLY));
+}
+
+// Full read from the current position, for pipes where pread doesn't work.
+static int macb_file_read_exactly(int fd,void *dst,int dstc) {
+  int dstp=0;
+  while (dstp<dstc) {
+    ssize_t err=MACB_SYSCALL(read(fd,(char*)dst+dstp,dstc-dstp));
+    if (err<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    if (!err) return -1;
+    dstp+=err;
+  }
+  return 0;
+}
+ 
+int64_t macb_file_read_header_fd(void *dst_128b,int fd) {
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  ssize_t err=MACB_SYSCALL(pread(fd,dst_128b,128,0));
+  if ((err<0)&&(errno==ESPIPE)) {
+    // Pipe: Read it sequentially, and the position is now at the end of the header.
+    if (macb_file_read_exactly(fd,dst_128b,128)<0) return -1;
+    macb_stats_end(&mark,MACB_STATS_HEADER,128);
+    return 0;
+  }
+  if (err!=128) return -1;
+  struct stat st={0};
+  int64_t flen=0;
+  // Not seekable: Indicate "got header but not length".
+  if ((MACB_SYSCALL(fstat(fd,&st))>=0)&&S_ISREG(st.st_mode)) flen=st.st_size;
+  macb_stats_end(&mark,MACB_STATS_HEADER,128);
+  return flen;
+}
+ 
+int macb_file_at_eof(int fd,int64_t p) {
+  uint8_t extra;
+  while (1) {
+    ssize_t err=MACB_SYSCALL(pread(fd,&extra,1,p));
+    if ((err<0)&&(errno==ESPIPE)) err=MACB_SYSCALL(read(fd,&extra,1));
+    if (err<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    return err?0:1;
+  }
+}
+
+int64_t macb_file_read_header(void *dst_128b,const char *path) {
+  int fd=macb_file_openr(path);
+  if (fd<0) return -1;
+  int64_t flen=macb_file_read_header_fd(dst_128b,fd);
+  MACB_SYSCALL(close(fd));
   return flen;
 }
 
@@ -91,49 +385,354 @@ int macb_file_read_header(void *dst_128b,const char *path) {
  */
  
 int macb_file_openw(const char *path) {
-  return open(path,O_WRONLY|O_CREAT|O_TRUNC,0666);
+  if (MACB_PATH_IS_STDIO(path)) return MACB_SYSCALL(dup(STDOUT_FILENO));
+  return MACB_SYSCALL(open(path,O_WRONLY|O_CREAT|O_TRUNC,0666));
 }
 
+int macb_file_openrw(const char *path) {
+  return MACB_SYSCALL(open(path,O_RDWR));
+}
+
+int64_t macb_file_tell_if_seekable(int fd) {
+  struct stat st={0};
+  if ((MACB_SYSCALL(fstat(fd,&st))<0)||!S_ISREG(st.st_mode)) return -1;
+  int flags=MACB_SYSCALL(fcntl(fd,F_GETFL));
+  if ((flags<0)||(flags&O_APPEND)) return -1; // pwrite would append.
+  off_t p=MACB_SYSCALL(lseek(fd,0,SEEK_CUR));
+  if (p<0) return -1;
+  return p;
+}
+
+const uint8_t macb_zero_page[MACB_ZERO_PAGE_SIZE]={0};
+
 int macb_file_append(int fd,const void *src,int srcc) {
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  int err=macb_file_append_unrecorded(fd,src,srcc);
+  if (err>=0) macb_stats_end(&mark,MACB_STATS_FORK_WRITE,srcc);
+  return err;
+}
+
+static int macb_file_append_unrecorded(int fd,const void *src,int srcc) {
   if ((fd<0)||(srcc<0)) return -1;
-  void *freeme=0;
-  if (!src) {
-    if (!(freeme=calloc(1,srcc))) return -1;
-    src=freeme;
-  }
   int srcp=0;
   while (srcp<srcc) {
-    int err=write(fd,(char*)src+srcp,srcc-srcp);
-    if (err<=0) {
-      if (freeme) free(freeme);
+    int cpc=srcc-srcp;
+    if (!src&&(cpc>MACB_ZERO_PAGE_SIZE)) cpc=MACB_ZERO_PAGE_SIZE;
+    int err=MACB_SYSCALL(write(fd,src?((char*)src+srcp):(const char*)macb_zero_page,cpc));
+    if (err<0) {
+      if (errno==EINTR) continue;
       return -1;
     }
+    if (!err) return -1;
     srcp+=err;
   }
-  if (freeme) free(freeme);
   return srcc;
 }
 
+int macb_file_writev_at(int fd,struct iovec *iov,int iovc,int64_t p) {
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  int64_t total=0;
+  while (iovc>0) {
+    int c=(iovc>IOV_MAX)?IOV_MAX:iovc;
+    ssize_t err=MACB_SYSCALL((p<0)?writev(fd,iov,c):pwritev(fd,iov,c,p));
+    if (err<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    if (!err) return -1;
+    if (p>=0) p+=err;
+    total+=err;
+    // Short write: Skip what's done, and go again from the middle of the vector.
+    while (iovc&&(err>=iov->iov_len)) {
+      err-=iov->iov_len;
+      iov++;
+      iovc--;
+    }
+    if (iovc) {
+      iov->iov_base=(char*)iov->iov_base+err;
+      iov->iov_len-=err;
+    }
+  }
+  macb_stats_end(&mark,MACB_STATS_FORK_WRITE,total);
+  return 0;
+}
+
 int macb_file_close(int fd) {
-  if (fd>=0) return close(fd);
+  if (fd<0) return 0;
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  int err=MACB_SYSCALL(close(fd));
+  macb_stats_end(&mark,MACB_STATS_SYNC,0);
+  return err;
+}
+
+/* Atomic output.
+ */
+
+static char *macb_output_tmppath(const char *path) {
+  static int seq=0;
+  int pathc=strlen(path);
+  char *tmppath=malloc(pathc+64);
+  if (!tmppath) return 0;
+  int slashp=pathc;
+  while (slashp&&(path[slashp-1]!='/')) slashp--;
+  snprintf(tmppath,pathc+64,"%.*s.%s.macb-%d-%d",slashp,path,path+slashp,(int)getpid(),__atomic_fetch_add(&seq,1,__ATOMIC_RELAXED));
+  return tmppath;
+}
+
+// O_TMPFILE files are published through /proc/self/fd. Without /proc (chroots, minimal containers), use temp names.
+static int macb_output_have_proc() {
+  static int have=0; // 0 unknown, 1 yes, -1 no.
+  int v=__atomic_load_n(&have,__ATOMIC_RELAXED);
+  if (!v) {
+    v=MACB_SYSCALL(access("/proc/self/fd",X_OK))?-1:1;
+    __atomic_store_n(&have,v,__ATOMIC_RELAXED);
+  }
+  return (v>0);
+}
+
+int macb_output_open(struct macb_output *output,const char *path,int64_t size) {
+  memset(output,0,sizeof(struct macb_output));
+  output->fd=-1;
+  output->path=path;
+  if (MACB_PATH_IS_STDIO(path)) {
+    output->fd=MACB_SYSCALL(dup(STDOUT_FILENO));
+    return (output->fd<0)?-1:0;
+  }
+
+  // Publish at a symlink's target, not over the link itself. A dangling link gets written through, as before.
+  struct stat st;
+  if (!MACB_SYSCALL(lstat(path,&st))&&S_ISLNK(st.st_mode)) {
+    if (!(output->ownpath=realpath(path,0))) {
+      output->fd=MACB_SYSCALL(open(path,O_WRONLY|O_CREAT|O_TRUNC,0666));
+      return (output->fd<0)?-1:0;
+    }
+    output->path=path=output->ownpath;
+  }
+  int exists=!MACB_SYSCALL(stat(path,&st));
+  if (exists&&!S_ISREG(st.st_mode)) {
+    output->fd=MACB_SYSCALL(open(path,O_WRONLY|O_TRUNC));
+    if (output->fd<0) {
+      macb_output_abort(output);
+      return -1;
+    }
+    return 0;
+  }
+
+  #if defined(O_TMPFILE)
+  if (macb_output_have_proc()) {
+    int pathc=strlen(path),slashp=pathc;
+    while (slashp&&(path[slashp-1]!='/')) slashp--;
+    char *dir=malloc(slashp+2);
+    if (!dir) {
+      macb_output_abort(output);
+      return -1;
+    }
+    if (slashp) memcpy(dir,path,slashp);
+    else dir[slashp++]='.';
+    dir[slashp]=0;
+    output->fd=MACB_SYSCALL(open(dir,O_WRONLY|O_TMPFILE,0666));
+    free(dir);
+    if (output->fd>=0) output->mode=MACB_OUTPUT_TMPFILE;
+  }
+  #endif
+  if (output->fd<0) {
+    int i=0; for (;i<16;i++) {
+      if (!(output->tmppath=macb_output_tmppath(path))) break;
+      if ((output->fd=MACB_SYSCALL(open(output->tmppath,O_WRONLY|O_CREAT|O_EXCL,0666)))>=0) break;
+      free(output->tmppath);
+      output->tmppath=0;
+      if (errno!=EEXIST) break;
+    }
+    if (output->fd<0) {
+      macb_output_abort(output);
+      return -1;
+    }
+    output->mode=MACB_OUTPUT_NAMED;
+  }
+
+  // Replacing a file must not widen its permissions. Owner first: fchown clears setuid bits.
+  // Only root can give a file away, so a failed fchown leaves it ours, and that's fine.
+  if (exists) {
+    if ((st.st_uid!=getuid())||(st.st_gid!=getgid())) MACB_SYSCALL(fchown(output->fd,st.st_uid,st.st_gid));
+    if (MACB_SYSCALL(fchmod(output->fd,st.st_mode&07777))<0) {
+      macb_output_abort(output);
+      return -1;
+    }
+  }
+
+  // Reserve it all in one extent if the filesystem can. Failing only matters if the disk is actually full.
+  #if MACB_USE_KERNEL_COPY
+    if ((size>0)&&(MACB_SYSCALL(fallocate(output->fd,0,0,size))<0)&&((errno==ENOSPC)||(errno==EDQUOT))) {
+      macb_output_abort(output);
+      return -1;
+    }
+  #endif
   return 0;
 }
 
-/* Stat.
+int macb_output_commit(struct macb_output *output) {
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  int result=macb_output_commit_unrecorded(output);
+  macb_stats_end(&mark,MACB_STATS_SYNC,0);
+  return result;
+}
+
+static int macb_output_commit_unrecorded(struct macb_output *output) {
+  int fd=output->fd,result=0;
+  output->fd=-1;
+  if (output->mode==MACB_OUTPUT_DIRECT) {
+    if (output->ownpath) free(output->ownpath);
+    output->ownpath=0;
+    return (MACB_SYSCALL(close(fd))<0)?-1:0;
+  }
+
+  // Data first, then the name: After a crash, (path) is either the old file or all of the new one.
+  if (MACB_SYSCALL(fdatasync(fd))<0) result=-1;
+
+  #if defined(O_TMPFILE)
+  if (!result&&(output->mode==MACB_OUTPUT_TMPFILE)) {
+    // linkat can't replace, so link to a temp name and rename that over (path).
+    char procpath[64];
+    snprintf(procpath,sizeof(procpath),"/proc/self/fd/%d",fd);
+    result=-1;
+    int i=0; for (;i<16;i++) {
+      if (!(output->tmppath=macb_output_tmppath(output->path))) break;
+      if (!MACB_SYSCALL(linkat(AT_FDCWD,procpath,AT_FDCWD,output->tmppath,AT_SYMLINK_FOLLOW))) {
+        result=0;
+        break;
+      }
+      // /proc went away since open. AT_EMPTY_PATH does the same without it, if we're privileged enough.
+      if ((errno==ENOENT)&&!MACB_SYSCALL(linkat(fd,"",AT_FDCWD,output->tmppath,AT_EMPTY_PATH))) {
+        result=0;
+        break;
+      }
+      free(output->tmppath);
+      output->tmppath=0;
+      if (errno!=EEXIST) break;
+    }
+  }
+  #endif
+
+  if (MACB_SYSCALL(close(fd))<0) result=-1;
+  if (!result&&(MACB_SYSCALL(rename(output->tmppath,output->path))<0)) result=-1;
+  if (result&&output->tmppath) MACB_SYSCALL(unlink(output->tmppath));
+  if (output->tmppath) free(output->tmppath);
+  output->tmppath=0;
+  if (output->ownpath) free(output->ownpath);
+  output->ownpath=0;
+  return result;
+}
+
+void macb_output_abort(struct macb_output *output) {
+  if (output->fd>=0) MACB_SYSCALL(close(output->fd));
+  output->fd=-1;
+  if (output->tmppath) {
+    MACB_SYSCALL(unlink(output->tmppath));
+    free(output->tmppath);
+    output->tmppath=0;
+  }
+  if (output->ownpath) free(output->ownpath);
+  output->ownpath=0;
+}
+
+int macb_output_link(const char *path,const char *srcpath) {
+  if (MACB_PATH_IS_STDIO(path)) return -1;
+  struct stat st;
+  char *ownpath=0;
+  if (!MACB_SYSCALL(lstat(path,&st))) {
+    if (S_ISLNK(st.st_mode)) {
+      if (!(ownpath=realpath(path,0))) return -1;
+      path=ownpath;
+      if (MACB_SYSCALL(stat(path,&st))) st.st_mode=S_IFREG;
+    }
+    if (!S_ISREG(st.st_mode)) {
+      if (ownpath) free(ownpath);
+      return -1;
+    }
+  }
+  int result=-1,i=0;
+  for (;i<16;i++) {
+    char *tmppath=macb_output_tmppath(path);
+    if (!tmppath) break;
+    if (!MACB_SYSCALL(link(srcpath,tmppath))) {
+      if (!MACB_SYSCALL(rename(tmppath,path))) result=0;
+      else MACB_SYSCALL(unlink(tmppath));
+      free(tmppath);
+      break;
+    }
+    free(tmppath);
+    if (errno!=EEXIST) break;
+  }
+  if (ownpath) free(ownpath);
+  return result;
+}
+
+/* Open input.
  */
  
-uint32_t macb_stat_ctime(const char *path) {
+int macb_input_open(struct macb_input *input,const char *path) {
+  memset(input,0,sizeof(struct macb_input));
+  input->fd=-1;
   if (!path||!path[0]) return 0;
+  if ((input->fd=macb_file_openr(path))<0) return -1;
   struct stat st={0};
-  stat(path,&st);
-  if (!st.st_ctime) return 0;
-  return st.st_ctime+UNIX_EPOCH_IN_MAC_TIME;
+  if (MACB_SYSCALL(fstat(input->fd,&st))<0) {
+    macb_input_close(input);
+    return -1;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    macb_input_close(input);
+    return -1;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    // Pipe, FIFO, device... Length unknown until we've read it all, and its timestamps mean nothing.
+    input->len=-1;
+    return 0;
+  }
+  input->len=st.st_size;
+  if (st.st_ctime) input->ctime=st.st_ctime+UNIX_EPOCH_IN_MAC_TIME;
+  if (st.st_mtime) input->mtime=st.st_mtime+UNIX_EPOCH_IN_MAC_TIME;
+  return 0;
 }
 
-uint32_t macb_stat_mtime(const char *path) {
-  if (!path||!path[0]) return 0;
-  struct stat st={0};
-  stat(path,&st);
-  if (!st.st_mtime) return 0;
-  return st.st_mtime+UNIX_EPOCH_IN_MAC_TIME;
+/* Copy a stream input to an anonymous temporary file, and switch to reading that.
+ */
+ 
+int macb_file_open_tmp() {
+  const char *dir=getenv("TMPDIR");
+  if (!dir||!dir[0]) dir="/tmp";
+  int fd;
+  #if defined(O_TMPFILE)
+    if ((fd=MACB_SYSCALL(open(dir,O_RDWR|O_TMPFILE|O_EXCL,0600)))>=0) return fd;
+  #endif
+  char path[1024];
+  if (snprintf(path,sizeof(path),"%s/macb-XXXXXX",dir)>=(int)sizeof(path)) return -1;
+  fd=MACB_SYSCALL(mkstemp(path));
+  if (fd<0) return -1;
+  MACB_SYSCALL(unlink(path));
+  return fd;
+}
+ 
+int macb_input_spool(struct macb_input *input) {
+  if ((input->fd<0)||(input->len>=0)) return 0;
+  int fd=macb_file_open_tmp();
+  if (fd<0) return -1;
+  int64_t len=macb_file_copy_to_eof(fd,input->fd);
+  if (len<0) {
+    MACB_SYSCALL(close(fd));
+    return -1;
+  }
+  MACB_SYSCALL(close(input->fd));
+  input->fd=fd;
+  input->len=len;
+  return 0;
+}
+
+void macb_input_close(struct macb_input *input) {
+  if (input->fd>=0) MACB_SYSCALL(close(input->fd));
+  input->fd=-1;
 }
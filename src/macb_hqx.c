@@ -0,0 +1,609 @@
+#include "macb.h"
+#include <unistd.h>
+#include <errno.h>
+
+/* BinHex 4.0.
+ *
+ * Text: Optional "(This file must be converted with BinHex 4.0)", then ':' at the start of a line,
+ * 64-column lines of 6-bit characters from a 64-character alphabet, and a closing ':'.
+ * Under that, RLE90: 0x90 N means the previous byte repeated to N copies in total, and 0x90 0x00 is a literal 0x90.
+ * Under that, the file:
+ *   1 name length
+ *   n name
+ *   1 version, zero
+ *   4 type
+ *   4 creator
+ *   2 Finder flags
+ *   4 data length
+ *   4 resource length
+ *   2 CRC of all the above
+ *   n data fork
+ *   2 CRC of data fork
+ *   n resource fork
+ *   2 CRC of resource fork
+ * CRCs are crc_binh over the section followed by two zero bytes; macb_crc_binh gives the same result faster.
+ * There are no dates, comment, location, or protected bit. Extracting to BinHex loses those, and
+ * creating from BinHex takes dates from the .hqx file, same as creating from plain forks.
+ *
+ * Everything streams: Memory is a few fixed buffers no matter how big the forks are.
+ */
+
+#define MACB_HQX_LINE_LENGTH 64
+#define MACB_HQX_BUFFER_SIZE 65536
+#define MACB_HQX_RLE_MARKER 0x90
+#define MACB_HQX_RUN_LIMIT 255
+
+static const char macb_hqx_alphabet[64]=
+  "!\"#$%&'()*+,-012345689@ABCDEFGHIJKLMNPQRSTUVXYZ[`abcdefhijklmpqr";
+
+// Decode table: 0..63 for alphabet characters, or one of these.
+#define MACB_HQX_CH_INVALID 0xff
+#define MACB_HQX_CH_SPACE   0xfe
+#define MACB_HQX_CH_COLON   0xfd
+
+static uint8_t macb_hqx_decode_table[256];
+
+static void __attribute__((constructor)) macb_hqx_init() {
+  memset(macb_hqx_decode_table,MACB_HQX_CH_INVALID,sizeof(macb_hqx_decode_table));
+  int i=0; for (;i<64;i++) macb_hqx_decode_table[(uint8_t)macb_hqx_alphabet[i]]=i;
+  macb_hqx_decode_table[' ']=MACB_HQX_CH_SPACE;
+  macb_hqx_decode_table['\t']=MACB_HQX_CH_SPACE;
+  macb_hqx_decode_table['\r']=MACB_HQX_CH_SPACE;
+  macb_hqx_decode_table['\n']=MACB_HQX_CH_SPACE;
+  macb_hqx_decode_table[':']=MACB_HQX_CH_COLON;
+}
+
+static uint16_t macb_hqx_crc_final(uint16_t crc) {
+  static const uint8_t zeroes[2]={0};
+  return macb_crc_binh(zeroes,2,crc);
+}
+
+/* Writer: Bytes in, RLE90, 6-bit, lines, fd.
+ * RLE output collects in (rlev) and gets encoded three bytes at a time when it fills.
+ */
+
+struct macb_hqx_writer {
+  int fd;
+  uint16_t crc;
+  uint8_t runb; int runc; // Run in progress, not yet in (rlev).
+  uint8_t rlev[3*4096]; int rlec;
+  char textv[MACB_HQX_BUFFER_SIZE]; int textc;
+  int col;
+};
+
+static int macb_hqx_writer_flush_text(struct macb_hqx_writer *writer) {
+  if (macb_file_append(writer->fd,writer->textv,writer->textc)<0) return -1;
+  writer->textc=0;
+  return 0;
+}
+
+static int macb_hqx_writer_char(struct macb_hqx_writer *writer,char ch) {
+  if (writer->textc>=MACB_HQX_BUFFER_SIZE-1) {
+    if (macb_hqx_writer_flush_text(writer)<0) return -1;
+  }
+  writer->textv[writer->textc++]=ch;
+  if (++(writer->col)>=MACB_HQX_LINE_LENGTH) {
+    writer->textv[writer->textc++]='\n';
+    writer->col=0;
+  }
+  return 0;
+}
+
+/* Encode whole groups of three from (rlev), keeping any remainder at the front.
+ * With (final), the remainder goes out too, as two or three characters.
+ */
+static int macb_hqx_writer_encode(struct macb_hqx_writer *writer,int final) {
+  const uint8_t *src=writer->rlev;
+  int srcc=writer->rlec;
+  for (;srcc>=3;src+=3,srcc-=3) {
+    uint32_t v=(src[0]<<16)|(src[1]<<8)|src[2];
+    // Usually room for the whole group and its line break; the careful path otherwise.
+    if ((writer->col<=MACB_HQX_LINE_LENGTH-4)&&(writer->textc<=MACB_HQX_BUFFER_SIZE-5)) {
+      char *dst=writer->textv+writer->textc;
+      dst[0]=macb_hqx_alphabet[v>>18];
+      dst[1]=macb_hqx_alphabet[(v>>12)&0x3f];
+      dst[2]=macb_hqx_alphabet[(v>>6)&0x3f];
+      dst[3]=macb_hqx_alphabet[v&0x3f];
+      writer->textc+=4;
+      if ((writer->col+=4)>=MACB_HQX_LINE_LENGTH) {
+        writer->textv[writer->textc++]='\n';
+        writer->col=0;
+      }
+    } else {
+      if (macb_hqx_writer_char(writer,macb_hqx_alphabet[v>>18])<0) return -1;
+      if (macb_hqx_writer_char(writer,macb_hqx_alphabet[(v>>12)&0x3f])<0) return -1;
+      if (macb_hqx_writer_char(writer,macb_hqx_alphabet[(v>>6)&0x3f])<0) return -1;
+      if (macb_hqx_writer_char(writer,macb_hqx_alphabet[v&0x3f])<0) return -1;
+    }
+  }
+  if (final&&srcc) {
+    uint32_t v=(src[0]<<16)|((srcc>1)?(src[1]<<8):0);
+    if (macb_hqx_writer_char(writer,macb_hqx_alphabet[v>>18])<0) return -1;
+    if (macb_hqx_writer_char(writer,macb_hqx_alphabet[(v>>12)&0x3f])<0) return -1;
+    if ((srcc>1)&&(macb_hqx_writer_char(writer,macb_hqx_alphabet[(v>>6)&0x3f])<0)) return -1;
+    srcc=0;
+  }
+  memmove(writer->rlev,src,srcc);
+  writer->rlec=srcc;
+  return 0;
+}
+
+static int macb_hqx_writer_rle_byte(struct macb_hqx_writer *writer,uint8_t b) {
+  if (writer->rlec>=sizeof(writer->rlev)) {
+    if (macb_hqx_writer_encode(writer,0)<0) return -1;
+  }
+  writer->rlev[writer->rlec++]=b;
+  return 0;
+}
+
+// Emit the pending run: One or two copies literally, three or more as "B 0x90 N".
+static int macb_hqx_writer_end_run(struct macb_hqx_writer *writer) {
+  if (!writer->runc) return 0;
+  int literalc=(writer->runc>=3)?1:writer->runc;
+  while (literalc-->0) {
+    if (macb_hqx_writer_rle_byte(writer,writer->runb)<0) return -1;
+    if ((writer->runb==MACB_HQX_RLE_MARKER)&&(macb_hqx_writer_rle_byte(writer,0)<0)) return -1;
+  }
+  if (writer->runc>=3) {
+    if (macb_hqx_writer_rle_byte(writer,MACB_HQX_RLE_MARKER)<0) return -1;
+    if (macb_hqx_writer_rle_byte(writer,writer->runc)<0) return -1;
+  }
+  writer->runc=0;
+  return 0;
+}
+
+static int macb_hqx_writer_rle(struct macb_hqx_writer *writer,const uint8_t *src,int srcc) {
+  while (srcc>0) {
+    if (writer->runc) {
+      while (srcc&&(*src==writer->runb)&&(writer->runc<MACB_HQX_RUN_LIMIT)) {
+        writer->runc++;
+        src++;
+        srcc--;
+      }
+      if (!srcc) break;
+      if (macb_hqx_writer_end_run(writer)<0) return -1;
+    }
+    // Bytes that don't start a run and aren't the marker go straight across, the common case for real data.
+    if (writer->rlec>=sizeof(writer->rlev)) {
+      if (macb_hqx_writer_encode(writer,0)<0) return -1;
+    }
+    int litc=sizeof(writer->rlev)-writer->rlec;
+    if (litc>srcc-1) litc=srcc-1;
+    uint8_t *dst=writer->rlev+writer->rlec;
+    int i=0;
+    for (;(i<litc)&&(src[i]!=src[i+1])&&(src[i]!=MACB_HQX_RLE_MARKER);i++) dst[i]=src[i];
+    writer->rlec+=i;
+    src+=i;
+    srcc-=i;
+    if (i<litc) {
+      writer->runb=*src;
+      writer->runc=1;
+      src++;
+      srcc--;
+    } else if (srcc==1) {
+      // Last byte of the chunk: Hold it, the next chunk might continue it.
+      writer->runb=*src;
+      writer->runc=1;
+      srcc=0;
+    }
+  }
+  return 0;
+}
+
+static int macb_hqx_put(struct macb_hqx_writer *writer,const void *src,int srcc) {
+  writer->crc=macb_crc_binh(src,srcc,writer->crc);
+  return macb_hqx_writer_rle(writer,src,srcc);
+}
+
+static int macb_hqx_put_crc(struct macb_hqx_writer *writer) {
+  uint16_t crc=macb_hqx_crc_final(writer->crc);
+  uint8_t tmp[2]={crc>>8,crc};
+  writer->crc=0;
+  return macb_hqx_writer_rle(writer,tmp,2);
+}
+
+static int macb_hqx_writer_begin(struct macb_hqx_writer *writer) {
+  static const char intro[]="(This file must be converted with BinHex 4.0)\n\n:";
+  memcpy(writer->textv,intro,sizeof(intro)-1);
+  writer->textc=sizeof(intro)-1;
+  writer->col=1;
+  return 0;
+}
+
+static int macb_hqx_writer_end(struct macb_hqx_writer *writer) {
+  if (macb_hqx_writer_end_run(writer)<0) return -1;
+  if (macb_hqx_writer_encode(writer,1)<0) return -1;
+  if (writer->textc>=MACB_HQX_BUFFER_SIZE-2) {
+    if (macb_hqx_writer_flush_text(writer)<0) return -1;
+  }
+  writer->textv[writer->textc++]=':';
+  writer->textv[writer->textc++]='\n';
+  return macb_hqx_writer_flush_text(writer);
+}
+
+/* Reader: fd, 6-bit, RLE90, bytes out.
+ * Each refill decodes one buffer of text into (rawv), before RLE, so the 6-bit loop runs over a lot at once.
+ */
+
+struct macb_hqx_reader {
+  int fd;
+  uint16_t crc;
+  int state; // 0 looking for the opening colon, 1 in the body, 2 after the closing colon.
+  int linestart; // While state 0.
+  uint32_t acc; int accc; // 6-bit accumulator and its bit count.
+  uint8_t rawv[(MACB_HQX_BUFFER_SIZE*3)/4+4]; int rawp,rawc;
+  uint8_t prev; // Last byte out of the RLE layer, for repeats.
+  int marker; // Saw 0x90, waiting for its count.
+  int repeatc; // Copies of (prev) still owed.
+  uint8_t textv[MACB_HQX_BUFFER_SIZE];
+  int64_t textp; // Total text consumed, for error messages.
+  const char *error; // Static string if decoding failed, for the caller's message.
+};
+
+static int macb_hqx_reader_refill(struct macb_hqx_reader *reader) {
+  reader->rawp=reader->rawc=0;
+  while (!reader->rawc) {
+    if (reader->state==2) return 0;
+    int textc=read(reader->fd,reader->textv,sizeof(reader->textv));
+    if (textc<0) {
+      if (errno==EINTR) continue;
+      reader->error="Read error";
+      return -1;
+    }
+    if (!textc) {
+      reader->error=reader->state?"Missing closing ':', file truncated":"No BinHex data found";
+      return -1;
+    }
+    const uint8_t *src=reader->textv;
+    int srcp=0;
+
+    if (!reader->state) {
+      for (;srcp<textc;srcp++) {
+        if ((src[srcp]==':')&&reader->linestart) { reader->state=1; srcp++; break; }
+        reader->linestart=((src[srcp]=='\n')||(src[srcp]=='\r'));
+      }
+    }
+
+    uint32_t acc=reader->acc;
+    int accc=reader->accc;
+    uint8_t *dst=reader->rawv;
+    for (;srcp<textc;srcp++) {
+      uint8_t v=macb_hqx_decode_table[src[srcp]];
+      if (v<64) {
+        acc=(acc<<6)|v;
+        if ((accc+=6)>=8) {
+          accc-=8;
+          *dst++=acc>>accc;
+        }
+      } else if (v==MACB_HQX_CH_SPACE) {
+      } else if (v==MACB_HQX_CH_COLON) {
+        reader->state=2;
+        break;
+      } else {
+        reader->textp+=srcp;
+        reader->error="Invalid character";
+        return -1;
+      }
+    }
+    reader->acc=acc;
+    reader->accc=accc;
+    reader->rawc=dst-reader->rawv;
+    reader->textp+=textc;
+  }
+  return 0;
+}
+
+/* Produce exactly (dstc) bytes from the RLE layer, or fail.
+ * Doesn't touch the CRC.
+ */
+static int macb_hqx_read_raw(struct macb_hqx_reader *reader,uint8_t *dst,int dstc) {
+  while (dstc>0) {
+    if (reader->repeatc) {
+      int c=(reader->repeatc<dstc)?reader->repeatc:dstc;
+      memset(dst,reader->prev,c);
+      dst+=c;
+      dstc-=c;
+      reader->repeatc-=c;
+      continue;
+    }
+    if (reader->rawp>=reader->rawc) {
+      if (macb_hqx_reader_refill(reader)<0) return -1;
+      if (reader->rawp>=reader->rawc) {
+        reader->error="Data ended early";
+        return -1;
+      }
+    }
+    const uint8_t *src=reader->rawv+reader->rawp;
+    int srcc=reader->rawc-reader->rawp;
+    if (reader->marker) {
+      reader->marker=0;
+      reader->rawp++;
+      if (!*src) {
+        *dst++=reader->prev=MACB_HQX_RLE_MARKER;
+        dstc--;
+      } else {
+        reader->repeatc=*src-1;
+      }
+      continue;
+    }
+    // Copy literals up to the next marker in one go.
+    int c=(srcc<dstc)?srcc:dstc;
+    const uint8_t *marker=memchr(src,MACB_HQX_RLE_MARKER,c);
+    if (marker==src) {
+      reader->marker=1;
+      reader->rawp++;
+      continue;
+    }
+    if (marker) c=marker-src;
+    memcpy(dst,src,c);
+    reader->prev=src[c-1];
+    dst+=c;
+    dstc-=c;
+    reader->rawp+=c;
+  }
+  return 0;
+}
+
+static int macb_hqx_get(struct macb_hqx_reader *reader,void *dst,int dstc) {
+  if (macb_hqx_read_raw(reader,dst,dstc)<0) return -1;
+  reader->crc=macb_crc_binh(dst,dstc,reader->crc);
+  return 0;
+}
+
+// Read the CRC following a section and compare. >0 if it matches.
+static int macb_hqx_check_crc(struct macb_hqx_reader *reader) {
+  uint8_t tmp[2];
+  if (macb_hqx_read_raw(reader,tmp,2)<0) return -1;
+  uint16_t expect=macb_hqx_crc_final(reader->crc);
+  reader->crc=0;
+  return (((tmp[0]<<8)|tmp[1])==expect)?1:0;
+}
+
+/* Paths.
+ * (dfpath) is the .hqx file, default "NAME.hqx" beside "NAME.bin". Or the archive is "NAME.bin" beside "NAME.hqx".
+ */
+
+static int macb_hqx_set_path(char **dst,int *dstc,const char *src,int srcc,const char *rmsfx,const char *addsfx) {
+  int rmc=strlen(rmsfx),addc=strlen(addsfx);
+  if ((srcc>=rmc)&&!memcmp(src+srcc-rmc,rmsfx,rmc)) srcc-=rmc;
+  char *path=malloc(srcc+addc+1);
+  if (!path) return -1;
+  memcpy(path,src,srcc);
+  memcpy(path+srcc,addsfx,addc+1);
+  if (*dst) free(*dst);
+  *dst=path;
+  *dstc=srcc+addc;
+  return 0;
+}
+
+static int macb_hqx_infer_paths(struct macb_request *request) {
+  if (!request->dfpathc) {
+    if (!request->arpathc||MACB_PATH_IS_STDIO(request->arpath)) {
+      fprintf(MACB_ERR(request),"'-d' required with '--as=hqx': the BinHex file.\n");
+      return -1;
+    }
+    return macb_hqx_set_path(&request->dfpath,&request->dfpathc,request->arpath,request->arpathc,".bin",".hqx");
+  }
+  if (!request->arpathc) {
+    if (MACB_PATH_IS_STDIO(request->dfpath)) {
+      fprintf(MACB_ERR(request),"Archive path required when the input is stdin.\n");
+      return -1;
+    }
+    return macb_hqx_set_path(&request->arpath,&request->arpathc,request->dfpath,request->dfpathc,".hqx",".bin");
+  }
+  return 0;
+}
+
+/* Extract: MacBinary to BinHex.
+ * We read the archive sequentially, so a pipe works too.
+ */
+
+static int macb_hqx_read_archive(int fd,void *dst,int dstc) {
+  uint8_t *DST=dst;
+  while (dstc>0) {
+    int err=read(fd,DST,dstc);
+    if (err<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    if (!err) return -1;
+    DST+=err;
+    dstc-=err;
+  }
+  return 0;
+}
+
+static int macb_hqx_encode_fork(struct macb_request *request,struct macb_hqx_writer *writer,int fd,int64_t *streamp,int64_t p,int64_t c,const char *what) {
+  uint8_t buf[MACB_HQX_BUFFER_SIZE];
+  if (macb_file_skip(fd,p-*streamp)<0) {
+    fprintf(MACB_ERR(request),"%s: Archive ended before %s fork.\n",request->arpath,what);
+    return -1;
+  }
+  *streamp=p+c;
+  while (c>0) {
+    int cpc=(c>(int64_t)sizeof(buf))?sizeof(buf):c;
+    if (macb_hqx_read_archive(fd,buf,cpc)<0) {
+      fprintf(MACB_ERR(request),"%s: Archive ended during %s fork.\n",request->arpath,what);
+      return -1;
+    }
+    if (macb_hqx_put(writer,buf,cpc)<0) return -1;
+    c-=cpc;
+  }
+  return macb_hqx_put_crc(writer);
+}
+
+int macb_main_hqx_extract(struct macb_request *request) {
+  int result=-1,fd=-1;
+  uint8_t hdr[128];
+  struct macb_hqx_writer *writer=0;
+  struct macb_output output={.fd=-1};
+
+  if (!request->arpathc) {
+    fprintf(MACB_ERR(request),"Archive path required with '-x'\n");
+    return -1;
+  }
+  if ((fd=macb_file_openr(request->arpath))<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open archive file.\n",request->arpath);
+    return -1;
+  }
+  int64_t flen=macb_file_read_header_fd(hdr,fd);
+  if (flen<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to read 128-byte header, this can't be MacBinary.\n",request->arpath);
+    goto _done_;
+  }
+  if (flen&&(lseek(fd,MACB_HEADER_SIZE,SEEK_SET)!=MACB_HEADER_SIZE)) goto _done_;
+  struct macb_header header;
+  struct macb_layout layout;
+  macb_header_decode(&header,hdr,128);
+  macb_layout_compute(&layout,&header);
+  if (macb_header_validate(hdr,flen?flen:-1)&MACB_FINDINGS_FATAL) {
+    fprintf(MACB_ERR(request),"%s:ERROR: Forks extend past the end of the %lld-byte archive.\n",request->arpath,(long long)flen);
+    goto _done_;
+  }
+  if (macb_hqx_infer_paths(request)<0) goto _done_;
+  if (!(writer=calloc(1,sizeof(struct macb_hqx_writer)))) goto _done_;
+  // Encoded length isn't known up front, so no preallocation. It still appears whole, see macb_output_open.
+  if (macb_output_open(&output,request->dfpath,-1)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open file for writing.\n",request->dfpath);
+    goto _done_;
+  }
+  writer->fd=output.fd;
+
+  uint8_t head[1+63+1+4+4+2+4+4];
+  int namec=(header.namec<=63)?header.namec:63;
+  int headc=0;
+  head[headc++]=namec;
+  memcpy(head+headc,hdr+0x02,namec); headc+=namec;
+  head[headc++]=0;
+  memcpy(head+headc,hdr+0x41,8); headc+=8; // type, creator
+  head[headc++]=header.flags_hi;
+  head[headc++]=header.flags_lo;
+  macb_wr32(head,headc,header.dflen); headc+=4;
+  macb_wr32(head,headc,header.rflen); headc+=4;
+
+  int64_t streamp=MACB_HEADER_SIZE;
+  if (macb_hqx_writer_begin(writer)<0) goto _done_;
+  if (macb_hqx_put(writer,head,headc)<0) goto _done_;
+  if (macb_hqx_put_crc(writer)<0) goto _done_;
+  if (macb_hqx_encode_fork(request,writer,fd,&streamp,layout.dfp,layout.dflen,"data")<0) goto _done_;
+  if (macb_hqx_encode_fork(request,writer,fd,&streamp,layout.rfp,layout.rflen,"resource")<0) goto _done_;
+  if ((macb_hqx_writer_end(writer)<0)||(macb_output_commit(&output)<0)) {
+    fprintf(MACB_ERR(request),"%s: Failed to write BinHex file.\n",request->dfpath);
+    goto _done_;
+  }
+  fprintf(MACB_OUT(request),"%s: Wrote BinHex, %lld + %lld bytes of forks.\n",request->dfpath,(long long)layout.dflen,(long long)layout.rflen);
+  result=0;
+
+ _done_:
+  if (writer) free(writer);
+  macb_output_abort(&output);
+  macb_file_close(fd);
+  return result;
+}
+
+/* Create: BinHex to MacBinary.
+ * The BinHex header comes first and has both fork lengths, so the MacBinary header can go out before any fork.
+ */
+
+static int macb_hqx_decode_fork(struct macb_request *request,struct macb_hqx_reader *reader,int fd,int64_t c,const char *what) {
+  uint8_t buf[MACB_HQX_BUFFER_SIZE];
+  int64_t remaining=c;
+  while (remaining>0) {
+    int cpc=(remaining>(int64_t)sizeof(buf))?sizeof(buf):remaining;
+    if (macb_hqx_get(reader,buf,cpc)<0) {
+      fprintf(MACB_ERR(request),"%s: %s in %s fork, around offset %lld.\n",request->dfpath,reader->error,what,(long long)reader->textp);
+      return -1;
+    }
+    if (macb_file_append(fd,buf,cpc)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to write.\n",request->arpath);
+      return -1;
+    }
+    remaining-=cpc;
+  }
+  int err=macb_hqx_check_crc(reader);
+  if (err<0) {
+    fprintf(MACB_ERR(request),"%s: %s at %s fork CRC.\n",request->dfpath,reader->error,what);
+    return -1;
+  }
+  if (!err) {
+    fprintf(MACB_ERR(request),"%s:ERROR: %s fork CRC mismatch.\n",request->dfpath,what);
+    return -1;
+  }
+  if (c&127) {
+    if (macb_file_append(fd,0,128-(c&127))<0) return -1;
+  }
+  return 0;
+}
+
+int macb_main_hqx_create(struct macb_request *request) {
+  int result=-1,fd=-1;
+  struct macb_input src={.fd=-1};
+  struct macb_output output={.fd=-1};
+  struct macb_hqx_reader *reader=0;
+  uint8_t hdr[128],head[64];
+
+  if (macb_hqx_infer_paths(request)<0) return -1;
+  if (macb_input_open(&src,request->dfpath)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open BinHex file.\n",request->dfpath);
+    return -1;
+  }
+  if (!(reader=calloc(1,sizeof(struct macb_hqx_reader)))) goto _done_;
+  reader->fd=src.fd;
+  reader->linestart=1;
+
+  if (macb_hqx_get(reader,head,1)<0) {
+    fprintf(MACB_ERR(request),"%s: %s, around offset %lld.\n",request->dfpath,reader->error,(long long)reader->textp);
+    goto _done_;
+  }
+  int namec=head[0];
+  if ((namec<1)||(namec>63)) {
+    fprintf(MACB_ERR(request),"%s: Invalid name length %d.\n",request->dfpath,namec);
+    goto _done_;
+  }
+  // name, version, type, creator, flags, data length, resource length
+  if (macb_hqx_get(reader,head+1,namec+1+4+4+2+4+4)<0) {
+    fprintf(MACB_ERR(request),"%s: %s in header.\n",request->dfpath,reader->error);
+    goto _done_;
+  }
+  int err=macb_hqx_check_crc(reader);
+  if (err<=0) {
+    fprintf(MACB_ERR(request),"%s:ERROR: %s.\n",request->dfpath,(err<0)?reader->error:"Header CRC mismatch");
+    goto _done_;
+  }
+  const uint8_t *info=head+1+namec+1;
+  int64_t dflen=macb_rd32(info,10);
+  int64_t rflen=macb_rd32(info,14);
+
+  macb_initialize_header(hdr,request);
+  hdr[0x01]=namec;
+  memset(hdr+0x02,0,63);
+  memcpy(hdr+0x02,head+1,namec);
+  memcpy(hdr+0x41,info,8); // type, creator
+  hdr[0x49]=info[8];
+  hdr[0x65]=info[9];
+  struct macb_input dfin={.fd=-1,.len=dflen,.ctime=src.ctime,.mtime=src.mtime};
+  struct macb_input rfin={.fd=-1,.len=rflen};
+  if (macb_finish_header(hdr,request,&dfin,&rfin)<0) goto _done_;
+
+  // The header is sealed before we've seen the forks, so a bad fork must not leave it behind: Nothing appears at
+  // (arpath) until every CRC has checked out.
+  if (macb_output_open(&output,request->arpath,128+((dflen+127)&~127ll)+((rflen+127)&~127ll))<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open file for writing.\n",request->arpath);
+    goto _done_;
+  }
+  fd=output.fd;
+  if (macb_file_append(fd,hdr,128)<0) goto _done_;
+  if (macb_hqx_decode_fork(request,reader,fd,dflen,"data")<0) goto _done_;
+  if (macb_hqx_decode_fork(request,reader,fd,rflen,"resource")<0) goto _done_;
+  if (macb_output_commit(&output)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to write archive.\n",request->arpath);
+    goto _done_;
+  }
+  result=0;
+
+ _done_:
+  if (reader) free(reader);
+  macb_output_abort(&output);
+  macb_input_close(&src);
+  return result;
+}
@@ -2,85 +2,223 @@
 #include <time.h>
 
 /* Create.
+ * Forks of known length stream from their files in one pass.
+ * Pipes and FIFOs, we don't know their length until we've read them. If the output is seekable,
+ * we copy them straight in and rewrite the header at the end. Otherwise we have to spool them first.
+ * With '--digest', forks are hashed on their way into the archive, and (digest) receives the result.
+ * Small archives are read into memory and go out in one gather write instead, padding from the shared zero page.
+ * The archive is built nameless, and only appears at (arpath), all at once, when it's complete. See macb_output_open.
+ * With '--cache', we stat everything first, and if nothing changed since the last create, that's it.
  */
  
+static int macb_create_copy_fork(struct macb_request *request,int fd,struct macb_input *input,const char *path,const char *what,char *digest) {
+  struct macb_digest d;
+  if (digest) macb_digest_init(&d,request->digest);
+  if (input->len<0) {
+    if ((input->len=digest?macb_digest_copy_to_eof(&d,fd,input->fd):macb_file_copy_to_eof(fd,input->fd))<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to copy %s fork.\n",path,what);
+      return -1;
+    }
+    if (input->len>MACB_FORK_LIMIT) {
+      fprintf(MACB_ERR(request),"%s: %s fork of %lld bytes exceeds MacBinary's limit of %lld.\n",path,what,(long long)input->len,MACB_FORK_LIMIT);
+      return -1;
+    }
+  } else if ((digest?macb_digest_copy(&d,fd,input->fd,0,input->len):macb_file_copy(fd,input->fd,0,input->len))<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to copy %lld-byte %s fork.\n",path,(long long)input->len,what);
+    return -1;
+  }
+  if (digest) macb_digest_final(digest,&d);
+  if (input->len&127) {
+    if (macb_file_append(fd,0,128-(input->len&127))<0) return -1;
+  }
+  return 0;
+}
+ 
+#define MACB_CREATE_GATHER_LIMIT 65536
+
+static int macb_create_gather(
+  struct macb_request *request,int fd,const uint8_t *fi,
+  struct macb_input *df,struct macb_input *rf,char *dfdigest,char *rfdigest
+) {
+  uint8_t buf[MACB_CREATE_GATHER_LIMIT];
+  struct iovec iov[5];
+  int iovc=0,bufp=0,i;
+  iov[iovc++]=(struct iovec){.iov_base=(void*)fi,.iov_len=128};
+  struct macb_input *inputv[2]={df,rf};
+  char *digestv[2]={dfdigest,rfdigest};
+  const char *pathv[2]={request->dfpath,request->rfpath};
+  const char *whatv[2]={"data","resource"};
+  for (i=0;i<2;i++) {
+    int len=inputv[i]->len;
+    if (len&&(macb_file_read_at(inputv[i]->fd,buf+bufp,len,0)<0)) {
+      fprintf(MACB_ERR(request),"%s: Failed to read %d-byte %s fork.\n",pathv[i],len,whatv[i]);
+      return -1;
+    }
+    if (digestv[i]) {
+      struct macb_digest d;
+      macb_digest_init(&d,request->digest);
+      macb_digest_update(&d,buf+bufp,len);
+      macb_digest_final(digestv[i],&d);
+    }
+    if (len) iov[iovc++]=(struct iovec){.iov_base=buf+bufp,.iov_len=len};
+    if (len&127) iov[iovc++]=(struct iovec){.iov_base=(void*)macb_zero_page,.iov_len=128-(len&127)};
+    bufp+=len;
+  }
+  if (macb_file_writev_at(fd,iov,iovc,-1)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to write archive.\n",request->arpath);
+    return -1;
+  }
+  return 0;
+}
+ 
 static int macb_main_create(struct macb_request *request) {
   int result=0,fd=-1;
+  struct macb_output output={.fd=-1};
+  struct macb_input df={.fd=-1},rf={.fd=-1};
+  uint8_t fi[128];
+  char dfdigest[MACB_DIGEST_SIZE],rfdigest[MACB_DIGEST_SIZE];
+  char fingerprint[MACB_CACHE_LINE_SIZE];
   #define FAIL { result=-1; goto _done_; }
   
   // Set defaults.
   if (macb_request_infer_archive_path_if_missing(request)<0) return -1;
   
-  // Acquire inputs.
-  void *df=0,*rf=0,*fi=0;
-  int dfc=0,rfc=0,fic=0;
-  if (request->dfpathc) {
-    if ((dfc=macb_file_read(&df,request->dfpath))<0) {
-      fprintf(stderr,"%s: Failed to read data fork.\n",request->dfpath);
-      FAIL
+  if (request->cachepathc) {
+    int fresh=macb_cache_check(request,fingerprint);
+    if (fresh<0) return -1;
+    if (fresh) {
+      fprintf(MACB_OUT(request),"%s: Inputs unchanged, skipped.\n",request->arpath);
+      return 0;
     }
   }
-  if (request->rfpathc) {
-    if ((rfc=macb_file_read(&rf,request->rfpath))<0) {
-      fprintf(stderr,"%s: Failed to read resource fork.\n",request->rfpath);
-      FAIL
-    }
+  
+  // Open inputs. We only learn their lengths and times here; content streams in at the end.
+  if (macb_input_open(&df,request->dfpath)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open data fork.\n",request->dfpath);
+    FAIL
+  }
+  if (macb_input_open(&rf,request->rfpath)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open resource fork.\n",request->rfpath);
+    FAIL
+  }
+  if (df.len>MACB_FORK_LIMIT) {
+    fprintf(MACB_ERR(request),"%s: Data fork of %lld bytes exceeds MacBinary's limit of %lld.\n",request->dfpath,(long long)df.len,MACB_FORK_LIMIT);
+    FAIL
+  }
+  if (rf.len>MACB_FORK_LIMIT) {
+    fprintf(MACB_ERR(request),"%s: Resource fork of %lld bytes exceeds MacBinary's limit of %lld.\n",request->rfpath,(long long)rf.len,MACB_FORK_LIMIT);
+    FAIL
   }
   if (request->fipathc) {
-    if ((fic=macb_file_read(&fi,request->fipath))<0) {
-      fprintf(stderr,"%s: Failed to read finder info.\n",request->fipath);
+    int fifd=macb_file_openr(request->fipath);
+    int64_t fic=(fifd<0)?-1:macb_file_read_header_fd(fi,fifd);
+    // A pipe has no length to check up front, so it has to end right after the 128 bytes.
+    int more=0;
+    if (!fic) {
+      int eof=macb_file_at_eof(fifd,128);
+      if (eof<0) fic=-1;
+      else more=!eof;
+    }
+    if (fifd>=0) macb_file_close(fifd);
+    if (fic<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to read finder info.\n",request->fipath);
+      FAIL
+    }
+    if (more) {
+      fprintf(MACB_ERR(request),"%s: Finder info must be exactly 128 bytes (have more)\n",request->fipath);
       FAIL
     }
-    if (fic!=128) {
-      fprintf(stderr,"%s: Finder info must be exactly 128 bytes (have %d)\n",request->fipath,fic);
+    if (fic&&(fic!=128)) {
+      fprintf(MACB_ERR(request),"%s: Finder info must be exactly 128 bytes (have %lld)\n",request->fipath,(long long)fic);
       FAIL
     }
   } else {
-    if (!(fi=malloc(128))) FAIL
     macb_initialize_header(fi,request);
-    fic=128;
   }
   
   // TODO Would it be helpful at this point to guess file types, if unspecified?
   
-  // Add type, creator, lengths, and CRC to the header.
-  if (macb_finish_header(fi,request,dfc,rfc)<0) FAIL
+  // Open output, and decide what to do about inputs of unknown length.
+  int streaming=(df.len<0)||(rf.len<0);
+  int64_t total=streaming?-1:(128+((df.len+127)&~127ll)+((rf.len+127)&~127ll));
+  if (macb_output_open(&output,request->arpath,total)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open file for writing.\n",request->arpath);
+    FAIL
+  }
+  fd=output.fd;
+  int64_t hdrp=streaming?macb_file_tell_if_seekable(fd):0;
+  if (hdrp<0) {
+    if (macb_input_spool(&df)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to spool data fork.\n",request->dfpath);
+      FAIL
+    }
+    if (macb_input_spool(&rf)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to spool resource fork.\n",request->rfpath);
+      FAIL
+    }
+    if (df.len>MACB_FORK_LIMIT) {
+      fprintf(MACB_ERR(request),"%s: Data fork of %lld bytes exceeds MacBinary's limit of %lld.\n",request->dfpath,(long long)df.len,MACB_FORK_LIMIT);
+      FAIL
+    }
+    if (rf.len>MACB_FORK_LIMIT) {
+      fprintf(MACB_ERR(request),"%s: Resource fork of %lld bytes exceeds MacBinary's limit of %lld.\n",request->rfpath,(long long)rf.len,MACB_FORK_LIMIT);
+      FAIL
+    }
+    streaming=0;
+  }
+  
+  // Add type, creator, lengths, and CRC to the header. Stream lengths count as zero for now.
+  if (macb_finish_header(fi,request,&df,&rf)<0) FAIL
   
   // Write output.
-  if ((fd=macb_file_openw(request->arpath))<0) {
-    fprintf(stderr,"%s: Failed to open file for writing.\n",request->arpath);
-    FAIL
+  if (!streaming&&(df.len+rf.len<=MACB_CREATE_GATHER_LIMIT)) {
+    if (macb_create_gather(request,fd,fi,&df,&rf,request->digest?dfdigest:0,request->digest?rfdigest:0)<0) FAIL
+  } else {
+    if (macb_file_append(fd,fi,128)<0) FAIL
+    if (macb_create_copy_fork(request,fd,&df,request->dfpath,"data",request->digest?dfdigest:0)<0) FAIL
+    if (macb_create_copy_fork(request,fd,&rf,request->rfpath,"resource",request->digest?rfdigest:0)<0) FAIL
   }
-  if (macb_file_append(fd,fi,fic)<0) FAIL
-  if (macb_file_append(fd,df,dfc)<0) FAIL
-  if (dfc&127) {
-    if (macb_file_append(fd,0,128-(dfc&127))<0) FAIL
+  
+  // Now we know all the lengths.
+  if (streaming) {
+    if (macb_finish_header(fi,request,&df,&rf)<0) FAIL
+    if (macb_file_write_at(fd,fi,128,hdrp)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to rewrite header.\n",request->arpath);
+      FAIL
+    }
+  }
+  if (macb_output_commit(&output)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to publish archive.\n",request->arpath);
+    FAIL
   }
-  if (macb_file_append(fd,rf,rfc)<0) FAIL
-  if (rfc&127) {
-    if (macb_file_append(fd,0,128-(rfc&127))<0) FAIL
+  if (request->digest) {
+    if (macb_manifest_emit(request,dfdigest,df.len,rfdigest,rf.len)<0) FAIL
   }
   
  _done_:
-  if (df) free(df);
-  if (rf) free(rf);
-  free(fi);
-  if (fd>=0) macb_file_close(fd);
+  macb_input_close(&df);
+  macb_input_close(&rf);
+  macb_output_abort(&output);
+  if (!result&&request->cachepathc) macb_cache_record(request,fingerprint);
   return result;
 }
 
 /* Extract.
  */
  
-static int macb_extract_guess_outputs(struct macb_request *request,int dflen,int rflen) {
+static int macb_extract_guess_outputs(struct macb_request *request,int64_t dflen,int64_t rflen) {
 
   // Issue a warning if both forks are empty -- that means we are (validly) not producing any output.
   if (!dflen&&!rflen) {
-    fprintf(stderr,"%s:WARNING: Both forks empty. Not producing any output.\n",request->arpath);
+    fprintf(MACB_ERR(request),"%s:WARNING: Both forks empty. Not producing any output.\n",request->arpath);
     return 0;
   }
 
   // Output path prefix. Strip ".bin" if present, otherwise just the archive path.
+  if (MACB_PATH_IS_STDIO(request->arpath)) {
+    fprintf(MACB_ERR(request),"Output paths (-d, -r, -f) required when the archive is stdin.\n");
+    return -1;
+  }
   const char *pfx=request->arpath;
   int pfxc=request->arpathc;
   if ((pfxc>=4)&&!memcmp(pfx+pfxc-4,".bin",4)) pfxc-=4;
@@ -108,44 +246,112 @@ static int macb_extract_guess_outputs(struct macb_request *request,int dflen,int
   return 0;
 }
  
-static int macb_extract_inner(struct macb_request *request,const uint8_t *src,int srcc) {
+/* Position a sequential archive at (p), if it's not there yet.
+ * (*streamp) is the current position, or <0 if the archive is seekable and we're not tracking.
+ */
+static int macb_extract_seek(struct macb_request *request,int fd,int64_t *streamp,int64_t p) {
+  if (*streamp<0) return 0;
+  if (macb_file_skip(fd,p-*streamp)<0) {
+    fprintf(MACB_ERR(request),"%s: Archive ended before offset %lld.\n",request->arpath,(long long)p);
+    return -1;
+  }
+  *streamp=p;
+  return 0;
+}
+ 
+/* Extract one fork to (dstpath), which may be null.
+ * With '--digest', (digest) receives the fork's digest. Forks with no output are read anyway, to hash them.
+ */
+static int macb_extract_fork(
+  struct macb_request *request,int fd,int64_t *streamp,int64_t p,int64_t c,
+  const char *dstpath,const char *what,char *digest
+) {
+  if (!dstpath&&!digest) return 0;
+  if (macb_extract_seek(request,fd,streamp,p)<0) return -1;
+  int64_t srcp=(*streamp<0)?p:-1;
+  int err;
+  if (digest) {
+    struct macb_digest d;
+    macb_digest_init(&d,request->digest);
+    if (dstpath) err=macb_digest_write_from_fd(&d,dstpath,fd,srcp,c);
+    else err=macb_digest_copy(&d,-1,fd,srcp,c);
+    macb_digest_final(digest,&d);
+  } else {
+    err=macb_file_write_from_fd(dstpath,fd,srcp,c);
+  }
+  if (err<0) {
+    if (dstpath) fprintf(MACB_ERR(request),"%s: Failed to write %lld-byte %s fork.\n",dstpath,(long long)c,what);
+    else fprintf(MACB_ERR(request),"%s: Failed to read %lld-byte %s fork.\n",request->arpath,(long long)c,what);
+    return -1;
+  }
+  if (dstpath) fprintf(MACB_OUT(request),"%s: Extracted %s fork, %lld bytes.\n",dstpath,what,(long long)c);
+  if (*streamp>=0) *streamp+=c;
+  return 0;
+}
+ 
+/* Extract one fork through the content-addressed store: Store it, then link it at (dstpath) if there is one.
+ * Every fork gets stored, whether we're outputting it or not, so the manifest is complete.
+ */
+static int macb_extract_store_fork(
+  struct macb_request *request,int fd,int64_t *streamp,int64_t p,int64_t c,
+  const char *dstpath,const char *what,char *hex
+) {
+  int fresh=0;
+  if (macb_store_fork(request,hex,&fresh,fd,streamp,p,c)<0) {
+    fprintf(MACB_ERR(request),
+      "%s: Failed to store %lld-byte %s fork in '%.*s'.\n",
+      request->arpath,(long long)c,what,request->storepathc,request->storepath
+    );
+    return -1;
+  }
+  if (!dstpath) return 0;
+  if (macb_store_link(request,hex,dstpath)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to link %s fork from store.\n",dstpath,what);
+    return -1;
+  }
+  fprintf(MACB_OUT(request),
+    "%s: Extracted %s fork, %lld bytes, %s %.12s.\n",
+    dstpath,what,(long long)c,fresh?"stored as":"already stored as",hex
+  );
+  return 0;
+}
+
+static int macb_extract_inner(struct macb_request *request,int fd,int64_t base,const uint8_t *src,int64_t srcc) {
 
   // Get fork lengths and positions and validate aggressively.
-  int dflen=macb_rd32(src,0x53);
-  int rflen=macb_rd32(src,0x57);
-  int addlhdrlen=macb_rd16(src,0x78);
-  int dfp=0,rfp=0;
-  if (addlhdrlen) {
-    fprintf(stderr,
+  // (srcc) zero means a pipe: We can't check lengths, and must read in order. We're just past the header.
+  // Otherwise the archive starts at (base) in (fd), which is nonzero for bundle members.
+  struct macb_header header;
+  struct macb_layout layout;
+  macb_header_decode(&header,src,128);
+  macb_layout_compute(&layout,&header);
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  uint32_t findings=macb_header_validate(src,srcc?srcc:-1);
+  macb_stats_end(&mark,MACB_STATS_CRC,128);
+  int64_t streamp=srcc?-1:MACB_HEADER_SIZE;
+  if (findings&MACB_FINDING_ADDL_HEADER) {
+    fprintf(MACB_ERR(request),
       "%s:WARNING: Additional header length %d. macb's author is not sure how to handle this, corruption may ensue.\n",
-      request->arpath,addlhdrlen
+      request->arpath,header.addlhdrlen
     );
-    addlhdrlen=(addlhdrlen+127)&~127;
-  }
-  dfp=128+addlhdrlen;
-  rfp=dfp+((dflen+127)&~127);
-  if ((dfp<128)||(dflen<0)||(dfp>srcc-dflen)) {
-    fprintf(stderr,
-      "%s:ERROR: Header indicates data fork %d bytes at %d -- impossible with archive length %d.\n",
-      request->arpath,dflen,dfp,srcc
-    );
-    return -1;
   }
-  if ((rfp<128)||(rflen<0)||(rfp>srcc-rflen)) {
-    fprintf(stderr,
-      "%s:ERROR: Header indicates resource fork %d bytes at %d -- impossible with archive length %d.\n",
-      request->arpath,rflen,rfp,srcc
+  if (findings&MACB_FINDING_DATA_BEYOND_EOF) {
+    fprintf(MACB_ERR(request),
+      "%s:ERROR: Header indicates data fork %lld bytes at %lld -- impossible with archive length %lld.\n",
+      request->arpath,(long long)layout.dflen,(long long)layout.dfp,(long long)srcc
     );
     return -1;
   }
-  if ((dfp<rfp+rflen)&&(rfp<dfp+dflen)) {
-    fprintf(stderr,
-      "%s:ERROR: Data fork (%d@%d) and resource fork (%d@%d) somehow overlap. "
-      "This must be a problem with macb, not necessarily with your archive.\n",
-      request->arpath,dflen,dfp,rflen,rfp
+  if (findings&MACB_FINDING_RES_BEYOND_EOF) {
+    fprintf(MACB_ERR(request),
+      "%s:ERROR: Header indicates resource fork %lld bytes at %lld -- impossible with archive length %lld.\n",
+      request->arpath,(long long)layout.rflen,(long long)layout.rfp,(long long)srcc
     );
     return -1;
   }
+  int64_t dfp=base+layout.dfp,dflen=layout.dflen;
+  int64_t rfp=base+layout.rfp,rflen=layout.rflen;
   
   // If no output arguments were provided, guess.
   if (!request->dfpathc&&!request->rfpathc&&!request->fipathc) {
@@ -153,28 +359,30 @@ static int macb_extract_inner(struct macb_request *request,const uint8_t *src,in
   }
   
   // Write all files for which we have an output path.
-  if (request->dfpathc) {
-    if (macb_file_write(request->dfpath,src+dfp,dflen)<0) {
-      fprintf(stderr,"%s: Failed to write %d-byte data fork.\n",request->dfpath,dflen);
+  // Forks stream straight from the archive; (src) is only the header.
+  if (request->storepathc) {
+    char dfhex[65],rfhex[65];
+    if (macb_extract_store_fork(request,fd,&streamp,dfp,dflen,request->dfpath,"data",dfhex)<0) return -1;
+    if (macb_extract_store_fork(request,fd,&streamp,rfp,rflen,request->rfpath,"resource",rfhex)<0) return -1;
+    if (macb_store_write_manifest(request,dfhex,dflen,rfhex,rflen)<0) {
+      fprintf(MACB_ERR(request),"%.*s: Failed to append to manifest.\n",request->storepathc,request->storepath);
       return -1;
-    } else {
-      printf("%s: Extracted data fork, %d bytes.\n",request->dfpath,dflen);
     }
-  }
-  if (request->rfpathc) {
-    if (macb_file_write(request->rfpath,src+rfp,rflen)<0) {
-      fprintf(stderr,"%s: Failed to write %d-byte resource fork.\n",request->rfpath,rflen);
-      return -1;
-    } else {
-      printf("%s: Extracted resource fork, %d bytes.\n",request->rfpath,rflen);
+  } else {
+    char dfdigest[MACB_DIGEST_SIZE],rfdigest[MACB_DIGEST_SIZE];
+    char *dfd=request->digest?dfdigest:0,*rfd=request->digest?rfdigest:0;
+    if (macb_extract_fork(request,fd,&streamp,dfp,dflen,request->dfpathc?request->dfpath:0,"data",dfd)<0) return -1;
+    if (macb_extract_fork(request,fd,&streamp,rfp,rflen,request->rfpathc?request->rfpath:0,"resource",rfd)<0) return -1;
+    if (request->digest) {
+      if (macb_manifest_emit(request,dfdigest,dflen,rfdigest,rflen)<0) return -1;
     }
   }
   if (request->fipathc) {
     if (macb_file_write(request->fipath,src,128)<0) {
-      fprintf(stderr,"%s: Failed to write 128-byte header.\n",request->fipath);
+      fprintf(MACB_ERR(request),"%s: Failed to write 128-byte header.\n",request->fipath);
       return -1;
     } else {
-      printf("%s: Extracted header.\n",request->fipath);
+      fprintf(MACB_OUT(request),"%s: Extracted header.\n",request->fipath);
     }
   }
 
@@ -184,170 +392,201 @@ static int macb_extract_inner(struct macb_request *request,const uint8_t *src,in
 static int macb_main_extract(struct macb_request *request) {
 
   if (!request->arpathc) {
-    fprintf(stderr,"Archive path required with '-x'\n");
+    fprintf(MACB_ERR(request),"Archive path required with '-x'\n");
     return -1;
   }
   
-  uint8_t *src=0;
-  int srcc=macb_file_read(&src,request->arpath);
-  if (srcc<0) {
-    fprintf(stderr,"%s: Failed to read archive file.\n",request->arpath);
+  // Bundle member: The header is in the index, and forks copy straight out of the bundle.
+  if (request->bundlepathc) {
+    struct macb_bundle bundle;
+    struct macb_bundle_member member;
+    if (macb_bundle_open(&bundle,request->bundlepath)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to open bundle.\n",request->bundlepath);
+      return -1;
+    }
+    if (macb_bundle_find(&member,&bundle,request->arpath,request->arpathc)<0) {
+      fprintf(MACB_ERR(request),"%s: Not in bundle '%s'.\n",request->arpath,request->bundlepath);
+      macb_bundle_close(&bundle);
+      return -1;
+    }
+    int err=macb_extract_inner(request,bundle.fd,member.p,member.hdr,member.c);
+    macb_bundle_close(&bundle);
+    return err;
+  }
+  
+  int fd=macb_file_openr(request->arpath);
+  if (fd<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open archive file.\n",request->arpath);
     return -1;
   }
-  if (srcc<128) {
-    fprintf(stderr,"%s: Length %d less than 128, this can't be MacBinary.\n",request->arpath,srcc);
-    free(src);
+  uint8_t hdr[128];
+  int64_t srcc=macb_file_read_header_fd(hdr,fd);
+  if (srcc<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to read 128-byte header, this can't be MacBinary.\n",request->arpath);
+    macb_file_close(fd);
     return -1;
   }
   
-  int err=macb_extract_inner(request,src,srcc);
-  free(src);
+  // Zero length means a pipe or something like it; extract_inner will read it sequentially.
+  int err=macb_extract_inner(request,fd,0,hdr,srcc);
+  macb_file_close(fd);
   return err;
 }
 
 /* Tell.
  */
  
-static void macb_report_ostype(const uint8_t *src,const char *what,const char *path) {
+static void macb_report_ostype(struct macb_request *request,const uint8_t *src,const char *what) {
+  const char *path=request->arpath;
   int kosher=1,i=4;
   while (i-->0) {
     if ((src[i]<0x20)||(src[i]>0x7e)) kosher=0;
   }
   if (kosher) {
-    printf("%s:INFO: File %s '%.4s'\n",path,what,src);
+    fprintf(MACB_OUT(request),"%s:INFO: File %s '%.4s'\n",path,what,src);
   } else {
     uint32_t be=(src[0]<<24)|(src[1]<<16)|(src[2]<<8)|src[3];
-    printf("%s:WARNING: Unprintable file %s: 0x%08x\n",path,what,be);
+    fprintf(MACB_OUT(request),"%s:WARNING: Unprintable file %s: 0x%08x\n",path,what,be);
   }
 }
 
-static void macb_report_time(uint32_t v,const char *which,const char *path) {
+static void macb_report_time(struct macb_request *request,uint32_t v,const char *which) {
+  const char *path=request->arpath;
   // I'm not going to worry about the details of timezone, daylight savings, leap seconds, yadda yadda
   time_t unixtime=v-(int64_t)UNIX_EPOCH_IN_MAC_TIME;
   struct tm local={0};
   if (localtime_r(&unixtime,&local)==&local) {
-    printf(
+    fprintf(MACB_OUT(request),
       "%s:INFO: %s time %04d-%02d-%02dT%02d:%02d:%02d\n",
       path,which,
       local.tm_year+1900,local.tm_mon+1,local.tm_mday,local.tm_hour,local.tm_min,local.tm_sec
     );
   } else {
-    printf("%s:ERROR: Unable to format %s time 0x%08x.\n",path,which,v);
+    fprintf(MACB_OUT(request),"%s:ERROR: Unable to format %s time 0x%08x.\n",path,which,v);
   }
 }
  
 static int macb_main_tell(struct macb_request *request) {
 
   if (!request->arpathc) {
-    fprintf(stderr,"Archive path required with '-t'\n");
+    fprintf(MACB_ERR(request),"Archive path required with '-t'\n");
     return -1;
   }
 
   uint8_t hdr[128];
-  int flen=macb_file_read_header(hdr,request->arpath);
+  int64_t flen;
+  if (request->bundlepathc) {
+    struct macb_bundle bundle;
+    struct macb_bundle_member member;
+    if (macb_bundle_open(&bundle,request->bundlepath)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to open bundle.\n",request->bundlepath);
+      return -1;
+    }
+    if (macb_bundle_find(&member,&bundle,request->arpath,request->arpathc)<0) {
+      fprintf(MACB_ERR(request),"%s: Not in bundle '%s'.\n",request->arpath,request->bundlepath);
+      if (request->format) macb_record_write_error(MACB_OUT(request),request->format,MACB_RECORD_HEADER,request->arpath,"Not in bundle.");
+      macb_bundle_close(&bundle);
+      return -1;
+    }
+    memcpy(hdr,member.hdr,128);
+    flen=member.c;
+    macb_bundle_close(&bundle);
+  } else if (request->prefetch&&(request->prefetch->status>0)) {
+    memcpy(hdr,request->prefetch->hdr,128);
+    flen=request->prefetch->flen;
+  } else {
+    flen=macb_file_read_header(hdr,request->arpath);
+  }
   if (flen<0) {
-    fprintf(stderr,"%s: Failed to read header.\n",request->arpath);
+    fprintf(MACB_ERR(request),"%s: Failed to read header.\n",request->arpath);
+    if (request->format) macb_record_write_error(MACB_OUT(request),request->format,MACB_RECORD_HEADER,request->arpath,"Failed to read header.");
     return -1;
   }
   
+  // Machine-readable formats are one record, and that's all.
+  if (request->format) {
+    macb_record_write(MACB_OUT(request),request->format,request->arpath,hdr,flen?flen:-1);
+    return 0;
+  }
+  
+  struct macb_header header;
+  struct macb_layout layout;
+  macb_header_decode(&header,hdr,128);
+  macb_layout_compute(&layout,&header);
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  uint32_t findings=macb_header_validate(hdr,flen?flen:-1);
+  uint16_t crcactual=macb_crc_macb(hdr,124,0);
+  macb_stats_end(&mark,MACB_STATS_CRC,128);
+  
   // Validate version numbers and whatnot.
-  int sigok=1;
-  if (hdr[0x00]) {
-    printf(
+  if (findings&MACB_FINDING_VERSION) {
+    fprintf(MACB_OUT(request),
       "%s:ERROR: Leading byte should be zero, found 0x%02x. This is probably not a MacBinary file.\n",
       request->arpath,hdr[0x00]
     );
-    sigok=0;
   }
-  if (hdr[0x4a]) {
-    printf("%s:ERROR: Byte [0x4a] should be zero, found 0x%02x.\n",request->arpath,hdr[0x4a]);
-    sigok=0;
+  if (findings&MACB_FINDING_PAD4A) {
+    fprintf(MACB_OUT(request),"%s:ERROR: Byte [0x4a] should be zero, found 0x%02x.\n",request->arpath,hdr[0x4a]);
   }
-  if (hdr[0x52]) {
-    printf("%s:ERROR: Byte [0x52] should be zero, found 0x%02x.\n",request->arpath,hdr[0x52]);
-    sigok=0;
+  if (findings&MACB_FINDING_PAD52) {
+    fprintf(MACB_OUT(request),"%s:ERROR: Byte [0x52] should be zero, found 0x%02x.\n",request->arpath,hdr[0x52]);
   }
-  if (!memcmp(hdr+0x66,"mBIN",4)) {
-    printf("%s:INFO: Detected MacBinary III signature.\n",request->arpath);
-  } else if (memcmp(hdr+0x66,"\0\0\0\0\0\0\0\0\0\0\0\0\0\0",14)) {
-    printf("%s:WARNING: Expected fourteen zero bytes at 0x66.\n",request->arpath);
-    sigok=0;
+  if (findings&MACB_FINDING_MACBINARY3) {
+    fprintf(MACB_OUT(request),"%s:INFO: Detected MacBinary III signature.\n",request->arpath);
+  } else if (findings&MACB_FINDING_UNUSED66) {
+    fprintf(MACB_OUT(request),"%s:WARNING: Expected fourteen zero bytes at 0x66.\n",request->arpath);
   }
-  if (hdr[0x7e]||hdr[0x7f]) {
-    printf(
+  if (findings&MACB_FINDING_TRAILER) {
+    fprintf(MACB_OUT(request),
       "%s:WARNING: Expected two trailing zero bytes in header, found 0x%02x 0x%02x.\n",
       request->arpath,hdr[0x7e],hdr[0x7f]
     );
-    sigok=0;
   }
-  if (sigok) {
-    printf("%s:INFO: Heuristic format check OK.\n",request->arpath);
+  if (!(findings&(MACB_FINDING_VERSION|MACB_FINDING_PAD4A|MACB_FINDING_PAD52|MACB_FINDING_UNUSED66|MACB_FINDING_TRAILER))) {
+    fprintf(MACB_OUT(request),"%s:INFO: Heuristic format check OK.\n",request->arpath);
   }
   
-  // Validate lengths.
-  int expectlen=128;
-  int dflen=macb_rd32(hdr,0x53);
-  int rflen=macb_rd32(hdr,0x57);
-  int cmtlen=macb_rd16(hdr,0x63);
-  int addlhdrlen=macb_rd16(hdr,0x78);
-  if (dflen<0) {
-    printf("%s:ERROR: Invalid data fork length 0x%08x.\n",request->arpath,dflen);
-  } else {
-    printf("%s:INFO: Data fork length %d.\n",request->arpath,dflen);
-    expectlen+=dflen;
-    if (dflen&127) expectlen+=128-(dflen&127);
+  // Report lengths.
+  fprintf(MACB_OUT(request),"%s:INFO: Data fork length %u.\n",request->arpath,header.dflen);
+  fprintf(MACB_OUT(request),"%s:INFO: Resource fork length %u.\n",request->arpath,header.rflen);
+  if (header.cmtlen) {
+    fprintf(MACB_OUT(request),"%s:INFO: Comment length %d.\n",request->arpath,header.cmtlen);
   }
-  if (rflen<0) {
-    printf("%s:ERROR: Invalid resource fork length 0x%08x.\n",request->arpath,rflen);
-  } else {
-    printf("%s:INFO: Resource fork length %d.\n",request->arpath,rflen);
-    expectlen+=rflen;
-    if (rflen&127) expectlen+=128-(rflen&127);
-  }
-  if (cmtlen) {
-    printf("%s:INFO: Comment length %d.\n",request->arpath,cmtlen);
-    expectlen+=cmtlen;
-    //TODO The spec doesn't say whether comments should pad to 128 bytes.
-    // Since everything else does, I'll assume that this should too.
-    if (cmtlen&127) expectlen+=128-(cmtlen&127);
-  }
-  if (addlhdrlen) {
-    printf("%s:INFO: Additional header length %d.\n",request->arpath,addlhdrlen);
-    expectlen+=addlhdrlen;
-    if (addlhdrlen&127) expectlen+=128-(addlhdrlen&127);
+  if (header.addlhdrlen) {
+    fprintf(MACB_OUT(request),"%s:INFO: Additional header length %d.\n",request->arpath,header.addlhdrlen);
   }
   
   // Validate total length.
-  if (expectlen<0) {
-    printf("%s:ERROR: Integer overflow calculating total length.\n",request->arpath);
-  } else if (!flen) {
-    printf(
-      "%s:WARNING: Unable to determine archive length. Can't validate against expected length %d.\n",
+  long long expectlen=layout.total;
+  if (findings&MACB_FINDING_LENGTH_UNKNOWN) {
+    fprintf(MACB_OUT(request),
+      "%s:WARNING: Unable to determine archive length. Can't validate against expected length %lld.\n",
       request->arpath,expectlen
     );
-  } else if (expectlen>flen) {
-    printf("%s:ERROR: Expected length %d but found %d.\n",request->arpath,expectlen,flen);
-  } else if (expectlen<flen) {
-    printf(
-      "%s:WARNING: Extra unexpected data (%d - %d = %d extra bytes)\n",
-      request->arpath,flen,expectlen,flen-expectlen
+  } else if (findings&MACB_FINDING_TRUNCATED) {
+    fprintf(MACB_OUT(request),"%s:ERROR: Expected length %lld but found %lld.\n",request->arpath,expectlen,(long long)flen);
+  } else if (findings&MACB_FINDING_EXTRA_DATA) {
+    fprintf(MACB_OUT(request),
+      "%s:WARNING: Extra unexpected data (%lld - %lld = %lld extra bytes)\n",
+      request->arpath,(long long)flen,expectlen,(long long)flen-expectlen
     );
   } else {
-    printf("%s:INFO: Length %d matches expectation.\n",request->arpath,flen);
+    fprintf(MACB_OUT(request),"%s:INFO: Length %lld matches expectation.\n",request->arpath,(long long)flen);
   }
   
   // Validate and report file name.
-  unsigned char safename[64];
-  memcpy(safename,hdr+0x02,63);
-  safename[63]=0;
-  int namelen=hdr[0x01];
-  if (namelen>63) {
-    printf("%s:ERROR: Name length %d exceeds buffer size!\n",request->arpath,namelen);
-  } else if (!namelen) {
-    printf("%s:ERROR: Name length zero.\n",request->arpath);
+  if (findings&MACB_FINDING_NAME_LENGTH) {
+    if (header.namec) {
+      fprintf(MACB_OUT(request),"%s:ERROR: Name length %d exceeds buffer size!\n",request->arpath,header.namec);
+    } else {
+      fprintf(MACB_OUT(request),"%s:ERROR: Name length zero.\n",request->arpath);
+    }
   } else {
     int loc=0,hic=0;
-    int i=0; for (;i<namelen;i++) {
+    unsigned char safename[64];
+    memcpy(safename,header.name,64);
+    int i=0; for (;i<header.namec;i++) {
       if (safename[i]<0x20) {
         loc++;
         safename[i]='?';
@@ -357,65 +596,211 @@ static int macb_main_tell(struct macb_request *request) {
       }
     }
     if (loc) {
-      printf("%s:WARNING: File name contains %d bytes in 0x00..0x1f. This is probably an error.\n",request->arpath,loc);
+      fprintf(MACB_OUT(request),"%s:WARNING: File name contains %d bytes in 0x00..0x1f. This is probably an error.\n",request->arpath,loc);
     } else if (hic) {
-      printf(
+      fprintf(MACB_OUT(request),
         "%s:WARNING: File name contains %d bytes in 0x7e..0xff. Not necessarily a problem, but we won't print them here.\n",
         request->arpath,hic
       );
     }
-    printf("%s:INFO: File name '%.*s'\n",request->arpath,namelen,safename);
+    fprintf(MACB_OUT(request),"%s:INFO: File name '%.*s'\n",request->arpath,header.namec,safename);
   }
   
   // Validate and report type, creator, flags, and timestamps.
-  macb_report_ostype(hdr+0x41,"type",request->arpath);
-  macb_report_ostype(hdr+0x45,"creator",request->arpath);
+  macb_report_ostype(request,hdr+0x41,"type");
+  macb_report_ostype(request,hdr+0x45,"creator");
   
   // Report all other fields.
-  printf("%s:INFO: Finder flags 0x%02x,0x%02x.\n",request->arpath,hdr[0x49],hdr[0x65]);//TODO anyone care about the bits' names?
-  printf(
+  fprintf(MACB_OUT(request),"%s:INFO: Finder flags 0x%02x,0x%02x.\n",request->arpath,header.flags_hi,header.flags_lo);//TODO anyone care about the bits' names?
+  fprintf(MACB_OUT(request),
     "%s:INFO: Position in Finder window (%d,%d).\n",
-    request->arpath,macb_rd16(hdr,0x4d),macb_rd16(hdr,0x4b)
+    request->arpath,header.hpos,header.vpos
   );
-  printf("%s:INFO: Window/folder ID 0x%04x.\n",request->arpath,macb_rd16(hdr,0x4f));
-  if (hdr[0x51]==0x01) printf("%s:INFO: Protected bit set.\n",request->arpath);
-  else if (hdr[0x51]==0x00) printf("%s:INFO: No protected bit.\n",request->arpath);
-  else printf("%s:WARNING: Unexpected value 0x%02x for protected bit.\n",request->arpath,hdr[0x51]);
-  macb_report_time(macb_rd32(hdr,0x5b),"Create",request->arpath);
-  macb_report_time(macb_rd32(hdr,0x5f),"Modify",request->arpath);
-  uint32_t uplen=macb_rd32(hdr,0x74);
-  if (uplen) printf("%s:INFO: Unpacked length %d.\n",request->arpath,uplen);
-  printf("%s:INFO: MacBinary version source=0x%02x, minimum=0x%02x.\n",request->arpath,hdr[0x7a],hdr[0x7b]);
+  fprintf(MACB_OUT(request),"%s:INFO: Window/folder ID 0x%04x.\n",request->arpath,header.folder);
+  if (header.protect==0x01) fprintf(MACB_OUT(request),"%s:INFO: Protected bit set.\n",request->arpath);
+  else if (header.protect==0x00) fprintf(MACB_OUT(request),"%s:INFO: No protected bit.\n",request->arpath);
+  else fprintf(MACB_OUT(request),"%s:WARNING: Unexpected value 0x%02x for protected bit.\n",request->arpath,header.protect);
+  macb_report_time(request,header.ctime,"Create");
+  macb_report_time(request,header.mtime,"Modify");
+  if (header.unpacklen) fprintf(MACB_OUT(request),"%s:INFO: Unpacked length %u.\n",request->arpath,header.unpacklen);
+  fprintf(MACB_OUT(request),"%s:INFO: MacBinary version source=0x%02x, minimum=0x%02x.\n",request->arpath,header.srcversion,header.minversion);
   
   // Validate CRC.
-  uint16_t crcactual=crc_macb(hdr,124,0);
-  uint16_t crcexpect=macb_rd16(hdr,124);
-  if (crcactual==crcexpect) {
-    printf("%s:INFO: CRC 0x%04x matches.\n",request->arpath,crcactual);
+  if (!(findings&MACB_FINDING_CRC)) {
+    fprintf(MACB_OUT(request),"%s:INFO: CRC 0x%04x matches.\n",request->arpath,crcactual);
   } else {
-    printf("%s:ERROR: CRC mismatch! Stated 0x%04x but calculated 0x%04x.\n",request->arpath,crcexpect,crcactual);
+    fprintf(MACB_OUT(request),"%s:ERROR: CRC mismatch! Stated 0x%04x but calculated 0x%04x.\n",request->arpath,header.crc,crcactual);
   }
 
   return 0;
 }
 
+/* Update.
+ * Rewrite just the 128-byte header in place. Forks are never read, whatever their size.
+ */
+
+static int macb_main_update(struct macb_request *request) {
+
+  if (!request->arpathc) {
+    fprintf(MACB_ERR(request),"Archive path required with '-u'\n");
+    return -1;
+  }
+  int fd=macb_file_openrw(request->arpath);
+  if (fd<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open archive for update.\n",request->arpath);
+    return -1;
+  }
+  uint8_t hdr[128];
+  int64_t flen=macb_file_read_header_fd(hdr,fd);
+  if (flen<=0) {
+    fprintf(MACB_ERR(request),"%s: Failed to read 128-byte header, this can't be MacBinary.\n",request->arpath);
+    macb_file_close(fd);
+    return -1;
+  }
+
+  // Don't stamp a fresh CRC over a header we wouldn't trust. MacBinary I has no CRC, and doesn't get one.
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  uint32_t findings=macb_header_validate(hdr,flen);
+  macb_stats_end(&mark,MACB_STATS_CRC,128);
+  int sealed=1;
+  if ((findings&MACB_FINDING_CRC)&&!hdr[0x7a]&&!hdr[0x7c]&&!hdr[0x7d]) {
+    findings&=~MACB_FINDING_CRC;
+    sealed=0;
+  }
+  // Missing trailing padding is harmless: We never read forks, and '-x' copes. Forks past the end are still refused.
+  findings&=~MACB_FINDING_TRUNCATED;
+  int i=0; for (;i<MACB_FINDING_COUNT;i++) {
+    uint32_t bit=1u<<i;
+    if (!(findings&bit)) continue;
+    if (macb_finding_severity(bit)<MACB_SEVERITY_ERROR) continue;
+    fprintf(MACB_ERR(request),"%s: Refusing to update a questionable header (%s).\n",request->arpath,macb_finding_name(bit));
+    macb_file_close(fd);
+    return -1;
+  }
+
+  uint8_t before[128];
+  memcpy(before,hdr,128);
+  if (request->type) macb_wr32(hdr,0x41,request->type);
+  if (request->creator) macb_wr32(hdr,0x45,request->creator);
+  if (request->flagsset) {
+    hdr[0x49]=request->flags>>8;
+    hdr[0x65]=request->flags;
+  }
+  if (request->ctime) macb_wr32(hdr,0x5b,request->ctime);
+  if (request->mtime) macb_wr32(hdr,0x5f,request->mtime);
+  if (sealed) {
+    macb_stats_begin(&mark);
+    macb_header_seal(hdr);
+    macb_stats_end(&mark,MACB_STATS_CRC,128);
+  }
+
+  // Unchanged headers aren't written, so the archive's own mtime stays put.
+  if (!memcmp(before,hdr,128)) {
+    fprintf(MACB_OUT(request),"%s: Header already as requested.\n",request->arpath);
+    macb_file_close(fd);
+    return 0;
+  }
+  if (macb_file_write_at(fd,hdr,128,0)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to write header.\n",request->arpath);
+    macb_file_close(fd);
+    return -1;
+  }
+  if (macb_file_close(fd)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to close archive after update.\n",request->arpath);
+    return -1;
+  }
+  fprintf(MACB_OUT(request),"%s: Updated header.\n",request->arpath);
+  return 0;
+}
+
+/* Dispatch one request.
+ */
+ 
+int macb_run_request(struct macb_request *request) {
+  switch (request->command) {
+    case 'c': switch (request->as) {
+        case MACB_AS_SINGLE: case MACB_AS_DOUBLE: return macb_main_apple_create(request);
+        case MACB_AS_BINHEX: return macb_main_hqx_create(request);
+      }
+      if (request->bundlepathc) return macb_main_bundle_create(request);
+      if (request->tar) return macb_main_tar(request);
+      return macb_main_create(request);
+    case 'x': switch (request->as) {
+        case MACB_AS_SINGLE: case MACB_AS_DOUBLE: return macb_main_apple_extract(request);
+        case MACB_AS_BINHEX: return macb_main_hqx_extract(request);
+      }
+      if (request->rsrcsel) return macb_main_extract_resources(request);
+      if (request->tar) return macb_main_tar(request);
+      return macb_main_extract(request);
+    case 't': {
+        if (request->resources) return macb_main_resources(request);
+        if (request->deep) return macb_main_deep(request);
+        if (request->bundlepathc&&!request->arpathc) return macb_main_bundle_list(request);
+      } return macb_main_tell(request);
+    case 'i': return macb_main_index(request);
+    case 'q': return macb_main_query(request);
+    case 'u': return macb_main_update(request);
+    case 'v': return macb_main_serve(request);
+  }
+  fprintf(MACB_ERR(request),"unknown command '%c'!\n",request->command);
+  return -1;
+}
+
 /* Main entry point.
  */
 
+// glibc ignores setvbuf's size unless we supply the buffer.
+static char macb_stdout_buffer[1<<20];
+
 int main(int argc,char **argv) {
   struct macb_request request={0};
+  // We don't know whether to count until the arguments are parsed, so take the mark by hand.
+  struct macb_stats_mark mark={.ns=macb_stats_now(),.syscallc=macb_stats_syscallc};
   if (macb_request_init(&request,argc,argv)<0) return 1;
+  if (request.stats) {
+    macb_stats_enabled=1;
+    macb_stats_end(&mark,MACB_STATS_ARGS,0);
+  }
+  
+  /* If stdout carries an archive or fork, reports go to stderr instead.
+   */
+  if (
+    ((request.command=='c')&&MACB_PATH_IS_STDIO(request.arpath))||
+    ((request.command=='x')&&(MACB_PATH_IS_STDIO(request.dfpath)||MACB_PATH_IS_STDIO(request.rfpath)||MACB_PATH_IS_STDIO(request.fipath)))||
+    (request.tar&&((request.command=='x')||!request.arpathc||MACB_PATH_IS_STDIO(request.arpath)))
+  ) {
+    request.out=stderr;
+  }
+  
+  /* Machine-readable output is meant for bulk, so give stdout a big buffer.
+   * Batch jobs each hand us a complete record; this way they leave in large writes, not one per job.
+   */
+  if (request.format) {
+    setvbuf(stdout,macb_stdout_buffer,_IOFBF,sizeof(macb_stdout_buffer));
+    macb_record_write_header(stdout,request.format,request.resources?MACB_RECORD_RESOURCE:MACB_RECORD_HEADER);
+  }
   
   int status=0;
   switch (request.command) {
     case 'h': macb_print_usage((argc>=1)?argv[0]:"macb"); break;
-    case 'c': if (macb_main_create(&request)<0) status=1; break;
-    case 'x': if (macb_main_extract(&request)<0) status=1; break;
-    case 't': if (macb_main_tell(&request)<0) status=1; break;
     case 0: macb_print_usage((argc>=1)?argv[0]:"macb"); status=1; break;
-    default: fprintf(stderr,"unknown command '%c'!\n",request.command); status=1; break;
+    default: {
+        if (request.batch) {
+          if (macb_main_batch(&request)<0) status=1;
+        } else {
+          int64_t start=macb_stats_now();
+          if (macb_run_request(&request)<0) status=1;
+          macb_stats_archive(macb_stats_now()-start);
+        }
+      }
+  }
+  
+  if (request.stats) {
+    fflush(stdout);
+    macb_stats_report(stderr,macb_stats_now()-mark.ns);
   }
   
   macb_request_cleanup(&request);
-  return 0;
+  return status;
 }
@@ -0,0 +1,278 @@
+#include "macb.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* Digest manifest, and '-t --deep'.
+ * Same line format as the store's DIR/manifest.tsv, so either can be checked with '--deep'.
+ * Manifests for big corpora run to hundreds of megabytes, so we map them and index the lines where they lie,
+ * instead of reading a copy into memory.
+ */
+
+/* Write.
+ */
+
+int macb_manifest_append(const char *path,const char *arpath,const char *dfdigest,int64_t dflen,const char *rfdigest,int64_t rflen) {
+  char line[4096];
+  if (strpbrk(arpath,"\t\n")) return -1; // Sorry, manifest is TSV.
+  int linec=snprintf(line,sizeof(line),"%s\t%s\t%lld\t%s\t%lld\n",arpath,dfdigest,(long long)dflen,rfdigest,(long long)rflen);
+  if ((linec<0)||(linec>=sizeof(line))) return -1;
+  int fd=open(path,O_WRONLY|O_APPEND|O_CREAT,0666);
+  if (fd<0) return -1;
+  int err=write(fd,line,linec);
+  close(fd);
+  return (err==linec)?0:-1;
+}
+
+int macb_manifest_emit(struct macb_request *request,const char *dfdigest,int64_t dflen,const char *rfdigest,int64_t rflen) {
+  if (!request->manifestpathc) {
+    fprintf(MACB_OUT(request),"%s\t%s\t%lld\t%s\t%lld\n",request->arpath,dfdigest,(long long)dflen,rfdigest,(long long)rflen);
+    return 0;
+  }
+  if (macb_manifest_append(request->manifestpath,request->arpath,dfdigest,dflen,rfdigest,rflen)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to append to manifest.\n",request->manifestpath);
+    return -1;
+  }
+  return 0;
+}
+
+/* Read.
+ */
+
+// Paths in the map aren't terminated.
+static int macb_manifest_path_cmp(const char *a,int ac,const char *b,int bc) {
+  int cmp=memcmp(a,b,(ac<bc)?ac:bc);
+  if (cmp) return cmp;
+  return ac-bc;
+}
+
+static int macb_manifest_entry_cmp(const void *a,const void *b) {
+  const struct macb_manifest_entry *A=a,*B=b;
+  int cmp=macb_manifest_path_cmp(A->path,A->pathc,B->path,B->pathc);
+  if (cmp) return cmp;
+  return A->seq-B->seq;
+}
+
+// Split off one tab-terminated field from (*src..end). Null if the line ran out first.
+static const char *macb_manifest_field(int *dstc,const char **src,const char *end) {
+  const char *field=*src,*tab=memchr(field,'\t',end-field);
+  if (!tab) return 0;
+  *dstc=tab-field;
+  *src=tab+1;
+  return field;
+}
+
+static int macb_manifest_length(int64_t *dst,const char *src,int srcc) {
+  int64_t v=0;
+  if (srcc<1) return -1;
+  for (;srcc-->0;src++) {
+    if ((*src<'0')||(*src>'9')) return -1;
+    if ((v=v*10+(*src-'0'))>MACB_FORK_LIMIT) return -1;
+  }
+  *dst=v;
+  return 0;
+}
+
+int macb_manifest_load(struct macb_manifest *manifest,const struct macb_request *request) {
+  const char *path=request->manifestpath;
+  memset(manifest,0,sizeof(struct macb_manifest));
+  int fd=open(path,O_RDONLY);
+  if (fd<0) goto _fail_;
+  struct stat st;
+  if (fstat(fd,&st)<0) {
+    close(fd);
+    goto _fail_;
+  }
+  if (st.st_size>0) {
+    const char *map=mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    if (map==MAP_FAILED) {
+      close(fd);
+      goto _fail_;
+    }
+    manifest->map=map;
+    manifest->mapc=st.st_size;
+  }
+  close(fd);
+
+  const char *src=manifest->map,*srcend=src+manifest->mapc,*line;
+  size_t linec=0;
+  for (line=src;line<srcend;linec++) {
+    const char *nl=memchr(line,'\n',srcend-line);
+    line=nl?(nl+1):srcend;
+  }
+  if ((linec>=INT_MAX)||!(manifest->v=malloc(sizeof(struct macb_manifest_entry)*(linec+1)))) goto _fail_;
+  int lineno=0;
+  for (line=src;line<srcend;) {
+    const char *nl=memchr(line,'\n',srcend-line);
+    const char *end=nl?nl:srcend;
+    lineno++;
+    if (end>line) {
+      struct macb_manifest_entry *entry=manifest->v+manifest->c;
+      const char *p=line,*dflen;
+      int dflenc;
+      if (
+        !(entry->path=macb_manifest_field(&entry->pathc,&p,end))||
+        !(entry->dfdigest=macb_manifest_field(&entry->dfdigestc,&p,end))||
+        !(dflen=macb_manifest_field(&dflenc,&p,end))||
+        !(entry->rfdigest=macb_manifest_field(&entry->rfdigestc,&p,end))||
+        (entry->dfdigestc>=MACB_DIGEST_SIZE)||(entry->rfdigestc>=MACB_DIGEST_SIZE)||
+        macb_manifest_length(&entry->dflen,dflen,dflenc)||
+        macb_manifest_length(&entry->rflen,p,end-p)
+      ) {
+        fprintf(MACB_ERR(request),"%s:%d: Malformed manifest line.\n",path,lineno);
+        macb_manifest_cleanup(manifest);
+        return -1;
+      }
+      entry->seq=lineno;
+      manifest->c++;
+    }
+    line=nl?(nl+1):srcend;
+  }
+  qsort(manifest->v,manifest->c,sizeof(struct macb_manifest_entry),macb_manifest_entry_cmp);
+  return 0;
+ _fail_:
+  fprintf(MACB_ERR(request),"%s: Failed to read manifest.\n",path);
+  macb_manifest_cleanup(manifest);
+  return -1;
+}
+
+void macb_manifest_cleanup(struct macb_manifest *manifest) {
+  if (manifest->map) munmap((void*)manifest->map,manifest->mapc);
+  if (manifest->v) free(manifest->v);
+  memset(manifest,0,sizeof(struct macb_manifest));
+}
+
+// Last entry for (path), ie the newest.
+const struct macb_manifest_entry *macb_manifest_find(const struct macb_manifest *manifest,const char *path) {
+  int pathc=strlen(path);
+  int lo=0,hi=manifest->c;
+  while (lo<hi) {
+    int ck=(lo+hi)>>1;
+    if (macb_manifest_path_cmp(path,pathc,manifest->v[ck].path,manifest->v[ck].pathc)<0) hi=ck;
+    else lo=ck+1;
+  }
+  if (lo&&!macb_manifest_path_cmp(manifest->v[lo-1].path,manifest->v[lo-1].pathc,path,pathc)) return manifest->v+lo-1;
+  return 0;
+}
+
+/* '-t --deep'
+ */
+
+static int macb_deep_fork(
+  struct macb_request *request,char *dst,int algo,int fd,int64_t *streamp,int64_t p,int64_t c,int threadc,const char *what
+) {
+  int err;
+  if (*streamp<0) {
+    err=macb_digest_fd(dst,algo,fd,p,c,threadc);
+  } else {
+    struct macb_digest digest;
+    macb_digest_init(&digest,algo);
+    if ((err=macb_file_skip(fd,p-*streamp))>=0) {
+      *streamp=p;
+      if ((err=macb_digest_copy(&digest,-1,fd,-1,c))>=0) *streamp+=c;
+    }
+    macb_digest_final(dst,&digest);
+  }
+  if (err<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to read %lld-byte %s fork.\n",request->arpath,(long long)c,what);
+    return -1;
+  }
+  return 0;
+}
+
+static int macb_deep_compare(
+  struct macb_request *request,const char *what,
+  const char *expectdigest,int64_t expectlen,const char *digest,int64_t len
+) {
+  if (expectlen!=len) {
+    fprintf(MACB_OUT(request),"%s:ERROR: %s fork length %lld, manifest says %lld.\n",request->arpath,what,(long long)len,(long long)expectlen);
+    return -1;
+  }
+  if (strcmp(expectdigest,digest)) {
+    fprintf(MACB_OUT(request),"%s:ERROR: %s fork digest mismatch! Manifest %s, computed %s.\n",request->arpath,what,expectdigest,digest);
+    return -1;
+  }
+  fprintf(MACB_OUT(request),"%s:INFO: %s fork %lld bytes, %s matches.\n",request->arpath,what,(long long)len,digest);
+  return 0;
+}
+
+int macb_main_deep(struct macb_request *request) {
+  struct macb_manifest manifest={0};
+  const struct macb_manifest_entry *entry=0;
+  int result=0,fd=-1;
+  #define FAIL { result=-1; goto _done_; }
+
+  if (!request->arpathc) {
+    fprintf(MACB_ERR(request),"Archive path required with '-t'\n");
+    return -1;
+  }
+
+  // Find the expected digests first. Algorithms come from there, or '--digest' if we're only printing.
+  int dfalgo=request->digest?request->digest:MACB_DIGEST_SHA256;
+  int rfalgo=dfalgo;
+  char expectdf[MACB_DIGEST_SIZE],expectrf[MACB_DIGEST_SIZE]; // The entry's, terminated.
+  if (request->manifestpathc) {
+    const struct macb_manifest *m=request->manifest;
+    if (!m) {
+      if (macb_manifest_load(&manifest,request)<0) FAIL
+      m=&manifest;
+    }
+    if (!(entry=macb_manifest_find(m,request->arpath))) {
+      fprintf(MACB_OUT(request),"%s:ERROR: Not in manifest '%s'.\n",request->arpath,request->manifestpath);
+      FAIL
+    }
+    memcpy(expectdf,entry->dfdigest,entry->dfdigestc);
+    expectdf[entry->dfdigestc]=0;
+    memcpy(expectrf,entry->rfdigest,entry->rfdigestc);
+    expectrf[entry->rfdigestc]=0;
+    if (((dfalgo=macb_digest_algo_of(expectdf))<0)||((rfalgo=macb_digest_algo_of(expectrf))<0)) {
+      fprintf(MACB_ERR(request),"%s: Unknown digest algorithm in manifest.\n",request->arpath);
+      FAIL
+    }
+  }
+
+  if ((fd=macb_file_openr(request->arpath))<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open archive file.\n",request->arpath);
+    FAIL
+  }
+  uint8_t hdr[128];
+  int64_t srcc=macb_file_read_header_fd(hdr,fd);
+  if (srcc<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to read 128-byte header, this can't be MacBinary.\n",request->arpath);
+    FAIL
+  }
+  struct macb_header header;
+  struct macb_layout layout;
+  macb_header_decode(&header,hdr,128);
+  macb_layout_compute(&layout,&header);
+  uint32_t findings=macb_header_validate(hdr,srcc?srcc:-1);
+  if (findings&(MACB_FINDING_DATA_BEYOND_EOF|MACB_FINDING_RES_BEYOND_EOF)) {
+    fprintf(MACB_OUT(request),"%s:ERROR: Forks extend beyond end of archive (%lld bytes).\n",request->arpath,(long long)srcc);
+    FAIL
+  }
+
+  // One archive at a time gets every core. In a batch, archives run in parallel instead.
+  int threadc=request->jobc;
+  if (threadc<1) {
+    long cpuc=sysconf(_SC_NPROCESSORS_ONLN);
+    threadc=(cpuc<1)?1:(cpuc>64)?64:cpuc;
+  }
+  int64_t streamp=srcc?-1:MACB_HEADER_SIZE;
+  char dfdigest[MACB_DIGEST_SIZE],rfdigest[MACB_DIGEST_SIZE];
+  if (macb_deep_fork(request,dfdigest,dfalgo,fd,&streamp,layout.dfp,layout.dflen,threadc,"data")<0) FAIL
+  if (macb_deep_fork(request,rfdigest,rfalgo,fd,&streamp,layout.rfp,layout.rflen,threadc,"resource")<0) FAIL
+
+  if (entry) {
+    if (macb_deep_compare(request,"Data",expectdf,entry->dflen,dfdigest,layout.dflen)<0) result=-1;
+    if (macb_deep_compare(request,"Resource",expectrf,entry->rflen,rfdigest,layout.rflen)<0) result=-1;
+  } else {
+    macb_manifest_emit(request,dfdigest,layout.dflen,rfdigest,layout.rflen);
+  }
+
+ _done_:
+  #undef FAIL
+  if (fd>=0) macb_file_close(fd);
+  macb_manifest_cleanup(&manifest);
+  return result;
+}
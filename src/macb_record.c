@@ -0,0 +1,272 @@
+#include "macb.h"
+#include <time.h>
+
+/* Machine-readable tell.
+ * One record per archive, as a JSON object on one line or a TSV row.
+ * Or with '--resources', one record per resource.
+ * Both formats carry the same fields in the same order; TSV's header row names them.
+ * The whole record is written under one stream lock, so records never interleave.
+ */
+
+#define MACB_RECORD_FIELDS \
+  "path","length","expected_length","version","name","type","creator", \
+  "flags_hi","flags_lo","vpos","hpos","folder","protect", \
+  "data_length","resource_length","comment_length","additional_header_length","unpacked_length", \
+  "ctime","mtime","source_version","minimum_version", \
+  "crc_stated","crc_computed","crc_ok","severity","findings","error"
+
+#define MACB_RECORD_RESOURCE_FIELDS \
+  "path","type","id","name","attributes","length","offset","error"
+
+static const char *macb_record_fieldv[]={MACB_RECORD_FIELDS};
+static const char *macb_record_resource_fieldv[]={MACB_RECORD_RESOURCE_FIELDS};
+
+static const char **macb_record_fields(int *fieldc,int kind) {
+  if (kind==MACB_RECORD_RESOURCE) {
+    *fieldc=sizeof(macb_record_resource_fieldv)/sizeof(macb_record_resource_fieldv[0]);
+    return macb_record_resource_fieldv;
+  }
+  *fieldc=sizeof(macb_record_fieldv)/sizeof(macb_record_fieldv[0]);
+  return macb_record_fieldv;
+}
+
+/* Strings.
+ * JSON: Everything outside printable ASCII becomes \u00XX, ie header bytes read as Latin-1.
+ * Not Mac Roman, but reversible, and indexers only need to compare them.
+ * TSV: Backslash escapes for tab, newline, backslash, and anything unprintable.
+ */
+
+static void macb_record_json_string(FILE *f,const char *src,int srcc) {
+  putc_unlocked('"',f);
+  for (;srcc-->0;src++) {
+    uint8_t ch=*src;
+    if ((ch=='"')||(ch=='\\')) {
+      putc_unlocked('\\',f);
+      putc_unlocked(ch,f);
+    } else if ((ch<0x20)||(ch>0x7e)) {
+      fprintf(f,"\\u%04x",ch);
+    } else {
+      putc_unlocked(ch,f);
+    }
+  }
+  putc_unlocked('"',f);
+}
+
+static void macb_record_tsv_string(FILE *f,const char *src,int srcc) {
+  for (;srcc-->0;src++) {
+    uint8_t ch=*src;
+    switch (ch) {
+      case '\t': fputs("\\t",f); break;
+      case '\n': fputs("\\n",f); break;
+      case '\r': fputs("\\r",f); break;
+      case '\\': fputs("\\\\",f); break;
+      default: {
+          if ((ch<0x20)||(ch>0x7e)) fprintf(f,"\\x%02x",ch);
+          else putc_unlocked(ch,f);
+        }
+    }
+  }
+}
+
+/* Field emitters.
+ * (fieldp) counts fields written so far, for the separators.
+ */
+
+struct macb_record_writer {
+  FILE *f;
+  int format;
+  const char **fieldv; // Null for the header record.
+  int fieldp;
+};
+
+static void macb_record_key(struct macb_record_writer *writer) {
+  if (writer->format==MACB_FORMAT_JSON) {
+    if (writer->fieldp) putc_unlocked(',',writer->f);
+    fprintf(writer->f,"\"%s\":",(writer->fieldv?writer->fieldv:macb_record_fieldv)[writer->fieldp]);
+  } else {
+    if (writer->fieldp) putc_unlocked('\t',writer->f);
+  }
+  writer->fieldp++;
+}
+
+static void macb_record_int(struct macb_record_writer *writer,int64_t v) {
+  macb_record_key(writer);
+  fprintf(writer->f,"%lld",(long long)v);
+}
+
+// Negative means unknown: null in JSON, empty in TSV.
+static void macb_record_int_or_null(struct macb_record_writer *writer,int64_t v) {
+  macb_record_key(writer);
+  if (v>=0) fprintf(writer->f,"%lld",(long long)v);
+  else if (writer->format==MACB_FORMAT_JSON) fputs("null",writer->f);
+}
+
+static void macb_record_string(struct macb_record_writer *writer,const char *src,int srcc) {
+  macb_record_key(writer);
+  if (!src) {
+    if (writer->format==MACB_FORMAT_JSON) fputs("null",writer->f);
+    return;
+  }
+  if (srcc<0) { srcc=0; while (src[srcc]) srcc++; }
+  if (writer->format==MACB_FORMAT_JSON) macb_record_json_string(writer->f,src,srcc);
+  else macb_record_tsv_string(writer->f,src,srcc);
+}
+
+static void macb_record_bool(struct macb_record_writer *writer,int v) {
+  macb_record_key(writer);
+  if (writer->format==MACB_FORMAT_JSON) fputs(v?"true":"false",writer->f);
+  else putc_unlocked(v?'1':'0',writer->f);
+}
+
+// Mac time as UTC ISO 8601. Unlike the text report, which uses local time.
+static void macb_record_time(struct macb_record_writer *writer,uint32_t v) {
+  time_t unixtime=v-(int64_t)UNIX_EPOCH_IN_MAC_TIME;
+  struct tm tm={0};
+  char tmp[32];
+  int tmpc=0;
+  if (gmtime_r(&unixtime,&tm)==&tm) {
+    tmpc=snprintf(tmp,sizeof(tmp),
+      "%04d-%02d-%02dT%02d:%02d:%02dZ",
+      tm.tm_year+1900,tm.tm_mon+1,tm.tm_mday,tm.tm_hour,tm.tm_min,tm.tm_sec
+    );
+  }
+  macb_record_string(writer,tmpc?tmp:0,tmpc);
+}
+
+// Findings as an array of names in JSON, comma-separated in TSV.
+static void macb_record_findings(struct macb_record_writer *writer,uint32_t findings) {
+  macb_record_key(writer);
+  if (writer->format==MACB_FORMAT_JSON) putc_unlocked('[',writer->f);
+  int first=1,i=0;
+  for (;i<MACB_FINDING_COUNT;i++) {
+    uint32_t finding=1u<<i;
+    if (!(findings&finding)) continue;
+    if (!first) putc_unlocked(',',writer->f);
+    first=0;
+    if (writer->format==MACB_FORMAT_JSON) fprintf(writer->f,"\"%s\"",macb_finding_name(finding));
+    else fputs(macb_finding_name(finding),writer->f);
+  }
+  if (writer->format==MACB_FORMAT_JSON) putc_unlocked(']',writer->f);
+}
+
+static const char *macb_record_severity(uint32_t findings) {
+  int severity=-1,i=0;
+  for (;i<MACB_FINDING_COUNT;i++) {
+    uint32_t finding=1u<<i;
+    if (!(findings&finding)) continue;
+    int s=macb_finding_severity(finding);
+    if (s>severity) severity=s;
+  }
+  switch (severity) {
+    case MACB_SEVERITY_INFO: return "info";
+    case MACB_SEVERITY_WARNING: return "warning";
+    case MACB_SEVERITY_ERROR: return "error";
+  }
+  return "ok";
+}
+
+static void macb_record_begin(struct macb_record_writer *writer) {
+  flockfile(writer->f);
+  if (writer->format==MACB_FORMAT_JSON) putc_unlocked('{',writer->f);
+}
+
+static void macb_record_end(struct macb_record_writer *writer) {
+  if (writer->format==MACB_FORMAT_JSON) putc_unlocked('}',writer->f);
+  putc_unlocked('\n',writer->f);
+  funlockfile(writer->f);
+}
+
+/* Header row.
+ */
+
+void macb_record_write_header(FILE *f,int format,int kind) {
+  if (format!=MACB_FORMAT_TSV) return;
+  int i=0,c;
+  const char **fieldv=macb_record_fields(&c,kind);
+  for (;i<c;i++) {
+    if (i) putc('\t',f);
+    fputs(fieldv[i],f);
+  }
+  putc('\n',f);
+}
+
+/* Record for an archive we couldn't read.
+ */
+
+void macb_record_write_error(FILE *f,int format,int kind,const char *path,const char *error) {
+  int fieldc;
+  struct macb_record_writer writer={.f=f,.format=format,.fieldv=macb_record_fields(&fieldc,kind)};
+  macb_record_begin(&writer);
+  macb_record_string(&writer,path,-1);
+  while (writer.fieldp<fieldc-1) macb_record_string(&writer,0,0);
+  macb_record_string(&writer,error,-1);
+  macb_record_end(&writer);
+}
+
+/* Record for a 128-byte header.
+ */
+
+void macb_record_write(FILE *f,int format,const char *path,const uint8_t *hdr,int64_t flen) {
+  struct macb_record_writer writer={.f=f,.format=format};
+  struct macb_header header;
+  struct macb_layout layout;
+  macb_header_decode(&header,hdr,MACB_HEADER_SIZE);
+  macb_layout_compute(&layout,&header);
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  uint32_t findings=macb_header_validate(hdr,flen);
+  uint16_t crcactual=macb_crc_macb(hdr,124,0);
+  macb_stats_end(&mark,MACB_STATS_CRC,128);
+  int namec=(header.namec<=63)?header.namec:63;
+
+  macb_record_begin(&writer);
+  macb_record_string(&writer,path,-1);
+  macb_record_int_or_null(&writer,flen);
+  macb_record_int(&writer,layout.total);
+  macb_record_int(&writer,header.version);
+  macb_record_string(&writer,header.name,namec);
+  macb_record_string(&writer,(char*)hdr+0x41,4);
+  macb_record_string(&writer,(char*)hdr+0x45,4);
+  macb_record_int(&writer,header.flags_hi);
+  macb_record_int(&writer,header.flags_lo);
+  macb_record_int(&writer,header.vpos);
+  macb_record_int(&writer,header.hpos);
+  macb_record_int(&writer,header.folder);
+  macb_record_int(&writer,header.protect);
+  macb_record_int(&writer,header.dflen);
+  macb_record_int(&writer,header.rflen);
+  macb_record_int(&writer,header.cmtlen);
+  macb_record_int(&writer,header.addlhdrlen);
+  macb_record_int(&writer,header.unpacklen);
+  macb_record_time(&writer,header.ctime);
+  macb_record_time(&writer,header.mtime);
+  macb_record_int(&writer,header.srcversion);
+  macb_record_int(&writer,header.minversion);
+  macb_record_int(&writer,header.crc);
+  macb_record_int(&writer,crcactual);
+  macb_record_bool(&writer,!(findings&MACB_FINDING_CRC));
+  macb_record_string(&writer,macb_record_severity(findings),-1);
+  macb_record_findings(&writer,findings);
+  macb_record_string(&writer,0,0);
+  macb_record_end(&writer);
+}
+
+/* Record for one resource.
+ * Type as four characters, same as the header record. Offset is where the body starts in the archive.
+ */
+
+void macb_record_write_resource(FILE *f,int format,const char *path,const struct macb_resource *resource,int64_t offset) {
+  int fieldc;
+  struct macb_record_writer writer={.f=f,.format=format,.fieldv=macb_record_fields(&fieldc,MACB_RECORD_RESOURCE)};
+  uint8_t type[4]={resource->type>>24,resource->type>>16,resource->type>>8,resource->type};
+  macb_record_begin(&writer);
+  macb_record_string(&writer,path,-1);
+  macb_record_string(&writer,(char*)type,4);
+  macb_record_int(&writer,resource->id);
+  macb_record_string(&writer,resource->name,resource->namec);
+  macb_record_int(&writer,resource->attributes);
+  macb_record_int_or_null(&writer,resource->len);
+  macb_record_int(&writer,offset);
+  macb_record_string(&writer,0,0);
+  macb_record_end(&writer);
+}
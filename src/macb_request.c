@@ -1,4 +1,6 @@
 #include "macb.h"
+#include <unistd.h>
+#include <time.h>
 
 /* Cleanup.
  */
@@ -8,6 +10,15 @@ void macb_request_cleanup(struct macb_request *request) {
   if (request->dfpath) free(request->dfpath);
   if (request->rfpath) free(request->rfpath);
   if (request->fipath) free(request->fipath);
+  if (request->catpath) free(request->catpath);
+  if (request->storepath) free(request->storepath);
+  if (request->manifestpath) free(request->manifestpath);
+  if (request->bundlepath) free(request->bundlepath);
+  if (request->cachepath) free(request->cachepath);
+  if (request->batchv) {
+    while (request->batchc-->0) free(request->batchv[request->batchc]);
+    free(request->batchv);
+  }
   memset(request,0,sizeof(struct macb_request));
 }
 
@@ -28,8 +39,61 @@ void macb_print_usage(const char *exename) {
     "  -r FILE,--res=FILE      Resource fork (input if -c, output if -x).\n"
     "  -f FILE,--finfo=FILE    Finder Info file (input if -c, output if -x).\n"
     "                          This is the 128-byte MacBinary header. Lengths and CRC are overwritten as needed.\n"
-    "  -T STR,--type=STR       Set file type (-c only).\n"
-    "  -C STR,--creator=STR    Set file creator (-c only).\n"
+    "                          Any FILE may be '-' for stdin or stdout. Forks may be pipes or FIFOs.\n"
+    "  -u FILE,--update=FILE   Change header fields of this MacBinary file in place. Forks aren't touched.\n"
+    "  -T STR,--type=STR       Set file type (-c or -u).\n"
+    "  -C STR,--creator=STR    Set file creator (-c or -u).\n"
+    "  --flags=N               Set Finder flags (-u only), 16 bits: high byte 0x49, low byte 0x65. eg '0x0100'.\n"
+    "  --ctime=DATE            Set create time (-u only), 'YYYY-MM-DD' or 'YYYY-MM-DDTHH:MM:SS', local.\n"
+    "  --mtime=DATE            Set modify time (-u only), same.\n"
+    "  -B,--batch              Process many archives: Repeat -x, -c, -t, or -u, or give none to read a\n"
+    "                          NUL-delimited list of archive paths from stdin. Can't combine with -d, -r, -f.\n"
+    "                          With -c, forks are 'NAME.data' and 'NAME.res' beside each 'NAME.bin'.\n"
+    "  -j N,--jobs=N           Worker threads for --batch. Default one per core.\n"
+    "  --as=single|double      Convert directly to (-x) or from (-c) AppleSingle or AppleDouble, instead of forks.\n"
+    "                          -d is the AppleSingle file or AppleDouble data file; -r is the AppleDouble header,\n"
+    "                          default '._' plus the data file's name.\n"
+    "                          Without -d, 'NAME.as', or 'NAME' and '._NAME', beside 'NAME.bin'.\n"
+    "  --as=hqx                Same, for BinHex 4.0. -d is the .hqx file, default 'NAME.hqx'. All three CRCs are checked.\n"
+    "  --io=ENGINE             I/O for --batch: 'auto' (default), 'sync', or 'uring'.\n"
+    "                          With io_uring, -t reads headers in bulk, a few syscalls per 32 archives.\n"
+    "  --index=DIR             Scan DIR recursively and record every MacBinary header in the catalog.\n"
+    "                          Unchanged files (same inode, size, and mtime) are not read again.\n"
+    "  --query                 List cataloged archives matching all given filters:\n"
+    "                            -T STR, -C STR       Type, creator.\n"
+    "                            --min-size=N[kMG]    Combined fork length at least N.\n"
+    "                            --max-size=N[kMG]    Combined fork length at most N.\n"
+    "                            --after=YYYY-MM-DD   Modified on or after this time (local).\n"
+    "                            --before=YYYY-MM-DD  Modified before this time (local).\n"
+    "                          Dates may include time as 'YYYY-MM-DDTHH:MM:SS'.\n"
+    "  --catalog=FILE          Catalog for --index and --query. Default 'macb.catalog'.\n"
+    "  --format=FMT            Output of -t: 'text' (default), 'json' (one object per line), or 'tsv'.\n"
+    "                          JSON and TSV carry every header field, findings, and CRC in one record per archive.\n"
+    "  --resources             With -t, list type, ID, name, size, and attributes of every resource instead.\n"
+    "                          Reads only the resource map, never resource data. With --format, one record per resource.\n"
+    "  --store=DIR             With -x, keep each distinct fork once in DIR/objects, named by SHA-256, and link outputs\n"
+    "                          to it (reflink, else hardlink, else copy). Appends digests to DIR/manifest.tsv.\n"
+    "  --rsrc=TYPE[:ID]        With -x, extract just the one resource, or every resource of TYPE, instead of forks.\n"
+    "                          Each goes to 'NAME.TYPE.ID' beside 'NAME.bin', or -d for a single one ('-' for stdout).\n"
+    "  --digest=ALGO           With -x or -c, hash both forks as they're copied: 'sha256', or 'fast' (XXH64 in 4 MB chunks).\n"
+    "                          Prints a manifest line per archive: path, data digest and length, resource digest and length.\n"
+    "  --manifest=FILE         Append those lines to FILE instead. Implies '--digest=sha256' unless given.\n"
+    "  --deep                  With -t, read both forks and check them against '--manifest', or print digests if none.\n"
+    "                          Large forks with 'fast' digests hash in parallel, -j threads, default one per core.\n"
+    "  --bundle=FILE           Many archives in one file, with a sorted index at the end. With -c, pack the archives given\n"
+    "                          (repeat -c, or a NUL-delimited list on stdin). With -x or -t, the archive is a member name.\n"
+    "                          With -t and no archive, list members.\n"
+    "  --tar                   With -x, read a tar of MacBinary files (the archive, default stdin) and write a tar to stdout\n"
+    "                          with 'NAME.finfo', 'NAME.data', 'NAME.res' in place of each 'NAME.bin'. Other members pass.\n"
+    "                          With -c, the reverse: tar on stdin, tar to the archive (default stdout). Streams throughout.\n"
+    "  --cache=FILE            With -c, skip archives whose inputs (path, size, mtime, inode of each, type, creator) and\n"
+    "                          output are unchanged since FILE recorded them, and record each one built.\n"
+    "                          Lines are only appended, so concurrent runs can share FILE.\n"
+    "  --serve=SOCK            Run as a daemon on Unix socket SOCK, serving -x, -c, -t, -u requests on -j workers.\n"
+    "                          Each request is its arguments, NUL-terminated, behind a 4-byte length. See macb_serve.c.\n"
+    "  --stats                 At exit, print to stderr time, bytes, calls, syscalls, and MB/s for each phase:\n"
+    "                          args, header read, fork read, crc, fork write, sync/close.\n"
+    "                          With many archives, also per-archive latency: mean, p50, p99, max, and a histogram.\n"
     "\n"
     "EXAMPLES:\n"
     "\n"
@@ -43,6 +107,24 @@ void macb_print_usage(const char *exename) {
     "    $ macb -x MyExistingFile.bin\n"
     "    # May create 'MyExistingFile.data' and/or 'MyExistingFile.res'\n"
     "\n"
+    "  Find applications over a megabyte, without opening any archives:\n"
+    "    $ macb --index=MyCorpus\n"
+    "    $ macb --query -T APPL --min-size=1M\n"
+    "\n"
+    "  Examine every archive in a tree, 8 at a time:\n"
+    "    $ find . -name '*.bin' -print0 | macb -t --batch --jobs=8\n"
+    "\n"
+    "  Same, as JSON Lines for an indexer:\n"
+    "    $ find . -name '*.bin' -print0 | macb -t --batch --format=json > headers.jsonl\n"
+    "\n"
+    "  Stream through a pipeline, without temporary files:\n"
+    "    $ curl -s https://example.com/App.bin | macb -x - -r - | my-resource-tool\n"
+    "    $ generate-data | macb -c - -d - -r MyResources -T TEXT > MyFile.bin\n"
+    "\n"
+    "  Convert a whole tree to AppleDouble for a file share, and back:\n"
+    "    $ find . -name '*.bin' -print0 | macb -x --batch --as=double\n"
+    "    $ find . -name '*.bin' -print0 | macb -c --batch --as=double\n"
+    "\n"
   );
 }
 
@@ -60,12 +142,19 @@ static int macb_canonicalize_option(const char *k,int kc) {
     case 'f': return 'f';
     case 'T': return 'T';
     case 'C': return 'C';
+    case 'B': return 'B';
+    case 'j': return 'j';
+    case 'u': return 'u';
     default: return 0;
   }
   if ((kc==4)&&!memcmp(k,"help",4)) return 'h';
   if ((kc==7)&&!memcmp(k,"extract",7)) return 'x';
   if ((kc==6)&&!memcmp(k,"create",6)) return 'c';
   if ((kc==4)&&!memcmp(k,"tell",4)) return 't';
+  if ((kc==6)&&!memcmp(k,"update",6)) return 'u';
+  if ((kc==5)&&!memcmp(k,"flags",5)) return 'g';
+  if ((kc==5)&&!memcmp(k,"ctime",5)) return 'e';
+  if ((kc==5)&&!memcmp(k,"mtime",5)) return 'm';
   if ((kc==4)&&!memcmp(k,"data",4)) return 'd';
   if ((kc==9)&&!memcmp(k,"data-fork",9)) return 'd';
   if ((kc==3)&&!memcmp(k,"res",3)) return 'r';
@@ -75,6 +164,29 @@ static int macb_canonicalize_option(const char *k,int kc) {
   if ((kc==5)&&!memcmp(k,"finfo",5)) return 'f';
   if ((kc==4)&&!memcmp(k,"type",4)) return 'T';
   if ((kc==7)&&!memcmp(k,"creator",7)) return 'C';
+  if ((kc==5)&&!memcmp(k,"batch",5)) return 'B';
+  if ((kc==4)&&!memcmp(k,"jobs",4)) return 'j';
+  if ((kc==5)&&!memcmp(k,"index",5)) return 'i';
+  if ((kc==5)&&!memcmp(k,"query",5)) return 'q';
+  if ((kc==7)&&!memcmp(k,"catalog",7)) return 'k';
+  if ((kc==8)&&!memcmp(k,"min-size",8)) return 's';
+  if ((kc==8)&&!memcmp(k,"max-size",8)) return 'S';
+  if ((kc==5)&&!memcmp(k,"after",5)) return 'a';
+  if ((kc==6)&&!memcmp(k,"before",6)) return 'b';
+  if ((kc==6)&&!memcmp(k,"format",6)) return 'F';
+  if ((kc==2)&&!memcmp(k,"io",2)) return 'I';
+  if ((kc==2)&&!memcmp(k,"as",2)) return 'A';
+  if ((kc==9)&&!memcmp(k,"resources",9)) return 'L';
+  if ((kc==4)&&!memcmp(k,"rsrc",4)) return 'P';
+  if ((kc==5)&&!memcmp(k,"store",5)) return 'O';
+  if ((kc==6)&&!memcmp(k,"digest",6)) return 'D';
+  if ((kc==8)&&!memcmp(k,"manifest",8)) return 'M';
+  if ((kc==4)&&!memcmp(k,"deep",4)) return 'V';
+  if ((kc==6)&&!memcmp(k,"bundle",6)) return 'U';
+  if ((kc==3)&&!memcmp(k,"tar",3)) return 'R';
+  if ((kc==5)&&!memcmp(k,"serve",5)) return 'v';
+  if ((kc==5)&&!memcmp(k,"cache",5)) return 'K';
+  if ((kc==5)&&!memcmp(k,"stats",5)) return 'Z';
   return 0;
 }
 
@@ -86,7 +198,7 @@ static int macb_set_command(
   char command
 ) {
   if (request->command&&(request->command!=command)) {
-    fprintf(stderr,"Conflicting commands '%c' and '%c'\n",request->command,command);
+    fprintf(MACB_ERR(request),"Conflicting commands '%c' and '%c'\n",request->command,command);
     return -1;
   }
   request->command=command;
@@ -94,11 +206,12 @@ static int macb_set_command(
 }
 
 static int macb_set_string(
+  struct macb_request *request,
   char **dst,int *dstc,
   const char *src,int srcc
 ) {
   if (*dst) {
-    fprintf(stderr,"Conflicting paths '%.*s' and '%.*s'\n",*dstc,*dst,srcc,src);
+    fprintf(MACB_ERR(request),"Conflicting paths '%.*s' and '%.*s'\n",*dstc,*dst,srcc,src);
     return -1;
   }
   if (!(*dst=malloc(srcc+1))) return -1;
@@ -108,7 +221,173 @@ static int macb_set_string(
   return 0;
 }
 
+static int macb_append_batch_path(
+  struct macb_request *request,
+  const char *src,int srcc
+) {
+  if (request->batchc>=request->batcha) {
+    int na=request->batcha+32;
+    if (na>INT_MAX/sizeof(void*)) return -1;
+    void *nv=realloc(request->batchv,sizeof(void*)*na);
+    if (!nv) return -1;
+    request->batchv=nv;
+    request->batcha=na;
+  }
+  char *path=malloc(srcc+1);
+  if (!path) return -1;
+  memcpy(path,src,srcc);
+  path[srcc]=0;
+  request->batchv[request->batchc++]=path;
+  return 0;
+}
+
+/* The parser binds the next bare argument to any option, so a flag that got one must say so rather than drop it.
+ * (dst) may be null for flags that only need the check.
+ */
+static int macb_set_flag(struct macb_request *request,int *dst,const char *name,const char *v,int vc) {
+  if (vc) {
+    fprintf(MACB_ERR(request),"'--%s' takes no value, found '%.*s'\n",name,vc,v);
+    return -1;
+  }
+  if (dst) *dst=1;
+  return 0;
+}
+
+static int macb_set_int(struct macb_request *request,int *dst,const char *src,int srcc) {
+  int v=0,srcp=0;
+  if (srcc<1) goto _invalid_;
+  for (;srcp<srcc;srcp++) {
+    if ((src[srcp]<'0')||(src[srcp]>'9')) goto _invalid_;
+    if (v>INT_MAX/10) goto _invalid_;
+    v*=10;
+    v+=src[srcp]-'0';
+  }
+  *dst=v;
+  return 0;
+ _invalid_:
+  fprintf(MACB_ERR(request),"Expected integer, found '%.*s'\n",srcc,src);
+  return -1;
+}
+
+static int macb_set_size(struct macb_request *request,int64_t *dst,const char *src,int srcc) {
+  int64_t v=0;
+  int srcp=0;
+  if (srcc<1) goto _invalid_;
+  for (;(srcp<srcc)&&(src[srcp]>='0')&&(src[srcp]<='9');srcp++) {
+    if (v>INT64_MAX/10) goto _invalid_;
+    v*=10;
+    v+=src[srcp]-'0';
+  }
+  if (!srcp) goto _invalid_;
+  int shift=0;
+  if (srcp<srcc) {
+    switch (src[srcp++]) {
+      case 'k': case 'K': shift=10; break;
+      case 'm': case 'M': shift=20; break;
+      case 'g': case 'G': shift=30; break;
+      default: goto _invalid_;
+    }
+    if (srcp<srcc) goto _invalid_;
+  }
+  if (v>(INT64_MAX>>shift)) goto _invalid_;
+  *dst=v<<shift;
+  return 0;
+ _invalid_:
+  fprintf(MACB_ERR(request),"Expected size like '1234', '64k', or '2M', found '%.*s'\n",srcc,src);
+  return -1;
+}
+
+/* "YYYY-MM-DD" or "YYYY-MM-DDTHH:MM:SS", in local time.
+ * Same loose treatment of time zones as the reports.
+ */
+static int macb_set_time(struct macb_request *request,uint32_t *dst,const char *src,int srcc) {
+  struct tm tm={0};
+  char tmp[32];
+  if ((srcc<1)||(srcc>=(int)sizeof(tmp))) goto _invalid_;
+  memcpy(tmp,src,srcc);
+  tmp[srcc]=0;
+  int n=0;
+  if (sscanf(tmp,"%d-%d-%dT%d:%d:%d%n",&tm.tm_year,&tm.tm_mon,&tm.tm_mday,&tm.tm_hour,&tm.tm_min,&tm.tm_sec,&n)!=6) {
+    if (sscanf(tmp,"%d-%d-%d%n",&tm.tm_year,&tm.tm_mon,&tm.tm_mday,&n)!=3) goto _invalid_;
+  }
+  if (n!=srcc) goto _invalid_;
+  tm.tm_year-=1900;
+  tm.tm_mon-=1;
+  tm.tm_isdst=-1;
+  time_t unixtime=mktime(&tm);
+  if (unixtime==(time_t)-1) goto _invalid_;
+  int64_t mactime=(int64_t)unixtime+UNIX_EPOCH_IN_MAC_TIME;
+  if ((mactime<0)||(mactime>UINT32_MAX)) goto _invalid_;
+  *dst=mactime;
+  return 0;
+ _invalid_:
+  fprintf(MACB_ERR(request),"Expected date like 'YYYY-MM-DD' or 'YYYY-MM-DDTHH:MM:SS', found '%.*s'\n",srcc,src);
+  return -1;
+}
+
+static int macb_set_flags(struct macb_request *request,const char *src,int srcc) {
+  char tmp[16],*end=0;
+  if ((srcc<1)||(srcc>=(int)sizeof(tmp))) goto _invalid_;
+  memcpy(tmp,src,srcc);
+  tmp[srcc]=0;
+  long v=strtol(tmp,&end,0);
+  if (*end||(v<0)||(v>0xffff)) goto _invalid_;
+  request->flags=v;
+  request->flagsset=1;
+  return 0;
+ _invalid_:
+  fprintf(MACB_ERR(request),"Expected 16-bit Finder flags like '0x0100', found '%.*s'\n",srcc,src);
+  return -1;
+}
+
+static int macb_set_format(struct macb_request *request,int *dst,const char *src,int srcc) {
+  if ((srcc==4)&&!memcmp(src,"text",4)) *dst=MACB_FORMAT_TEXT;
+  else if ((srcc==4)&&!memcmp(src,"json",4)) *dst=MACB_FORMAT_JSON;
+  else if ((srcc==3)&&!memcmp(src,"tsv",3)) *dst=MACB_FORMAT_TSV;
+  else {
+    fprintf(MACB_ERR(request),"Expected format 'text', 'json', or 'tsv', found '%.*s'\n",srcc,src);
+    return -1;
+  }
+  return 0;
+}
+
+static int macb_set_io(struct macb_request *request,int *dst,const char *src,int srcc) {
+  if ((srcc==4)&&!memcmp(src,"auto",4)) *dst=MACB_IO_AUTO;
+  else if ((srcc==4)&&!memcmp(src,"sync",4)) *dst=MACB_IO_SYNC;
+  else if ((srcc==5)&&!memcmp(src,"uring",5)) *dst=MACB_IO_URING;
+  else {
+    fprintf(MACB_ERR(request),"Expected I/O engine 'auto', 'sync', or 'uring', found '%.*s'\n",srcc,src);
+    return -1;
+  }
+  return 0;
+}
+
+static int macb_set_as(struct macb_request *request,int *dst,const char *src,int srcc) {
+  if ((srcc==9)&&!memcmp(src,"macbinary",9)) *dst=MACB_AS_MACBINARY;
+  else if ((srcc==6)&&!memcmp(src,"single",6)) *dst=MACB_AS_SINGLE;
+  else if ((srcc==6)&&!memcmp(src,"double",6)) *dst=MACB_AS_DOUBLE;
+  else if ((srcc==3)&&!memcmp(src,"hqx",3)) *dst=MACB_AS_BINHEX;
+  else if ((srcc==6)&&!memcmp(src,"binhex",6)) *dst=MACB_AS_BINHEX;
+  else {
+    fprintf(MACB_ERR(request),"Expected 'single', 'double', or 'hqx', found '%.*s'\n",srcc,src);
+    return -1;
+  }
+  return 0;
+}
+
+static int macb_set_digest(struct macb_request *request,int *dst,const char *src,int srcc) {
+  if ((srcc==6)&&!memcmp(src,"sha256",6)) *dst=MACB_DIGEST_SHA256;
+  else if ((srcc==4)&&!memcmp(src,"fast",4)) *dst=MACB_DIGEST_FAST;
+  else if ((srcc==8)&&!memcmp(src,"xxh64-4m",8)) *dst=MACB_DIGEST_FAST;
+  else {
+    fprintf(MACB_ERR(request),"Expected digest 'sha256' or 'fast', found '%.*s'\n",srcc,src);
+    return -1;
+  }
+  return 0;
+}
+
 static int macb_set_ostype(
+  struct macb_request *request,
   uint32_t *dst,
   const char *src,int srcc
 ) {
@@ -120,12 +399,12 @@ static int macb_set_ostype(
     (src[3]<0x20)||(src[3]>0x7e)
   ) {
     // ASCII is I think not actually a requirement, but you'd be crazy to do otherwise.
-    fprintf(stderr,"Type and creator must be 4 ASCII characters.\n");
+    fprintf(MACB_ERR(request),"Type and creator must be 4 ASCII characters.\n");
     return -1;
   }
   uint32_t packed=(src[0]<<24)|(src[1]<<16)|(src[2]<<8)|src[3];
   if (*dst&&(*dst!=packed)) {
-    fprintf(stderr,
+    fprintf(MACB_ERR(request),
       "Conflicting type or creator '%c%c%c%c' and '%.4s'\n",
       (*dst)>>24,((*dst)>>16)&0xff,((*dst)>>8)&0xff,(*dst)&0xff,src
     );
@@ -135,6 +414,29 @@ static int macb_set_ostype(
   return 0;
 }
  
+/* "TYPE" or "TYPE:ID", where TYPE is exactly four characters and ID may be negative.
+ */
+static int macb_set_rsrc(struct macb_request *request,const char *src,int srcc) {
+  uint32_t type=0;
+  if (macb_set_ostype(request,&type,src,(srcc>4)?4:srcc)<0) return -1;
+  request->rsrctype=type;
+  request->rsrcsel=MACB_RSRC_TYPE;
+  if (srcc==4) return 0;
+  if ((srcc<6)||(src[4]!=':')) {
+    fprintf(MACB_ERR(request),"Expected 'TYPE' or 'TYPE:ID', found '%.*s'\n",srcc,src);
+    return -1;
+  }
+  int neg=(src[5]=='-')?1:0;
+  if (macb_set_int(request,&request->rsrcid,src+5+neg,srcc-5-neg)<0) return -1;
+  if (neg) request->rsrcid=-request->rsrcid;
+  if ((request->rsrcid<-32768)||(request->rsrcid>32767)) {
+    fprintf(MACB_ERR(request),"Resource ID %d out of range.\n",request->rsrcid);
+    return -1;
+  }
+  request->rsrcsel=MACB_RSRC_TYPE_AND_ID;
+  return 0;
+}
+
 static int macb_apply_option(
   struct macb_request *request,
   char k,
@@ -144,17 +446,55 @@ static int macb_apply_option(
     case 'h': return macb_set_command(request,'h');
     case 'x':
     case 'c':
-    case 't': {
+    case 't':
+    case 'u': {
         if (macb_set_command(request,k)<0) return -1;
-        if (macb_set_string(&request->arpath,&request->arpathc,v,vc)<0) return -1;
+        // Repeated archive paths are legal in batch mode, which we might not know about yet.
+        if (request->arpath&&vc) return macb_append_batch_path(request,v,vc);
+        if (macb_set_string(request,&request->arpath,&request->arpathc,v,vc)<0) return -1;
       } return 0;
-    case 'd': return macb_set_string(&request->dfpath,&request->dfpathc,v,vc);
-    case 'r': return macb_set_string(&request->rfpath,&request->rfpathc,v,vc);
-    case 'f': return macb_set_string(&request->fipath,&request->fipathc,v,vc);
-    case 'T': return macb_set_ostype(&request->type,v,vc);
-    case 'C': return macb_set_ostype(&request->creator,v,vc);
+    case 'd': return macb_set_string(request,&request->dfpath,&request->dfpathc,v,vc);
+    case 'r': return macb_set_string(request,&request->rfpath,&request->rfpathc,v,vc);
+    case 'f': return macb_set_string(request,&request->fipath,&request->fipathc,v,vc);
+    case 'T': return macb_set_ostype(request,&request->type,v,vc);
+    case 'C': return macb_set_ostype(request,&request->creator,v,vc);
+    case 'B': return macb_set_flag(request,&request->batch,"batch",v,vc);
+    case 'j': return macb_set_int(request,&request->jobc,v,vc);
+    case 'i': {
+        if (macb_set_command(request,'i')<0) return -1;
+        return macb_set_string(request,&request->arpath,&request->arpathc,v,vc);
+      }
+    case 'q': {
+        if (macb_set_flag(request,0,"query",v,vc)<0) return -1;
+        return macb_set_command(request,'q');
+      }
+    case 'k': return macb_set_string(request,&request->catpath,&request->catpathc,v,vc);
+    case 's': return macb_set_size(request,&request->minsize,v,vc);
+    case 'S': return macb_set_size(request,&request->maxsize,v,vc);
+    case 'a': return macb_set_time(request,&request->after,v,vc);
+    case 'b': return macb_set_time(request,&request->before,v,vc);
+    case 'F': return macb_set_format(request,&request->format,v,vc);
+    case 'I': return macb_set_io(request,&request->io,v,vc);
+    case 'A': return macb_set_as(request,&request->as,v,vc);
+    case 'L': return macb_set_flag(request,&request->resources,"resources",v,vc);
+    case 'P': return macb_set_rsrc(request,v,vc);
+    case 'O': return macb_set_string(request,&request->storepath,&request->storepathc,v,vc);
+    case 'D': return macb_set_digest(request,&request->digest,v,vc);
+    case 'M': return macb_set_string(request,&request->manifestpath,&request->manifestpathc,v,vc);
+    case 'V': return macb_set_flag(request,&request->deep,"deep",v,vc);
+    case 'U': return macb_set_string(request,&request->bundlepath,&request->bundlepathc,v,vc);
+    case 'R': return macb_set_flag(request,&request->tar,"tar",v,vc);
+    case 'K': return macb_set_string(request,&request->cachepath,&request->cachepathc,v,vc);
+    case 'Z': return macb_set_flag(request,&request->stats,"stats",v,vc);
+    case 'g': return macb_set_flags(request,v,vc);
+    case 'e': return macb_set_time(request,&request->ctime,v,vc);
+    case 'm': return macb_set_time(request,&request->mtime,v,vc);
+    case 'v': {
+        if (macb_set_command(request,'v')<0) return -1;
+        return macb_set_string(request,&request->arpath,&request->arpathc,v,vc);
+      }
     default: {
-        fprintf(stderr,"Unexpected option '%c'\n",k);
+        fprintf(MACB_ERR(request),"Unexpected option '%c'\n",k);
         return -1;
       }
   }
@@ -191,7 +531,7 @@ int macb_request_init(
       argi++;
       v=argi;
       while (*argi) { argi++; vc++; }
-    } else if ((argp<argc)&&(argv[argp][0]!='-')) {
+    } else if ((argp<argc)&&((argv[argp][0]!='-')||!argv[argp][1])) { // "-" alone is a value: stdin or stdout.
       v=argv[argp++];
       while (v[vc]) vc++;
     }
@@ -204,9 +544,159 @@ int macb_request_init(
     continue;
     
    _unexpected_:
-    fprintf(stderr,"%s: Unexpected argument '%s'\n",argv[0],arg);
+    fprintf(MACB_ERR(request),"%s: Unexpected argument '%s'\n",argv[0],arg);
+    return -1;
+  }
+  
+  // Extra archive paths only make sense in batch mode, or packing a bundle.
+  if (request->batchc&&!request->batch&&!(request->bundlepath&&(request->command=='c'))) {
+    fprintf(MACB_ERR(request),
+      "Conflicting paths '%.*s' and '%s'\n",
+      request->arpathc,request->arpath,request->batchv[0]
+    );
     return -1;
   }
+  if (request->batch&&(request->command!='x')&&(request->command!='c')&&(request->command!='t')&&(request->command!='u')) {
+    fprintf(MACB_ERR(request),"'--batch' requires one of '-x', '-c', '-t', '-u'\n");
+    return -1;
+  }
+  if (request->batch&&(MACB_PATH_IS_STDIO(request->arpath))) {
+    fprintf(MACB_ERR(request),"'-' can't be used with '--batch'\n");
+    return -1;
+  }
+  // With '-c', forks and finder info are inputs: Only one can be stdin. With '-x', only one can be stdout.
+  if (
+    (MACB_PATH_IS_STDIO(request->dfpath)?1:0)+
+    (MACB_PATH_IS_STDIO(request->rfpath)?1:0)+
+    (MACB_PATH_IS_STDIO(request->fipath)?1:0)>1
+  ) {
+    fprintf(MACB_ERR(request),"Only one of '-d', '-r', '-f' can be '-'\n");
+    return -1;
+  }
+  if (request->as&&(request->command!='x')&&(request->command!='c')) {
+    fprintf(MACB_ERR(request),"'--as' requires '-x' or '-c'\n");
+    return -1;
+  }
+  if (request->as&&request->fipath) {
+    fprintf(MACB_ERR(request),"'--as' carries Finder info itself; '-f' can't be used with it\n");
+    return -1;
+  }
+  if ((request->as==MACB_AS_BINHEX)&&request->rfpath) {
+    fprintf(MACB_ERR(request),"BinHex is one file, '-r' can't be used with '--as=hqx'\n");
+    return -1;
+  }
+  if (request->resources&&(request->command!='t')) {
+    fprintf(MACB_ERR(request),"'--resources' requires '-t'\n");
+    return -1;
+  }
+  if (request->rsrcsel&&((request->command!='x')||request->as||request->rfpath||request->fipath)) {
+    fprintf(MACB_ERR(request),"'--rsrc' requires '-x', and can't be combined with '--as', '-r', or '-f'\n");
+    return -1;
+  }
+  if (request->storepath&&((request->command!='x')||request->as||request->rsrcsel)) {
+    fprintf(MACB_ERR(request),"'--store' requires '-x', and can't be combined with '--as' or '--rsrc'\n");
+    return -1;
+  }
+  if (request->storepath&&(MACB_PATH_IS_STDIO(request->dfpath)||MACB_PATH_IS_STDIO(request->rfpath))) {
+    fprintf(MACB_ERR(request),"'--store' outputs are links into the store, they can't be '-'\n");
+    return -1;
+  }
+  if (request->deep&&((request->command!='t')||request->resources||request->format)) {
+    fprintf(MACB_ERR(request),"'--deep' requires '-t', and can't be combined with '--resources' or '--format'\n");
+    return -1;
+  }
+  if ((request->digest||request->manifestpath)&&(request->command!='x')&&(request->command!='c')&&!request->deep) {
+    fprintf(MACB_ERR(request),"'--digest' and '--manifest' require '-x', '-c', or '-t --deep'\n");
+    return -1;
+  }
+  if ((request->digest||request->manifestpath)&&(request->as||request->rsrcsel||request->storepath)) {
+    fprintf(MACB_ERR(request),"'--digest' and '--manifest' can't be combined with '--as', '--rsrc', or '--store'\n");
+    return -1;
+  }
+  if (MACB_PATH_IS_STDIO(request->manifestpath)) {
+    fprintf(MACB_ERR(request),"Without '--manifest', digests go to stdout already\n");
+    return -1;
+  }
+  if (request->manifestpath&&!request->digest&&!request->deep) request->digest=MACB_DIGEST_SHA256;
+  if (request->bundlepath&&(request->batch||request->as||request->rsrcsel||request->resources||request->deep)) {
+    fprintf(MACB_ERR(request),"'--bundle' can't be combined with '--batch', '--as', '--rsrc', '--resources', or '--deep'\n");
+    return -1;
+  }
+  if (request->bundlepath&&(request->command=='c')&&(request->dfpath||request->rfpath||request->fipath||request->digest)) {
+    fprintf(MACB_ERR(request),"'-c --bundle' packs existing archives; '-d', '-r', '-f', and '--digest' don't apply\n");
+    return -1;
+  }
+  if (request->bundlepath&&(request->command!='c')&&(request->command!='x')&&(request->command!='t')) {
+    fprintf(MACB_ERR(request),"'--bundle' requires one of '-x', '-c', '-t'\n");
+    return -1;
+  }
+  if (request->bundlepath&&(request->command!='c')&&MACB_PATH_IS_STDIO(request->bundlepath)) {
+    fprintf(MACB_ERR(request),"Bundles must be regular files to read, not '-'\n");
+    return -1;
+  }
+  if (request->tar&&(request->command!='x')&&(request->command!='c')) {
+    fprintf(MACB_ERR(request),"'--tar' requires '-x' or '-c'\n");
+    return -1;
+  }
+  if (request->tar&&(
+    request->batch||request->dfpath||request->rfpath||request->fipath||request->as||request->rsrcsel||
+    request->storepath||request->digest||request->manifestpath||request->bundlepath
+  )) {
+    fprintf(MACB_ERR(request),"'--tar' converts whole streams, it can't be combined with other outputs or modes\n");
+    return -1;
+  }
+  if ((request->flagsset||request->ctime||request->mtime)&&(request->command!='u')) {
+    fprintf(MACB_ERR(request),"'--flags', '--ctime', and '--mtime' require '-u'\n");
+    return -1;
+  }
+  if ((request->command=='u')&&!request->type&&!request->creator&&!request->flagsset&&!request->ctime&&!request->mtime) {
+    fprintf(MACB_ERR(request),"'-u' needs something to change: '-T', '-C', '--flags', '--ctime', or '--mtime'\n");
+    return -1;
+  }
+  if ((request->command=='u')&&(
+    request->dfpath||request->rfpath||request->fipath||request->format||request->as||request->rsrcsel||request->resources||
+    request->storepath||request->digest||request->manifestpath||request->bundlepath||request->tar||request->cachepath
+  )) {
+    fprintf(MACB_ERR(request),"'-u' rewrites the header in place; fork, output, and format options don't apply\n");
+    return -1;
+  }
+  if ((request->command=='u')&&MACB_PATH_IS_STDIO(request->arpath)) {
+    fprintf(MACB_ERR(request),"'-u' writes back into the archive, it can't be '-'\n");
+    return -1;
+  }
+  if (request->cachepath&&((request->command!='c')||request->as||request->bundlepath||request->tar||request->digest)) {
+    fprintf(MACB_ERR(request),"'--cache' requires '-c', and can't be combined with '--as', '--bundle', '--tar', '--digest', or '--manifest'\n");
+    return -1;
+  }
+  if (request->cachepath&&(
+    MACB_PATH_IS_STDIO(request->cachepath)||MACB_PATH_IS_STDIO(request->arpath)||
+    MACB_PATH_IS_STDIO(request->dfpath)||MACB_PATH_IS_STDIO(request->rfpath)||MACB_PATH_IS_STDIO(request->fipath)
+  )) {
+    fprintf(MACB_ERR(request),"'--cache' compares files by identity, so nothing can be '-'\n");
+    return -1;
+  }
+  if ((request->command=='v')&&(
+    request->batch||request->dfpath||request->rfpath||request->fipath||request->type||request->creator||
+    request->format||request->as||request->rsrcsel||request->resources||request->storepath||
+    request->digest||request->manifestpath||request->deep||request->bundlepath||request->tar||request->cachepath||
+    request->stats
+  )) {
+    fprintf(MACB_ERR(request),"'--serve' takes only '-j'; everything else comes with each request\n");
+    return -1;
+  }
+  if (request->io&&!request->batch) {
+    fprintf(MACB_ERR(request),"'--io' requires '--batch'\n");
+    return -1;
+  }
+  if (request->format&&(request->command!='t')) {
+    fprintf(MACB_ERR(request),"'--format' requires '-t'\n");
+    return -1;
+  }
+  if (request->batch&&(request->dfpath||request->rfpath||request->fipath)) {
+    fprintf(MACB_ERR(request),"Fork and finder info paths can't be used with '--batch'\n");
+    return -1;
+  }
+  
   return 0;
 }
 
@@ -244,6 +734,46 @@ int macb_request_infer_archive_path_if_missing(struct macb_request *request) {
     return macb_request_set_archive_path(request,request->rfpath,request->rfpathc-5,".bin",4);
   }
   
-  fprintf(stderr,"Unable to infer archive path.\n");
+  fprintf(MACB_ERR(request),"Unable to infer archive path.\n");
   return -1;
 }
+
+/* Infer fork paths.
+ */
+ 
+static int macb_request_set_fork_path_if_exists(
+  char **dst,int *dstc,
+  const char *pfx,int pfxc,
+  const char *sfx,int sfxc
+) {
+  char *path=malloc(pfxc+sfxc+1);
+  if (!path) return -1;
+  memcpy(path,pfx,pfxc);
+  memcpy(path+pfxc,sfx,sfxc);
+  path[pfxc+sfxc]=0;
+  if (access(path,F_OK)<0) {
+    free(path);
+    return 0;
+  }
+  *dst=path;
+  *dstc=pfxc+sfxc;
+  return 1;
+}
+ 
+int macb_request_infer_fork_paths_if_missing(struct macb_request *request) {
+  if (!request->arpathc) return 0;
+  if (request->dfpathc||request->rfpathc) return 0;
+  if (request->dfpath) { free(request->dfpath); request->dfpath=0; }
+  if (request->rfpath) { free(request->rfpath); request->rfpath=0; }
+  
+  const char *pfx=request->arpath;
+  int pfxc=request->arpathc;
+  if ((pfxc>=4)&&!memcmp(pfx+pfxc-4,".bin",4)) pfxc-=4;
+  
+  int result=0,err;
+  if ((err=macb_request_set_fork_path_if_exists(&request->dfpath,&request->dfpathc,pfx,pfxc,".data",5))<0) return -1;
+  if (err) result=1;
+  if ((err=macb_request_set_fork_path_if_exists(&request->rfpath,&request->rfpathc,pfx,pfxc,".res",4))<0) return -1;
+  if (err) result=1;
+  return result;
+}
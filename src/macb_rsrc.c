@@ -0,0 +1,442 @@
+#include "macb.h"
+#include <unistd.h>
+
+/* Resource fork map.
+ *
+ * Resource header, at the start of the fork:
+ *   0000   4 data offset
+ *   0004   4 map offset
+ *   0008   4 data length
+ *   000c   4 map length
+ * Map:
+ *   0000  16 copy of the resource header, or zero
+ *   0010   4 next map handle
+ *   0014   2 file reference
+ *   0016   2 attributes
+ *   0018   2 type list offset, from the start of the map
+ *   001a   2 name list offset, from the start of the map
+ * Type list: 2 bytes count minus one, then 8 bytes per type:
+ *   0000   4 type
+ *   0004   2 count minus one
+ *   0006   2 reference list offset, from the start of the type list
+ * Reference list: 12 bytes per resource:
+ *   0000   2 ID, signed
+ *   0002   2 name offset, from the start of the name list, or 0xffff
+ *   0004   1 attributes
+ *   0005   3 data offset, from the start of the data
+ *   0008   4 handle
+ * Names are Pascal strings. Each resource's data is a 4-byte length and then the body.
+ */
+
+#define MACB_RESMAP_HEADER_SIZE 16
+#define MACB_RESMAP_MIN_SIZE 30
+#define MACB_RESMAP_LIMIT (1<<24) /* Offsets in the map are 16 bits, so real maps are well under this. */
+
+#define MACB_RES_ATTR_SYSHEAP   0x40
+#define MACB_RES_ATTR_PURGEABLE 0x20
+#define MACB_RES_ATTR_LOCKED    0x10
+#define MACB_RES_ATTR_PROTECTED 0x08
+#define MACB_RES_ATTR_PRELOAD   0x04
+#define MACB_RES_ATTR_CHANGED   0x02
+
+void macb_resmap_cleanup(struct macb_resmap *resmap) {
+  if (resmap->map) free(resmap->map);
+  if (resmap->v) free(resmap->v);
+  memset(resmap,0,sizeof(struct macb_resmap));
+}
+
+/* Read (c) bytes at (p), by pread or by skipping forward in a stream.
+ */
+
+static int macb_resmap_read_at(int fd,int64_t *streamp,void *dst,int c,int64_t p) {
+  uint8_t *DST=dst;
+  if (*streamp>=0) {
+    if (p<*streamp) return -1;
+    if (macb_file_skip(fd,p-*streamp)<0) return -1;
+    *streamp=p;
+  }
+  while (c>0) {
+    int err=(*streamp>=0)?read(fd,DST,c):pread(fd,DST,c,p);
+    if (err<=0) return -1;
+    DST+=err;
+    c-=err;
+    p+=err;
+    if (*streamp>=0) *streamp+=err;
+  }
+  return 0;
+}
+
+/* Sizes from the gaps between data offsets.
+ * Resources can share data, so equal offsets get the same size.
+ */
+
+static int macb_resmap_cmp_datap(const void *a,const void *b) {
+  const struct macb_resource *A=*(const struct macb_resource**)a,*B=*(const struct macb_resource**)b;
+  if (A->datap<B->datap) return -1;
+  if (A->datap>B->datap) return 1;
+  return 0;
+}
+
+static int macb_resmap_compute_sizes(struct macb_resmap *resmap) {
+  if (resmap->c<1) return 0;
+  struct macb_resource **sortv=malloc(sizeof(void*)*resmap->c);
+  if (!sortv) return -1;
+  int i=0; for (;i<resmap->c;i++) sortv[i]=resmap->v+i;
+  qsort(sortv,resmap->c,sizeof(void*),macb_resmap_cmp_datap);
+  int64_t end=resmap->datap+resmap->datalen;
+  for (i=resmap->c;i-->0;) {
+    struct macb_resource *resource=sortv[i];
+    int64_t len=end-resource->datap-4;
+    resource->len=(len>=0)?len:-1;
+    if ((i>0)&&(sortv[i-1]->datap<resource->datap)) end=resource->datap;
+  }
+  free(sortv);
+  return 0;
+}
+
+/* Read and decode.
+ */
+
+int macb_resmap_read(
+  struct macb_resmap *resmap,struct macb_request *request,
+  int fd,int64_t streamp,int64_t forkp,int64_t forklen
+) {
+  uint8_t head[MACB_RESMAP_HEADER_SIZE];
+  memset(resmap,0,sizeof(struct macb_resmap));
+  if ((forklen<MACB_RESMAP_HEADER_SIZE)||(macb_resmap_read_at(fd,&streamp,head,sizeof(head),forkp)<0)) {
+    fprintf(MACB_ERR(request),"%s: Resource fork too short for a resource header.\n",request->arpath);
+    return -1;
+  }
+  resmap->datap=macb_rd32(head,0);
+  resmap->mapp=macb_rd32(head,4);
+  resmap->datalen=macb_rd32(head,8);
+  int64_t maplen=macb_rd32(head,12);
+  if (
+    (resmap->datap+resmap->datalen>forklen)||(resmap->mapp+maplen>forklen)||
+    (resmap->mapp<MACB_RESMAP_HEADER_SIZE)||(maplen<MACB_RESMAP_MIN_SIZE)||(maplen>MACB_RESMAP_LIMIT)
+  ) {
+    fprintf(MACB_ERR(request),
+      "%s: Invalid resource header: data %lld bytes at %lld, map %lld bytes at %lld, in %lld-byte fork.\n",
+      request->arpath,(long long)resmap->datalen,(long long)resmap->datap,(long long)maplen,(long long)resmap->mapp,(long long)forklen
+    );
+    return -1;
+  }
+  if (!(resmap->map=malloc(maplen))) return -1;
+  resmap->mapc=maplen;
+  if (macb_resmap_read_at(fd,&streamp,resmap->map,resmap->mapc,forkp+resmap->mapp)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to read %d-byte resource map.\n",request->arpath,resmap->mapc);
+    macb_resmap_cleanup(resmap);
+    return -1;
+  }
+
+  const uint8_t *map=resmap->map;
+  int mapc=resmap->mapc;
+  resmap->attributes=macb_rd16(map,0x16);
+  int typelistp=macb_rd16(map,0x18);
+  int namelistp=macb_rd16(map,0x1a);
+  if (typelistp+2>mapc) {
+    fprintf(MACB_ERR(request),"%s: Resource type list offset %d outside %d-byte map.\n",request->arpath,typelistp,mapc);
+    macb_resmap_cleanup(resmap);
+    return -1;
+  }
+  resmap->typec=(macb_rd16(map,typelistp)+1)&0xffff;
+  if (typelistp+2+resmap->typec*8>mapc) {
+    fprintf(MACB_ERR(request),"%s: Resource type list (%d types) overflows map.\n",request->arpath,resmap->typec);
+    macb_resmap_cleanup(resmap);
+    return -1;
+  }
+
+  // Count first, so one allocation holds them all.
+  int total=0,ti=0;
+  for (;ti<resmap->typec;ti++) total+=macb_rd16(map,typelistp+2+ti*8+4)+1;
+  if (total>mapc/12) {
+    fprintf(MACB_ERR(request),"%s: Resource map claims %d resources, more than fit.\n",request->arpath,total);
+    macb_resmap_cleanup(resmap);
+    return -1;
+  }
+  if (total&&!(resmap->v=calloc(total,sizeof(struct macb_resource)))) {
+    macb_resmap_cleanup(resmap);
+    return -1;
+  }
+
+  for (ti=0;ti<resmap->typec;ti++) {
+    const uint8_t *typeentry=map+typelistp+2+ti*8;
+    uint32_t type=macb_rd32(typeentry,0);
+    int refc=macb_rd16(typeentry,4)+1;
+    int refp=typelistp+macb_rd16(typeentry,6);
+    if (refp+refc*12>mapc) {
+      fprintf(MACB_ERR(request),"%s: Reference list for type 0x%08x overflows map.\n",request->arpath,type);
+      macb_resmap_cleanup(resmap);
+      return -1;
+    }
+    for (;refc-->0;refp+=12) {
+      const uint8_t *ref=map+refp;
+      struct macb_resource *resource=resmap->v+resmap->c++;
+      resource->type=type;
+      resource->id=(int16_t)macb_rd16(ref,0);
+      resource->attributes=ref[4];
+      resource->datap=resmap->datap+((ref[5]<<16)|(ref[6]<<8)|ref[7]);
+      int namep=macb_rd16(ref,2);
+      if (namep!=0xffff) {
+        namep+=namelistp;
+        if ((namep<mapc)&&(namep+1+map[namep]<=mapc)) {
+          resource->name=(char*)map+namep+1;
+          resource->namec=map[namep];
+        }
+      }
+    }
+  }
+
+  if (macb_resmap_compute_sizes(resmap)<0) {
+    macb_resmap_cleanup(resmap);
+    return -1;
+  }
+  return 0;
+}
+
+/* List, for '-t --resources'.
+ */
+
+static void macb_resource_describe_type(char *dst,uint32_t type) {
+  uint8_t src[4]={type>>24,type>>16,type>>8,type};
+  int i=0; for (;i<4;i++) {
+    if ((src[i]<0x20)||(src[i]>0x7e)) {
+      sprintf(dst,"0x%08x",type);
+      return;
+    }
+  }
+  sprintf(dst,"'%.4s'",src);
+}
+
+static void macb_resource_describe_attributes(char *dst,uint8_t attributes) {
+  dst[0]=(attributes&MACB_RES_ATTR_SYSHEAP)?'H':'-';
+  dst[1]=(attributes&MACB_RES_ATTR_PURGEABLE)?'P':'-';
+  dst[2]=(attributes&MACB_RES_ATTR_LOCKED)?'L':'-';
+  dst[3]=(attributes&MACB_RES_ATTR_PROTECTED)?'R':'-';
+  dst[4]=(attributes&MACB_RES_ATTR_PRELOAD)?'D':'-';
+  dst[5]=(attributes&MACB_RES_ATTR_CHANGED)?'C':'-';
+  dst[6]=0;
+}
+
+int macb_main_resources(struct macb_request *request) {
+  int result=-1;
+  struct macb_resmap resmap={0};
+  uint8_t hdr[128];
+
+  if (!request->arpathc) {
+    fprintf(MACB_ERR(request),"Archive path required with '-t'\n");
+    return -1;
+  }
+  int fd=macb_file_openr(request->arpath);
+  if (fd<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open archive file.\n",request->arpath);
+    if (request->format) macb_record_write_error(MACB_OUT(request),request->format,MACB_RECORD_RESOURCE,request->arpath,"Failed to open archive.");
+    return -1;
+  }
+  int64_t flen=macb_file_read_header_fd(hdr,fd);
+  if (flen<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to read header.\n",request->arpath);
+    if (request->format) macb_record_write_error(MACB_OUT(request),request->format,MACB_RECORD_RESOURCE,request->arpath,"Failed to read header.");
+    goto _done_;
+  }
+  struct macb_header header;
+  struct macb_layout layout;
+  macb_header_decode(&header,hdr,128);
+  macb_layout_compute(&layout,&header);
+  if (macb_header_validate(hdr,flen?flen:-1)&MACB_FINDING_RES_BEYOND_EOF) {
+    fprintf(MACB_ERR(request),
+      "%s:ERROR: Header indicates resource fork %lld bytes at %lld -- impossible with archive length %lld.\n",
+      request->arpath,(long long)layout.rflen,(long long)layout.rfp,(long long)flen
+    );
+    if (request->format) macb_record_write_error(MACB_OUT(request),request->format,MACB_RECORD_RESOURCE,request->arpath,"Resource fork beyond end of archive.");
+    goto _done_;
+  }
+  if (!layout.rflen) {
+    if (!request->format) fprintf(MACB_OUT(request),"%s:INFO: No resource fork.\n",request->arpath);
+    result=0;
+    goto _done_;
+  }
+
+  if (macb_resmap_read(&resmap,request,fd,flen?-1:MACB_HEADER_SIZE,layout.rfp,layout.rflen)<0) {
+    if (request->format) macb_record_write_error(MACB_OUT(request),request->format,MACB_RECORD_RESOURCE,request->arpath,"Invalid resource map.");
+    goto _done_;
+  }
+
+  if (request->format) {
+    int i=0; for (;i<resmap.c;i++) {
+      const struct macb_resource *resource=resmap.v+i;
+      macb_record_write_resource(MACB_OUT(request),request->format,request->arpath,resource,layout.rfp+resource->datap+4);
+    }
+  } else {
+    FILE *out=MACB_OUT(request);
+    flockfile(out);
+    fprintf(out,
+      "%s:INFO: Resource fork %lld bytes: %d types, %d resources.\n",
+      request->arpath,(long long)layout.rflen,resmap.typec,resmap.c
+    );
+    int i=0; for (;i<resmap.c;i++) {
+      const struct macb_resource *resource=resmap.v+i;
+      char type[16],attributes[8],name[256];
+      macb_resource_describe_type(type,resource->type);
+      macb_resource_describe_attributes(attributes,resource->attributes);
+      int j=0; for (;j<resource->namec;j++) {
+        char ch=resource->name[j];
+        name[j]=((ch<0x20)||(ch>0x7e))?'?':ch;
+      }
+      if (resource->len>=0) {
+        fprintf(out,"%s: %-10s %6d %10lld %s",request->arpath,type,resource->id,(long long)resource->len,attributes);
+      } else {
+        fprintf(out,"%s: %-10s %6d %10s %s",request->arpath,type,resource->id,"?",attributes);
+      }
+      if (resource->name) fprintf(out," \"%.*s\"\n",resource->namec,name);
+      else fprintf(out,"\n");
+    }
+    funlockfile(out);
+  }
+  result=0;
+
+ _done_:
+  macb_resmap_cleanup(&resmap);
+  macb_file_close(fd);
+  return result;
+}
+
+/* Extract selected resources, for '-x --rsrc=TYPE[:ID]'.
+ */
+
+// "PREFIX.TYPE.ID". Type characters that don't belong in a file name are escaped as "%XX", eg "STR%20".
+static char *macb_resource_output_path(const struct macb_request *request,const struct macb_resource *resource) {
+  int pfxc=request->arpathc;
+  if ((pfxc>=4)&&!memcmp(request->arpath+pfxc-4,".bin",4)) pfxc-=4;
+  char type[16];
+  int typec=0,i=0;
+  for (;i<4;i++) {
+    uint8_t ch=resource->type>>(24-i*8);
+    if ((ch<=0x20)||(ch>0x7e)||(ch=='/')||(ch=='%')) typec+=sprintf(type+typec,"%%%02X",ch);
+    else type[typec++]=ch;
+  }
+  type[typec]=0;
+  char *path=malloc(pfxc+32);
+  if (!path) return 0;
+  sprintf(path,"%.*s.%s.%d",pfxc,request->arpath,type,resource->id);
+  return path;
+}
+
+static int macb_resource_extract_one(
+  struct macb_request *request,int fd,const struct macb_resmap *resmap,
+  const struct macb_resource *resource,int64_t forkp,const char *dstpath
+) {
+  char type[16];
+  uint8_t prefix[4];
+  macb_resource_describe_type(type,resource->type);
+  if (pread(fd,prefix,4,forkp+resource->datap)!=4) {
+    fprintf(MACB_ERR(request),"%s: Failed to read length of resource %s %d.\n",request->arpath,type,resource->id);
+    return -1;
+  }
+  int64_t len=macb_rd32(prefix,0);
+  if (resource->datap+4+len>resmap->datap+resmap->datalen) {
+    fprintf(MACB_ERR(request),
+      "%s: Resource %s %d claims %lld bytes, past the end of resource data.\n",
+      request->arpath,type,resource->id,(long long)len
+    );
+    return -1;
+  }
+  if (macb_file_write_from_fd(dstpath,fd,forkp+resource->datap+4,len)<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to write %lld-byte resource %s %d.\n",dstpath,(long long)len,type,resource->id);
+    return -1;
+  }
+  fprintf(MACB_OUT(request),"%s: Extracted resource %s %d, %lld bytes.\n",dstpath,type,resource->id,(long long)len);
+  return 0;
+}
+
+static int macb_resource_cmp_datap(const void *a,const void *b) {
+  const struct macb_resource *A=a,*B=b;
+  if (A->datap<B->datap) return -1;
+  if (A->datap>B->datap) return 1;
+  return 0;
+}
+
+int macb_main_extract_resources(struct macb_request *request) {
+  int result=-1;
+  struct macb_resmap resmap={0};
+  uint8_t hdr[128];
+
+  if (!request->arpathc) {
+    fprintf(MACB_ERR(request),"Archive path required with '-x'\n");
+    return -1;
+  }
+  int fd=macb_file_openr(request->arpath);
+  if (fd<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to open archive file.\n",request->arpath);
+    return -1;
+  }
+  int64_t flen=macb_file_read_header_fd(hdr,fd);
+  if (flen<0) {
+    fprintf(MACB_ERR(request),"%s: Failed to read 128-byte header, this can't be MacBinary.\n",request->arpath);
+    goto _done_;
+  }
+  if (!flen) {
+    fprintf(MACB_ERR(request),"%s: Selecting resources needs a seekable archive.\n",request->arpath);
+    goto _done_;
+  }
+  struct macb_header header;
+  struct macb_layout layout;
+  macb_header_decode(&header,hdr,128);
+  macb_layout_compute(&layout,&header);
+  if (macb_header_validate(hdr,flen)&MACB_FINDING_RES_BEYOND_EOF) {
+    fprintf(MACB_ERR(request),
+      "%s:ERROR: Header indicates resource fork %lld bytes at %lld -- impossible with archive length %lld.\n",
+      request->arpath,(long long)layout.rflen,(long long)layout.rfp,(long long)flen
+    );
+    goto _done_;
+  }
+  if (!layout.rflen) {
+    fprintf(MACB_ERR(request),"%s: No resource fork.\n",request->arpath);
+    goto _done_;
+  }
+  if (macb_resmap_read(&resmap,request,fd,-1,layout.rfp,layout.rflen)<0) goto _done_;
+
+  // Keep the selected ones at the front, in data order so the reads go forward through the file.
+  int selc=0,i=0;
+  for (;i<resmap.c;i++) {
+    const struct macb_resource *resource=resmap.v+i;
+    if (resource->type!=request->rsrctype) continue;
+    if ((request->rsrcsel==MACB_RSRC_TYPE_AND_ID)&&(resource->id!=request->rsrcid)) continue;
+    resmap.v[selc++]=*resource;
+  }
+  qsort(resmap.v,selc,sizeof(struct macb_resource),macb_resource_cmp_datap);
+
+  char type[16];
+  macb_resource_describe_type(type,request->rsrctype);
+  if (!selc) {
+    if (request->rsrcsel==MACB_RSRC_TYPE_AND_ID) {
+      fprintf(MACB_ERR(request),"%s: No resource %s %d.\n",request->arpath,type,request->rsrcid);
+    } else {
+      fprintf(MACB_ERR(request),"%s: No %s resources.\n",request->arpath,type);
+    }
+    goto _done_;
+  }
+  if (request->dfpathc&&(selc>1)) {
+    fprintf(MACB_ERR(request),"%s: %d %s resources, but '-d' names one file. Give an ID too.\n",request->arpath,selc,type);
+    goto _done_;
+  }
+
+  for (i=0;i<selc;i++) {
+    const struct macb_resource *resource=resmap.v+i;
+    if (request->dfpathc) {
+      if (macb_resource_extract_one(request,fd,&resmap,resource,layout.rfp,request->dfpath)<0) goto _done_;
+    } else {
+      char *path=macb_resource_output_path(request,resource);
+      if (!path) goto _done_;
+      int err=macb_resource_extract_one(request,fd,&resmap,resource,layout.rfp,path);
+      free(path);
+      if (err<0) goto _done_;
+    }
+  }
+  result=0;
+
+ _done_:
+  macb_resmap_cleanup(&resmap);
+  macb_file_close(fd);
+  return result;
+}
@@ -0,0 +1,275 @@
+#include "macb.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+/* '--serve': Resident daemon on a Unix domain socket.
+ * Spawning a process per archive costs more than the work for small ones, so clients can keep one daemon and talk to it.
+ *
+ * Protocol, all integers 4 bytes big-endian. A connection carries any number of requests, one at a time:
+ *   Request:  LEN, then LEN bytes of arguments, each NUL-terminated. Exactly what you'd put on the command line,
+ *             without argv[0]. So every field of struct macb_request is reachable, parsed by macb_request_init.
+ *   Response: LEN, then STATUS (0 ok, 1 failed), OUTC, OUTC bytes of report, ERRC, ERRC bytes of errors.
+ * The report is what the same command would print to stdout: With '--format=json', one record per archive.
+ * With '--format=tsv', the header row comes first in every response, so each one parses alone.
+ *
+ * Only '-x', '-c', '-t', and '-u' are served. Nothing can be '-': the daemon's stdin and stdout are not the client's.
+ * Relative paths resolve against the daemon's working directory.
+ *
+ * A fixed pool of workers (-j, default one per core) each accept a connection and serve it until the client hangs up.
+ * So at most that many connections are served at once; further ones wait in the listen backlog.
+ */
+
+#define MACB_SERVE_REQUEST_LIMIT 65536
+#define MACB_SERVE_ARG_LIMIT 256
+
+struct macb_serve {
+  const struct macb_request *request;
+  int fd; // Listening.
+};
+
+/* Socket I/O.
+ */
+
+static int macb_serve_read(int fd,void *dst,int dstc) {
+  char *DST=dst;
+  while (dstc>0) {
+    ssize_t err=read(fd,DST,dstc);
+    if (err<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    if (!err) return -1;
+    DST+=err;
+    dstc-=err;
+  }
+  return 0;
+}
+
+// MSG_NOSIGNAL: A client hanging up mid-response must not take the daemon down with SIGPIPE.
+static int macb_serve_write(int fd,const void *src,size_t srcc) {
+  const char *SRC=src;
+  while (srcc>0) {
+    ssize_t err=send(fd,SRC,srcc,MSG_NOSIGNAL);
+    if (err<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    SRC+=err;
+    srcc-=err;
+  }
+  return 0;
+}
+
+static void macb_serve_wr32(uint8_t *dst,uint32_t v) {
+  dst[0]=v>>24;
+  dst[1]=v>>16;
+  dst[2]=v>>8;
+  dst[3]=v;
+}
+
+static int macb_serve_respond(int fd,int status,const char *outv,size_t outc,const char *errv,size_t errc) {
+  if ((outc>UINT32_MAX/2)||(errc>UINT32_MAX/2)) return -1;
+  uint8_t pre[12];
+  macb_serve_wr32(pre,12+outc+errc);
+  macb_serve_wr32(pre+4,status?1:0);
+  macb_serve_wr32(pre+8,outc);
+  if (macb_serve_write(fd,pre,12)<0) return -1;
+  if (macb_serve_write(fd,outv,outc)<0) return -1;
+  uint8_t errcv[4];
+  macb_serve_wr32(errcv,errc);
+  if (macb_serve_write(fd,errcv,4)<0) return -1;
+  if (macb_serve_write(fd,errv,errc)<0) return -1;
+  return 0;
+}
+
+/* Run one request.
+ * (src) is the argument block, NUL-terminated. Reports go into (out,err).
+ */
+
+static int macb_serve_check(struct macb_request *request,FILE *err) {
+  if ((request->command!='x')&&(request->command!='c')&&(request->command!='t')&&(request->command!='u')) {
+    fprintf(err,"Only '-x', '-c', '-t', and '-u' are served.\n");
+    return -1;
+  }
+  if (request->batch||request->tar) {
+    fprintf(err,"'--batch' and '--tar' read stdin, they can't be served. Send one request per archive.\n");
+    return -1;
+  }
+  if (request->stats) {
+    fprintf(err,"'--stats' counts for the whole process, it can't be served.\n");
+    return -1;
+  }
+  if (
+    MACB_PATH_IS_STDIO(request->arpath)||MACB_PATH_IS_STDIO(request->dfpath)||
+    MACB_PATH_IS_STDIO(request->rfpath)||MACB_PATH_IS_STDIO(request->fipath)||
+    MACB_PATH_IS_STDIO(request->bundlepath)
+  ) {
+    fprintf(err,"'-' is the daemon's stdin or stdout, not the client's. Name files instead.\n");
+    return -1;
+  }
+  if (request->bundlepath&&(request->command=='c')&&!request->arpathc) {
+    fprintf(err,"'-c --bundle' needs its archives named, it can't read the list from stdin.\n");
+    return -1;
+  }
+  return 0;
+}
+
+static int macb_serve_run(char *src,int srcc,FILE *out,FILE *err) {
+  char *argv[MACB_SERVE_ARG_LIMIT];
+  int argc=0,srcp=0;
+  argv[argc++]="macb";
+  while (srcp<srcc) {
+    if (argc>=MACB_SERVE_ARG_LIMIT) {
+      fprintf(err,"Too many arguments, limit %d.\n",MACB_SERVE_ARG_LIMIT-1);
+      return -1;
+    }
+    argv[argc++]=src+srcp;
+    while (src[srcp]) srcp++;
+    srcp++;
+  }
+
+  // Parse errors go to the client, like everything else about its request.
+  struct macb_request request={0};
+  request.err=err;
+  if (macb_request_init(&request,argc,argv)<0) {
+    macb_request_cleanup(&request);
+    return -1;
+  }
+  if (macb_serve_check(&request,err)<0) {
+    macb_request_cleanup(&request);
+    return -1;
+  }
+  if (!request.jobc) request.jobc=1; // For '--deep': Connections are already in parallel, don't split forks too.
+  request.out=out;
+  request.err=err;
+  if (request.format) macb_record_write_header(out,request.format,request.resources?MACB_RECORD_RESOURCE:MACB_RECORD_HEADER);
+  int result=macb_run_request(&request);
+  request.out=request.err=0;
+  macb_request_cleanup(&request);
+  return result;
+}
+
+/* Serve one connection until the client hangs up, or says something we can't frame.
+ */
+
+static void macb_serve_connection(int fd) {
+  char *src=malloc(MACB_SERVE_REQUEST_LIMIT+1);
+  if (!src) return;
+  while (1) {
+    uint8_t lenv[4];
+    if (macb_serve_read(fd,lenv,4)<0) break;
+    uint32_t srcc=((uint32_t)lenv[0]<<24)|(lenv[1]<<16)|(lenv[2]<<8)|lenv[3];
+    if (srcc>MACB_SERVE_REQUEST_LIMIT) break;
+    if (macb_serve_read(fd,src,srcc)<0) break;
+    if (srcc&&src[srcc-1]) break; // Last argument must be terminated.
+    src[srcc]=0;
+
+    char *outv=0,*errv=0;
+    size_t outc=0,errc=0;
+    FILE *out=open_memstream(&outv,&outc);
+    FILE *err=open_memstream(&errv,&errc);
+    int status=-1;
+    if (out&&err) status=macb_serve_run(src,srcc,out,err);
+    if (out) fclose(out);
+    if (err) fclose(err);
+    int sent=macb_serve_respond(fd,status<0,outv,outc,errv,errc);
+    if (outv) free(outv);
+    if (errv) free(errv);
+    if (sent<0) break;
+  }
+  free(src);
+}
+
+static void *macb_serve_worker_main(void *arg) {
+  const struct macb_serve *serve=arg;
+  while (1) {
+    int fd=accept(serve->fd,0,0);
+    if (fd<0) {
+      if ((errno==EINTR)||(errno==ECONNABORTED)) continue;
+      fprintf(stderr,"%s: Failed to accept connection.\n",serve->request->arpath);
+      return 0;
+    }
+    macb_serve_connection(fd);
+    close(fd);
+  }
+}
+
+/* Listen.
+ * A socket file left behind by a dead daemon is replaced. One with a live daemon behind it is not.
+ */
+
+static int macb_serve_listen(const char *path) {
+  struct sockaddr_un addr={.sun_family=AF_UNIX};
+  int pathc=0;
+  while (path[pathc]) pathc++;
+  if (pathc>=sizeof(addr.sun_path)) {
+    fprintf(stderr,"%s: Socket path too long, limit %d bytes.\n",path,(int)sizeof(addr.sun_path)-1);
+    return -1;
+  }
+  memcpy(addr.sun_path,path,pathc+1);
+
+  int fd=socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+  if (fd<0) return -1;
+  struct stat st;
+  if (!lstat(path,&st)&&S_ISSOCK(st.st_mode)) {
+    if (!connect(fd,(struct sockaddr*)&addr,sizeof(addr))) {
+      fprintf(stderr,"%s: Another daemon is already serving here.\n",path);
+      close(fd);
+      return -1;
+    }
+    close(fd);
+    unlink(path);
+    if ((fd=socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0))<0) return -1;
+  }
+  if (bind(fd,(struct sockaddr*)&addr,sizeof(addr))<0) {
+    fprintf(stderr,"%s: Failed to bind socket.\n",path);
+    close(fd);
+    return -1;
+  }
+  if (listen(fd,SOMAXCONN)<0) {
+    fprintf(stderr,"%s: Failed to listen on socket.\n",path);
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  return fd;
+}
+
+/* Serve, main entry point.
+ */
+
+int macb_main_serve(struct macb_request *request) {
+  if (!request->arpathc) {
+    fprintf(stderr,"Socket path required with '--serve'\n");
+    return -1;
+  }
+  struct macb_serve serve={.request=request};
+  if ((serve.fd=macb_serve_listen(request->arpath))<0) return -1;
+
+  int workerc=request->jobc;
+  if (workerc<1) {
+    long cpuc=sysconf(_SC_NPROCESSORS_ONLN);
+    workerc=(cpuc<1)?1:(cpuc>64)?64:cpuc;
+  }
+  fprintf(stderr,"%s: Serving with %d worker%s.\n",request->arpath,workerc,(workerc==1)?"":"s");
+
+  // This thread is one of the workers. Workers only return if accept fails for good.
+  pthread_t *threadv=malloc(sizeof(pthread_t)*workerc);
+  int startedc=0,i;
+  if (threadv) {
+    for (i=1;i<workerc;i++) {
+      if (pthread_create(threadv+startedc,0,macb_serve_worker_main,&serve)) break;
+      startedc++;
+    }
+  }
+  macb_serve_worker_main(&serve);
+  for (i=0;i<startedc;i++) pthread_join(threadv[i],0);
+  if (threadv) free(threadv);
+  close(serve.fd);
+  unlink(request->arpath);
+  return -1;
+}
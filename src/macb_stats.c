@@ -0,0 +1,204 @@
+#include "macb.h"
+#include <pthread.h>
+#include <time.h>
+
+/* '--stats': Where the time goes, per phase and per archive.
+ * Every counter is per thread, so workers never share a cache line: A helper that does I/O costs two vDSO clock reads
+ * and a few adds to memory only its own thread touches. Each thread's block is linked into a global list the first
+ * time it records anything, and the report sums them after the workers are joined.
+ * Blocks are never freed, a thread that exits keeps its counts.
+ *
+ * Latencies go into a log-linear histogram: Exact below 32 ns, then 8 buckets per power of two, so any
+ * percentile we interpolate from it is within 1/8 of the true value.
+ */
+
+#define MACB_STATS_HISTO_SUB 8
+#define MACB_STATS_HISTO_SIZE 512
+
+struct macb_stats_phase {
+  int64_t ns,bytes,syscallc,callc;
+};
+
+struct macb_stats_local {
+  struct macb_stats_local *next;
+  struct macb_stats_phase phasev[MACB_STATS_PHASE_COUNT];
+  int64_t histo[MACB_STATS_HISTO_SIZE];
+  int64_t archivec,archivens,archivemax;
+};
+
+int macb_stats_enabled=0;
+__thread int64_t macb_stats_syscallc=0;
+
+static __thread struct macb_stats_local *macb_stats_local=0;
+static struct macb_stats_local *macb_stats_list=0;
+static pthread_mutex_t macb_stats_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+int64_t macb_stats_now() {
+  struct timespec ts={0};
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (int64_t)ts.tv_sec*1000000000ll+ts.tv_nsec;
+}
+
+static struct macb_stats_local *macb_stats_get_local() {
+  if (macb_stats_local) return macb_stats_local;
+  struct macb_stats_local *local=calloc(1,sizeof(struct macb_stats_local));
+  if (!local) return 0;
+  pthread_mutex_lock(&macb_stats_mutex);
+  local->next=macb_stats_list;
+  macb_stats_list=local;
+  pthread_mutex_unlock(&macb_stats_mutex);
+  return macb_stats_local=local;
+}
+
+/* Record.
+ */
+
+void macb_stats_begin(struct macb_stats_mark *mark) {
+  if (!macb_stats_enabled) {
+    mark->ns=0;
+    return;
+  }
+  mark->ns=macb_stats_now();
+  mark->syscallc=macb_stats_syscallc;
+}
+
+void macb_stats_end(const struct macb_stats_mark *mark,int phase,int64_t bytes) {
+  if (!mark->ns) return;
+  int64_t now=macb_stats_now();
+  struct macb_stats_local *local=macb_stats_get_local();
+  if (!local||(phase<0)||(phase>=MACB_STATS_PHASE_COUNT)) return;
+  struct macb_stats_phase *p=local->phasev+phase;
+  p->ns+=now-mark->ns;
+  if (bytes>0) p->bytes+=bytes;
+  p->syscallc+=macb_stats_syscallc-mark->syscallc;
+  p->callc++;
+}
+
+static int macb_stats_bucket(int64_t ns) {
+  if (ns<0) ns=0;
+  if (ns<MACB_STATS_HISTO_SUB*4) return ns;
+  int e=63-__builtin_clzll(ns);
+  int sub=(ns>>(e-3))&(MACB_STATS_HISTO_SUB-1);
+  int p=MACB_STATS_HISTO_SUB*4+(e-5)*MACB_STATS_HISTO_SUB+sub;
+  return (p>=MACB_STATS_HISTO_SIZE)?(MACB_STATS_HISTO_SIZE-1):p;
+}
+
+// Lower bound of bucket (p), in ns. The upper bound is the next bucket's lower bound.
+static int64_t macb_stats_bucket_floor(int p) {
+  if (p<MACB_STATS_HISTO_SUB*4) return p;
+  p-=MACB_STATS_HISTO_SUB*4;
+  int e=p/MACB_STATS_HISTO_SUB+5;
+  int sub=p%MACB_STATS_HISTO_SUB;
+  return (int64_t)(MACB_STATS_HISTO_SUB+sub)<<(e-3);
+}
+
+void macb_stats_archive(int64_t ns) {
+  if (!macb_stats_enabled) return;
+  struct macb_stats_local *local=macb_stats_get_local();
+  if (!local) return;
+  local->histo[macb_stats_bucket(ns)]++;
+  local->archivec++;
+  local->archivens+=ns;
+  if (ns>local->archivemax) local->archivemax=ns;
+}
+
+/* Report.
+ */
+
+static const char *macb_stats_phase_name(int phase) {
+  switch (phase) {
+    case MACB_STATS_ARGS: return "args";
+    case MACB_STATS_HEADER: return "header read";
+    case MACB_STATS_FORK_READ: return "fork read";
+    case MACB_STATS_CRC: return "crc";
+    case MACB_STATS_FORK_WRITE: return "fork write";
+    case MACB_STATS_SYNC: return "sync/close";
+  }
+  return "?";
+}
+
+// Rank (q) of (c) samples, interpolated within its bucket.
+static double macb_stats_percentile(const int64_t *histo,int64_t c,double q) {
+  double rank=q*c;
+  int64_t below=0;
+  int p=0; for (;p<MACB_STATS_HISTO_SIZE;p++) {
+    if (!histo[p]) continue;
+    if (below+histo[p]>=rank) {
+      double lo=macb_stats_bucket_floor(p);
+      double hi=(p+1<MACB_STATS_HISTO_SIZE)?macb_stats_bucket_floor(p+1):lo;
+      return lo+(hi-lo)*((rank-below)/histo[p]);
+    }
+    below+=histo[p];
+  }
+  return 0.0;
+}
+
+static const char *macb_stats_ns_repr(char *dst,int dsta,double ns) {
+  if (ns<1000.0) snprintf(dst,dsta,"%.0f ns",ns);
+  else if (ns<1000000.0) snprintf(dst,dsta,"%.1f us",ns/1000.0);
+  else if (ns<1000000000.0) snprintf(dst,dsta,"%.2f ms",ns/1000000.0);
+  else snprintf(dst,dsta,"%.3f s",ns/1000000000.0);
+  return dst;
+}
+
+void macb_stats_report(FILE *f,int64_t wallns) {
+  struct macb_stats_phase phasev[MACB_STATS_PHASE_COUNT]={0};
+  int64_t histo[MACB_STATS_HISTO_SIZE]={0};
+  int64_t archivec=0,archivens=0,archivemax=0;
+  int i;
+  pthread_mutex_lock(&macb_stats_mutex);
+  struct macb_stats_local *local=macb_stats_list;
+  for (;local;local=local->next) {
+    for (i=0;i<MACB_STATS_PHASE_COUNT;i++) {
+      phasev[i].ns+=local->phasev[i].ns;
+      phasev[i].bytes+=local->phasev[i].bytes;
+      phasev[i].syscallc+=local->phasev[i].syscallc;
+      phasev[i].callc+=local->phasev[i].callc;
+    }
+    for (i=0;i<MACB_STATS_HISTO_SIZE;i++) histo[i]+=local->histo[i];
+    archivec+=local->archivec;
+    archivens+=local->archivens;
+    if (local->archivemax>archivemax) archivemax=local->archivemax;
+  }
+  pthread_mutex_unlock(&macb_stats_mutex);
+
+  // Phase times are summed over threads, so with -j they can add up to more than the wall time.
+  fprintf(f,"stats: %-12s %12s %14s %10s %10s %10s\n","phase","time ms","bytes","calls","syscalls","MB/s");
+  for (i=0;i<MACB_STATS_PHASE_COUNT;i++) {
+    const struct macb_stats_phase *p=phasev+i;
+    fprintf(f,"stats: %-12s %12.3f %14lld %10lld %10lld ",
+      macb_stats_phase_name(i),p->ns/1000000.0,(long long)p->bytes,(long long)p->callc,(long long)p->syscallc
+    );
+    if (p->bytes&&(p->ns>0)) fprintf(f,"%10.1f\n",(p->bytes/1000000.0)/(p->ns/1000000000.0));
+    else fprintf(f,"%10s\n","-");
+  }
+  fprintf(f,"stats: wall %.3f ms, %lld archive%s\n",wallns/1000000.0,(long long)archivec,(archivec==1)?"":"s");
+  if (archivec<2) return;
+
+  char mean[32],p50[32],p99[32],max[32];
+  fprintf(f,"stats: per archive: mean %s, p50 %s, p99 %s, max %s\n",
+    macb_stats_ns_repr(mean,sizeof(mean),(double)archivens/archivec),
+    macb_stats_ns_repr(p50,sizeof(p50),macb_stats_percentile(histo,archivec,0.50)),
+    macb_stats_ns_repr(p99,sizeof(p99),macb_stats_percentile(histo,archivec,0.99)),
+    macb_stats_ns_repr(max,sizeof(max),archivemax)
+  );
+
+  // Histogram by powers of two; the fine buckets are only for percentiles.
+  int64_t powv[64]={0};
+  for (i=0;i<MACB_STATS_HISTO_SIZE;i++) {
+    if (!histo[i]) continue;
+    int64_t floor=macb_stats_bucket_floor(i);
+    powv[floor?(63-__builtin_clzll(floor)):0]+=histo[i];
+  }
+  int64_t most=0;
+  for (i=0;i<64;i++) if (powv[i]>most) most=powv[i];
+  for (i=0;i<63;i++) {
+    if (!powv[i]) continue;
+    char lo[32],hi[32];
+    int barc=(int)((powv[i]*40+most-1)/most);
+    fprintf(f,"stats:   %10s .. %-10s %10lld %.*s\n",
+      macb_stats_ns_repr(lo,sizeof(lo),(double)(1ll<<i)),macb_stats_ns_repr(hi,sizeof(hi),(double)(1ll<<(i+1))),
+      (long long)powv[i],barc,"########################################"
+    );
+  }
+}
@@ -0,0 +1,214 @@
+#include "macb.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+  #include <sys/ioctl.h>
+  #include <linux/fs.h>
+#endif
+
+/* Content-addressed fork store, for '-x --store=DIR'.
+ *
+ * DIR/objects/ab/cdef...  Each distinct fork once, named by its SHA-256 in hex, read-only.
+ * DIR/tmp/                Objects being written. Renamed into place when complete, so objects are never partial.
+ * DIR/manifest.tsv        One line per archive extracted, see macb_store_write_manifest.
+ *
+ * A seekable archive is hashed first and copied only if the object is new, so a duplicate costs one read and no writes.
+ * A pipe can only be read once: We hash and write together, and throw the temp file away if the object already exists.
+ * Outputs are reflinked to the object where the filesystem can, otherwise hardlinked, otherwise copied.
+ * A hardlinked output shares the object's inode; replace it, don't edit it in place.
+ */
+
+#define MACB_STORE_BUFFER_SIZE 65536
+
+/* Paths.
+ */
+
+static int macb_store_path(char *dst,int dsta,const struct macb_request *request,const char *sub) {
+  int dstc=snprintf(dst,dsta,"%.*s/%s",request->storepathc,request->storepath,sub);
+  if ((dstc<0)||(dstc>=dsta)) return -1;
+  return dstc;
+}
+
+static int macb_store_object_path(char *dst,int dsta,const struct macb_request *request,const char *hex) {
+  int dstc=snprintf(dst,dsta,"%.*s/objects/%.2s/%s",request->storepathc,request->storepath,hex,hex+2);
+  if ((dstc<0)||(dstc>=dsta)) return -1;
+  return dstc;
+}
+
+static int macb_store_mkdir(const char *path) {
+  if (mkdir(path,0777)<0) {
+    if (errno!=EEXIST) return -1;
+  }
+  return 0;
+}
+
+// Temp file in DIR/tmp. Creates DIR, DIR/objects, and DIR/tmp the first time.
+static int macb_store_open_tmp(char *path,int patha,const struct macb_request *request) {
+  if (macb_store_path(path,patha,request,"tmp/XXXXXX")<0) return -1;
+  int fd=mkstemp(path);
+  if ((fd<0)&&(errno==ENOENT)) {
+    char dir[1024];
+    if (macb_store_mkdir(request->storepath)<0) return -1;
+    if (macb_store_path(dir,sizeof(dir),request,"objects")<0) return -1;
+    if (macb_store_mkdir(dir)<0) return -1;
+    if (macb_store_path(dir,sizeof(dir),request,"tmp")<0) return -1;
+    if (macb_store_mkdir(dir)<0) return -1;
+    if (macb_store_path(path,patha,request,"tmp/XXXXXX")<0) return -1;
+    fd=mkstemp(path);
+  }
+  return fd;
+}
+
+// Move a complete temp file into place. If another job stored the same object meanwhile, that's fine, it's identical.
+static int macb_store_publish(const char *tmppath,const struct macb_request *request,const char *hex) {
+  char path[1024];
+  int pathc=macb_store_object_path(path,sizeof(path),request,hex);
+  if (pathc<0) return -1;
+  path[pathc-63]=0; // "objects/ab"
+  if (macb_store_mkdir(path)<0) return -1;
+  path[pathc-63]='/';
+  chmod(tmppath,0444);
+  return rename(tmppath,path);
+}
+
+/* Store one fork.
+ */
+
+static int macb_store_fork_seekable(struct macb_request *request,char *hex,int *fresh,int fd,int64_t p,int64_t c) {
+  uint8_t buf[MACB_STORE_BUFFER_SIZE],digest[32];
+  struct macb_sha256 sha;
+  macb_sha256_init(&sha);
+  int64_t q=p,remaining=c;
+  while (remaining>0) {
+    int cpc=(remaining>(int64_t)sizeof(buf))?sizeof(buf):remaining;
+    int err=pread(fd,buf,cpc,q);
+    if (err<=0) {
+      if ((err<0)&&(errno==EINTR)) continue;
+      return -1;
+    }
+    macb_sha256_update(&sha,buf,err);
+    q+=err;
+    remaining-=err;
+  }
+  macb_sha256_final(digest,&sha);
+  macb_sha256_hex(hex,digest);
+
+  char path[1024];
+  if (macb_store_object_path(path,sizeof(path),request,hex)<0) return -1;
+  if (!access(path,F_OK)) {
+    *fresh=0;
+    return 0;
+  }
+  char tmppath[1024];
+  int tmpfd=macb_store_open_tmp(tmppath,sizeof(tmppath),request);
+  if (tmpfd<0) return -1;
+  if (macb_file_copy(tmpfd,fd,p,c)<0) {
+    close(tmpfd);
+    unlink(tmppath);
+    return -1;
+  }
+  close(tmpfd);
+  if (macb_store_publish(tmppath,request,hex)<0) {
+    unlink(tmppath);
+    return -1;
+  }
+  *fresh=1;
+  return 0;
+}
+
+static int macb_store_fork_stream(struct macb_request *request,char *hex,int *fresh,int fd,int64_t c) {
+  uint8_t buf[MACB_STORE_BUFFER_SIZE],digest[32];
+  struct macb_sha256 sha;
+  char tmppath[1024];
+  int tmpfd=macb_store_open_tmp(tmppath,sizeof(tmppath),request);
+  if (tmpfd<0) return -1;
+  macb_sha256_init(&sha);
+  while (c>0) {
+    int cpc=(c>(int64_t)sizeof(buf))?sizeof(buf):c;
+    int err=read(fd,buf,cpc);
+    if (err<=0) {
+      if ((err<0)&&(errno==EINTR)) continue;
+      close(tmpfd);
+      unlink(tmppath);
+      return -1;
+    }
+    macb_sha256_update(&sha,buf,err);
+    if (macb_file_append(tmpfd,buf,err)<0) {
+      close(tmpfd);
+      unlink(tmppath);
+      return -1;
+    }
+    c-=err;
+  }
+  close(tmpfd);
+  macb_sha256_final(digest,&sha);
+  macb_sha256_hex(hex,digest);
+
+  char path[1024];
+  if ((macb_store_object_path(path,sizeof(path),request,hex)>=0)&&!access(path,F_OK)) {
+    unlink(tmppath);
+    *fresh=0;
+    return 0;
+  }
+  if (macb_store_publish(tmppath,request,hex)<0) {
+    unlink(tmppath);
+    return -1;
+  }
+  *fresh=1;
+  return 0;
+}
+
+int macb_store_fork(struct macb_request *request,char *hex,int *fresh,int fd,int64_t *streamp,int64_t p,int64_t c) {
+  if (*streamp<0) return macb_store_fork_seekable(request,hex,fresh,fd,p,c);
+  if (macb_file_skip(fd,p-*streamp)<0) return -1;
+  *streamp=p;
+  if (macb_store_fork_stream(request,hex,fresh,fd,c)<0) return -1;
+  *streamp+=c;
+  return 0;
+}
+
+/* Put an object at an output path: Reflink, hardlink, or copy, whichever works first.
+ * Each one lands under a temp name and is renamed over (dstpath), so it holds the old file until the new one is whole.
+ */
+
+int macb_store_link(struct macb_request *request,const char *hex,const char *dstpath) {
+  char path[1024];
+  if (macb_store_object_path(path,sizeof(path),request,hex)<0) return -1;
+  int srcfd=open(path,O_RDONLY);
+  if (srcfd<0) return -1;
+  // Stdout, FIFOs and devices can only be copied into.
+  struct stat st;
+  int regular=!MACB_PATH_IS_STDIO(dstpath)&&(stat(dstpath,&st)||S_ISREG(st.st_mode));
+  #if defined(FICLONE)
+    struct macb_output output;
+    if (regular&&(macb_output_open(&output,dstpath,-1)>=0)) {
+      if ((output.mode!=MACB_OUTPUT_DIRECT)&&(ioctl(output.fd,FICLONE,srcfd)>=0)) {
+        close(srcfd);
+        return macb_output_commit(&output);
+      }
+      macb_output_abort(&output);
+    }
+  #endif
+  if (regular&&(macb_output_link(dstpath,path)>=0)) {
+    close(srcfd);
+    return 0;
+  }
+  int err=-1;
+  if (!fstat(srcfd,&st)) err=macb_file_write_from_fd(dstpath,srcfd,0,st.st_size);
+  close(srcfd);
+  return err;
+}
+
+/* Manifest.
+ * Same format as '--manifest', see macb_manifest_append.
+ */
+
+int macb_store_write_manifest(struct macb_request *request,const char *dfhex,int64_t dflen,const char *rfhex,int64_t rflen) {
+  char path[1024],dfdigest[MACB_DIGEST_SIZE],rfdigest[MACB_DIGEST_SIZE];
+  if (macb_store_path(path,sizeof(path),request,"manifest.tsv")<0) return -1;
+  snprintf(dfdigest,sizeof(dfdigest),"sha256:%s",dfhex);
+  snprintf(rfdigest,sizeof(rfdigest),"sha256:%s",rfhex);
+  return macb_manifest_append(path,request->arpath,dfdigest,dflen,rfdigest,rflen);
+}
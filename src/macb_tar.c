@@ -0,0 +1,550 @@
+#include "macb.h"
+#include <unistd.h>
+#include <errno.h>
+
+/* Tar bridge, for '-x --tar' and '-c --tar'.
+ *
+ * '-x --tar' reads a tar, and replaces each MacBinary member 'NAME.bin' with 'NAME.finfo' (the 128-byte header),
+ * then 'NAME.data' and 'NAME.res' if they're not empty. Other members pass through untouched.
+ * '-c --tar' does the reverse. A 'NAME.finfo' tells us both fork lengths before the forks arrive, so we can write
+ * the '.bin' member's tar header up front and stream the forks straight through.
+ * Forks with no '.finfo' ahead of them (tars from elsewhere) pair up with the adjacent other fork if there is one.
+ * That needs the first fork's length before its partner's, so the first one spools to an anonymous temp file.
+ *
+ * Everything else streams: One 512-byte header at a time, and fork bodies through macb_file_copy.
+ * Long names come in as GNU 'L' or pax 'path' records, and go out as pax when they don't fit ustar.
+ */
+
+#define MACB_TAR_BLOCK 512
+#define MACB_TAR_EXT_LIMIT (1<<20)
+#define MACB_TAR_PAD(n) ((MACB_TAR_BLOCK-((n)&(MACB_TAR_BLOCK-1)))&(MACB_TAR_BLOCK-1))
+
+struct macb_tar_member {
+  uint8_t hdr[MACB_TAR_BLOCK];
+  char name[4096]; int namec;
+  int64_t size;
+  int64_t mtime;
+  char type; // '0' for regular files, whatever the header said.
+  uint8_t *ext; int extc,exta; // Raw extension members ahead of this one, to pass through with it.
+};
+
+struct macb_tar {
+  struct macb_request *request;
+  int infd,outfd;
+  int spoolfd; // Anonymous temp file, opened on first need.
+  struct macb_tar_member member,next;
+  int havenext;
+};
+
+/* Numbers: Octal, NUL or space terminated, or GNU base-256 when the high bit is set.
+ */
+
+static int64_t macb_tar_rdnum(const uint8_t *src,int srcc) {
+  int64_t v=0;
+  if (src[0]&0x80) {
+    int i=1;
+    v=src[0]&0x3f;
+    for (;i<srcc;i++) {
+      if (v>(INT64_MAX>>8)) return -1;
+      v=(v<<8)|src[i];
+    }
+    return v;
+  }
+  int i=0;
+  while ((i<srcc)&&(src[i]==' ')) i++;
+  for (;(i<srcc)&&(src[i]>='0')&&(src[i]<='7');i++) {
+    if (v>(INT64_MAX>>3)) return -1;
+    v=(v<<3)|(src[i]-'0');
+  }
+  return v;
+}
+
+static void macb_tar_wrnum(uint8_t *dst,int dstc,int64_t v) {
+  // Octal if it fits with a terminator, otherwise base-256.
+  if (v<(1ll<<((dstc-1)*3))) {
+    snprintf((char*)dst,dstc,"%0*llo",dstc-1,(long long)v);
+  } else {
+    int i=dstc;
+    while (i-->1) { dst[i]=v; v>>=8; }
+    dst[0]=0x80;
+  }
+}
+
+static unsigned int macb_tar_checksum(const uint8_t *hdr) {
+  unsigned int sum=0;
+  int i=0; for (;i<MACB_TAR_BLOCK;i++) sum+=((i>=148)&&(i<156))?' ':hdr[i];
+  return sum;
+}
+
+/* Read.
+ */
+
+static int macb_tar_read_exactly(int fd,void *dst,int dstc) {
+  int dstp=0;
+  while (dstp<dstc) {
+    ssize_t err=read(fd,(char*)dst+dstp,dstc-dstp);
+    if (err<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    if (!err) break;
+    dstp+=err;
+  }
+  return dstp;
+}
+
+static int macb_tar_ext_append(struct macb_tar_member *member,const void *src,int srcc) {
+  if (member->extc>MACB_TAR_EXT_LIMIT-srcc) return -1;
+  if (member->extc+srcc>member->exta) {
+    int na=member->extc+srcc+MACB_TAR_BLOCK*4;
+    void *nv=realloc(member->ext,na);
+    if (!nv) return -1;
+    member->ext=nv;
+    member->exta=na;
+  }
+  memcpy(member->ext+member->extc,src,srcc);
+  member->extc+=srcc;
+  return 0;
+}
+
+static void macb_tar_set_name(struct macb_tar_member *member,const char *src,int srcc) {
+  if (srcc>=(int)sizeof(member->name)) srcc=sizeof(member->name)-1;
+  memcpy(member->name,src,srcc);
+  member->name[srcc]=0;
+  member->namec=srcc;
+}
+
+// pax records: "LENGTH KEY=VALUE\n". We only care about path and size.
+static void macb_tar_apply_pax(struct macb_tar_member *member,int64_t *size,const char *src,int srcc) {
+  int srcp=0;
+  while (srcp<srcc) {
+    int len=0,p=srcp;
+    while ((p<srcc)&&(src[p]>='0')&&(src[p]<='9')) len=len*10+src[p++]-'0';
+    if ((len<=0)||(len>srcc-srcp)||(p>=srcc)||(src[p]!=' ')) return;
+    const char *k=src+p+1;
+    int kvc=srcp+len-(p+1)-1; // Without the newline.
+    if ((kvc>=5)&&!memcmp(k,"path=",5)) macb_tar_set_name(member,k+5,kvc-5);
+    else if ((kvc>=5)&&!memcmp(k,"size=",5)) {
+      int64_t v=0;
+      int i=5; for (;(i<kvc)&&(k[i]>='0')&&(k[i]<='9');i++) v=v*10+k[i]-'0';
+      *size=v;
+    }
+    srcp+=len;
+  }
+}
+
+/* Read the next member's header, with any extension members ahead of it.
+ * Returns >0 if we got one, 0 at the end of the archive, or <0 on errors.
+ */
+static int macb_tar_read_member(struct macb_tar *tar,struct macb_tar_member *member) {
+  int havename=0;
+  int64_t paxsize=-1;
+  member->extc=0;
+  while (1) {
+    int err=macb_tar_read_exactly(tar->infd,member->hdr,MACB_TAR_BLOCK);
+    if (!err) return 0; // Missing end blocks. Plenty of tools do that.
+    if (err<MACB_TAR_BLOCK) return -1;
+    int i=0; while ((i<MACB_TAR_BLOCK)&&!member->hdr[i]) i++;
+    if (i>=MACB_TAR_BLOCK) return 0;
+    if (macb_tar_rdnum(member->hdr+148,8)!=macb_tar_checksum(member->hdr)) {
+      fprintf(MACB_ERR(tar->request),"%s: Tar header checksum mismatch.\n",tar->request->arpath);
+      return -1;
+    }
+    member->type=member->hdr[156]?member->hdr[156]:'0';
+    member->size=macb_tar_rdnum(member->hdr+124,12);
+    member->mtime=macb_tar_rdnum(member->hdr+136,12);
+    if (member->size<0) return -1;
+
+    // Extensions describe the member after them. Keep them raw too, in case that member passes through.
+    if ((member->type=='L')||(member->type=='K')||(member->type=='x')) {
+      int64_t padded=member->size+MACB_TAR_PAD(member->size);
+      if (padded>MACB_TAR_EXT_LIMIT) return -1;
+      if (macb_tar_ext_append(member,member->hdr,MACB_TAR_BLOCK)<0) return -1;
+      int extp=member->extc;
+      uint8_t *body=malloc(padded?padded:1);
+      if (!body) return -1;
+      if (macb_tar_read_exactly(tar->infd,body,padded)<padded) { free(body); return -1; }
+      err=macb_tar_ext_append(member,body,padded);
+      free(body);
+      if (err<0) return -1;
+      const char *src=(char*)member->ext+extp;
+      int srcc=member->size;
+      if (member->type=='L') {
+        while (srcc&&!src[srcc-1]) srcc--;
+        macb_tar_set_name(member,src,srcc);
+        havename=1;
+      } else if (member->type=='x') {
+        int namec=member->namec;
+        member->namec=-1;
+        macb_tar_apply_pax(member,&paxsize,src,srcc);
+        if (member->namec>=0) havename=1;
+        else member->namec=namec;
+      }
+      continue;
+    }
+
+    if (!havename) {
+      char tmp[256];
+      int tmpc=0;
+      const uint8_t *hdr=member->hdr;
+      if (!memcmp(hdr+257,"ustar\0",6)&&hdr[345]) { // POSIX only: Old GNU has times here.
+        while ((tmpc<155)&&hdr[345+tmpc]) { tmp[tmpc]=hdr[345+tmpc]; tmpc++; }
+        tmp[tmpc++]='/';
+      }
+      int namec=0;
+      while ((namec<100)&&hdr[namec]) tmp[tmpc++]=hdr[namec++];
+      macb_tar_set_name(member,tmp,tmpc);
+    }
+    if (paxsize>=0) member->size=paxsize;
+    return 1;
+  }
+}
+
+static int macb_tar_next(struct macb_tar *tar,struct macb_tar_member *member) {
+  if (tar->havenext) {
+    // Swap, so both keep their extension buffers.
+    struct macb_tar_member tmp=*member;
+    *member=tar->next;
+    tar->next=tmp;
+    tar->havenext=0;
+    return 1;
+  }
+  return macb_tar_read_member(tar,member);
+}
+
+static int macb_tar_peek(struct macb_tar *tar) {
+  if (tar->havenext) return 1;
+  int err=macb_tar_read_member(tar,&tar->next);
+  if (err>0) tar->havenext=1;
+  return err;
+}
+
+/* Write.
+ */
+
+static int macb_tar_write_block(struct macb_tar *tar,uint8_t *hdr) {
+  memset(hdr+148,' ',8);
+  snprintf((char*)hdr+148,8,"%06o",macb_tar_checksum(hdr));
+  return macb_file_append(tar->outfd,hdr,MACB_TAR_BLOCK);
+}
+
+static int macb_tar_pad(struct macb_tar *tar,int64_t c) {
+  if (!MACB_TAR_PAD(c)) return 0;
+  return macb_file_append(tar->outfd,0,MACB_TAR_PAD(c));
+}
+
+/* Header for a new regular file, with ownership, mode, and time from (tmpl).
+ * Names that don't fit in ustar get a pax header first.
+ */
+static int macb_tar_write_header(struct macb_tar *tar,const uint8_t *tmpl,const char *name,int namec,int64_t size) {
+  uint8_t hdr[MACB_TAR_BLOCK];
+  memcpy(hdr,tmpl,MACB_TAR_BLOCK);
+  memset(hdr,0,100); // name
+  memset(hdr+157,0,100); // linkname
+  memset(hdr+345,0,167); // prefix, and the rest
+  memcpy(hdr+257,"ustar\0" "00",8);
+
+  int prefixc=-1;
+  if (namec>100) {
+    // ustar can split at a slash: up to 155 before it, up to 100 after.
+    int i=(namec-101<0)?0:namec-101;
+    for (;(i<namec)&&(i<=155);i++) {
+      if ((name[i]=='/')&&(namec-i-1<=100)&&(namec-i-1>0)) { prefixc=i; break; }
+    }
+    if (prefixc<0) {
+      // The record's length includes its own digits.
+      char rec[4200];
+      int bodyc=namec+7,recc=bodyc,i;
+      for (i=0;i<3;i++) recc=bodyc+snprintf(0,0,"%d",recc);
+      int c=snprintf(rec,sizeof(rec),"%d path=%.*s\n",recc,namec,name);
+      if ((c!=recc)||(c>=(int)sizeof(rec))) return -1;
+      uint8_t pax[MACB_TAR_BLOCK];
+      memcpy(pax,hdr,MACB_TAR_BLOCK);
+      memcpy(pax,"PaxHeader",9);
+      macb_tar_wrnum(pax+124,12,recc);
+      pax[156]='x';
+      if (macb_tar_write_block(tar,pax)<0) return -1;
+      if (macb_file_append(tar->outfd,rec,recc)<0) return -1;
+      if (macb_tar_pad(tar,recc)<0) return -1;
+      memcpy(hdr,name+namec-100,100); // Truncated name for readers that ignore pax.
+    } else {
+      memcpy(hdr+345,name,prefixc);
+      memcpy(hdr,name+prefixc+1,namec-prefixc-1);
+    }
+  } else {
+    memcpy(hdr,name,namec);
+  }
+  macb_tar_wrnum(hdr+124,12,size);
+  hdr[156]='0';
+  return macb_tar_write_block(tar,hdr);
+}
+
+// Copy a member through unchanged, extensions and all. (consumed) bytes of its body are in (head) already.
+static int macb_tar_passthrough(struct macb_tar *tar,const struct macb_tar_member *member,const void *head,int consumed) {
+  if (member->extc&&(macb_file_append(tar->outfd,member->ext,member->extc)<0)) return -1;
+  if (macb_file_append(tar->outfd,member->hdr,MACB_TAR_BLOCK)<0) return -1;
+  int64_t c=member->size;
+  // Links and directories have no body, whatever the size field says.
+  if ((member->type=='1')||(member->type=='2')||(member->type=='5')) c=0;
+  c+=MACB_TAR_PAD(c);
+  if (consumed&&(macb_file_append(tar->outfd,head,consumed)<0)) return -1;
+  return macb_file_copy(tar->outfd,tar->infd,-1,c-consumed);
+}
+
+static int macb_tar_is_regular(const struct macb_tar_member *member) {
+  return (member->type=='0')||(member->type=='7');
+}
+
+static int macb_tar_has_suffix(const struct macb_tar_member *member,const char *sfx) {
+  int sfxc=strlen(sfx);
+  return (member->namec>sfxc)&&!memcmp(member->name+member->namec-sfxc,sfx,sfxc);
+}
+
+/* '-x --tar': Replace each .bin member with .finfo, .data, .res.
+ */
+
+static int macb_tar_split_member(struct macb_tar *tar,struct macb_tar_member *member) {
+  struct macb_request *request=tar->request;
+  uint8_t src[128];
+  int consumed=0;
+  if (macb_tar_is_regular(member)&&macb_tar_has_suffix(member,".bin")&&(member->size>=128)) {
+    if ((consumed=macb_tar_read_exactly(tar->infd,src,128))<128) return -1;
+    uint32_t findings=macb_header_validate(src,member->size);
+    if (findings&(MACB_FINDING_VERSION|MACB_FINDING_TRUNCATED|MACB_FINDINGS_FATAL)) {
+      fprintf(MACB_ERR(request),"%s:WARNING: Not a valid MacBinary file, passing through as is.\n",member->name);
+    } else {
+      struct macb_header header;
+      struct macb_layout layout;
+      macb_header_decode(&header,src,128);
+      macb_layout_compute(&layout,&header);
+      char name[4200];
+      int basec=member->namec-4;
+      int64_t p=128;
+      snprintf(name,sizeof(name),"%.*s.finfo",basec,member->name);
+      if (macb_tar_write_header(tar,member->hdr,name,basec+6,128)<0) return -1;
+      if (macb_file_append(tar->outfd,src,128)<0) return -1;
+      if (macb_tar_pad(tar,128)<0) return -1;
+      if (layout.dflen) {
+        if (macb_file_skip(tar->infd,layout.dfp-p)<0) return -1;
+        snprintf(name,sizeof(name),"%.*s.data",basec,member->name);
+        if (macb_tar_write_header(tar,member->hdr,name,basec+5,layout.dflen)<0) return -1;
+        if (macb_file_copy(tar->outfd,tar->infd,-1,layout.dflen)<0) return -1;
+        if (macb_tar_pad(tar,layout.dflen)<0) return -1;
+        p=layout.dfp+layout.dflen;
+      }
+      if (layout.rflen) {
+        if (macb_file_skip(tar->infd,layout.rfp-p)<0) return -1;
+        snprintf(name,sizeof(name),"%.*s.res",basec,member->name);
+        if (macb_tar_write_header(tar,member->hdr,name,basec+4,layout.rflen)<0) return -1;
+        if (macb_file_copy(tar->outfd,tar->infd,-1,layout.rflen)<0) return -1;
+        if (macb_tar_pad(tar,layout.rflen)<0) return -1;
+        p=layout.rfp+layout.rflen;
+      }
+      fprintf(MACB_OUT(request),
+        "%s: Split into %.*s.finfo, data fork %lld bytes, resource fork %lld bytes.\n",
+        member->name,basec,member->name,(long long)layout.dflen,(long long)layout.rflen
+      );
+      return macb_file_skip(tar->infd,member->size-p+MACB_TAR_PAD(member->size));
+    }
+  }
+  return macb_tar_passthrough(tar,member,src,consumed);
+}
+
+/* '-c --tar': Join .finfo, .data, .res into .bin.
+ */
+
+// Write a .bin member's header and MacBinary header, for forks of these lengths.
+static int macb_tar_begin_bin(
+  struct macb_tar *tar,const uint8_t *tmpl,const char *base,int basec,uint8_t *fi,
+  int64_t dflen,int64_t rflen,uint32_t mtime
+) {
+  char name[4200];
+  snprintf(name,sizeof(name),"%.*s.bin",basec,base);
+  struct macb_request sub={.arpath=name,.arpathc=basec+4,.type=tar->request->type,.creator=tar->request->creator};
+  struct macb_input df={.fd=-1,.len=dflen,.ctime=mtime,.mtime=mtime};
+  struct macb_input rf={.fd=-1,.len=rflen,.ctime=mtime,.mtime=mtime};
+  if (dflen>MACB_FORK_LIMIT||rflen>MACB_FORK_LIMIT) {
+    fprintf(MACB_ERR(tar->request),"%s: Fork exceeds MacBinary's limit of %lld bytes.\n",name,MACB_FORK_LIMIT);
+    return -1;
+  }
+  if (macb_finish_header(fi,&sub,&df,&rf)<0) return -1;
+  int64_t size=128+((dflen+127)&~127ll)+((rflen+127)&~127ll);
+  if (macb_tar_write_header(tar,tmpl,name,basec+4,size)<0) return -1;
+  if (macb_file_append(tar->outfd,fi,128)<0) return -1;
+  fprintf(MACB_OUT(tar->request),"%s: Joined, data fork %lld bytes, resource fork %lld bytes.\n",name,(long long)dflen,(long long)rflen);
+  return 0;
+}
+
+// After a fork inside a .bin member: MacBinary padding, and tar padding too if it's the last.
+static int macb_tar_end_fork(struct macb_tar *tar,int64_t c) {
+  if (c&127) return macb_file_append(tar->outfd,0,128-(c&127));
+  return 0;
+}
+
+// Fork member body from input into the archive, (c) bytes: Skip its tar padding, and pad the fork to 128.
+static int macb_tar_copy_fork(struct macb_tar *tar,int64_t c) {
+  if (macb_file_copy(tar->outfd,tar->infd,-1,c)<0) return -1;
+  if (macb_file_skip(tar->infd,MACB_TAR_PAD(c))<0) return -1;
+  return macb_tar_end_fork(tar,c);
+}
+
+static int macb_tar_end_bin(struct macb_tar *tar,int64_t dflen,int64_t rflen) {
+  return macb_tar_pad(tar,128+((dflen+127)&~127ll)+((rflen+127)&~127ll));
+}
+
+// Is the next member (base)(sfx), (c) bytes? Returns >0 if so and takes it, 0 if not, <0 on errors.
+static int macb_tar_take_fork(struct macb_tar *tar,const char *base,int basec,const char *sfx,int64_t c) {
+  int err=macb_tar_peek(tar);
+  if (err<=0) return err;
+  struct macb_tar_member *next=&tar->next;
+  int sfxc=strlen(sfx);
+  if (!macb_tar_is_regular(next)||(next->namec!=basec+sfxc)) return 0;
+  if (memcmp(next->name,base,basec)||memcmp(next->name+basec,sfx,sfxc)) return 0;
+  if ((c>=0)&&(next->size!=c)) {
+    fprintf(MACB_ERR(tar->request),"%s: Expected %lld bytes, per the '.finfo', found %lld.\n",next->name,(long long)c,(long long)next->size);
+    return -1;
+  }
+  tar->havenext=0;
+  return 1;
+}
+
+static int macb_tar_join_finfo(struct macb_tar *tar,struct macb_tar_member *member) {
+  uint8_t fi[128];
+  if (macb_tar_read_exactly(tar->infd,fi,128)<128) return -1;
+  if (macb_file_skip(tar->infd,MACB_TAR_PAD(128))<0) return -1;
+  char base[4096];
+  int basec=member->namec-6;
+  memcpy(base,member->name,basec);
+  int64_t dflen=macb_rd32(fi,0x53),rflen=macb_rd32(fi,0x57);
+  // The header may have an additional header or a comment; the new archive won't. Forks go right after it.
+  macb_wr16(fi,0x78,0);
+  macb_wr16(fi,0x63,0);
+  if (macb_tar_begin_bin(tar,member->hdr,base,basec,fi,dflen,rflen,0)<0) return -1;
+  if (dflen) {
+    if (macb_tar_take_fork(tar,base,basec,".data",dflen)<=0) {
+      fprintf(MACB_ERR(tar->request),"%.*s.data: Expected next, after '.finfo'.\n",basec,base);
+      return -1;
+    }
+    if (macb_tar_copy_fork(tar,dflen)<0) return -1;
+  } else if (macb_tar_take_fork(tar,base,basec,".data",0)<0) return -1; // Empty and present is fine too.
+  if (rflen) {
+    if (macb_tar_take_fork(tar,base,basec,".res",rflen)<=0) {
+      fprintf(MACB_ERR(tar->request),"%.*s.res: Expected next, after '.finfo'.\n",basec,base);
+      return -1;
+    }
+    if (macb_tar_copy_fork(tar,rflen)<0) return -1;
+  } else if (macb_tar_take_fork(tar,base,basec,".res",0)<0) return -1;
+  return macb_tar_end_bin(tar,dflen,rflen);
+}
+
+// A fork without '.finfo': Spool it, and see whether its partner is next.
+static int macb_tar_join_forks(struct macb_tar *tar,struct macb_tar_member *member,int isdata) {
+  char base[4096];
+  int basec=member->namec-(isdata?5:4);
+  memcpy(base,member->name,basec);
+  int64_t firstc=member->size;
+  uint32_t mtime=(member->mtime>0)?(member->mtime+UNIX_EPOCH_IN_MAC_TIME):0;
+  if (firstc>MACB_FORK_LIMIT) {
+    fprintf(MACB_ERR(tar->request),"%s: Fork exceeds MacBinary's limit of %lld bytes.\n",member->name,MACB_FORK_LIMIT);
+    return -1;
+  }
+  if ((tar->spoolfd<0)&&((tar->spoolfd=macb_file_open_tmp())<0)) return -1;
+  if (ftruncate(tar->spoolfd,0)<0) return -1;
+  if (lseek(tar->spoolfd,0,SEEK_SET)<0) return -1;
+  if (macb_file_copy(tar->spoolfd,tar->infd,-1,firstc)<0) return -1;
+  if (macb_file_skip(tar->infd,MACB_TAR_PAD(firstc))<0) return -1;
+
+  // If paired, take_fork leaves the partner's header in (tar->next), released but still readable.
+  int paired=macb_tar_take_fork(tar,base,basec,isdata?".res":".data",-1);
+  if (paired<0) return -1;
+  int64_t secondc=paired?tar->next.size:0;
+  int64_t dflen=isdata?firstc:secondc,rflen=isdata?secondc:firstc;
+  uint8_t fi[128];
+  char binname[4200];
+  snprintf(binname,sizeof(binname),"%.*s.bin",basec,base);
+  struct macb_request sub={.arpath=binname,.arpathc=basec+4};
+  macb_initialize_header(fi,&sub);
+  if (macb_tar_begin_bin(tar,member->hdr,base,basec,fi,dflen,rflen,mtime)<0) return -1;
+
+  // Data first, wherever it is.
+  if (isdata) {
+    if (macb_file_copy(tar->outfd,tar->spoolfd,0,firstc)<0) return -1;
+    if (macb_tar_end_fork(tar,firstc)<0) return -1;
+    if (paired) {
+      if (macb_tar_copy_fork(tar,secondc)<0) return -1;
+    }
+  } else {
+    if (paired) {
+      if (macb_tar_copy_fork(tar,secondc)<0) return -1;
+    }
+    if (macb_file_copy(tar->outfd,tar->spoolfd,0,firstc)<0) return -1;
+    if (macb_tar_end_fork(tar,firstc)<0) return -1;
+  }
+  return macb_tar_end_bin(tar,dflen,rflen);
+}
+
+static int macb_tar_join_member(struct macb_tar *tar,struct macb_tar_member *member) {
+  if (macb_tar_is_regular(member)) {
+    if (macb_tar_has_suffix(member,".finfo")&&(member->size==128)) return macb_tar_join_finfo(tar,member);
+    if (macb_tar_has_suffix(member,".data")) return macb_tar_join_forks(tar,member,1);
+    if (macb_tar_has_suffix(member,".res")) return macb_tar_join_forks(tar,member,0);
+  }
+  return macb_tar_passthrough(tar,member,0,0);
+}
+
+/* Main entry point, for both directions.
+ */
+
+int macb_main_tar(struct macb_request *request) {
+  struct macb_tar tar={.request=request,.infd=-1,.outfd=-1,.spoolfd=-1};
+  struct macb_output output={.fd=-1};
+  int result=0,err;
+  const char *path=request->arpathc?request->arpath:"-";
+  if (request->command=='x') {
+    tar.infd=macb_file_openr(path);
+    tar.outfd=dup(STDOUT_FILENO);
+  } else {
+    // A named output tar appears whole, or the old one stays, see macb_output_open.
+    tar.infd=dup(STDIN_FILENO);
+    if (macb_output_open(&output,path,-1)>=0) tar.outfd=output.fd;
+  }
+  if ((tar.infd<0)||(tar.outfd<0)) {
+    fprintf(MACB_ERR(request),"%s: Failed to open file.\n",path);
+    result=-1;
+    goto _done_;
+  }
+
+  while ((err=macb_tar_next(&tar,&tar.member))>0) {
+    if (request->command=='x') err=macb_tar_split_member(&tar,&tar.member);
+    else err=macb_tar_join_member(&tar,&tar.member);
+    if (err<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to convert tar member.\n",tar.member.name);
+      result=-1;
+      goto _done_;
+    }
+  }
+  if (err<0) {
+    fprintf(MACB_ERR(request),"%s: Malformed or truncated tar.\n",path);
+    result=-1;
+    goto _done_;
+  }
+  // End of archive: Two zero blocks.
+  if (macb_file_append(tar.outfd,0,MACB_TAR_BLOCK*2)<0) result=-1;
+  if (!result&&(output.fd>=0)) {
+    tar.outfd=-1;
+    if (macb_output_commit(&output)<0) {
+      fprintf(MACB_ERR(request),"%s: Failed to write tar.\n",path);
+      result=-1;
+    }
+  }
+
+ _done_:
+  if (tar.infd>=0) close(tar.infd);
+  if (output.fd>=0) tar.outfd=-1; // Ours to abort, not close.
+  macb_output_abort(&output);
+  if (tar.outfd>=0) close(tar.outfd);
+  if (tar.spoolfd>=0) close(tar.spoolfd);
+  if (tar.member.ext) free(tar.member.ext);
+  if (tar.next.ext) free(tar.next.ext);
+  return result;
+}
@@ -0,0 +1,311 @@
+#if defined(__linux__)
+  #define _GNU_SOURCE 1 // statx
+  #if defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+      #define MACB_USE_URING 1
+    #endif
+  #endif
+#endif
+#ifndef MACB_USE_URING
+  #define MACB_USE_URING 0
+#endif
+#include "macb.h"
+
+/* io_uring header prefetch.
+ * Raw syscalls against the kernel's own header, so we don't need liburing.
+ *
+ * Each window of archives goes in two submissions:
+ *   1. OPENAT and STATX for every path, all independent.
+ *   2. READ of the first 128 bytes, hard-linked to CLOSE, for every file that opened.
+ * So a window of N archives costs two io_uring_enter calls instead of 4*N blocking syscalls.
+ * Anything that fails here is just marked unfetched, and the caller reads it the old way,
+ * which also takes care of reporting the error properly.
+ * If the ring itself fails, we wait out whatever is still in flight before returning, since completions write into
+ * the window's arrays and can hand us fds. Those arrays belong to the ring, so a ring we couldn't drain keeps them.
+ */
+
+#if MACB_USE_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+struct macb_uring_window {
+  struct macb_prefetch *v;
+  int *fdv;
+  struct statx *stxv;
+  int *statokv;
+  uint8_t (*hdrv)[MACB_HEADER_SIZE]; // Copied out to (v) once read, so nothing in flight points at the caller.
+};
+
+struct macb_uring {
+  int fd;
+  unsigned entries;
+  unsigned *sq_tail,*sq_mask,*sq_array;
+  unsigned *cq_head,*cq_tail,*cq_mask;
+  unsigned sqtail; // Our copy, published at submit.
+  struct io_uring_sqe *sqev;
+  struct io_uring_cqe *cqev;
+  void *sqmap,*cqmap,*sqemap;
+  size_t sqmapc,cqmapc,sqemapc;
+  int inflight; // Queued and not yet reaped.
+  struct macb_uring_window window; // Sized for (entries) paths.
+};
+
+// user_data: Index in the window, and which op.
+#define MACB_URING_OP_OPEN  0
+#define MACB_URING_OP_STATX 1
+#define MACB_URING_OP_READ  2
+#define MACB_URING_OP_CLOSE 3
+
+/* Setup and teardown.
+ */
+
+void macb_uring_del(struct macb_uring *uring) {
+  if (!uring) return;
+  // If completions are still owed, the kernel may yet write into the window, so it has to outlive us.
+  if (!uring->inflight) {
+    if (uring->window.fdv) free(uring->window.fdv);
+    if (uring->window.stxv) free(uring->window.stxv);
+    if (uring->window.statokv) free(uring->window.statokv);
+    if (uring->window.hdrv) free(uring->window.hdrv);
+  }
+  if (uring->sqemap) munmap(uring->sqemap,uring->sqemapc);
+  if (uring->cqmap&&(uring->cqmap!=uring->sqmap)) munmap(uring->cqmap,uring->cqmapc);
+  if (uring->sqmap) munmap(uring->sqmap,uring->sqmapc);
+  if (uring->fd>=0) close(uring->fd);
+  free(uring);
+}
+
+// io_uring dates from 5.1, but OPENAT, STATX and CLOSE only arrived in 5.6, along with the probe itself.
+static int macb_uring_probe(struct macb_uring *uring) {
+  int opc=256;
+  struct io_uring_probe *probe=calloc(1,sizeof(struct io_uring_probe)+sizeof(struct io_uring_probe_op)*opc);
+  if (!probe) return -1;
+  int result=-1;
+  if (syscall(__NR_io_uring_register,uring->fd,IORING_REGISTER_PROBE,probe,opc)>=0) {
+    const uint8_t needv[]={IORING_OP_OPENAT,IORING_OP_STATX,IORING_OP_READ,IORING_OP_CLOSE};
+    int i=0; for (;i<sizeof(needv);i++) {
+      if (needv[i]>probe->last_op) break;
+      if (!(probe->ops[needv[i]].flags&IO_URING_OP_SUPPORTED)) break;
+    }
+    if (i>=sizeof(needv)) result=0;
+  }
+  free(probe);
+  return result;
+}
+
+struct macb_uring *macb_uring_new(int entries) {
+  struct macb_uring *uring=calloc(1,sizeof(struct macb_uring));
+  if (!uring) return 0;
+  struct io_uring_params params={0};
+  if ((uring->fd=syscall(__NR_io_uring_setup,entries,&params))<0) {
+    free(uring);
+    return 0;
+  }
+  uring->entries=params.sq_entries;
+
+  uring->sqmapc=params.sq_off.array+params.sq_entries*sizeof(unsigned);
+  uring->cqmapc=params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+  if (params.features&IORING_FEAT_SINGLE_MMAP) {
+    if (uring->cqmapc>uring->sqmapc) uring->sqmapc=uring->cqmapc;
+    uring->cqmapc=uring->sqmapc;
+  }
+  uring->sqmap=mmap(0,uring->sqmapc,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,uring->fd,IORING_OFF_SQ_RING);
+  if (uring->sqmap==MAP_FAILED) { uring->sqmap=0; macb_uring_del(uring); return 0; }
+  if (params.features&IORING_FEAT_SINGLE_MMAP) {
+    uring->cqmap=uring->sqmap;
+  } else {
+    uring->cqmap=mmap(0,uring->cqmapc,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,uring->fd,IORING_OFF_CQ_RING);
+    if (uring->cqmap==MAP_FAILED) { uring->cqmap=0; macb_uring_del(uring); return 0; }
+  }
+  uring->sqemapc=params.sq_entries*sizeof(struct io_uring_sqe);
+  uring->sqemap=mmap(0,uring->sqemapc,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,uring->fd,IORING_OFF_SQES);
+  if (uring->sqemap==MAP_FAILED) { uring->sqemap=0; macb_uring_del(uring); return 0; }
+
+  uint8_t *sq=uring->sqmap,*cq=uring->cqmap;
+  uring->sq_tail=(unsigned*)(sq+params.sq_off.tail);
+  uring->sq_mask=(unsigned*)(sq+params.sq_off.ring_mask);
+  uring->sq_array=(unsigned*)(sq+params.sq_off.array);
+  uring->cq_head=(unsigned*)(cq+params.cq_off.head);
+  uring->cq_tail=(unsigned*)(cq+params.cq_off.tail);
+  uring->cq_mask=(unsigned*)(cq+params.cq_off.ring_mask);
+  uring->sqev=uring->sqemap;
+  uring->cqev=(struct io_uring_cqe*)(cq+params.cq_off.cqes);
+  uring->sqtail=*uring->sq_tail;
+
+  if (
+    !(uring->window.fdv=malloc(sizeof(int)*uring->entries))||
+    !(uring->window.stxv=malloc(sizeof(struct statx)*uring->entries))||
+    !(uring->window.statokv=malloc(sizeof(int)*uring->entries))||
+    !(uring->window.hdrv=malloc(MACB_HEADER_SIZE*uring->entries))
+  ) {
+    macb_uring_del(uring);
+    return 0;
+  }
+  if (macb_uring_probe(uring)<0) {
+    macb_uring_del(uring);
+    return 0;
+  }
+  return uring;
+}
+
+/* Queue one SQE. Caller guarantees there's room.
+ */
+
+static struct io_uring_sqe *macb_uring_sqe(struct macb_uring *uring,uint8_t op,int fd,uint64_t user_data) {
+  unsigned p=uring->sqtail&*uring->sq_mask;
+  struct io_uring_sqe *sqe=uring->sqev+p;
+  memset(sqe,0,sizeof(struct io_uring_sqe));
+  sqe->opcode=op;
+  sqe->fd=fd;
+  sqe->user_data=user_data;
+  uring->sq_array[p]=p;
+  uring->sqtail++;
+  uring->inflight++;
+  return sqe;
+}
+
+/* Publish everything queued, and wait until (waitc) completions have been handed to (cb).
+ */
+
+static int macb_uring_run(
+  struct macb_uring *uring,int submitc,int waitc,
+  void (*cb)(void *userdata,uint64_t user_data,int res),void *userdata
+) {
+  __atomic_store_n(uring->sq_tail,uring->sqtail,__ATOMIC_RELEASE);
+  while (waitc>0) {
+    int err=MACB_SYSCALL(syscall(__NR_io_uring_enter,uring->fd,submitc,1,IORING_ENTER_GETEVENTS,0,0));
+    if (err<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    submitc-=err;
+    if (submitc<0) submitc=0;
+    unsigned head=*uring->cq_head;
+    unsigned tail=__atomic_load_n(uring->cq_tail,__ATOMIC_ACQUIRE);
+    for (;head!=tail;head++,waitc--) {
+      const struct io_uring_cqe *cqe=uring->cqev+(head&*uring->cq_mask);
+      cb(userdata,cqe->user_data,cqe->res);
+      uring->inflight--;
+    }
+    __atomic_store_n(uring->cq_head,head,__ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+// Everything queued so far, whether or not it was submitted. Fails only if io_uring_enter keeps failing.
+static int macb_uring_drain(
+  struct macb_uring *uring,
+  void (*cb)(void *userdata,uint64_t user_data,int res),void *userdata
+) {
+  return macb_uring_run(uring,uring->inflight,uring->inflight,cb,userdata);
+}
+
+/* Prefetch.
+ */
+
+static void macb_uring_complete(void *userdata,uint64_t user_data,int res) {
+  struct macb_uring_window *window=userdata;
+  int i=user_data>>2;
+  switch (user_data&3) {
+    case MACB_URING_OP_OPEN: window->fdv[i]=res; break;
+    case MACB_URING_OP_STATX: window->statokv[i]=(res>=0); break;
+    case MACB_URING_OP_READ: if (res==MACB_HEADER_SIZE) window->v[i].status=1; break;
+    case MACB_URING_OP_CLOSE: if (res==-ECANCELED) close(window->fdv[i]); break;
+  }
+}
+
+// Ring failed mid-window. Nothing in the window counts, and fds are ours to close only if no CLOSE can still run.
+static int macb_uring_fail_window(struct macb_uring *uring,int c,int closefds) {
+  struct macb_uring_window *window=&uring->window;
+  macb_uring_drain(uring,macb_uring_complete,window); // If this fails too, (inflight) stays up and del leaks the window.
+  int i=0; for (;i<c;i++) {
+    window->v[i].status=-1;
+    if (closefds&&(window->fdv[i]>=0)) close(window->fdv[i]);
+  }
+  return -1;
+}
+
+static int macb_uring_prefetch_window(struct macb_uring *uring,struct macb_prefetch *v,int c) {
+  struct macb_uring_window *window=&uring->window;
+  int *fdv=window->fdv,*statokv=window->statokv;
+  struct statx *stxv=window->stxv;
+  int i,queuec=0;
+  window->v=v;
+
+  for (i=0;i<c;i++) {
+    struct io_uring_sqe *sqe=macb_uring_sqe(uring,IORING_OP_OPENAT,AT_FDCWD,((uint64_t)i<<2)|MACB_URING_OP_OPEN);
+    sqe->addr=(uintptr_t)v[i].path;
+    sqe->open_flags=O_RDONLY|O_CLOEXEC;
+    sqe=macb_uring_sqe(uring,IORING_OP_STATX,AT_FDCWD,((uint64_t)i<<2)|MACB_URING_OP_STATX);
+    sqe->addr=(uintptr_t)v[i].path;
+    sqe->len=STATX_TYPE|STATX_SIZE;
+    sqe->off=(uintptr_t)(stxv+i);
+    fdv[i]=-1;
+    statokv[i]=0;
+  }
+  if (macb_uring_run(uring,c*2,c*2,macb_uring_complete,window)<0) return macb_uring_fail_window(uring,c,1);
+
+  for (i=0;i<c;i++) {
+    if (fdv[i]<0) continue;
+    struct io_uring_sqe *sqe=macb_uring_sqe(uring,IORING_OP_READ,fdv[i],((uint64_t)i<<2)|MACB_URING_OP_READ);
+    sqe->addr=(uintptr_t)window->hdrv[i];
+    sqe->len=MACB_HEADER_SIZE;
+    sqe->off=0;
+    sqe->flags=IOSQE_IO_HARDLINK; // Close even if the read fails.
+    macb_uring_sqe(uring,IORING_OP_CLOSE,fdv[i],((uint64_t)i<<2)|MACB_URING_OP_CLOSE);
+    queuec+=2;
+  }
+  if (queuec&&(macb_uring_run(uring,queuec,queuec,macb_uring_complete,window)<0)) {
+    return macb_uring_fail_window(uring,c,0);
+  }
+
+  // Same rules as macb_file_read_header: Length is zero if it's not a regular file.
+  for (i=0;i<c;i++) {
+    if (v[i].status<=0) continue;
+    if (!statokv[i]) { v[i].status=-1; continue; }
+    memcpy(v[i].hdr,window->hdrv[i],MACB_HEADER_SIZE);
+    v[i].flen=S_ISREG(stxv[i].stx_mode)?(int64_t)stxv[i].stx_size:0;
+  }
+  return 0;
+}
+
+int macb_uring_prefetch_headers(struct macb_uring *uring,struct macb_prefetch *v,int c) {
+  if (!uring||!v) return -1;
+  struct macb_stats_mark mark;
+  macb_stats_begin(&mark);
+  int64_t bytes=(int64_t)c*128;
+  int i=0; for (;i<c;i++) {
+    v[i].status=-1;
+    v[i].flen=0;
+  }
+  int windowc=uring->entries>>1;
+  while (c>0) {
+    int n=(c>windowc)?windowc:c;
+    if (macb_uring_prefetch_window(uring,v,n)<0) return -1;
+    v+=n;
+    c-=n;
+  }
+  macb_stats_end(&mark,MACB_STATS_HEADER,bytes);
+  return 0;
+}
+
+#else
+
+struct macb_uring *macb_uring_new(int entries) {
+  return 0;
+}
+
+void macb_uring_del(struct macb_uring *uring) {
+}
+
+int macb_uring_prefetch_headers(struct macb_uring *uring,struct macb_prefetch *v,int c) {
+  return -1;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#include "macb.h"
+
+/* SHA-256, per FIPS 180-4.
+ * Plain C, one 64-byte block at a time. Only the stores use it, and there the disk is slower anyway.
+ */
+
+static const uint32_t macb_sha256_k[64]={
+  0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+  0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+  0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+  0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+  0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+  0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+  0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+  0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2,
+};
+
+#define ROTR(x,n) (((x)>>(n))|((x)<<(32-(n))))
+
+static void macb_sha256_block(uint32_t *h,const uint8_t *src) {
+  uint32_t w[64];
+  int i=0;
+  for (;i<16;i++) w[i]=(src[i*4]<<24)|(src[i*4+1]<<16)|(src[i*4+2]<<8)|src[i*4+3];
+  for (;i<64;i++) {
+    uint32_t s0=ROTR(w[i-15],7)^ROTR(w[i-15],18)^(w[i-15]>>3);
+    uint32_t s1=ROTR(w[i-2],17)^ROTR(w[i-2],19)^(w[i-2]>>10);
+    w[i]=w[i-16]+s0+w[i-7]+s1;
+  }
+  uint32_t a=h[0],b=h[1],c=h[2],d=h[3],e=h[4],f=h[5],g=h[6],hh=h[7];
+  for (i=0;i<64;i++) {
+    uint32_t t1=hh+(ROTR(e,6)^ROTR(e,11)^ROTR(e,25))+((e&f)^(~e&g))+macb_sha256_k[i]+w[i];
+    uint32_t t2=(ROTR(a,2)^ROTR(a,13)^ROTR(a,22))+((a&b)^(a&c)^(b&c));
+    hh=g; g=f; f=e; e=d+t1;
+    d=c; c=b; b=a; a=t1+t2;
+  }
+  h[0]+=a; h[1]+=b; h[2]+=c; h[3]+=d;
+  h[4]+=e; h[5]+=f; h[6]+=g; h[7]+=hh;
+}
+
+#undef ROTR
+
+void macb_sha256_init(struct macb_sha256 *sha) {
+  static const uint32_t h0[8]={
+    0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19,
+  };
+  memcpy(sha->h,h0,sizeof(h0));
+  sha->len=0;
+  sha->bufc=0;
+}
+
+void macb_sha256_update(struct macb_sha256 *sha,const void *src,int64_t srcc) {
+  const uint8_t *SRC=src;
+  sha->len+=srcc;
+  if (sha->bufc) {
+    int cpc=64-sha->bufc;
+    if (cpc>srcc) cpc=srcc;
+    memcpy(sha->buf+sha->bufc,SRC,cpc);
+    sha->bufc+=cpc;
+    SRC+=cpc;
+    srcc-=cpc;
+    if (sha->bufc<64) return;
+    macb_sha256_block(sha->h,sha->buf);
+    sha->bufc=0;
+  }
+  for (;srcc>=64;SRC+=64,srcc-=64) macb_sha256_block(sha->h,SRC);
+  memcpy(sha->buf,SRC,srcc);
+  sha->bufc=srcc;
+}
+
+void macb_sha256_final(uint8_t *dst,struct macb_sha256 *sha) {
+  uint64_t bits=sha->len*8;
+  sha->buf[sha->bufc++]=0x80;
+  if (sha->bufc>56) {
+    memset(sha->buf+sha->bufc,0,64-sha->bufc);
+    macb_sha256_block(sha->h,sha->buf);
+    sha->bufc=0;
+  }
+  memset(sha->buf+sha->bufc,0,56-sha->bufc);
+  int i=0; for (;i<8;i++) sha->buf[56+i]=bits>>(56-i*8);
+  macb_sha256_block(sha->h,sha->buf);
+  for (i=0;i<8;i++) macb_wr32(dst,i*4,sha->h[i]);
+}
+
+void macb_sha256_hex(char *dst,const uint8_t *digest) {
+  static const char hexdigits[]="0123456789abcdef";
+  int i=0; for (;i<32;i++) {
+    dst[i*2]=hexdigits[digest[i]>>4];
+    dst[i*2+1]=hexdigits[digest[i]&15];
+  }
+  dst[64]=0;
+}
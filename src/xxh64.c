@@ -0,0 +1,108 @@
+#include "macb.h"
+
+/* XXH64, per Yann Collet's xxHash spec.
+ * Fast and not cryptographic: Good for catching corruption, useless against someone who wants a collision.
+ */
+
+#define P1 0x9e3779b185ebca87ull
+#define P2 0xc2b2ae3d27d4eb4full
+#define P3 0x165667b19e3779f9ull
+#define P4 0x85ebca77c2b2ae63ull
+#define P5 0x27d4eb2f165667c5ull
+#define ROTL(x,n) (((x)<<(n))|((x)>>(64-(n))))
+
+static uint64_t macb_xxh64_rd64(const uint8_t *src) {
+  return
+    (uint64_t)src[0]|((uint64_t)src[1]<<8)|((uint64_t)src[2]<<16)|((uint64_t)src[3]<<24)|
+    ((uint64_t)src[4]<<32)|((uint64_t)src[5]<<40)|((uint64_t)src[6]<<48)|((uint64_t)src[7]<<56);
+}
+
+static uint64_t macb_xxh64_round(uint64_t acc,uint64_t input) {
+  acc+=input*P2;
+  acc=ROTL(acc,31);
+  return acc*P1;
+}
+
+static uint64_t macb_xxh64_merge(uint64_t acc,uint64_t v) {
+  acc^=macb_xxh64_round(0,v);
+  return acc*P1+P4;
+}
+
+static void macb_xxh64_stripe(uint64_t *v,const uint8_t *src) {
+  v[0]=macb_xxh64_round(v[0],macb_xxh64_rd64(src));
+  v[1]=macb_xxh64_round(v[1],macb_xxh64_rd64(src+8));
+  v[2]=macb_xxh64_round(v[2],macb_xxh64_rd64(src+16));
+  v[3]=macb_xxh64_round(v[3],macb_xxh64_rd64(src+24));
+}
+
+void macb_xxh64_init(struct macb_xxh64 *xxh,uint64_t seed) {
+  xxh->v[0]=seed+P1+P2;
+  xxh->v[1]=seed+P2;
+  xxh->v[2]=seed;
+  xxh->v[3]=seed-P1;
+  xxh->seed=seed;
+  xxh->len=0;
+  xxh->bufc=0;
+}
+
+void macb_xxh64_update(struct macb_xxh64 *xxh,const void *src,int64_t srcc) {
+  const uint8_t *SRC=src;
+  xxh->len+=srcc;
+  if (xxh->bufc) {
+    int cpc=32-xxh->bufc;
+    if (cpc>srcc) cpc=srcc;
+    memcpy(xxh->buf+xxh->bufc,SRC,cpc);
+    xxh->bufc+=cpc;
+    SRC+=cpc;
+    srcc-=cpc;
+    if (xxh->bufc<32) return;
+    macb_xxh64_stripe(xxh->v,xxh->buf);
+    xxh->bufc=0;
+  }
+  for (;srcc>=32;SRC+=32,srcc-=32) macb_xxh64_stripe(xxh->v,SRC);
+  memcpy(xxh->buf,SRC,srcc);
+  xxh->bufc=srcc;
+}
+
+uint64_t macb_xxh64_final(const struct macb_xxh64 *xxh) {
+  uint64_t h;
+  if (xxh->len>=32) {
+    h=ROTL(xxh->v[0],1)+ROTL(xxh->v[1],7)+ROTL(xxh->v[2],12)+ROTL(xxh->v[3],18);
+    h=macb_xxh64_merge(h,xxh->v[0]);
+    h=macb_xxh64_merge(h,xxh->v[1]);
+    h=macb_xxh64_merge(h,xxh->v[2]);
+    h=macb_xxh64_merge(h,xxh->v[3]);
+  } else {
+    h=xxh->seed+P5;
+  }
+  h+=xxh->len;
+  const uint8_t *src=xxh->buf;
+  int srcc=xxh->bufc;
+  for (;srcc>=8;src+=8,srcc-=8) {
+    h^=macb_xxh64_round(0,macb_xxh64_rd64(src));
+    h=ROTL(h,27)*P1+P4;
+  }
+  if (srcc>=4) {
+    h^=(uint64_t)(src[0]|(src[1]<<8)|(src[2]<<16)|((uint32_t)src[3]<<24))*P1;
+    h=ROTL(h,23)*P2+P3;
+    src+=4;
+    srcc-=4;
+  }
+  for (;srcc>0;src++,srcc--) {
+    h^=(*src)*P5;
+    h=ROTL(h,11)*P1;
+  }
+  h^=h>>33;
+  h*=P2;
+  h^=h>>29;
+  h*=P3;
+  h^=h>>32;
+  return h;
+}
+
+#undef P1
+#undef P2
+#undef P3
+#undef P4
+#undef P5
+#undef ROTL